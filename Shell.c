@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // tee(2), splice(2)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,317 +8,12209 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/pidfd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdint.h>
+#include <endian.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+
+#include "pucitshell.h"
+
+// The engine's standard descriptors and streams. In the pucitshell program
+// they are the process's own 0-2, stdout and stderr. psh_run() gives each
+// command line private ones instead: built-ins write to these streams,
+// redirections in the shell replace these descriptors, and forked children
+// take them as their 0-2 in adopt_shell_fds(). The host's own descriptors
+// are never changed, and nothing its other threads write is captured.
+int shell_fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+FILE* shell_stdout = NULL;  // NULL: the process's stdout
+FILE* shell_stderr = NULL;  // NULL: the process's stderr
+
+// Every stdout, stderr, printf() and perror() in this file means the engine's
+#undef stdout
+#undef stderr
+#define stdout (shell_stdout ? shell_stdout : (stdout))
+#define stderr (shell_stderr ? shell_stderr : (stderr))
+#define printf(...) fprintf(stdout, __VA_ARGS__)
+#define perror(s) fprintf(stderr, "%s: %s\n", (s), strerror(errno))
+
+// Function to find the engine's descriptor for fd: its own for 0-2, fd itself otherwise
+int shell_fd(int fd) {
+    return fd >= 0 && fd < 3 ? shell_fds[fd] : fd;
+}
 
 #define BUFFER_SIZE 1024
 #define HISTORY_SIZE 10  // Maximum number of commands in history
-#define MAX_VARS 50      // Maximum number of variables
+#define VARS_MIN 64      // Initial room in the variable table, which grows as needed
 
 char* history[HISTORY_SIZE];  // Array to store command history
 int history_count = 0;        // Current count of commands in history
-pid_t bg_processes[HISTORY_SIZE];  // Array to store background process IDs
-int bg_count = 0;             // Count of background processes
+
+struct array;
 
 // Structure to store shell variables
 struct var {
     char *name;
-    char *value;
+    char *value;      // NULL for an array
     bool global;
-} shell_vars[MAX_VARS];
+    long long ival;   // Integer value, valid when ival_valid is set
+    bool ival_valid;  // value has been parsed as (or assigned) an integer
+    bool str_stale;   // Assigned by arithmetic; value is rebuilt from ival on demand
+    struct array *array;  // Indexed or associative array, or NULL for a string
+};
+struct var* shell_vars = NULL;  // Table of shell variables
 int var_count = 0;  // Count of defined shell variables
+int var_cap = 0;    // Slots allocated in shell_vars
+
+bool noclobber = false;  // `set -o noclobber`: refuse to truncate existing files with '>'
+bool suggest = false;    // `set -o suggest`: show the newest matching history entry inline
+int last_status = 0;     // Exit status of the last command, expanded as $?
+pid_t last_bg_pid = 0;   // Most recent background process, expanded as $!
+bool in_subshell = false; // Running in a forked copy of the shell
+int loop_depth = 0;      // Number of enclosing while/until/for loops
+int break_levels = 0;    // Pending `break n`: loops still to leave
+int continue_levels = 0; // Pending `continue n`
+int function_depth = 0;  // Number of function calls being run
+bool return_pending = false; // `return` is unwinding the current function
+int return_status = 0;   // Status given to that `return`
+char** positional = NULL; // $1, $2, ... of the current function call
+int positional_count = 0; // $#
+bool expansion_failed = false; // Set by an arithmetic error during expansion
+int stdin_redirects = 0; // stdin is a redirect or pipe, not the stream commands are read from
+bool interactive = false; // Commands come from a terminal
+char prompt_text[PATH_MAX + 256]; // Prompt of the line being read, for redrawing it
+bool prompt_live = false; // prompt_text came from PS1 with slow segments still to arrive
+int prompt_generation = 0; // Number of prompts shown so far
+
+// Redirection operators recognised by parse_redirect_op()
+enum redir_type {
+    REDIR_IN,          // [n]<file
+    REDIR_OUT,         // [n]>file
+    REDIR_CLOBBER,     // [n]>|file, ignores noclobber
+    REDIR_APPEND,      // [n]>>file
+    REDIR_RDWR,        // [n]<>file
+    REDIR_DUP,         // [n]>&m, [n]<&m, or [n]>&- to close
+    REDIR_OUT_ERR,     // &>file, stdout and stderr to the same file
+    REDIR_APPEND_ERR   // &>>file
+};
+
+// Piece of a word as compiled by the parser
+enum part_type {
+    PART_LITERAL,  // Text with quotes and backslashes already removed
+    PART_PARAM,    // $name, ${name} or a special parameter such as $?
+    PART_ARITH     // $(( expression ))
+};
+
+struct arith_node;
+struct glob_pattern;
+
+struct word;
+
+struct word_part {
+    enum part_type type;
+    char *text;    // Literal text, the parameter name, or the expression
+    bool quoted;   // Inside quotes, so never field-split
+    struct arith_node *arith;  // PART_ARITH expression compiled at parse time; PART_PARAM
+                               // subscript compiled as an index
+    char prefix;   // PART_PARAM: '#' for ${#name}, '!' for ${!a[@]}, else 0
+    char all;      // PART_PARAM: '@' or '*' for ${a[@]} and ${a[*]}, else 0
+    struct word *subscript;    // PART_PARAM: the i of ${a[i]}, or NULL
+};
+
+// A word compiled once at parse time and expanded again on every execution
+struct word {
+    struct word_part *parts;
+    int part_count;
+    char *literal;  // Set when the word needs no expansion at all (fast path)
+    bool may_glob;  // Has unquoted *, ? or [, or an unquoted expansion
+    struct glob_pattern *glob;  // Compiled on first use when literal is a pattern
+};
+
+// One entry of a command's redirection list, applied left to right
+struct redirect {
+    int fd;                   // Descriptor being redirected
+    enum redir_type type;
+    struct word target_word;  // Target as written
+    char *target;             // Expanded file name, descriptor number or "-"
+    bool fanout;              // Opened for the fan-out helper, which the command's stdout goes to
+};
+
+// One word of an array assignment, a=(word [key]=word ...)
+struct array_item {
+    bool keyed;
+    struct word key;    // [key]=, when keyed
+    struct word value;
+};
+
+// Leading name=value word of a simple command, or name+=value, name[i]=value
+// and name=(words...)
+struct assignment {
+    char *name;
+    struct word value;
+    struct word *subscript;     // i of name[i]=value, or NULL
+    struct arith_node *index;   // subscript compiled as an index
+    bool append;                // +=
+    bool list;                  // name=( ... ): items replace the whole array
+    struct array_item *items;
+    int item_count;
+};
+
+// A parsed simple command: assignments, words and its redirection list
+struct command {
+    struct assignment *assigns;
+    int assign_count;
+    struct word *words;
+    int word_count;
+    char **args;              // Expanded arguments while the command runs, else NULL
+    struct assignment *lists; // name=(...) arguments of declare and local, assigned after it runs
+    int list_count;
+    struct redirect *redirs;
+    int redir_count;
+};
+
+// Kinds of node in the syntax tree
+enum node_type {
+    NODE_COMMAND,     // Simple command
+    NODE_PIPELINE,    // children joined with '|'
+    NODE_AND,         // left && right
+    NODE_OR,          // left || right
+    NODE_NOT,         // ! left
+    NODE_SEQUENCE,    // children separated by ';' or newlines
+    NODE_BACKGROUND,  // left &
+    NODE_IF,          // if left; then right; else alt; fi
+    NODE_WHILE,       // while left; do right; done
+    NODE_UNTIL,       // until left; do right; done
+    NODE_FOR,         // for var in cmd.words; do right; done
+    NODE_CASE,        // case cmd.words[0] in items... esac
+    NODE_GROUP,       // { left; }
+    NODE_SUBSHELL,    // ( left )
+    NODE_FUNCTION     // var() left: defines a function
+};
+
+struct node;
+
+// One "pattern|pattern) list ;;" arm of a case command
+struct case_item {
+    struct word *patterns;
+    int pattern_count;
+    struct node *body;
+};
+
+// Node of the syntax tree; a whole input is parsed once into a tree of these
+// and loop bodies are re-run from the tree without tokenizing again
+struct node {
+    enum node_type type;
+    struct command cmd;        // NODE_COMMAND; words and redirections of compound commands
+    struct node **children;    // NODE_PIPELINE stages, NODE_SEQUENCE items
+    int child_count;
+    struct node *left;
+    struct node *right;
+    struct node *alt;          // else / elif branch of NODE_IF
+    char *var;                 // Loop variable of NODE_FOR
+    struct case_item *items;   // Arms of NODE_CASE
+    int item_count;
+    int refs;                  // Owners besides its parent, e.g. the function table
+    char *text;                // Function body: the definition's tokens, for snapshots
+};
+
+// Token types produced by tokenize_input()
+enum token_type {
+    TOK_WORD,
+    TOK_REDIR,    // Redirection operator; the target is the following word
+    TOK_SEMI,     // ;
+    TOK_AND_IF,   // &&
+    TOK_OR_IF,    // ||
+    TOK_PIPE,     // |
+    TOK_AMP,      // &
+    TOK_DSEMI,    // ;;
+    TOK_LPAREN,   // (
+    TOK_RPAREN,   // )
+    TOK_NEWLINE,
+    TOK_EOF
+};
+
+struct token {
+    enum token_type type;
+    char *text;              // Raw word text, quotes included, or the operator
+    struct redirect redir;   // fd and type for TOK_REDIR
+    int expansion;           // 1 + index of the alias expansion it came from; 0 if typed
+};
+
+struct command_entry;
+
+// An alias the parser has replaced by its tokens
+struct alias_expansion {
+    struct command_entry *alias;
+    int parent;              // Expansion the alias name itself came from, as in struct token
+};
+
+// Parser state over a token array
+struct parser {
+    struct token *tokens;
+    int count;
+    int pos;
+    int status;  // PARSE_OK, PARSE_INCOMPLETE or PARSE_ERROR
+    struct alias_expansion *expansions;
+    int expansion_count;
+};
+
+enum {
+    PARSE_OK,
+    PARSE_INCOMPLETE,  // Input ended inside a quote or after |, && or ||
+    PARSE_ERROR
+};
+
+struct array_arena;
+
+// Growable list of expanded fields
+struct field_list {
+    char **items;
+    int count;
+    int cap;
+    bool borrow;               // "${a[@]}" may point items into the array's arena
+    struct array_arena **pins; // Arenas items were borrowed from, kept alive by a reference
+    int pin_count;
+};
+
+// Descriptor saved while a built-in runs with redirections in the shell itself
+struct saved_fd {
+    int fd;
+    int copy;  // -1 if the descriptor was closed before the redirection
+};
+
+#define MAX_EVENTS 16      // Events taken from epoll_wait() at a time
+#define MAX_TIMERS 16      // Pending timers
+#define MAX_NOTICES 16     // Job notifications waiting to be shown
+#define TIMEOUT_GRACE 5000 // Default milliseconds from a deadline's SIGTERM to its SIGKILL
+#define JOB_POLL_MS 100    // psh_run(): how often a foreground job is checked for stops
+#define MEMO_SIZE (64LL << 20) // Default limit of the memo store
+
+// Function called by the event loop when a watched descriptor is readable
+typedef void (*event_handler)(int fd, void* data);
+
+// Descriptor watched by the event loop
+struct event_source {
+    int fd;
+    event_handler handler;   // NULL once removed
+    void *data;
+    struct event_source *next;
+};
+
+// Timer run from the event loop
+struct timer {
+    long long deadline;      // CLOCK_MONOTONIC, in nanoseconds
+    void (*fn)(void* data);
+    void *data;
+    bool active;
+};
+
+// Deadline of a foreground job, enforced from a timer
+struct deadline {
+    pid_t pgid;              // Process group signalled when it passes
+    long long grace;         // Milliseconds from SIGTERM to SIGKILL
+    int timer;
+    bool expired;            // SIGTERM has been sent
+};
+
+// States of a job's process
+enum {
+    PROC_RUNNING,
+    PROC_STOPPED,
+    PROC_DONE
+};
+
+// Process started for a job
+struct job_process {
+    pid_t pid;
+    int status;              // waitpid() status once it is done
+    int state;
+    int pidfd;               // psh_run(): readable once it exits, or -1
+};
+
+// Output of a background job captured under `set -o spool`: a ring buffer
+// that grows up to the job's size limit, then drops (or, with `set -o spill`, moves to
+// a memfd) its oldest bytes
+struct spool {
+    int fd;                  // Read end of the job's stdout/stderr pipe, -1 at EOF
+    char *buf;
+    size_t size;             // spool_size when the job started, which later `set` leaves alone
+    size_t alloc;            // Bytes allocated, at most size
+    size_t start, len;       // Oldest byte and bytes held
+    int spill_fd;            // memfd the oldest bytes move to, -1 without spill
+    size_t spilled, dropped; // Bytes in spill_fd, bytes lost
+    bool live;               // Job in the foreground: pass output straight through
+};
+
+// Job: the processes started for one pipeline, subshell or background list
+struct job {
+    int id;                  // Number used as %n
+    pid_t pgid;              // Process group, 0 if the job stays in the shell's
+    struct job_process *procs;
+    int proc_count, proc_cap;
+    char *text;              // Command shown by jobs, fg and the notices
+    bool background;
+    bool disowned;           // Reaped silently and no longer listed
+    struct termios tmodes;   // Terminal modes when it was stopped, given back by fg
+    bool has_tmodes;
+    char *cgroup;            // Its leaf under `set -o cgroup=DIR`, NULL if none
+    struct spool *spool;     // Captured output of a background job, NULL if none
+    bool inherited;          // The parent's, copied by fork(): listed, never waited for
+};
+
+int epoll_fd = -1;           // Event loop; only an interactive shell has one
+int signal_fd = -1;          // SIGCHLD (and SIGINT, SIGQUIT when interactive), read by the loop
+int timer_fd = -1;           // Armed for the earliest pending timer
+sigset_t child_sigmask;      // Signal mask to give back to children
+struct event_source* event_sources = NULL;    // Descriptors being watched
+struct event_source* retired_sources = NULL;  // Removed while their events may still be in hand
+int dispatch_depth = 0;      // Nesting of event_dispatch(): commands run from handlers wait in it too
+struct timer timers[MAX_TIMERS];
+char* job_notices[MAX_NOTICES];  // "Done" lines for background jobs, shown before the next prompt
+int notice_count = 0;
+bool editing = false;        // The line editor owns the terminal
+bool interrupted = false; // Ctrl+C while a command ran: unwind loops and lists
+bool embedded = false;       // Running a line for psh_run(): `exit` ends the line, not the process
+int loop_iterations = 0;     // Loop iterations since the signals were last looked at
+long long default_deadline = 0; // `set -o timeout=DURATION`: milliseconds for each foreground job, 0 for none
+struct job** job_table = NULL; // Jobs started and not yet finished (or stopped)
+int job_count = 0, job_cap = 0;
+int current_job = 0;         // Job fg and bg act on by default, marked '+'
+struct termios shell_tmodes; // Terminal modes of the shell, restored after each job
+const char* current_line = "";  // Input being run: the text of jobs that are not simple commands
+size_t spool_size = 0;       // `set -o spool=SIZE`: buffer bytes per background job, 0 for off
+bool spool_spill = false;    // `set -o spill`: move old spooled output to a memfd instead of dropping it
+long long memo_limit = MEMO_SIZE; // `set -o memo=SIZE`: bytes the memo store may hold, 0 when off
+long long memo_store_bytes = -1;  // Bytes in the memo store when last counted, plus those stored since
+
+// Function to add fd to the event loop; handler is called whenever it is readable
+bool event_add(int fd, event_handler handler, void* data) {
+    struct epoll_event ev = { 0 };
+    struct event_source* src;
+
+    if (epoll_fd < 0) {
+        return false;
+    }
+    src = malloc(sizeof(struct event_source));
+    if (!src) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    src->fd = fd;
+    src->handler = handler;
+    src->data = data;
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free(src);
+        return false;
+    }
+    src->next = event_sources;
+    event_sources = src;
+    return true;
+}
+
+// Function to choose what fd's handler is called for: when it is readable,
+// writable, both, or (for a source paused for now) neither
+void event_watch(int fd, bool readable, bool writable) {
+    for (struct event_source* src = event_sources; src; src = src->next) {
+        if (src->fd == fd) {
+            struct epoll_event ev = { 0 };
+            ev.events = (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+            ev.data.ptr = src;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+            return;
+        }
+    }
+}
+
+// Function to stop watching fd. The source is freed only when no dispatch
+// is running, since an event for it may already have been taken.
+void event_remove(int fd) {
+    for (struct event_source** p = &event_sources; *p; p = &(*p)->next) {
+        struct event_source* src = *p;
+        if (src->fd == fd) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            *p = src->next;
+            src->handler = NULL;
+            src->next = retired_sources;
+            retired_sources = src;
+            return;
+        }
+    }
+}
+
+// Function to wait for events (timeout in ms, -1 for none) and call their
+// handlers. Handlers may run commands, which wait in a nested dispatch.
+void event_dispatch(int timeout) {
+    struct epoll_event events[MAX_EVENTS];
+
+    fflush(stdout);
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    dispatch_depth++;
+    for (int i = 0; i < n; i++) {
+        struct event_source* src = events[i].data.ptr;
+        if (src->handler) {
+            src->handler(src->fd, src->data);
+        }
+    }
+    if (--dispatch_depth == 0) {
+        while (retired_sources) {
+            struct event_source* src = retired_sources;
+            retired_sources = src->next;
+            free(src);
+        }
+    }
+}
+
+// Function to read CLOCK_MONOTONIC in nanoseconds
+long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Function to arm timer_fd for the earliest pending timer, or disarm it
+void arm_timer_fd() {
+    struct itimerspec its = { 0 };
+    long long earliest = 0;
+
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (timers[i].active && (earliest == 0 || timers[i].deadline < earliest)) {
+            earliest = timers[i].deadline;
+        }
+    }
+    if (earliest > 0) {
+        its.it_value.tv_sec = earliest / 1000000000LL;
+        its.it_value.tv_nsec = earliest % 1000000000LL;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Function to run fn(data) from the event loop after ms milliseconds.
+// Returns the timer's id for timer_cancel(), or -1 without an event loop.
+int timer_start(long long ms, void (*fn)(void* data), void* data) {
+    if (timer_fd < 0) {
+        return -1;
+    }
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (!timers[i].active) {
+            timers[i].deadline = monotonic_ns() + ms * 1000000LL;
+            timers[i].fn = fn;
+            timers[i].data = data;
+            timers[i].active = true;
+            arm_timer_fd();
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to cancel a timer that has not fired yet
+void timer_cancel(int id) {
+    if (id >= 0 && id < MAX_TIMERS && timers[id].active) {
+        timers[id].active = false;
+        arm_timer_fd();
+    }
+}
+
+// Function to run the timers that are due when timer_fd fires
+void timers_expired(int fd, void* data) {
+    unsigned long long ticks;
+    long long now = monotonic_ns();
+
+    (void)data;
+    read(fd, &ticks, sizeof(ticks));
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (timers[i].active && timers[i].deadline <= now) {
+            timers[i].active = false;  // The callback may start a new timer here
+            timers[i].fn(timers[i].data);
+        }
+    }
+    arm_timer_fd();
+}
+
+#define TRACE_FLUSH_MS 100        // Buffered trace events wait at most this long for the event loop
+#define TRACE_FLUSH_BYTES 65536   // ... or are written at once when this much is buffered
+
+bool tracing = false;        // `set -o trace=FILE`: record spans for each phase of each command
+char* trace_path = NULL;     // FILE, for `set -o`
+int trace_fd = -1;           // Opened with O_APPEND: children add their spans with single writes
+char* trace_buf = NULL;      // Chrome trace events not written yet
+size_t trace_len = 0, trace_cap = 0;
+int trace_timer = -1;        // Flushes trace_buf from the event loop
+pid_t trace_pid = 0;         // Process the events are recorded in
+
+// Function to write the buffered trace events to the trace file
+void trace_flush() {
+    if (trace_len > 0 && trace_fd >= 0 && write(trace_fd, trace_buf, trace_len) < 0) {
+        perror("trace");
+    }
+    trace_len = 0;
+}
+
+// Function run from the event loop to flush the events buffered meanwhile
+void trace_flush_timer(void* data) {
+    (void)data;
+    trace_timer = -1;
+    trace_flush();
+}
+
+// Function to append n bytes to the trace buffer
+void trace_append(const char* text, size_t n) {
+    if (trace_len + n > trace_cap) {
+        trace_cap = trace_cap ? trace_cap * 2 : 4096;
+        while (trace_cap < trace_len + n) {
+            trace_cap *= 2;
+        }
+        trace_buf = realloc(trace_buf, trace_cap);
+        if (!trace_buf) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(trace_buf + trace_len, text, n);
+    trace_len += n;
+}
+
+// Function to record a Chrome trace "complete" event for a phase that began
+// at start (monotonic_ns()) and ends now. detail (argv, a path) may be NULL;
+// child is left out when 0 and status when negative.
+void trace_span(const char* name, long long start, const char* detail, pid_t child, int status) {
+    long long now = monotonic_ns();
+    char event[512];
+
+    if (start == 0) {
+        return;  // Began before `set -o trace`
+    }
+    int n = snprintf(event, sizeof(event),
+                     "{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"pid\":%d,\"tid\":%d,\"args\":{",
+                     name, start / 1000.0, (now - start) / 1000.0, (int)trace_pid, (int)trace_pid);
+    const char* sep = "";
+
+    trace_append(event, n);
+    if (detail) {
+        const char* end = detail + strlen(detail);
+        while (end > detail && end[-1] == '\n') {
+            end--;  // A line's own newline
+        }
+        trace_append("\"argv\":\"", 8);
+        for (const char* c = detail; c < end; c++) {
+            if (*c == '"' || *c == '\\') {
+                trace_append("\\", 1);
+                trace_append(c, 1);
+            } else if ((unsigned char)*c < 0x20) {
+                n = snprintf(event, sizeof(event), "\\u%04x", (unsigned char)*c);
+                trace_append(event, n);
+            } else {
+                trace_append(c, 1);
+            }
+        }
+        trace_append("\"", 1);
+        sep = ",";
+    }
+    if (child > 0) {
+        n = snprintf(event, sizeof(event), "%s\"child\":%d", sep, (int)child);
+        trace_append(event, n);
+        sep = ",";
+    }
+    if (status >= 0) {
+        n = snprintf(event, sizeof(event), "%s\"status\":%d", sep, status);
+        trace_append(event, n);
+    }
+    trace_append("}},\n", 4);
+    if (trace_len >= TRACE_FLUSH_BYTES) {
+        trace_flush();
+    } else if (trace_timer < 0) {
+        trace_timer = timer_start(TRACE_FLUSH_MS, trace_flush_timer, NULL);
+    }
+}
+
+bool ensure_event_loop();
+
+// Function for `set -o trace=FILE` (path) and `set +o trace` (NULL). The
+// file is a Chrome trace JSON array, left open so that children of a still
+// running shell can append to it; Perfetto and chrome://tracing accept that.
+bool trace_to(const char* path) {
+    if (tracing) {
+        trace_flush();
+        timer_cancel(trace_timer);
+        trace_timer = -1;
+        close(trace_fd);
+        trace_fd = -1;
+        free(trace_path);
+        trace_path = NULL;
+        tracing = false;
+    }
+    if (path == NULL) {
+        return true;
+    }
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        fprintf(stderr, "set: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    static bool flush_at_exit = false;
+    if (!flush_at_exit) {
+        atexit(trace_flush);
+        flush_at_exit = true;
+    }
+    ensure_event_loop();  // For the flush timer, in scripts too
+    trace_pid = getpid();
+    trace_path = strdup(path);
+    tracing = true;
+    char header[128];
+    int n = snprintf(header, sizeof(header),
+                     "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"PUCITshell\"}},\n",
+                     (int)trace_pid);
+    trace_append(header, n);
+    trace_flush();
+    return true;
+}
+
+#define PROFILE_HZ 1000        // Default sampling rate of `profile start`
+#define PROFILE_MAX_HZ 10000
+#define PROFILE_DEPTH 64       // Frames kept per sample
+#define PROFILE_SAMPLES 8192   // Samples kept per run; later ones are only counted
+
+// A stack sampled by the SIGPROF handler, innermost frame first
+struct profile_sample {
+    int depth;
+    uintptr_t pcs[PROFILE_DEPTH];
+};
+
+// A function from the executable's symbol table
+struct profile_symbol {
+    uintptr_t addr;
+    size_t size;
+    char* name;
+};
+
+struct profile_sample* profile_samples = NULL;  // Allocated up front: the handler must not malloc
+volatile sig_atomic_t profile_count = 0;         // Samples taken in this run
+volatile sig_atomic_t profile_dropped = 0;       // Samples past PROFILE_SAMPLES
+bool profiling = false;                          // Between `profile start` and `profile stop`
+int profile_hz = 0;
+int profile_fd = -1;                             // perf task-clock event, or -1 for ITIMER_PROF
+const char* profile_clock = NULL;                // Which of the two the last run used
+uintptr_t profile_stack_end = 0;                 // Top of the main stack; frame pointers stay below it
+struct profile_symbol* profile_symbols = NULL;   // Sorted by address, loaded by the first report
+int profile_symbol_count = 0;
+uintptr_t profile_bias = 0;                      // Load address of the (PIE) executable
+
+// Function to take one sample on SIGPROF: the interrupted PC, then the
+// return addresses found by following the saved frame pointers. Each frame
+// pointer must lie above the last one and below the top of the stack, so a
+// register used for something else in a function built without frame
+// pointers ends the walk instead of sending it off the stack.
+void profile_signal(int sig, siginfo_t* info, void* context) {
+    ucontext_t* uc = context;
+    uintptr_t pc, fp, sp;
+
+    (void)sig;
+    (void)info;
+    if (profile_count >= PROFILE_SAMPLES) {
+        profile_dropped++;  // Not re-armed: the perf event stays quiet from here on
+        return;
+    }
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+    sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+    sp = uc->uc_mcontext.sp;
+#else
+    (void)uc;
+    return;  // No unwinder for this architecture
+#endif
+    struct profile_sample* s = &profile_samples[profile_count];
+    int depth = 0;
+    s->pcs[depth++] = pc;
+    // Both ABIs keep {caller's frame pointer, return address} at the frame pointer
+    while (depth < PROFILE_DEPTH && fp >= sp && fp % sizeof(uintptr_t) == 0 &&
+           fp + 2 * sizeof(uintptr_t) <= profile_stack_end) {
+        const uintptr_t* frame = (const uintptr_t*)fp;
+        if (frame[1] == 0) {
+            break;
+        }
+        s->pcs[depth++] = frame[1];
+        sp = fp + 2 * sizeof(uintptr_t);
+        fp = frame[0];
+    }
+    s->depth = depth;
+    profile_count++;
+    if (profile_fd >= 0) {
+        ioctl(profile_fd, PERF_EVENT_IOC_REFRESH, 1);  // Signal on the next overflow too
+    }
+}
+
+// Function to find the top of the main thread's stack in /proc/self/maps
+uintptr_t profile_find_stack_end() {
+    char line[512];
+    uintptr_t end = 0;
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long from, to;
+        if (strstr(line, "[stack]") && sscanf(line, "%lx-%lx", &from, &to) == 2) {
+            end = to;
+            break;
+        }
+    }
+    fclose(maps);
+    return end;
+}
+
+// Function to open a perf task-clock event that sends SIGPROF each time
+// the shell has run 1/hz seconds. It is timed by an hrtimer, so unlike
+// ITIMER_PROF it keeps rates above the kernel tick. -1 when perf events
+// are unavailable (no kernel support, or perf_event_paranoid above 2).
+int profile_open_perf(int hz) {
+    struct perf_event_attr attr;
+    struct f_owner_ex owner;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.sample_period = 1000000000 / hz;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;  // All perf_event_paranoid=2 allows
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    owner.type = F_OWNER_TID;
+    owner.pid = getpid();
+    if (fcntl(fd, F_SETFL, O_ASYNC) < 0 || fcntl(fd, F_SETSIG, SIGPROF) < 0 ||
+        fcntl(fd, F_SETOWN_EX, &owner) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function for `profile start [hz]`: sample the shell's own CPU time (not
+// its children's) until `profile stop`, with perf events if possible
+bool profile_start(int hz) {
+    if (profiling) {
+        fprintf(stderr, "profile: already running\n");
+        return false;
+    }
+    if (profile_samples == NULL) {
+        profile_samples = malloc(PROFILE_SAMPLES * sizeof(struct profile_sample));
+        if (!profile_samples) {
+            fprintf(stderr, "Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (profile_stack_end == 0 && (profile_stack_end = profile_find_stack_end()) == 0) {
+        fprintf(stderr, "profile: cannot find the stack in /proc/self/maps\n");
+        return false;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = profile_signal;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+    profile_count = profile_dropped = 0;
+    profile_hz = hz;
+    profile_fd = profile_open_perf(hz);
+    if (profile_fd >= 0) {
+        ioctl(profile_fd, PERF_EVENT_IOC_REFRESH, 1);
+        profile_clock = "perf task-clock";
+        profiling = true;
+        return true;
+    }
+    struct itimerval it;
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 1000000 / hz;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, NULL) < 0) {
+        perror("profile");
+        signal(SIGPROF, SIG_DFL);
+        return false;
+    }
+    profile_clock = "ITIMER_PROF";
+    profiling = true;
+    return true;
+}
+
+// Function for `profile stop`. A signal already generated is delivered
+// when the disabling call returns, so the default action can come back after it.
+void profile_stop() {
+    if (profile_fd >= 0) {
+        ioctl(profile_fd, PERF_EVENT_IOC_DISABLE, 0);
+        close(profile_fd);
+        profile_fd = -1;
+    } else {
+        struct itimerval it;
+        memset(&it, 0, sizeof(it));
+        setitimer(ITIMER_PROF, &it, NULL);
+    }
+    signal(SIGPROF, SIG_DFL);
+    profiling = false;
+}
+
+// Function to order symbols by address
+int compare_profile_symbols(const void* a, const void* b) {
+    const struct profile_symbol* x = a;
+    const struct profile_symbol* y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// Function to load the function symbols of the shell's own executable from
+// its ELF symbol table, which (unlike dladdr()) also covers functions not
+// exported with -rdynamic. Leaves the table empty for a stripped binary.
+void profile_load_symbols() {
+    struct stat st;
+    int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return;
+    }
+    const char* image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return;
+    }
+    const ElfW(Ehdr)* eh = (const ElfW(Ehdr)*)image;
+    const ElfW(Shdr)* sections = (const ElfW(Shdr)*)(image + eh->e_shoff);
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh->e_shoff + (size_t)eh->e_shnum * sizeof(ElfW(Shdr)) > (size_t)st.st_size) {
+        munmap((void*)image, st.st_size);
+        return;
+    }
+    int capacity = 0;
+    uintptr_t self = 0;
+    for (int i = 0; i < eh->e_shnum; i++) {
+        const ElfW(Shdr)* sh = &sections[i];
+        if (sh->sh_type != SHT_SYMTAB || sh->sh_link >= eh->e_shnum) {
+            continue;
+        }
+        const ElfW(Sym)* syms = (const ElfW(Sym)*)(image + sh->sh_offset);
+        const char* names = image + sections[sh->sh_link].sh_offset;
+        size_t count = sh->sh_size / sizeof(ElfW(Sym));
+        for (size_t k = 0; k < count; k++) {
+            if (ELF64_ST_TYPE(syms[k].st_info) != STT_FUNC || syms[k].st_value == 0) {
+                continue;
+            }
+            if (profile_symbol_count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                profile_symbols = realloc(profile_symbols, capacity * sizeof(struct profile_symbol));
+                if (!profile_symbols) {
+                    fprintf(stderr, "Reallocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            struct profile_symbol* sym = &profile_symbols[profile_symbol_count++];
+            sym->addr = syms[k].st_value;
+            sym->size = syms[k].st_size;
+            sym->name = strdup(names + syms[k].st_name);
+            if (strcmp(sym->name, "profile_load_symbols") == 0) {
+                self = sym->addr;
+            }
+        }
+    }
+    munmap((void*)image, st.st_size);
+    // The table has link-time addresses; this function's own address gives the offset
+    profile_bias = self ? (uintptr_t)profile_load_symbols - self : 0;
+    qsort(profile_symbols, profile_symbol_count, sizeof(struct profile_symbol), compare_profile_symbols);
+}
+
+// Function to name the function containing pc: from the executable's own
+// symbols, else from the shared library's dynamic symbols, else its address
+void profile_symbol_name(uintptr_t pc, char* buf, size_t size) {
+    uintptr_t addr = pc - profile_bias;
+    int lo = 0, hi = profile_symbol_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const struct profile_symbol* sym = &profile_symbols[mid];
+        if (addr < sym->addr) {
+            hi = mid - 1;
+        } else if (addr >= sym->addr + (sym->size ? sym->size : 1)) {
+            lo = mid + 1;
+        } else {
+            snprintf(buf, size, "%s", sym->name);
+            return;
+        }
+    }
+    Dl_info info = {0};
+    if (!dladdr((void*)pc, &info)) {
+        snprintf(buf, size, "0x%lx", (unsigned long)pc);  // Nothing is mapped there that dladdr() knows
+    } else if (info.dli_sname) {
+        snprintf(buf, size, "%s", info.dli_sname);
+    } else if (info.dli_fname) {
+        const char* base = strrchr(info.dli_fname, '/');
+        snprintf(buf, size, "[%s]", base ? base + 1 : info.dli_fname);
+    } else {
+        snprintf(buf, size, "0x%lx", (unsigned long)pc);
+    }
+}
+
+// A folded stack and the number of samples that had it
+struct profile_stack {
+    char* frames;
+    int count;
+};
+
+// Function to order folded stacks by text, to count repeats
+int compare_profile_frames(const void* a, const void* b) {
+    return strcmp(((const struct profile_stack*)a)->frames, ((const struct profile_stack*)b)->frames);
+}
+
+// Function to order folded stacks by sample count, most first
+int compare_profile_counts(const void* a, const void* b) {
+    const struct profile_stack* x = a;
+    const struct profile_stack* y = b;
+    if (x->count != y->count) {
+        return y->count - x->count;
+    }
+    return strcmp(x->frames, y->frames);
+}
+
+// Function for `profile report [file]`: print each distinct stack as
+// "outer;...;inner count", the folded format flamegraph.pl and speedscope read
+bool profile_report(const char* path) {
+    sigset_t block, saved;
+    char name[256];
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGPROF);
+    sigprocmask(SIG_BLOCK, &block, &saved);  // Keep the report itself out of the samples
+    if (profile_symbols == NULL) {
+        profile_load_symbols();
+    }
+    int n = profile_count;
+    struct profile_stack* stacks = malloc((n ? n : 1) * sizeof(struct profile_stack));
+    if (!stacks) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+        const struct profile_sample* s = &profile_samples[i];
+        size_t len = 0, cap = 256;
+        char* frames = malloc(cap);
+        if (!frames) {
+            fprintf(stderr, "Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        frames[0] = '\0';
+        for (int d = s->depth - 1; d >= 0; d--) {
+            // A return address is just past the call, which may be the next function's start
+            profile_symbol_name(d > 0 ? s->pcs[d] - 1 : s->pcs[d], name, sizeof(name));
+            size_t need = len + strlen(name) + 2;
+            if (need > cap) {
+                cap = need * 2;
+                frames = realloc(frames, cap);
+                if (!frames) {
+                    fprintf(stderr, "Reallocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            len += sprintf(frames + len, "%s%s", len ? ";" : "", name);
+        }
+        stacks[i].frames = frames;
+        stacks[i].count = 1;
+    }
+    qsort(stacks, n, sizeof(struct profile_stack), compare_profile_frames);
+    int distinct = 0;
+    for (int i = 0; i < n; i++) {
+        if (distinct > 0 && strcmp(stacks[distinct - 1].frames, stacks[i].frames) == 0) {
+            stacks[distinct - 1].count++;
+            free(stacks[i].frames);
+        } else {
+            stacks[distinct++] = stacks[i];
+        }
+    }
+    qsort(stacks, distinct, sizeof(struct profile_stack), compare_profile_counts);
+    FILE* out = path ? fopen(path, "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "profile: %s: %s\n", path, strerror(errno));
+    }
+    for (int i = 0; i < distinct; i++) {
+        if (out) {
+            fprintf(out, "%s %d\n", stacks[i].frames, stacks[i].count);
+        }
+        free(stacks[i].frames);
+    }
+    free(stacks);
+    if (out && out != stdout) {
+        fclose(out);
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return out != NULL;
+}
+
+// Function to handle the profile built-in
+void profile_builtin(char** args) {
+    if (args[1] == NULL) {
+        printf("profile: %s, %d samples", profiling ? "running" : "stopped", (int)profile_count);
+        if (profile_clock) {
+            printf(" at %d Hz (%s)", profile_hz, profile_clock);
+        }
+        if (profile_dropped > 0) {
+            printf(", %d dropped", (int)profile_dropped);
+        }
+        printf("\n");
+    } else if (strcmp(args[1], "start") == 0 && (args[2] == NULL || args[3] == NULL)) {
+        char* end = NULL;
+        long hz = args[2] ? strtol(args[2], &end, 10) : PROFILE_HZ;
+        if (args[2] && (*end != '\0' || hz < 1 || hz > PROFILE_MAX_HZ)) {
+            fprintf(stderr, "profile: invalid rate '%s' (1-%d Hz)\n", args[2], PROFILE_MAX_HZ);
+            last_status = 1;
+        } else if (!profile_start(hz)) {
+            last_status = 1;
+        }
+    } else if (strcmp(args[1], "stop") == 0 && args[2] == NULL) {
+        if (!profiling) {
+            fprintf(stderr, "profile: not running\n");
+            last_status = 1;
+            return;
+        }
+        profile_stop();
+    } else if (strcmp(args[1], "report") == 0 && (args[2] == NULL || args[3] == NULL)) {
+        if (!profile_report(args[2])) {
+            last_status = 1;
+        }
+    } else {
+        fprintf(stderr, "Usage: profile [start [hz] | stop | report [file]]\n");
+        last_status = 2;
+    }
+}
+
+void update_jobs();
+
+// Function to take the signals queued on signal_fd. Ctrl+C reaches the
+// foreground command directly; the shell only stops the list it is running.
+void signals_received(int fd, void* data) {
+    struct signalfd_siginfo si;
+
+    (void)data;
+    bool child = false;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+        if ((si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) && !editing) {
+            interrupted = true;  // SIGTERM is only taken here by a server
+        } else if (si.ssi_signo == SIGCHLD) {
+            child = true;  // Several exits may share one SIGCHLD
+        }
+    }
+    if (child) {
+        update_jobs();
+    }
+}
+
+// Function to look at pending signals from a loop made only of built-ins,
+// which never reaches the event loop; cheap enough for every iteration
+void check_interrupt() {
+    if (signal_fd >= 0 && !interrupted && (++loop_iterations & 1023) == 0) {
+        signals_received(signal_fd, NULL);
+        if (interrupted) {
+            printf("\n");  // The terminal echoed "^C"
+        }
+    }
+}
+
+void editor_show_notices();
+
+// Function to queue a line about a background job. It is printed above the
+// line being edited, or before the next prompt if a command is running.
+void job_notice(const char* text) {
+    if (notice_count < MAX_NOTICES) {
+        job_notices[notice_count++] = strdup(text);
+    }
+    if (editing) {
+        editor_show_notices();
+    }
+}
+
+// Function to print and clear the queued job notices
+void print_job_notices() {
+    for (int i = 0; i < notice_count; i++) {
+        printf("%s\n", job_notices[i]);
+        free(job_notices[i]);
+    }
+    notice_count = 0;
+}
+
+// Function to turn a waitpid() status into a shell exit status
+int decode_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+// Function to hand the terminal to process group pgid, or back to the shell
+// when pgid is 0. Only the interactive shell itself owns the terminal.
+void give_terminal(pid_t pgid) {
+    if (interactive && !in_subshell) {
+        tcsetpgrp(STDIN_FILENO, pgid ? pgid : getpgrp());
+    }
+}
+
+// Function to check whether jobs started now get process groups of their
+// own: only an interactive shell does job control, not its subshells
+bool job_control() {
+    return interactive && !in_subshell;
+}
+
+// Function to find the job numbered id, or NULL
+struct job* find_job(int id) {
+    for (int i = 0; i < job_count; i++) {
+        if (job_table[i]->id == id && !job_table[i]->disowned) {
+            return job_table[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to start a job for text, numbered with the lowest free number
+struct job* new_job(const char* text, bool background) {
+    struct job* j = calloc(1, sizeof(struct job));
+    int id = 1;
+
+    if (!j) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < job_count; i++) {
+        if (job_table[i]->id == id) {
+            id++;
+            i = -1;  // Number taken: look again from the start
+        }
+    }
+    if (job_count == job_cap) {
+        job_cap = job_cap ? job_cap * 2 : 8;
+        job_table = realloc(job_table, job_cap * sizeof(struct job*));
+        if (!job_table) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    j->id = id;
+    j->text = strndup(text, strcspn(text, "\n"));  // First line only
+    j->background = background;
+    job_table[job_count++] = j;
+    return j;
+}
+
+// Function called when a pidfd shows that a child of psh_run() has exited.
+// The host's threads may take SIGCHLD, so signal_fd cannot be relied on. The
+// pidfd is only a wakeup: it stops being watched, and update_jobs() reaps the
+// child if it belongs to the loaded session (another's waits for psh_poll()).
+void child_exited(int fd, void* data) {
+    (void)data;
+    event_remove(fd);
+    update_jobs();
+}
+
+// Function to record a child of job j in the parent. With own_group set the
+// child joins the job's process group, led by its first process; the child
+// makes the same setpgid() call, so neither side can run ahead of the other.
+void add_job_process(struct job* j, pid_t pid, bool own_group) {
+    if (own_group) {
+        if (j->pgid == 0) {
+            j->pgid = pid;
+        }
+        setpgid(pid, j->pgid);
+    }
+    if (j->proc_count == j->proc_cap) {
+        j->proc_cap = j->proc_cap ? j->proc_cap * 2 : 4;
+        j->procs = realloc(j->procs, j->proc_cap * sizeof(struct job_process));
+        if (!j->procs) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    j->procs[j->proc_count].pid = pid;
+    j->procs[j->proc_count].status = 0;
+    j->procs[j->proc_count].state = PROC_RUNNING;
+    j->procs[j->proc_count].pidfd = embedded && ensure_event_loop() ? pidfd_open(pid, 0) : -1;
+    if (j->procs[j->proc_count].pidfd >= 0) {
+        event_add(j->procs[j->proc_count].pidfd, child_exited, NULL);
+    }
+    j->proc_count++;
+}
+
+// Function run in a job's child right after fork(): join the group (pgid 0
+// starts it) and take the terminal if the job runs in the foreground. This
+// happens before leave_event_loop(), while SIGTTOU is still blocked.
+void join_job_group(pid_t pgid, bool foreground) {
+    setpgid(0, pgid);
+    if (foreground) {
+        give_terminal(getpgrp());
+    }
+}
+
+// Function to get rid of the n oldest bytes in a spool's ring
+void spool_evict(struct spool* s, const char* data, size_t n) {
+    if (s->spill_fd >= 0 && write(s->spill_fd, data, n) == (ssize_t)n) {
+        s->spilled += n;
+    } else {
+        s->dropped += n;
+    }
+}
+
+// Function to add n bytes of a job's output to its spool
+void spool_append(struct spool* s, const char* data, size_t n) {
+    if (n == 0 || s->size == 0) {  // Nothing to add, or nowhere to keep it
+        return;
+    }
+    if (n > s->size) {  // Only the tail can stay in the ring
+        while (s->len > 0) {
+            size_t first = s->alloc - s->start < s->len ? s->alloc - s->start : s->len;
+            spool_evict(s, s->buf + s->start, first);
+            s->start = (s->start + first) % s->alloc;
+            s->len -= first;
+        }
+        spool_evict(s, data, n - s->size);
+        data += n - s->size;
+        n = s->size;
+    }
+    if (s->len + n > s->alloc && s->alloc < s->size) {  // Not wrapped yet: start is 0
+        size_t alloc = s->alloc ? s->alloc * 2 : 4096;
+        while (alloc < s->len + n) {
+            alloc *= 2;
+        }
+        alloc = alloc < s->size ? alloc : s->size;
+        s->buf = realloc(s->buf, alloc);
+        if (!s->buf) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        s->alloc = alloc;
+    }
+    while (s->len + n > s->alloc) {  // Full: make room from the oldest end
+        size_t need = s->len + n - s->alloc;
+        size_t first = s->alloc - s->start;
+        first = first < need ? first : need;
+        spool_evict(s, s->buf + s->start, first);
+        s->start = (s->start + first) % s->alloc;
+        s->len -= first;
+    }
+    size_t end = (s->start + s->len) % s->alloc;
+    size_t first = s->alloc - end < n ? s->alloc - end : n;
+    memcpy(s->buf + end, data, first);
+    memcpy(s->buf, data + first, n - first);
+    s->len += n;
+}
+
+// Function to drain a spooled job's pipe, from the event loop or before its
+// output is shown
+void spool_ready(int fd, void* data) {
+    struct spool* s = ((struct job*)data)->spool;
+    char buf[65536];
+
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0 && s->live) {
+            fflush(stdout);
+            if (write(shell_fd(STDOUT_FILENO), buf, n) < 0) {
+                s->dropped += n;
+            }
+        } else if (n > 0) {
+            spool_append(s, buf, n);
+        } else if (n == 0) {  // Every process holding the write end is gone
+            event_remove(fd);
+            close(fd);
+            s->fd = -1;
+            return;
+        } else if (errno != EINTR) {
+            return;
+        }
+    }
+}
+
+// Function to make the pipe a background job's output is spooled through.
+// Returns NULL with spooling off or in a subshell (its output goes where the
+// subshell's does); otherwise *write_fd is the end the children write to.
+struct spool* spool_open(int* write_fd) {
+    int fds[2];
+
+    if (spool_size == 0 || in_subshell || !ensure_event_loop() || pipe2(fds, O_CLOEXEC) < 0) {
+        return NULL;
+    }
+    struct spool* s = calloc(1, sizeof(struct spool));
+    if (!s) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    s->fd = fds[0];
+    s->size = spool_size;
+    s->spill_fd = spool_spill ? memfd_create("psh-spool", MFD_CLOEXEC) : -1;
+    *write_fd = fds[1];
+    return s;
+}
+
+// Function to give spool s to job j and start draining it
+void spool_attach(struct job* j, struct spool* s) {
+    if (s) {
+        j->spool = s;
+        event_add(s->fd, spool_ready, j);
+    }
+}
+
+// Function to copy everything a spool holds, spilled bytes first, into a new
+// buffer. Sets *len; the caller frees the result.
+char* spool_contents(struct spool* s, size_t* len) {
+    char* out = malloc(s->spilled + s->len + 1);
+    size_t n = 0;
+
+    if (!out) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (s->spilled > 0) {
+        ssize_t r = pread(s->spill_fd, out, s->spilled, 0);
+        n = r > 0 ? (size_t)r : 0;
+    }
+    for (size_t i = 0; i < s->len; i++) {
+        out[n++] = s->buf[(s->start + i) % s->alloc];
+    }
+    *len = n;
+    return out;
+}
+
+// Function to empty a spool once its output has been shown
+void spool_clear(struct spool* s) {
+    s->start = s->len = 0;
+    s->spilled = s->dropped = 0;
+    if (s->spill_fd >= 0 && ftruncate(s->spill_fd, 0) != 0) {
+        close(s->spill_fd);
+        s->spill_fd = -1;
+    }
+}
+
+// Function to print and empty a job's spooled output; a note on stderr says
+// how much was dropped. A copy inherited by a pipeline stage is only printed:
+// the spill memfd is shared with the parent.
+void spool_print(struct job* j) {
+    struct spool* s = j->spool;
+    size_t len;
+
+    if (s->fd >= 0) {
+        spool_ready(s->fd, j);
+    }
+    if (s->dropped > 0) {
+        fprintf(stderr, "[%zu bytes of output dropped]\n", s->dropped);
+    }
+    char* out = spool_contents(s, &len);
+    fflush(stdout);
+    if (len > 0 && write(shell_fd(STDOUT_FILENO), out, len) < 0) {
+        perror("write");
+    }
+    free(out);
+    if (!j->inherited) {
+        spool_clear(s);
+    }
+}
+
+// Function to close and free a spool, which may be NULL
+void spool_free(struct spool* s) {
+    if (!s) {
+        return;
+    }
+    if (s->fd >= 0) {
+        event_remove(s->fd);
+        close(s->fd);
+    }
+    if (s->spill_fd >= 0) {
+        close(s->spill_fd);
+    }
+    free(s->buf);
+    free(s);
+}
+
+// Function to stop watching a process's pidfd and close it
+void drop_pidfd(struct job_process* p) {
+    if (p->pidfd >= 0) {
+        event_remove(p->pidfd);  // If the wakeup has not removed it already
+        close(p->pidfd);
+        p->pidfd = -1;
+    }
+}
+
+// Function to drop job j from the table and free it
+void free_job(struct job* j) {
+    for (int i = 0; i < job_count; i++) {
+        if (job_table[i] == j) {
+            job_table[i] = job_table[--job_count];
+            break;
+        }
+    }
+    if (current_job == j->id) {
+        current_job = 0;
+    }
+    if (j->cgroup && !j->inherited) {
+        rmdir(j->cgroup);  // Fails while a process that escaped the job is still in it
+    }
+    for (int i = 0; i < j->proc_count; i++) {
+        drop_pidfd(&j->procs[i]);
+    }
+    free(j->cgroup);
+    spool_free(j->spool);
+    free(j->procs);
+    free(j->text);
+    free(j);
+}
+
+// Function to count a job's processes in the given state
+int job_procs_in(struct job* j, int state) {
+    int n = 0;
+    for (int i = 0; i < j->proc_count; i++) {
+        n += j->procs[i].state == state;
+    }
+    return n;
+}
+
+// Function to check whether a job has stopped: nothing running, something stopped
+bool job_stopped(struct job* j) {
+    return job_procs_in(j, PROC_RUNNING) == 0 && job_procs_in(j, PROC_STOPPED) > 0;
+}
+
+// Function to count the jobs that jobs lists
+int count_jobs() {
+    int n = 0;
+    for (int i = 0; i < job_count; i++) {
+        n += !job_table[i]->disowned;
+    }
+    return n;
+}
+
+// Function to describe a job's state: Running, Stopped, Done, Exit n or the
+// signal that killed it
+void job_state_text(struct job* j, char* buf, size_t size) {
+    int status = j->proc_count ? j->procs[j->proc_count - 1].status : 0;
+
+    if (job_procs_in(j, PROC_RUNNING) > 0) {
+        snprintf(buf, size, "Running");
+    } else if (job_stopped(j)) {
+        snprintf(buf, size, "Stopped");
+    } else if (WIFSIGNALED(status)) {
+        snprintf(buf, size, "%s", strsignal(WTERMSIG(status)));
+    } else if (decode_status(status) != 0) {
+        snprintf(buf, size, "Exit %d", decode_status(status));
+    } else {
+        snprintf(buf, size, "Done");
+    }
+}
+
+// Function to format a job as `jobs` lists it: "[1]+  Running    sleep 10 &"
+void format_job(struct job* j, char* buf, size_t size) {
+    char state[64];
+    job_state_text(j, state, sizeof(state));
+    snprintf(buf, size, "[%d]%c  %-10s %s%s", j->id, j->id == current_job ? '+' : ' ', state,
+             j->text, j->background && job_procs_in(j, PROC_RUNNING) > 0 ? " &" : "");
+}
+
+// Function to mark a job's processes running again after SIGCONT
+void continue_job(struct job* j) {
+    if (j->pgid > 0) {
+        kill(-j->pgid, SIGCONT);
+    }
+    for (int i = 0; i < j->proc_count; i++) {
+        if (j->procs[i].state == PROC_STOPPED) {
+            if (j->pgid == 0) {
+                kill(j->procs[i].pid, SIGCONT);
+            }
+            j->procs[i].state = PROC_RUNNING;
+        }
+    }
+}
+
+void session_job_done(struct job* j);
+
+// Function to collect state changes of every job's processes: called for
+// SIGCHLD and by `jobs`. Each pid is waited for by itself, so children that
+// are not jobs (the prompt helper) are left to their owners. Background jobs
+// that finish or stop are announced; finished ones are dropped.
+void update_jobs() {
+    for (int i = 0; i < job_count; i++) {
+        struct job* j = job_table[i];
+        bool was_stopped = job_stopped(j);
+        bool was_done = job_procs_in(j, PROC_DONE) == j->proc_count;
+
+        if (j->inherited) {
+            continue;  // The parent's children, not ours to wait for
+        }
+        for (int k = 0; k < j->proc_count; k++) {
+            struct job_process* p = &j->procs[k];
+            int status;
+            if (p->state == PROC_DONE) {
+                continue;
+            }
+            pid_t r = waitpid(p->pid, &status, WNOHANG | WUNTRACED | WCONTINUED);
+            if (r == p->pid) {
+                if (WIFSTOPPED(status)) {
+                    p->state = PROC_STOPPED;
+                } else if (WIFCONTINUED(status)) {
+                    p->state = PROC_RUNNING;
+                } else {
+                    p->state = PROC_DONE;
+                    p->status = status;
+                }
+            } else if (r < 0 && errno == ECHILD) {
+                p->state = PROC_DONE;  // Reaped already
+            }
+            if (p->state == PROC_DONE) {
+                drop_pidfd(p);
+            }
+        }
+        if (!j->background) {
+            continue;  // wait_for_job() reports on foreground jobs
+        }
+        bool done = job_procs_in(j, PROC_DONE) == j->proc_count;
+        if (((done && !was_done) || (job_stopped(j) && !was_stopped)) && interactive && !j->disowned) {
+            char text[PATH_MAX];
+            format_job(j, text, sizeof(text));
+            job_notice(text);
+        }
+        if (done && !was_done && !j->disowned) {
+            session_job_done(j);  // Reported by psh_poll()
+        }
+        if (done && (!j->spool || j->disowned)) {  // Spooled output waits for jobs -o
+            free_job(j);
+            i--;
+        }
+    }
+}
+
+// Function to wait for a foreground job until it finishes or stops, and
+// return its exit status (that of its last process). A stopped job stays in
+// the table as a background job for fg and bg; a finished one is freed.
+int wait_for_job(struct job* j) {
+    int status;
+
+    if (j->pgid > 0) {
+        give_terminal(j->pgid);
+    }
+    while (job_procs_in(j, PROC_RUNNING) > 0) {
+        if (signal_fd >= 0 && !embedded) {
+            event_dispatch(-1);  // SIGCHLD arrives through the event loop
+            continue;
+        } else if (signal_fd >= 0) {
+            // In psh_run() exits wake the loop through pidfds; stops are
+            // polled for, as SIGCHLD may go to another of the host's threads
+            event_dispatch(JOB_POLL_MS);
+            update_jobs();
+            continue;
+        }
+        for (int i = 0; i < j->proc_count; i++) {
+            struct job_process* p = &j->procs[i];
+            if (p->state == PROC_RUNNING) {
+                while (waitpid(p->pid, &p->status, 0) < 0 && errno == EINTR) {
+                }
+                p->state = PROC_DONE;
+                drop_pidfd(p);
+            }
+        }
+    }
+    if (j->pgid > 0 && job_control()) {
+        give_terminal(0);
+        if (job_stopped(j)) {
+            j->has_tmodes = tcgetattr(STDIN_FILENO, &j->tmodes) == 0;
+        }
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    if (job_stopped(j)) {
+        char text[PATH_MAX];
+        j->background = true;
+        if (j->spool) {
+            j->spool->live = false;  // Spooled again until the next fg
+        }
+        current_job = j->id;
+        format_job(j, text, sizeof(text));
+        printf("\n%s\n", text);
+        return 128 + SIGTSTP;
+    }
+    status = j->procs[j->proc_count - 1].status;
+    if (epoll_fd >= 0 && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+        printf("\n");  // Ctrl+C left the cursor after "^C"
+        interrupted = true;  // Any SIGINT the shell got may not be read yet
+    }
+    if (j->spool && j->spool->fd >= 0) {
+        spool_ready(j->spool->fd, j);  // What the job wrote last, still in the pipe
+    }
+    free_job(j);
+    return decode_status(status);
+}
+
+// Function to resolve a job spec: %n, %+, %% or n; the current job if spec
+// is NULL. Prints an error naming cmd and returns NULL if there is none.
+struct job* parse_job_spec(const char* cmd, const char* spec) {
+    struct job* j;
+
+    if (spec == NULL || strcmp(spec, "%+") == 0 || strcmp(spec, "%%") == 0) {
+        j = find_job(current_job);
+        if (!j && job_count > 0) {
+            for (int i = job_count - 1; i >= 0 && !j; i--) {
+                j = job_table[i]->disowned ? NULL : job_table[i];
+            }
+        }
+    } else {
+        char* end;
+        long id = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+        j = *end == '\0' && id > 0 && id <= INT_MAX ? find_job((int)id) : NULL;
+    }
+    if (!j) {
+        fprintf(stderr, "%s: %s: no such job\n", cmd, spec ? spec : "current");
+    }
+    return j;
+}
+
+// Function for fg, bg and disown
+void job_builtin(char** args) {
+    struct job* j;
+
+    last_status = 1;
+    if (strcmp(args[0], "disown") != 0 && !job_control()) {
+        fprintf(stderr, "%s: no job control\n", args[0]);
+        return;
+    }
+    update_jobs();
+    j = parse_job_spec(args[0], args[1]);
+    if (!j) {
+        return;
+    }
+    if (strcmp(args[0], "disown") == 0) {
+        j->disowned = true;  // Still reaped, silently
+        if (current_job == j->id) {
+            current_job = 0;
+        }
+        last_status = 0;
+    } else if (strcmp(args[0], "bg") == 0) {
+        current_job = j->id;
+        continue_job(j);
+        printf("[%d]+ %s &\n", j->id, j->text);
+        last_status = 0;
+    } else {
+        printf("%s\n", j->text);
+        fflush(stdout);
+        j->background = false;
+        if (j->spool) {
+            spool_print(j);  // What it wrote in the background, then the rest as it comes
+            j->spool->live = true;
+        }
+        if (j->pgid > 0) {
+            give_terminal(j->pgid);
+            if (j->has_tmodes) {
+                tcsetattr(STDIN_FILENO, TCSADRAIN, &j->tmodes);
+            }
+        }
+        continue_job(j);
+        last_status = wait_for_job(j);
+    }
+}
+
+// Signals kill accepts by name
+static const struct {
+    const char* name;
+    int sig;
+} signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+    { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { NULL, 0 }
+};
+
+// Function to parse a signal given as a number, a name or a SIG-prefixed
+// name. Returns -1 if it is none of these.
+int parse_signal(const char* text) {
+    char* end;
+    long n = strtol(text, &end, 10);
+
+    if (*text != '\0' && *end == '\0') {
+        return n > 0 && n < NSIG ? (int)n : -1;
+    }
+    if (strncmp(text, "SIG", 3) == 0) {
+        text += 3;
+    }
+    for (int i = 0; signal_names[i].name; i++) {
+        if (strcmp(text, signal_names[i].name) == 0) {
+            return signal_names[i].sig;
+        }
+    }
+    return -1;
+}
+
+// Function for `kill [-SIGNAL] pid|%n...`. A job is signalled as a whole
+// process group; a stopped one is also continued so it can act on the
+// signal. Without -SIGNAL the target is killed, as kill always has done here.
+void kill_builtin(char** args) {
+    int sig = SIGKILL, i = 1;
+
+    if (args[i] && args[i][0] == '-' && args[i][1] != '\0') {
+        sig = parse_signal(args[i] + 1);
+        if (sig < 0) {
+            fprintf(stderr, "kill: %s: invalid signal\n", args[i] + 1);
+            last_status = 1;
+            return;
+        }
+        i++;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "Expected PID for \"kill\"\n");
+        last_status = 1;
+        return;
+    }
+    for (; args[i]; i++) {
+        if (args[i][0] == '%') {
+            struct job* j = parse_job_spec("kill", args[i]);
+            if (!j) {
+                last_status = 1;
+                continue;
+            }
+            for (int k = 0; k < j->proc_count; k++) {
+                if (j->pgid == 0 && j->procs[k].state != PROC_DONE) {
+                    kill(j->procs[k].pid, sig);  // No group of its own: one by one
+                }
+            }
+            if (j->pgid > 0 && kill(-j->pgid, sig) != 0) {
+                perror("kill failed");
+                last_status = 1;
+                continue;
+            }
+            if (job_stopped(j) && sig != SIGSTOP && sig != SIGTSTP && sig != SIGKILL) {
+                continue_job(j);
+            }
+            if (sig == SIGKILL) {
+                printf("Job %d terminated.\n", j->id);
+            }
+            continue;
+        }
+        int pid = atoi(args[i]);
+        if (kill(pid, sig) == 0) {
+            if (sig == SIGKILL) {
+                printf("Process %d terminated.\n", pid);
+            }
+        } else {
+            perror("kill failed");
+            last_status = 1;
+        }
+    }
+}
+
+#define IOPRIO_CLASS_SHIFT 13  // ioprio_set(2): class in the top bits, level below
+#define IOPRIO_WHO_PROCESS 1
+#define LIMIT_SOFT 1           // Which of a resource's limits ulimit sets
+#define LIMIT_HARD 2
+#define CPU_PERIOD 100000      // cpu.max period in microseconds
+
+// Resources ulimit sets, and the unit their values are given in
+static const struct {
+    char option;
+    int resource;
+    rlim_t unit;
+    const char* name;
+} ulimit_options[] = {
+    { 'c', RLIMIT_CORE, 1024, "core file size (KB)" },
+    { 'd', RLIMIT_DATA, 1024, "data seg size (KB)" },
+    { 'f', RLIMIT_FSIZE, 1024, "file size (KB)" },
+    { 'l', RLIMIT_MEMLOCK, 1024, "max locked memory (KB)" },
+    { 'n', RLIMIT_NOFILE, 1, "open files" },
+    { 's', RLIMIT_STACK, 1024, "stack size (KB)" },
+    { 't', RLIMIT_CPU, 1, "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC, 1, "max user processes" },
+    { 'v', RLIMIT_AS, 1024, "virtual memory (KB)" },
+};
+#define ULIMIT_COUNT (int)(sizeof(ulimit_options) / sizeof(ulimit_options[0]))
+
+// Where and how a job's processes run: set by the affinity, nice, sched,
+// ulimit and cgroup prefixes, on top of the session default
+struct placement {
+    cpu_set_t cpus;
+    bool has_cpus;
+    int nice;                // Niceness added to the shell's
+    bool has_nice;
+    int policy, priority;    // sched_setscheduler() policy and its priority
+    bool has_policy;
+    int ioclass, iolevel;    // ioprio_set() class (1 rt, 2 be, 3 idle) and level
+    bool has_io;
+    struct rlimit limits[ULIMIT_COUNT];      // Values for ulimit_options[i]
+    unsigned char limit_set[ULIMIT_COUNT];   // LIMIT_SOFT and/or LIMIT_HARD
+    long long memory_max;    // cgroup memory.max in bytes, -1 for no limit
+    bool has_memory;
+    long long cpu_quota;     // cgroup cpu.max in microseconds per CPU_PERIOD, -1 for no limit
+    bool has_cpu;
+};
+
+struct placement session_placement;  // Default for every job: the prefixes without a command
+char* cgroup_root = NULL;  // `set -o cgroup=DIR`: delegated cgroup v2 directory jobs get leaves in
+char* own_cgroup = NULL;   // Leaf this process was placed in, in a job's forked shell
+int cgroup_serial = 0;     // Numbers the leaves
+
+// Scheduling policies sched accepts
+static const struct {
+    const char* name;
+    int policy;
+} sched_policies[] = {
+    { "other", SCHED_OTHER }, { "batch", SCHED_BATCH }, { "idle", SCHED_IDLE },
+    { "fifo", SCHED_FIFO }, { "rr", SCHED_RR }, { NULL, 0 }
+};
+
+// I/O scheduling classes, indexed by class number
+static const char* io_classes[] = { "none", "rt", "be", "idle" };
+
+// Function to parse a CPU list such as "0-3,8" into set. Every CPU must
+// exist on this machine, so a typo is caught before anything starts.
+bool parse_cpu_list(const char* text, cpu_set_t* set) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    CPU_ZERO(set);
+    while (*text) {
+        char* end;
+        long from = strtol(text, &end, 10), to = from;
+        if (end == text || from < 0) {
+            return false;
+        }
+        if (*end == '-') {
+            text = end + 1;
+            to = strtol(text, &end, 10);
+            if (end == text || to < from) {
+                return false;
+            }
+        }
+        if (to >= CPU_SETSIZE || (cpus > 0 && to >= cpus)) {
+            return false;
+        }
+        for (long c = from; c <= to; c++) {
+            CPU_SET(c, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return false;
+        }
+        text = end;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+// Function to write set as a CPU list with ranges, e.g. "0-3,8"
+void format_cpu_list(const cpu_set_t* set, char* buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && len < size; c++) {
+        if (!CPU_ISSET(c, set)) {
+            continue;
+        }
+        int to = c;
+        while (to + 1 < CPU_SETSIZE && CPU_ISSET(to + 1, set)) {
+            to++;
+        }
+        len += snprintf(buf + len, size - len, to > c ? "%s%d-%d" : "%s%d", len ? "," : "", c, to);
+        c = to;
+    }
+}
+
+// Function to parse one sched item: a policy ("batch", "fifo:10") or an I/O
+// class ("io=idle", "io=be:7"). Returns false if it is neither.
+bool parse_sched_item(const char* item, struct placement* p) {
+    char name[16];
+    int level = -1;
+    const char* colon = strchr(item, ':');
+    bool io = strncmp(item, "io=", 3) == 0;
+
+    if (io) {
+        item += 3;
+    }
+    size_t n = colon ? (size_t)(colon - item) : strlen(item);
+    if (n >= sizeof(name)) {
+        return false;
+    }
+    memcpy(name, item, n);
+    name[n] = '\0';
+    if (colon) {
+        char* end;
+        level = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0') {
+            return false;
+        }
+    }
+    if (io) {
+        for (int c = 0; c < 4; c++) {
+            if (strcmp(name, io_classes[c]) == 0) {
+                int max = c == 1 || c == 2 ? 7 : 0;
+                if (level > max) {
+                    return false;
+                }
+                p->has_io = c != 0;
+                p->ioclass = c;
+                p->iolevel = level < 0 ? (max ? 4 : 0) : level;
+                return true;
+            }
+        }
+        return false;
+    }
+    for (int i = 0; sched_policies[i].name; i++) {
+        if (strcmp(name, sched_policies[i].name) == 0) {
+            int policy = sched_policies[i].policy;
+            bool realtime = policy == SCHED_FIFO || policy == SCHED_RR;
+            if (realtime ? level < 1 || level > 99 : level > 0) {
+                return false;  // fifo and rr need a priority, the others take none
+            }
+            p->has_policy = policy != SCHED_OTHER;
+            p->policy = policy;
+            p->priority = realtime ? level : 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to check whether a word is one of the placement prefixes
+bool is_placement_prefix(const char* word) {
+    return strcmp(word, "affinity") == 0 || strcmp(word, "nice") == 0 || strcmp(word, "sched") == 0 ||
+           strcmp(word, "ulimit") == 0 || strcmp(word, "cgroup") == 0;
+}
+
+// Function to find the ulimit_options entry for option letter c, -1 if none
+int find_ulimit_option(char c) {
+    for (int i = 0; i < ULIMIT_COUNT; i++) {
+        if (ulimit_options[i].option == c) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to check whether a ulimit value is given in word ("unlimited" or digits)
+bool is_ulimit_value(const char* word) {
+    return word && (strcmp(word, "unlimited") == 0 || isdigit((unsigned char)word[0]));
+}
+
+// Function to find what a ulimit command asks to see: the option letter of
+// the first resource given without a value, 'a' for -a, 'f' for a bare
+// "ulimit", or 0 if it only sets limits
+char ulimit_query(char** args) {
+    if (args[1] == NULL) {
+        return 'f';
+    }
+    for (int i = 1; args[i] && args[i][0] == '-'; i++) {
+        char last = args[i][strlen(args[i]) - 1];
+        if (strchr(args[i], 'a')) {
+            return 'a';
+        }
+        if (last != 'S' && last != 'H') {
+            if (args[i + 1] == NULL || args[i + 1][0] == '-') {
+                return last;
+            }
+            i++;
+        }
+    }
+    return 0;
+}
+
+// Function to read `ulimit [-S|-H] [-X value]...` into p. Returns the words
+// after it, the end of args when it only asks to see limits, or NULL on error.
+char** parse_ulimit(char** args, struct placement* p) {
+    int which = LIMIT_SOFT | LIMIT_HARD;
+
+    if (ulimit_query(args)) {
+        while (*args) {
+            args++;
+        }
+        return args;
+    }
+    for (args++; args[0] && args[0][0] == '-'; args++) {
+        for (const char* c = args[0] + 1; *c; c++) {
+            if (*c == 'S' || *c == 'H') {
+                which = *c == 'S' ? LIMIT_SOFT : LIMIT_HARD;
+                continue;
+            }
+            int i = find_ulimit_option(*c);
+            if (i < 0 || c[1] != '\0') {
+                fprintf(stderr, "ulimit: invalid option '%s'\n", args[0]);
+                return NULL;
+            }
+            const char* value = args[1];  // Present: ulimit_query() checked
+            rlim_t limit = RLIM_INFINITY;
+            if (!is_ulimit_value(value)) {
+                fprintf(stderr, "ulimit: invalid value '%s'\n", value);
+                return NULL;
+            }
+            if (strcmp(value, "unlimited") != 0) {
+                char* end;
+                errno = 0;
+                unsigned long long n = strtoull(value, &end, 10);
+                if (*end != '\0' || errno || n > (RLIM_INFINITY - 1) / ulimit_options[i].unit) {
+                    fprintf(stderr, "ulimit: invalid value '%s'\n", value);
+                    return NULL;
+                }
+                limit = n * ulimit_options[i].unit;
+            }
+            if (which & LIMIT_SOFT) {
+                p->limits[i].rlim_cur = limit;
+            }
+            if (which & LIMIT_HARD) {
+                p->limits[i].rlim_max = limit;
+            }
+            p->limit_set[i] |= which;
+            args++;
+        }
+    }
+    return args;
+}
+
+// Function to parse a byte count with an optional K, M, G or T suffix; -1 if invalid
+long long parse_size(const char* text) {
+    char* end;
+    errno = 0;
+    long long n = strtoll(text, &end, 10);
+    const char* units = "KMGT";
+    const char* unit = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+
+    if (end == text || n < 0 || errno || (*end && (!unit || end[1] != '\0'))) {
+        return -1;
+    }
+    for (const char* u = units; unit && u <= unit; u++) {
+        if (n > LLONG_MAX / 1024) {
+            return -1;
+        }
+        n *= 1024;
+    }
+    return n;
+}
+
+// Function to read one cgroup item, "memory=SIZE" or "cpu=N%" / "cpu=CPUS",
+// either of them "max" for no limit. Returns false if it is neither.
+bool parse_cgroup_item(const char* item, struct placement* p) {
+    if (strncmp(item, "memory=", 7) == 0) {
+        item += 7;
+        p->memory_max = strcmp(item, "max") == 0 ? -1 : parse_size(item);
+        p->has_memory = p->memory_max != -1 || strcmp(item, "max") == 0;
+        return p->has_memory;
+    }
+    if (strncmp(item, "cpu=", 4) == 0) {
+        char* end;
+        item += 4;
+        if (strcmp(item, "max") == 0) {
+            p->cpu_quota = -1;
+            p->has_cpu = true;
+            return true;
+        }
+        double cpus = strtod(item, &end);
+        if (*end == '%' && end[1] == '\0') {
+            cpus /= 100;
+        } else if (*end != '\0') {
+            return false;
+        }
+        if (end == item || cpus < 0.01 || cpus > 100000) {
+            return false;
+        }
+        p->cpu_quota = (long long)(cpus * CPU_PERIOD);
+        p->has_cpu = true;
+        return true;
+    }
+    return false;
+}
+
+// Function to read the placement prefixes at the start of args into p:
+//   affinity CPULIST | nice [-n N] | sched ITEM[,ITEM...] |
+//   ulimit [-S|-H] [-X value]... | cgroup ITEM[,ITEM...]
+// Returns the command words after them (possibly empty), or NULL after an error.
+char** parse_placement(char** args, struct placement* p) {
+    while (args[0] && is_placement_prefix(args[0])) {
+        const char* name = args[0];
+        const char* value = args[1];
+        if (strcmp(name, "ulimit") == 0) {
+            args = parse_ulimit(args, p);
+            if (args == NULL) {
+                return NULL;
+            }
+            continue;
+        }
+        if (strcmp(name, "nice") == 0) {
+            char* end;
+            long adjust = 10;  // Like nice(1) without -n
+            args++;
+            if (args[0] && strcmp(args[0], "-n") == 0) {
+                adjust = args[1] ? strtol(args[1], &end, 10) : 0;
+                if (!args[1] || *end != '\0' || end == args[1] || adjust < -40 || adjust > 40) {
+                    fprintf(stderr, "nice: invalid adjustment '%s'\n", args[1] ? args[1] : "");
+                    return NULL;
+                }
+                args += 2;
+            }
+            p->has_nice = adjust != 0;
+            p->nice = adjust;
+            continue;
+        }
+        if (value == NULL) {
+            return args + 1;  // No value: show the session default
+        }
+        if (strcmp(name, "affinity") == 0) {
+            if (strcmp(value, "all") == 0) {
+                p->has_cpus = false;
+            } else if (parse_cpu_list(value, &p->cpus)) {
+                p->has_cpus = true;
+            } else {
+                fprintf(stderr, "affinity: invalid CPU list '%s' (the highest CPU is %ld)\n", value,
+                        sysconf(_SC_NPROCESSORS_CONF) - 1);
+                return NULL;
+            }
+        } else if (strcmp(name, "cgroup") == 0 && cgroup_root == NULL && own_cgroup == NULL) {
+            fprintf(stderr, "cgroup: no delegated cgroup; see set -o cgroup=<dir>\n");
+            return NULL;
+        } else {
+            char items[64];
+            bool sched = strcmp(name, "sched") == 0;
+            snprintf(items, sizeof(items), "%s", value);
+            for (char* item = strtok(items, ","); item; item = strtok(NULL, ",")) {
+                if (sched ? !parse_sched_item(item, p) : !parse_cgroup_item(item, p)) {
+                    fprintf(stderr, "%s: invalid %s '%s'\n", name, sched ? "policy" : "limit", item);
+                    return NULL;
+                }
+            }
+        }
+        args += 2;
+    }
+    return args;
+}
+
+// Function to get the placement a new job starts from: the session default
+// in the shell itself; nothing in a subshell, whose processes inherit it
+struct placement inherited_placement() {
+    struct placement none = { 0 };
+    return in_subshell ? none : session_placement;
+}
+
+// Function run in a child before exec: apply p to the calling process.
+// A CPU set the kernel refuses (CPUs outside the cpuset, say) fails the
+// command, since running it elsewhere is what the prefix was to prevent.
+// Other failures (a real-time policy without privilege) are reported and
+// the command runs anyway, as it would have without the prefix.
+void apply_placement(const struct placement* p) {
+    if (p->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &p->cpus) != 0) {
+        char list[256];
+        format_cpu_list(&p->cpus, list, sizeof(list));
+        fprintf(stderr, "affinity: %s: %s\n", list, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    if (p->has_nice) {
+        errno = 0;
+        int current = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0 && setpriority(PRIO_PROCESS, 0, current + p->nice) != 0) {
+            perror("nice");
+        }
+    }
+    if (p->has_policy) {
+        struct sched_param param = { .sched_priority = p->priority };
+        if (sched_setscheduler(0, p->policy, &param) != 0) {
+            perror("sched");
+        }
+    }
+    if (p->has_io &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (p->ioclass << IOPRIO_CLASS_SHIFT) | p->iolevel) != 0) {
+        perror("sched io");
+    }
+    for (int i = 0; i < ULIMIT_COUNT; i++) {
+        struct rlimit limit;
+        if (p->limit_set[i] == 0 || getrlimit(ulimit_options[i].resource, &limit) != 0) {
+            continue;
+        }
+        if (p->limit_set[i] & LIMIT_HARD) {
+            limit.rlim_max = p->limits[i].rlim_max;
+        }
+        if (p->limit_set[i] & LIMIT_SOFT) {
+            limit.rlim_cur = p->limits[i].rlim_cur;
+        } else if (limit.rlim_cur > limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;  // Lowering only the hard limit takes the soft one along
+        }
+        if (setrlimit(ulimit_options[i].resource, &limit) != 0) {
+            fprintf(stderr, "ulimit: -%c: %s\n", ulimit_options[i].option, strerror(errno));
+        }
+    }
+}
+
+// Function to write text to the file name in cgroup directory dir. Returns
+// -1 with errno set on failure.
+int cgroup_write(const char* dir, const char* name, const char* text) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, text, strlen(text));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n < 0 ? -1 : 0;
+}
+
+// Function to read the first line of the file name in cgroup directory dir
+// into buf. Returns false if it cannot be read.
+bool cgroup_read(const char* dir, const char* name, char* buf, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* f = fopen(path, "re");
+    if (!f) {
+        return false;
+    }
+    bool ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+    buf[strcspn(buf, "\n")] = '\0';
+    return ok;
+}
+
+// Function to write p's memory and CPU limits into cgroup leaf. The
+// controllers may be missing, so failures are reported and not fatal.
+void cgroup_limit(const char* leaf, const struct placement* p) {
+    char text[64];
+
+    if (leaf == NULL) {
+        return;
+    }
+    if (p->has_memory) {
+        if (p->memory_max < 0) {
+            strcpy(text, "max");
+        } else {
+            snprintf(text, sizeof(text), "%lld", p->memory_max);
+        }
+        if (cgroup_write(leaf, "memory.max", text) != 0) {
+            fprintf(stderr, "cgroup: memory.max: %s\n", strerror(errno));
+        }
+    }
+    if (p->has_cpu) {
+        if (p->cpu_quota < 0) {
+            snprintf(text, sizeof(text), "max %d", CPU_PERIOD);
+        } else {
+            snprintf(text, sizeof(text), "%lld %d", p->cpu_quota, CPU_PERIOD);
+        }
+        if (cgroup_write(leaf, "cpu.max", text) != 0) {
+            fprintf(stderr, "cgroup: cpu.max: %s\n", strerror(errno));
+        }
+    }
+}
+
+// Function to make the cgroup leaf for a job started by the shell itself,
+// limited as p says. Returns its path, or NULL without `set -o cgroup` or in
+// a subshell, whose job already has one.
+char* cgroup_create(const struct placement* p) {
+    char path[PATH_MAX];
+
+    if (cgroup_root == NULL || in_subshell) {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/psh-%d-%d", cgroup_root, (int)getpid(), ++cgroup_serial);
+    if (mkdir(path, 0755) != 0) {
+        fprintf(stderr, "cgroup: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    cgroup_limit(path, p);
+    char* leaf = strdup(path);
+    if (!leaf) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return leaf;
+}
+
+// Function run in a job's child: move the calling process into leaf
+void cgroup_enter(const char* leaf) {
+    if (leaf == NULL) {
+        return;
+    }
+    if (cgroup_write(leaf, "cgroup.procs", "0") != 0) {
+        fprintf(stderr, "cgroup: %s: %s\n", leaf, strerror(errno));
+        return;
+    }
+    free(own_cgroup);
+    own_cgroup = strdup(leaf);
+}
+
+// Function to remove a leaf no process was placed in, and free its path
+void cgroup_remove(char* leaf) {
+    if (leaf) {
+        rmdir(leaf);
+        free(leaf);
+    }
+}
+
+// Function to describe a job's cgroup usage, as jobs -l shows it:
+// "cgroup psh-12-3: cpu 1.20s, memory 10.5M (peak 20.0M, max 512.0M)"
+void describe_cgroup(const char* leaf, char* buf, size_t size) {
+    char line[128], path[PATH_MAX];
+    double cpu = 0;
+    size_t len = snprintf(buf, size, "cgroup %s:", strrchr(leaf, '/') + 1);
+
+    snprintf(path, sizeof(path), "%s/cpu.stat", leaf);
+    FILE* f = fopen(path, "re");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "usage_usec ", 11) == 0) {
+            cpu = atoll(line + 11) / 1e6;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    len += snprintf(buf + len, size - len, " cpu %.2fs", cpu);
+    if (len < size && cgroup_read(leaf, "memory.current", line, sizeof(line))) {
+        len += snprintf(buf + len, size - len, ", memory %.1fM", atoll(line) / 1048576.0);
+        if (len < size && cgroup_read(leaf, "memory.peak", line, sizeof(line))) {
+            len += snprintf(buf + len, size - len, " (peak %.1fM", atoll(line) / 1048576.0);
+            if (len < size && cgroup_read(leaf, "memory.max", line, sizeof(line)) && strcmp(line, "max") != 0) {
+                len += snprintf(buf + len, size - len, ", max %.1fM", atoll(line) / 1048576.0);
+            }
+            if (len < size) {
+                snprintf(buf + len, size - len, ")");
+            }
+        }
+    }
+}
+
+// Function to check that dir is a delegated cgroup v2 directory for
+// `set -o cgroup=DIR`, and to enable the memory and cpu controllers for the
+// leaves made in it
+bool cgroup_setup(const char* dir) {
+    struct statfs fs;
+    char controllers[256];
+
+    if (statfs(dir, &fs) != 0 || fs.f_type != CGROUP2_SUPER_MAGIC) {
+        fprintf(stderr, "set: %s: not a cgroup v2 directory\n", dir);
+        return false;
+    }
+    if (access(dir, W_OK) != 0) {
+        fprintf(stderr, "set: %s: %s (not delegated?)\n", dir, strerror(errno));
+        return false;
+    }
+    if (!cgroup_read(dir, "cgroup.controllers", controllers, sizeof(controllers))) {
+        controllers[0] = '\0';
+    }
+    const char* wanted[] = { "memory", "cpu" };
+    for (int i = 0; i < 2; i++) {
+        char word[16];
+        snprintf(word, sizeof(word), " %s ", wanted[i]);
+        char padded[260];
+        snprintf(padded, sizeof(padded), " %s ", controllers);
+        if (strstr(padded, word) == NULL) {
+            fprintf(stderr, "set: %s: no %s controller; %s= limits will fail\n", dir, wanted[i], wanted[i]);
+            continue;
+        }
+        snprintf(word, sizeof(word), "+%s", wanted[i]);
+        if (cgroup_write(dir, "cgroup.subtree_control", word) != 0) {
+            fprintf(stderr, "set: %s: enabling %s: %s\n", dir, wanted[i], strerror(errno));
+        }
+    }
+    return true;
+}
+
+// Function to describe where process pid runs now, as jobs -l shows it:
+// "cpus 0-3 nice 10 batch io idle"
+void describe_placement(pid_t pid, char* buf, size_t size) {
+    cpu_set_t set;
+    char cpus[256] = "?";
+    const char* policy = "?";
+    int prio = 0;
+    long io;
+
+    if (sched_getaffinity(pid, sizeof(set), &set) == 0) {
+        format_cpu_list(&set, cpus, sizeof(cpus));
+    }
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, pid);
+    int sp = sched_getscheduler(pid);
+    for (int i = 0; sched_policies[i].name; i++) {
+        if (sched_policies[i].policy == (sp & ~SCHED_RESET_ON_FORK)) {
+            policy = sched_policies[i].name;
+        }
+    }
+    if (sp == SCHED_FIFO || sp == SCHED_RR) {
+        struct sched_param param;
+        if (sched_getparam(pid, &param) == 0) {
+            prio = param.sched_priority;
+        }
+    }
+    io = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, pid);
+    size_t len = snprintf(buf, size, "cpus %s nice %d %s", cpus, errno ? 0 : nice, policy);
+    if (prio > 0 && len < size) {
+        len += snprintf(buf + len, size - len, ":%d", prio);
+    }
+    if (io >= 0 && len < size) {
+        int c = (io >> IOPRIO_CLASS_SHIFT) & 3;
+        len += snprintf(buf + len, size - len, " io %s", io_classes[c]);
+        if ((c == 1 || c == 2) && len < size) {
+            snprintf(buf + len, size - len, ":%ld", io & 7);
+        }
+    }
+}
+
+// Function for affinity, nice and sched without a command: with no value,
+// show the session default; otherwise p (already parsed) becomes it
+void placement_builtin(char** args, const struct placement* p) {
+    const struct placement* d = &session_placement;
+    char cpus[256];
+    char query = strcmp(args[0], "ulimit") == 0 ? ulimit_query(args) : 0;
+
+    if (args[1] != NULL && !query) {
+        session_placement = *p;
+        return;
+    }
+    if (query) {
+        bool hard = false;
+        for (int i = 1; args[i] && args[i][0] == '-'; i++) {
+            hard = hard || strchr(args[i], 'H') != NULL;
+        }
+        for (int i = 0; i < ULIMIT_COUNT; i++) {
+            struct rlimit limit;
+            if (query != 'a' && query != ulimit_options[i].option) {
+                continue;
+            }
+            getrlimit(ulimit_options[i].resource, &limit);
+            if (d->limit_set[i] & LIMIT_SOFT) {
+                limit.rlim_cur = d->limits[i].rlim_cur;
+            }
+            if (d->limit_set[i] & LIMIT_HARD) {
+                limit.rlim_max = d->limits[i].rlim_max;
+            }
+            rlim_t value = hard ? limit.rlim_max : limit.rlim_cur;
+            if (query == 'a') {
+                printf("%-24s (-%c) ", ulimit_options[i].name, ulimit_options[i].option);
+            }
+            if (value == RLIM_INFINITY) {
+                printf("unlimited\n");
+            } else {
+                printf("%llu\n", (unsigned long long)(value / ulimit_options[i].unit));
+            }
+        }
+        if (query != 'a' && find_ulimit_option(query) < 0) {
+            fprintf(stderr, "ulimit: invalid option '-%c'\n", query);
+            last_status = 1;
+        }
+    } else if (strcmp(args[0], "cgroup") == 0) {
+        if (cgroup_root) {
+            printf("%s: ", cgroup_root);
+        }
+        if (d->has_memory && d->memory_max >= 0) {
+            printf("memory=%lld,", d->memory_max);
+        } else {
+            printf("memory=max,");
+        }
+        if (d->has_cpu && d->cpu_quota >= 0) {
+            printf("cpu=%g%%\n", d->cpu_quota * 100.0 / CPU_PERIOD);
+        } else {
+            printf("cpu=max\n");
+        }
+    } else if (strcmp(args[0], "affinity") == 0) {
+        if (d->has_cpus) {
+            format_cpu_list(&d->cpus, cpus, sizeof(cpus));
+        }
+        printf("%s\n", d->has_cpus ? cpus : "all");
+    } else if (strcmp(args[0], "nice") == 0) {
+        printf("%d\n", d->has_nice ? d->nice : 0);
+    } else {
+        const char* policy = "other";
+        for (int i = 0; d->has_policy && sched_policies[i].name; i++) {
+            if (sched_policies[i].policy == d->policy) {
+                policy = sched_policies[i].name;
+            }
+        }
+        printf("%s", policy);
+        if (d->has_policy && d->priority > 0) {
+            printf(":%d", d->priority);
+        }
+        printf(",io=%s", io_classes[d->has_io ? d->ioclass : 0]);
+        if (d->has_io && d->ioclass != 3) {
+            printf(":%d", d->iolevel);
+        }
+        printf("\n");
+    }
+}
+
+// Function for `jobs -o [%n]`: print and empty a job's spooled output. A
+// finished job is dropped once its output has been read.
+void job_output(char** args) {
+    update_jobs();
+    struct job* j = parse_job_spec("jobs", args[2]);
+    if (!j) {
+        last_status = 1;
+        return;
+    }
+    if (!j->spool) {
+        fprintf(stderr, "jobs: %%%d: output not spooled\n", j->id);
+        last_status = 1;
+        return;
+    }
+    spool_print(j);
+    if (job_procs_in(j, PROC_DONE) == j->proc_count && !j->inherited) {
+        free_job(j);
+    }
+}
+
+// Function to check whether args are `tail [-n lines] %n`, the only form
+// of tail the shell handles itself
+bool is_job_tail(char** args) {
+    int i = args[1] && strcmp(args[1], "-n") == 0 && args[2] ? 3 : 1;
+    return args[i] && args[i][0] == '%' && args[i + 1] == NULL;
+}
+
+// Function for `tail [-n lines] %n`: print the last lines (default 10) of a
+// job's spooled output, leaving it in place. Returns false for any other
+// use of tail, which runs the real one.
+bool tail_builtin(char** args) {
+    long lines = 10;
+    int i = 1;
+    size_t len;
+
+    if (!is_job_tail(args)) {
+        return false;
+    }
+    if (strcmp(args[i], "-n") == 0) {
+        char* end;
+        lines = strtol(args[i + 1], &end, 10);
+        if (*end != '\0' || end == args[i + 1] || lines < 0) {
+            lines = -1;
+        }
+        i += 2;
+    }
+    last_status = 1;
+    if (lines < 0) {
+        fprintf(stderr, "tail: invalid number of lines '%s'\n", args[i - 1]);
+        return true;
+    }
+    update_jobs();
+    struct job* j = parse_job_spec("tail", args[i]);
+    if (!j) {
+        return true;
+    }
+    if (!j->spool) {
+        fprintf(stderr, "tail: %%%d: output not spooled\n", j->id);
+        return true;
+    }
+    if (j->spool->fd >= 0) {
+        spool_ready(j->spool->fd, j);
+    }
+    char* out = spool_contents(j->spool, &len);
+    size_t start = len;
+    long seen = 0;
+    if (start > 0 && out[start - 1] == '\n') {
+        start--;  // The last line's own newline
+    }
+    while (start > 0 && lines > 0) {
+        if (out[start - 1] == '\n' && ++seen == lines) {
+            break;
+        }
+        start--;
+    }
+    if (lines == 0) {
+        start = len;
+    }
+    fflush(stdout);
+    if (len > start && write(shell_fd(STDOUT_FILENO), out + start, len - start) < 0) {
+        perror("tail");
+    }
+    free(out);
+    last_status = 0;
+    return true;
+}
+
+// Function for `jobs [-l]`: list the jobs in number order; -l adds their
+// process group and where each process runs. `jobs -o` prints spooled output.
+void jobs_builtin(char** args) {
+    bool list_pids = args[1] && strcmp(args[1], "-l") == 0;
+    int last_id = 0;
+    char text[PATH_MAX];
+
+    if (args[1] && strcmp(args[1], "-o") == 0) {
+        job_output(args);
+        return;
+    }
+    update_jobs();
+    print_job_notices();
+    printf("Background Jobs:\n");
+    for (;;) {
+        struct job* next = NULL;
+        for (int i = 0; i < job_count; i++) {
+            struct job* j = job_table[i];
+            if (!j->disowned && j->id > last_id && (!next || j->id < next->id)) {
+                next = j;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        format_job(next, text, sizeof(text));
+        printf("%s\n", text);
+        if (list_pids) {
+            printf("      pgid %d:\n", next->pgid);
+            if (next->cgroup) {
+                describe_cgroup(next->cgroup, text, sizeof(text));
+                printf("        %s\n", text);
+            }
+            if (next->spool) {
+                printf("        output %zu bytes held, %zu spilled, %zu dropped\n", next->spool->len,
+                       next->spool->spilled, next->spool->dropped);
+            }
+            for (int k = 0; k < next->proc_count; k++) {
+                struct job_process* p = &next->procs[k];
+                if (p->state == PROC_DONE) {
+                    printf("        %d (done)\n", p->pid);
+                } else {
+                    describe_placement(p->pid, text, sizeof(text));
+                    printf("        %d %s\n", p->pid, text);
+                }
+            }
+        }
+        last_id = next->id;
+    }
+}
+
+// Function to keep the job table in a forked child only as a copy of the
+// parent's, so that `jobs` and `jobs -o %n | ...` still show its jobs
+void forget_jobs() {
+    for (int i = 0; i < job_count; i++) {
+        struct job* j = job_table[i];
+        j->inherited = true;
+        if (j->spool && j->spool->fd >= 0) {
+            close(j->spool->fd);  // Leave the parent's epoll registration alone
+            j->spool->fd = -1;
+        }
+    }
+}
+
+// Function to create the epoll set, timer_fd and signal_fd if they do not
+// exist yet. Scripts get them only once a deadline needs a timer.
+bool ensure_event_loop() {
+    sigset_t mask;
+
+    if (epoll_fd >= 0) {
+        return true;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        return false;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd >= 0) {
+        event_add(timer_fd, timers_expired, NULL);
+    }
+    // Children are followed through SIGCHLD, taken from signal_fd
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &child_sigmask);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);  // Waits block in waitpid() instead
+    } else {
+        event_add(signal_fd, signals_received, NULL);
+    }
+    return true;
+}
+
+// Function called by the timer when a job's deadline passes: SIGTERM to its
+// process group first, SIGKILL once the grace period has passed too
+void deadline_expired(void* data) {
+    struct deadline* d = data;
+    if (!d->expired) {
+        d->expired = true;
+        kill(-d->pgid, SIGTERM);
+        kill(-d->pgid, SIGCONT);  // A stopped process acts on SIGTERM only once continued
+        d->timer = timer_start(d->grace, deadline_expired, d);
+    } else {
+        d->timer = -1;
+        kill(-d->pgid, SIGKILL);
+    }
+}
+
+// Function to give process group pgid ms milliseconds. The job's waits run
+// through the event loop, which signals the group when the timer fires.
+void start_deadline(struct deadline* d, pid_t pgid, long long ms, long long grace) {
+    d->pgid = pgid;
+    d->grace = grace;
+    d->expired = false;
+    d->timer = ensure_event_loop() ? timer_start(ms, deadline_expired, d) : -1;
+}
+
+// Function to stop a deadline once its job has been waited for
+void stop_deadline(struct deadline* d) {
+    timer_cancel(d->timer);
+    d->timer = -1;
+}
+
+// Function to parse a duration such as "10", "1.5", "90s", "2m", "1h" or
+// "1d" into milliseconds. Returns -1 if text is not a duration.
+long long parse_duration(const char* text) {
+    char* end;
+    double value, unit = 1000;
+
+    errno = 0;
+    value = strtod(text, &end);
+    if (end == text || errno != 0 || !(value >= 0) || value > 1e9) {
+        return -1;  // !(value >= 0) also catches NaN
+    }
+    if (*end == 'm') {
+        unit = 60 * 1000;
+    } else if (*end == 'h') {
+        unit = 3600 * 1000;
+    } else if (*end == 'd') {
+        unit = 86400 * 1000;
+    } else if (*end != 's' && *end != '\0') {
+        return -1;
+    }
+    if (*end != '\0' && end[1] != '\0') {
+        return -1;
+    }
+    return (long long)(value * unit + 0.5);
+}
+
+// Function to set up the event loop of an interactive shell and take the
+// terminal for job control. SIGINT and SIGQUIT go to signal_fd instead of
+// killing the shell; SIGTSTP, SIGTTIN and SIGTTOU stay blocked so that the
+// shell can hand the terminal back and forth. Returns false without epoll.
+bool start_event_loop() {
+    sigset_t mask, old;
+    pid_t pgid;
+
+    // Started in the background: wait until the terminal is ours
+    while (tcgetpgrp(STDIN_FILENO) != (pgid = getpgrp()) && tcgetpgrp(STDIN_FILENO) > 0) {
+        kill(-pgid, SIGTTIN);
+    }
+    if (!ensure_event_loop()) {
+        perror("epoll_create1");
+        return false;
+    }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGTTIN);
+    sigaddset(&mask, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    setpgid(0, 0);  // Fails harmlessly if the shell leads its session
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    if (signal_fd >= 0) {
+        signalfd(signal_fd, &mask, 0);
+    }
+    return true;
+}
+
+void sync_fd_reader(int fd, bool release);
+
+// Function for a freshly forked child: make the engine's descriptors its
+// 0-2, and its streams ones over them, so commands it runs inherit them
+void adopt_shell_fds() {
+    for (int i = 0; i < 3; i++) {
+        if (shell_fds[i] != i) {
+            sync_fd_reader(shell_fds[i], true);
+            dup2(shell_fds[i], i);
+            close(shell_fds[i]);
+            shell_fds[i] = i;
+            stdin_redirects += i == STDIN_FILENO;  // Not the stream commands are read from
+        }
+    }
+    if (shell_stdout) {  // The parent's were flushed before fork()
+        shell_stdout = fdopen(STDOUT_FILENO, "w");
+        shell_stderr = fdopen(STDERR_FILENO, "w");
+        if (shell_stderr) {
+            setvbuf(shell_stderr, NULL, _IONBF, 0);
+        }
+    }
+}
+
+// Function for a freshly forked child: drop the parent's jobs and event
+// loop, which the child must not touch, give it back the signal mask and
+// the engine's descriptors
+void leave_event_loop() {
+    adopt_shell_fds();
+    forget_jobs();
+    if (profile_fd >= 0) {  // The event samples the parent; interval timers are not inherited
+        close(profile_fd);
+        profile_fd = -1;
+    }
+    profiling = false;
+    if (tracing) {  // The parent writes its own events; this process records its own
+        trace_len = 0;
+        trace_timer = -1;
+        trace_pid = getpid();
+    }
+    if (epoll_fd < 0) {
+        return;
+    }
+    close(epoll_fd);
+    if (signal_fd >= 0) {
+        close(signal_fd);
+    }
+    sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+    if (timer_fd >= 0) {
+        close(timer_fd);
+    }
+    epoll_fd = signal_fd = timer_fd = -1;
+    while (event_sources) {
+        struct event_source* src = event_sources;
+        event_sources = src->next;
+        free(src);
+    }
+    memset(timers, 0, sizeof(timers));
+    editing = false;
+}
+
+// Function to display the shell prompt with the current working directory
+void render_prompt(bool* async);
+void start_prompt_helper(const char* dir);
+
+void display_prompt() {
+    char cwd[PATH_MAX];
+    bool async;
+
+    print_job_notices();
+    prompt_generation++;
+    render_prompt(&async);
+    printf("%s", prompt_text);
+    prompt_live = async;
+    // Slow segments are shown from the cache now and refreshed in the background
+    if (async && interactive && getcwd(cwd, sizeof(cwd)) != NULL) {
+        start_prompt_helper(cwd);
+    }
+}
+
+const char* snapshot_map = NULL;  // State snapshot mapped read-only at startup; NULL without one
+size_t snapshot_size = 0;
+
+// Function to check whether s points into the snapshot
+bool in_snapshot(const char* s) {
+    uintptr_t p = (uintptr_t)s, map = (uintptr_t)snapshot_map;
+    return snapshot_map && p >= map && p < map + snapshot_size;
+}
+
+// Function to free a string unless it points into the snapshot. Variables
+// and history use the snapshot's strings in place until they are replaced,
+// which is when a string gets a copy of its own.
+void release_string(char* s) {
+    if (!in_snapshot(s)) {
+        free(s);
+    }
+}
+
+// Function to add a command to history
+void add_to_history(char* input) {
+    if (history_count < HISTORY_SIZE) {
+        history[history_count++] = strdup(input);
+    } else {
+        release_string(history[0]);
+        for (int i = 1; i < HISTORY_SIZE; i++) {
+            history[i - 1] = history[i];
+        }
+        history[HISTORY_SIZE - 1] = strdup(input);
+    }
+}
+
+// Function to display command history
+void display_history() {
+    for (int i = 0; i < history_count; i++) {
+        printf("%d: %s", i + 1, history[i]);
+    }
+}
+
+// Function to retrieve command from history
+char* get_command_from_history(int index) {
+    if (index < 1 || index > history_count) {
+        printf("No such command in history.\n");
+        return NULL;
+    }
+    return strdup(history[index - 1]);
+}
+
+#define ARRAY_INDEX_MAX (1 << 24)  // Largest index of an indexed array
+#define ARRAY_ARENA_MIN 256        // First arena of an array, in bytes
+#define SLICE_UNSET UINT32_MAX     // Length of an element that is not set
+
+// Block of NUL-terminated strings an array's elements point into. Bytes
+// once written never change, so an expansion can hand them to a command
+// as they are; it holds a reference that keeps the arena alive meanwhile.
+struct array_arena {
+    int refs;
+    size_t size;  // Bytes in data
+    size_t used;
+    char data[];
+};
+
+// Element of an array: offset and length of its text in the arena
+struct slice {
+    uint32_t offset;
+    uint32_t length;  // SLICE_UNSET for a hole in an indexed array
+};
+
+enum { SLOT_EMPTY, SLOT_FULL, SLOT_DELETED };
+
+// Entry of an associative array's open-addressing table
+struct assoc_slot {
+    struct slice key;
+    struct slice value;
+    uint32_t hash;
+    uint8_t state;  // SLOT_*
+};
+
+// Indexed array (a vector of slices) or associative array (a table with
+// linear probing); both keep their text in one arena
+struct array {
+    bool assoc;
+    struct array_arena *arena;
+    size_t garbage;   // Arena bytes of overwritten and unset elements
+    struct slice *items;  // Indexed: element i
+    int count;        // Indexed: highest set index + 1
+    int cap;          // Room in items, or slots in the table (a power of two)
+    struct assoc_slot *slots;
+    int set;          // Elements that are set
+    int used;         // Assoc: full and deleted slots, which end a probe
+};
+
+// Function to hash a byte string (FNV-1a)
+uint32_t hash_bytes(const char* s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Function to create an empty array
+struct array* array_new(bool assoc) {
+    struct array* a = calloc(1, sizeof(struct array));
+    if (!a) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    a->assoc = assoc;
+    return a;
+}
+
+// Function to drop a reference to an arena
+void arena_release(struct array_arena* arena) {
+    if (arena && --arena->refs == 0) {
+        free(arena);
+    }
+}
+
+// Function to release an array; arenas still lent to an expansion stay
+void array_free(struct array* a) {
+    if (!a) {
+        return;
+    }
+    arena_release(a->arena);
+    free(a->items);
+    free(a->slots);
+    free(a);
+}
+
+// Function to get the text of a set element
+char* array_text(struct array* a, struct slice s) {
+    return a->arena->data + s.offset;
+}
+
+// Function to copy one element into a new arena during repacking
+void repack_slice(struct array_arena* from, struct array_arena* to, struct slice* s) {
+    if (s->length == SLICE_UNSET) {
+        return;
+    }
+    memcpy(to->data + to->used, from->data + s->offset, s->length + 1);
+    s->offset = to->used;
+    to->used += s->length + 1;
+}
+
+// Function to make room for extra more bytes in an array's arena. A private
+// arena grows in place; one that is lent out, or mostly garbage, is replaced
+// by a new arena holding just the live elements.
+void array_reserve(struct array* a, size_t extra) {
+    struct array_arena* arena = a->arena;
+
+    if (arena && arena->used + extra <= arena->size) {
+        return;
+    }
+    if (arena && arena->refs == 1 && a->garbage * 2 <= arena->used) {
+        size_t size = arena->size * 2;
+        while (size < arena->used + extra) {
+            size *= 2;
+        }
+        arena = realloc(arena, sizeof(struct array_arena) + size);
+        if (!arena) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        arena->size = size;
+        a->arena = arena;
+        return;
+    }
+
+    size_t live = arena ? arena->used - a->garbage : 0;
+    size_t size = ARRAY_ARENA_MIN;
+    while (size < 2 * (live + extra)) {
+        size *= 2;
+    }
+    struct array_arena* fresh = malloc(sizeof(struct array_arena) + size);
+    if (!fresh) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    fresh->refs = 1;
+    fresh->size = size;
+    fresh->used = 0;
+    for (int i = 0; !a->assoc && i < a->count; i++) {
+        repack_slice(arena, fresh, &a->items[i]);
+    }
+    for (int i = 0; a->assoc && i < a->cap; i++) {
+        if (a->slots[i].state == SLOT_FULL) {
+            repack_slice(arena, fresh, &a->slots[i].key);
+            repack_slice(arena, fresh, &a->slots[i].value);
+        }
+    }
+    arena_release(arena);
+    a->arena = fresh;
+    a->garbage = 0;
+}
+
+// Function to copy len bytes of text into the arena; room must be reserved
+struct slice array_store(struct array* a, const char* text, size_t len) {
+    struct array_arena* arena = a->arena;
+    struct slice s = { (uint32_t)arena->used, (uint32_t)len };
+
+    memcpy(arena->data + arena->used, text, len);
+    arena->data[arena->used + len] = '\0';
+    arena->used += len + 1;
+    return s;
+}
+
+// Function to resolve an index of an indexed array: negative ones count back
+// from the end. Returns -1 if it is out of range.
+long long array_index(struct array* a, long long i) {
+    if (i < 0) {
+        i += a->count;
+    }
+    return (i < 0 || i > ARRAY_INDEX_MAX) ? -1 : i;
+}
+
+// Function to get element i of an indexed array, or NULL if it is not set
+char* array_get(struct array* a, long long i) {
+    i = array_index(a, i);
+    if (i < 0 || i >= a->count || a->items[i].length == SLICE_UNSET) {
+        return NULL;
+    }
+    return array_text(a, a->items[i]);
+}
+
+// Function to set element i of an indexed array to len bytes of text.
+// Returns 0, or -1 if the index is out of range.
+int array_set(struct array* a, long long i, const char* text, size_t len) {
+    long long at = array_index(a, i);
+
+    if (at < 0) {
+        fprintf(stderr, "%lld: array index out of range\n", i);
+        return -1;
+    }
+    if (at >= a->cap) {
+        int cap = a->cap ? a->cap * 2 : 8;
+        while (cap <= at) {
+            cap *= 2;
+        }
+        struct slice* items = realloc(a->items, cap * sizeof(struct slice));
+        if (!items) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        a->items = items;
+        a->cap = cap;
+    }
+    while (a->count <= at) {
+        a->items[a->count].offset = 0;
+        a->items[a->count++].length = SLICE_UNSET;
+    }
+    array_reserve(a, len + 1);
+    struct slice* s = &a->items[at];
+    if (s->length == SLICE_UNSET) {
+        a->set++;
+    } else {
+        a->garbage += s->length + 1;
+    }
+    *s = array_store(a, text, len);
+    return 0;
+}
+
+// Function to unset element i of an indexed array; later indexes stay as they are
+void array_unset(struct array* a, long long i) {
+    i = array_index(a, i);
+    if (i < 0 || i >= a->count || a->items[i].length == SLICE_UNSET) {
+        return;
+    }
+    a->garbage += a->items[i].length + 1;
+    a->items[i].length = SLICE_UNSET;
+    a->set--;
+    while (a->count > 0 && a->items[a->count - 1].length == SLICE_UNSET) {
+        a->count--;
+    }
+}
+
+// Function to find key in an associative array's table. With insert, returns
+// the slot to put a new key in when it is missing (reusing a deleted one);
+// otherwise NULL.
+struct assoc_slot* assoc_find(struct array* a, const char* key, size_t len, uint32_t hash, bool insert) {
+    struct assoc_slot* reuse = NULL;
+
+    if (a->cap == 0) {
+        return NULL;
+    }
+    for (uint32_t i = hash & (a->cap - 1);; i = (i + 1) & (a->cap - 1)) {
+        struct assoc_slot* slot = &a->slots[i];
+        if (slot->state == SLOT_EMPTY) {
+            return insert ? (reuse ? reuse : slot) : NULL;
+        }
+        if (slot->state == SLOT_DELETED) {
+            if (!reuse) {
+                reuse = slot;
+            }
+        } else if (slot->hash == hash && slot->key.length == len &&
+                   memcmp(array_text(a, slot->key), key, len) == 0) {
+            return slot;
+        }
+    }
+}
+
+// Function to rebuild an associative array's table with room to grow,
+// dropping deleted slots
+void assoc_grow(struct array* a) {
+    struct assoc_slot* old = a->slots;
+    int old_cap = a->cap;
+    int cap = 8;
+
+    while (cap * 3 < (a->set + 1) * 8) {  // At most 3/8 full after growing
+        cap *= 2;
+    }
+    a->slots = calloc(cap, sizeof(struct assoc_slot));
+    if (!a->slots) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    a->cap = cap;
+    a->used = a->set;
+    for (int i = 0; i < old_cap; i++) {
+        if (old[i].state == SLOT_FULL) {
+            uint32_t j = old[i].hash & (cap - 1);
+            while (a->slots[j].state != SLOT_EMPTY) {
+                j = (j + 1) & (cap - 1);
+            }
+            a->slots[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+// Function to get the value of key in an associative array, or NULL
+char* assoc_get(struct array* a, const char* key) {
+    size_t len = strlen(key);
+    struct assoc_slot* slot = assoc_find(a, key, len, hash_bytes(key, len), false);
+    return slot ? array_text(a, slot->value) : NULL;
+}
+
+// Function to set key of an associative array to len bytes of value
+void assoc_set(struct array* a, const char* key, const char* value, size_t len) {
+    size_t key_len = strlen(key);
+    uint32_t hash = hash_bytes(key, key_len);
+
+    if ((a->used + 1) * 4 > a->cap * 3) {
+        assoc_grow(a);
+    }
+    struct assoc_slot* slot = assoc_find(a, key, key_len, hash, true);
+    if (slot->state == SLOT_FULL) {
+        array_reserve(a, len + 1);
+        a->garbage += slot->value.length + 1;
+        slot->value = array_store(a, value, len);
+        return;
+    }
+    array_reserve(a, key_len + len + 2);
+    a->used += slot->state == SLOT_EMPTY;
+    a->set++;
+    slot->key = array_store(a, key, key_len);
+    slot->value = array_store(a, value, len);
+    slot->hash = hash;
+    slot->state = SLOT_FULL;
+}
+
+// Function to remove key from an associative array
+void assoc_unset(struct array* a, const char* key) {
+    size_t len = strlen(key);
+    struct assoc_slot* slot = assoc_find(a, key, len, hash_bytes(key, len), false);
+
+    if (slot) {
+        a->garbage += slot->key.length + slot->value.length + 2;
+        slot->state = SLOT_DELETED;
+        a->set--;
+    }
+}
+
+// Function to find a shell variable's slot, or -1
+int find_variable(const char* name) {
+    for (int i = 0; i < var_count; i++) {
+        if (strcmp(shell_vars[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to get a variable's string value, formatting it first if the last
+// assignment came from arithmetic and only stored the integer. An array
+// gives its element 0, or "" without one.
+char* variable_string(struct var* v) {
+    if (v->array) {
+        char* first = v->array->assoc ? assoc_get(v->array, "0") : array_get(v->array, 0);
+        return first ? first : "";
+    }
+    if (v->str_stale) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lld", v->ival);
+        release_string(v->value);
+        v->value = strdup(buf);
+        v->str_stale = false;
+    }
+    return v->value;
+}
+
+/// Find the value of a shell variable by name
+char* get_variable_value(char* name) {
+    int i = find_variable(name);
+    if (i >= 0) {
+        return variable_string(&shell_vars[i]);
+    }
+    return NULL;  // Variable not found
+}
+
+// Function to take a new slot at the end of the variable table, growing it
+// when it is full. The slot is zeroed; var_count is not changed.
+struct var* new_variable() {
+    if (var_count == var_cap) {
+        int cap = var_cap ? var_cap * 2 : VARS_MIN;
+        struct var* vars = realloc(shell_vars, cap * sizeof(struct var));
+        if (!vars) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        shell_vars = vars;
+        var_cap = cap;
+    }
+    memset(&shell_vars[var_count], 0, sizeof(struct var));
+    return &shell_vars[var_count];
+}
+
+// Function to create or update a shell variable. Returns its slot.
+int store_variable(const char* name) {
+    int i = find_variable(name);
+    if (i >= 0) {
+        return i;
+    }
+    new_variable()->name = strdup(name);
+    return var_count++;
+}
+
+// Function to set a variable to the first len bytes of value; an array gets
+// it as element 0. Returns 0.
+int set_variable_n(const char* name, const char* value, size_t len) {
+    int i = store_variable(name);
+    struct array* a = shell_vars[i].array;
+
+    if (a && a->assoc) {
+        assoc_set(a, "0", value, len);
+    } else if (a) {
+        array_set(a, 0, value, len);
+    } else {
+        release_string(shell_vars[i].value);
+        shell_vars[i].value = strndup(value, len);
+    }
+    shell_vars[i].ival_valid = false;  // Parsed again on the next arithmetic use
+    shell_vars[i].str_stale = false;
+    return 0;
+}
+
+// Function to create or update a shell variable. Returns 0.
+int set_variable(const char* name, const char* value) {
+    return set_variable_n(name, value, strlen(value));
+}
+
+// Function to assign an integer to a variable without formatting it; the
+// string is only built if something expands the variable as text
+int set_variable_int(const char* name, long long value) {
+    int i = store_variable(name);
+    if (shell_vars[i].array) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lld", value);
+        return set_variable(name, buf);
+    }
+    if (!shell_vars[i].value) {
+        shell_vars[i].value = strdup("");
+    }
+    shell_vars[i].ival = value;
+    shell_vars[i].ival_valid = true;
+    shell_vars[i].str_stale = true;
+    return 0;
+}
+
+// Function to release what a variable owns
+void free_variable(struct var* v) {
+    release_string(v->name);
+    release_string(v->value);
+    array_free(v->array);
+}
+
+// Function to remove a shell variable. Returns 0, or -1 if it is not set.
+int unset_variable(const char* name) {
+    int i = find_variable(name);
+    if (i < 0) {
+        return -1;
+    }
+    free_variable(&shell_vars[i]);
+    shell_vars[i] = shell_vars[var_count - 1];
+    var_count--;
+    return 0;
+}
+
+// Function to turn a variable into an array. A string becomes its element 0
+// (key "0" of an associative array). Returns the array, or NULL with a
+// message when an existing array is of the other kind.
+struct array* make_array(struct var* v, bool assoc) {
+    if (v->array) {
+        if (v->array->assoc != assoc) {
+            fprintf(stderr, "%s: cannot convert %s to %s array\n", v->name,
+                    v->array->assoc ? "associative" : "indexed", assoc ? "associative" : "indexed");
+            return NULL;
+        }
+        return v->array;
+    }
+    struct array* a = array_new(assoc);
+    if (v->value) {
+        char* value = variable_string(v);
+        if (assoc) {
+            assoc_set(a, "0", value, strlen(value));
+        } else {
+            array_set(a, 0, value, strlen(value));
+        }
+        release_string(v->value);
+        v->value = NULL;
+    }
+    v->array = a;
+    v->ival_valid = false;
+    v->str_stale = false;
+    return a;
+}
+
+// Function to evaluate the arguments of test / [ and return its exit status:
+// 0 for true, 1 for false, 2 for a usage error
+int evaluate_test(char** args, int argc) {
+    struct stat st;
+
+    if (argc == 0) {
+        return 1;
+    }
+    if (strcmp(args[0], "!") == 0) {
+        int result = evaluate_test(args + 1, argc - 1);
+        return result == 2 ? 2 : !result;
+    }
+    if (argc == 1) {
+        return args[0][0] == '\0';
+    }
+    if (argc == 2) {
+        const char* op = args[0];
+        const char* arg = args[1];
+        if (strcmp(op, "-n") == 0) return arg[0] == '\0';
+        if (strcmp(op, "-z") == 0) return arg[0] != '\0';
+        if (strcmp(op, "-e") == 0) return stat(arg, &st) != 0;
+        if (strcmp(op, "-f") == 0) return !(stat(arg, &st) == 0 && S_ISREG(st.st_mode));
+        if (strcmp(op, "-d") == 0) return !(stat(arg, &st) == 0 && S_ISDIR(st.st_mode));
+        if (strcmp(op, "-s") == 0) return !(stat(arg, &st) == 0 && st.st_size > 0);
+        if (strcmp(op, "-r") == 0) return access(arg, R_OK) != 0;
+        if (strcmp(op, "-w") == 0) return access(arg, W_OK) != 0;
+        if (strcmp(op, "-x") == 0) return access(arg, X_OK) != 0;
+        fprintf(stderr, "test: unknown operator '%s'\n", op);
+        return 2;
+    }
+    if (argc == 3) {
+        const char* op = args[1];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(args[0], args[2]) != 0;
+        if (strcmp(op, "!=") == 0) return strcmp(args[0], args[2]) == 0;
+
+        long long a = atoll(args[0]), b = atoll(args[2]);
+        if (strcmp(op, "-eq") == 0) return !(a == b);
+        if (strcmp(op, "-ne") == 0) return !(a != b);
+        if (strcmp(op, "-lt") == 0) return !(a < b);
+        if (strcmp(op, "-le") == 0) return !(a <= b);
+        if (strcmp(op, "-gt") == 0) return !(a > b);
+        if (strcmp(op, "-ge") == 0) return !(a >= b);
+        fprintf(stderr, "test: unknown operator '%s'\n", op);
+        return 2;
+    }
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
+
+// Operators of the arithmetic evaluator
+enum arith_op {
+    ARITH_NUM, ARITH_VAR,
+    ARITH_NEG, ARITH_NOT, ARITH_BITNOT,
+    ARITH_PREINC, ARITH_PREDEC, ARITH_POSTINC, ARITH_POSTDEC,
+    ARITH_POW, ARITH_MUL, ARITH_DIV, ARITH_MOD, ARITH_ADD, ARITH_SUB,
+    ARITH_SHL, ARITH_SHR, ARITH_LT, ARITH_LE, ARITH_GT, ARITH_GE,
+    ARITH_EQ, ARITH_NE, ARITH_BITAND, ARITH_BITXOR, ARITH_BITOR,
+    ARITH_AND, ARITH_OR, ARITH_COND, ARITH_ASSIGN, ARITH_COMMA,
+    ARITH_SUBSCRIPT
+};
+
+// Node of a compiled $(( )) expression
+struct arith_node {
+    enum arith_op op;
+    enum arith_op assign_op;  // ARITH_ASSIGN: operator of a compound "+=" etc., or ARITH_NUM for "="
+    long long value;          // ARITH_NUM
+    char *name;               // ARITH_VAR and assignment targets; ARITH_SUBSCRIPT: its text
+    int slot;                 // Last shell_vars[] slot of name; checked before use
+    struct arith_node *a, *b, *c;  // c: the ternary's else branch, or the subscript of a[i]
+};
+
+// Binary operators in precedence-climbing order: higher binds tighter
+struct arith_binop {
+    const char *text;
+    enum arith_op op;
+    int prec;
+};
+
+static const struct arith_binop arith_binops[] = {
+    { "**", ARITH_POW, 11 },
+    { "*", ARITH_MUL, 10 }, { "/", ARITH_DIV, 10 }, { "%", ARITH_MOD, 10 },
+    { "+", ARITH_ADD, 9 }, { "-", ARITH_SUB, 9 },
+    { "<<", ARITH_SHL, 8 }, { ">>", ARITH_SHR, 8 },
+    { "<=", ARITH_LE, 7 }, { ">=", ARITH_GE, 7 }, { "<", ARITH_LT, 7 }, { ">", ARITH_GT, 7 },
+    { "==", ARITH_EQ, 6 }, { "!=", ARITH_NE, 6 },
+    { "&&", ARITH_AND, 2 }, { "||", ARITH_OR, 1 },
+    { "&", ARITH_BITAND, 5 }, { "^", ARITH_BITXOR, 4 }, { "|", ARITH_BITOR, 3 },
+    { NULL, ARITH_NUM, 0 }
+};
+
+// Cursor over the text of an arithmetic expression
+struct arith_parser {
+    const char *p;
+    bool error;
+};
+
+struct arith_node* arith_parse_assign(struct arith_parser* ap);
+
+// Function to allocate an arithmetic node
+struct arith_node* arith_new(enum arith_op op, struct arith_node* a, struct arith_node* b) {
+    struct arith_node* n = calloc(1, sizeof(struct arith_node));
+    if (!n) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    n->op = op;
+    n->slot = -1;
+    n->a = a;
+    n->b = b;
+    return n;
+}
+
+// Function to release a compiled arithmetic expression
+void arith_free(struct arith_node* n) {
+    if (!n) {
+        return;
+    }
+    arith_free(n->a);
+    arith_free(n->b);
+    arith_free(n->c);
+    free(n->name);
+    free(n);
+}
+
+// Function to skip blanks inside an arithmetic expression
+void arith_skip(struct arith_parser* ap) {
+    while (isspace((unsigned char)*ap->p)) {
+        ap->p++;
+    }
+}
+
+struct arith_node* arith_compile(const char* text);
+
+// Function to parse the [i] that may follow a variable name, or return NULL.
+// The subscript keeps its text: an associative array takes that, with
+// parameters expanded, as the key, where an indexed array evaluates it.
+struct arith_node* arith_read_subscript(struct arith_parser* ap) {
+    const char* start = ap->p + 1;
+    int depth = 0;
+
+    if (*ap->p != '[') {
+        return NULL;
+    }
+    for (; *ap->p && (*ap->p != ']' || --depth > 0); ap->p++) {
+        depth += *ap->p == '[';
+    }
+    if (!*ap->p) {
+        ap->error = true;
+        return NULL;
+    }
+    struct arith_node* n = arith_new(ARITH_SUBSCRIPT, NULL, NULL);
+    n->name = strndup(start, ap->p - start);
+    n->a = arith_compile(n->name);  // NULL if it is only a key
+    ap->p++;
+    return n;
+}
+
+// Function to read a variable name, allowing the optional $ and ${} forms,
+// and the subscript of an array element into *subscript
+char* arith_read_name(struct arith_parser* ap, struct arith_node** subscript) {
+    const char* start;
+    bool braced = false, dollar = ap->p[0] == '$';
+
+    if (dollar) {
+        ap->p++;
+        if (*ap->p == '{') {
+            braced = true;
+            ap->p++;
+        }
+    }
+    start = ap->p;
+    if (dollar && (isdigit((unsigned char)*ap->p) || *ap->p == '#')) {  // $1, ${10} or $#
+        ap->p += *ap->p == '#' || !braced ? 1 : strspn(ap->p, "0123456789");
+    } else if (!isalpha((unsigned char)*ap->p) && *ap->p != '_') {
+        return NULL;
+    } else {
+        while (isalnum((unsigned char)*ap->p) || *ap->p == '_') {
+            ap->p++;
+        }
+    }
+    char* name = strndup(start, ap->p - start);
+    *subscript = isdigit((unsigned char)*start) || *start == '#' ? NULL : arith_read_subscript(ap);
+    if (braced) {
+        if (*ap->p != '}') {
+            free(name);
+            arith_free(*subscript);
+            *subscript = NULL;
+            return NULL;
+        }
+        ap->p++;
+    }
+    return name;
+}
+
+// Function to parse a number, variable, parenthesised expression or postfix ++/--
+struct arith_node* arith_parse_primary(struct arith_parser* ap) {
+    struct arith_node* n;
+
+    arith_skip(ap);
+    if (*ap->p == '(') {
+        ap->p++;
+        n = arith_parse_assign(ap);
+        while (!ap->error && (arith_skip(ap), *ap->p == ',')) {
+            ap->p++;
+            n = arith_new(ARITH_COMMA, n, arith_parse_assign(ap));
+        }
+        arith_skip(ap);
+        if (*ap->p != ')') {
+            ap->error = true;
+            return n;
+        }
+        ap->p++;
+        return n;
+    }
+    if (isdigit((unsigned char)*ap->p)) {
+        char* end;
+        n = arith_new(ARITH_NUM, NULL, NULL);
+        n->value = (long long)strtoull(ap->p, &end, 0);  // Decimal, 0x hex or 0 octal
+        if (isalnum((unsigned char)*end) || *end == '_') {
+            ap->error = true;
+        }
+        ap->p = end;
+        return n;
+    }
+    struct arith_node* subscript;
+    char* name = arith_read_name(ap, &subscript);
+    if (!name) {
+        ap->error = true;
+        return NULL;
+    }
+    n = arith_new(ARITH_VAR, NULL, NULL);
+    n->name = name;
+    n->c = subscript;
+    arith_skip(ap);
+    if ((ap->p[0] == '+' && ap->p[1] == '+') || (ap->p[0] == '-' && ap->p[1] == '-')) {
+        n->op = (ap->p[0] == '+') ? ARITH_POSTINC : ARITH_POSTDEC;
+        ap->p += 2;
+    }
+    return n;
+}
+
+// Function to parse the prefix operators + - ! ~ ++ --
+struct arith_node* arith_parse_unary(struct arith_parser* ap) {
+    arith_skip(ap);
+    if ((ap->p[0] == '+' && ap->p[1] == '+') || (ap->p[0] == '-' && ap->p[1] == '-')) {
+        enum arith_op op = (ap->p[0] == '+') ? ARITH_PREINC : ARITH_PREDEC;
+        ap->p += 2;
+        arith_skip(ap);
+        struct arith_node* subscript;
+        char* name = arith_read_name(ap, &subscript);
+        if (!name) {
+            ap->error = true;
+            return NULL;
+        }
+        struct arith_node* n = arith_new(op, NULL, NULL);
+        n->name = name;
+        n->c = subscript;
+        return n;
+    }
+    switch (*ap->p) {
+    case '-':
+        ap->p++;
+        return arith_new(ARITH_NEG, arith_parse_unary(ap), NULL);
+    case '+':
+        ap->p++;
+        return arith_parse_unary(ap);
+    case '!':
+        ap->p++;
+        return arith_new(ARITH_NOT, arith_parse_unary(ap), NULL);
+    case '~':
+        ap->p++;
+        return arith_new(ARITH_BITNOT, arith_parse_unary(ap), NULL);
+    }
+    return arith_parse_primary(ap);
+}
+
+// Function to recognise a binary operator at the cursor. Compound assignment
+// operators such as "+=" are not binary operators and are rejected here.
+const struct arith_binop* arith_peek_binop(struct arith_parser* ap) {
+    arith_skip(ap);
+    for (const struct arith_binop* b = arith_binops; b->text; b++) {
+        size_t len = strlen(b->text);
+        if (strncmp(ap->p, b->text, len) == 0) {
+            bool comparison = b->op == ARITH_LE || b->op == ARITH_GE || b->op == ARITH_EQ || b->op == ARITH_NE;
+            if (ap->p[len] == '=' && !comparison) {
+                return NULL;
+            }
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// Function to parse binary operators by precedence climbing
+struct arith_node* arith_parse_binary(struct arith_parser* ap, int min_prec) {
+    struct arith_node* left = arith_parse_unary(ap);
+    const struct arith_binop* b;
+
+    while (!ap->error && (b = arith_peek_binop(ap)) != NULL && b->prec >= min_prec) {
+        ap->p += strlen(b->text);
+        // ** is right-associative, everything else left-associative
+        struct arith_node* right = arith_parse_binary(ap, b->op == ARITH_POW ? b->prec : b->prec + 1);
+        left = arith_new(b->op, left, right);
+    }
+    return left;
+}
+
+// Function to parse "cond ? a : b"
+struct arith_node* arith_parse_ternary(struct arith_parser* ap) {
+    struct arith_node* cond = arith_parse_binary(ap, 1);
+
+    arith_skip(ap);
+    if (ap->error || *ap->p != '?') {
+        return cond;
+    }
+    ap->p++;
+    struct arith_node* n = arith_new(ARITH_COND, cond, arith_parse_assign(ap));
+    arith_skip(ap);
+    if (*ap->p != ':') {
+        ap->error = true;
+        return n;
+    }
+    ap->p++;
+    n->c = arith_parse_ternary(ap);
+    return n;
+}
+
+// Function to parse an assignment (=, +=, -=, ...) or a conditional expression
+struct arith_node* arith_parse_assign(struct arith_parser* ap) {
+    static const struct { const char* text; enum arith_op op; } assign_ops[] = {
+        { "=", ARITH_NUM }, { "+=", ARITH_ADD }, { "-=", ARITH_SUB }, { "*=", ARITH_MUL },
+        { "/=", ARITH_DIV }, { "%=", ARITH_MOD }, { "<<=", ARITH_SHL }, { ">>=", ARITH_SHR },
+        { "&=", ARITH_BITAND }, { "^=", ARITH_BITXOR }, { "|=", ARITH_BITOR }, { NULL, ARITH_NUM }
+    };
+    const char* start;
+    bool error = ap->error;
+
+    arith_skip(ap);
+    start = ap->p;
+    if (isalpha((unsigned char)*ap->p) || *ap->p == '_' || *ap->p == '$') {
+        struct arith_node* subscript = NULL;
+        char* name = arith_read_name(ap, &subscript);
+        arith_skip(ap);
+        for (int i = 0; name && !ap->error && assign_ops[i].text; i++) {
+            size_t len = strlen(assign_ops[i].text);
+            if (strncmp(ap->p, assign_ops[i].text, len) == 0 && ap->p[len] != '=') {
+                ap->p += len;
+                struct arith_node* n = arith_new(ARITH_ASSIGN, arith_parse_assign(ap), NULL);
+                n->assign_op = assign_ops[i].op;
+                n->name = name;
+                n->c = subscript;
+                return n;
+            }
+        }
+        free(name);
+        arith_free(subscript);
+        ap->error = error;
+        ap->p = start;  // Not an assignment: parse again as an expression
+    }
+    return arith_parse_ternary(ap);
+}
+
+// Function to compile an arithmetic expression once. Returns NULL on a syntax error.
+struct arith_node* arith_compile(const char* text) {
+    struct arith_parser ap = { text, false };
+    struct arith_node* n = arith_parse_assign(&ap);
+
+    while (!ap.error && (arith_skip(&ap), *ap.p == ',')) {
+        ap.p++;
+        n = arith_new(ARITH_COMMA, n, arith_parse_assign(&ap));
+    }
+    arith_skip(&ap);
+    if (ap.error || *ap.p != '\0') {
+        arith_free(n);
+        return NULL;
+    }
+    return n;
+}
+
+const char* lookup_param(const char* name, char* numbuf, size_t numbuf_size);
+
+// Function to read a variable as an integer straight from the variable store.
+// The parsed value is cached in the variable, so a counter updated by
+// arithmetic never goes through a decimal string.
+long long arith_get_var(struct arith_node* n) {
+    int i = n->slot;
+
+    if (isdigit((unsigned char)n->name[0]) || n->name[0] == '#') {  // $1 or $#
+        char numbuf[32];
+        return strtoll(lookup_param(n->name, numbuf, sizeof(numbuf)), NULL, 0);
+    }
+
+    if (i < 0 || i >= var_count || strcmp(shell_vars[i].name, n->name) != 0) {
+        i = find_variable(n->name);
+        n->slot = i;
+    }
+    if (i < 0) {
+        const char* env = getenv(n->name);
+        return env ? strtoll(env, NULL, 0) : 0;
+    }
+    struct var* v = &shell_vars[i];
+    if (v->array) {
+        return strtoll(variable_string(v), NULL, 0);
+    }
+    if (!v->ival_valid) {
+        char* end;
+        v->ival = strtoll(v->value, &end, 0);
+        v->ival_valid = (*end == '\0');  // Only cache values that are plain numbers
+        return v->ival;
+    }
+    return v->ival;
+}
+
+long long arith_eval(struct arith_node* n, bool* error);
+void compile_word(const char* raw, struct word* w);
+char* expand_word_string(struct word* w);
+void free_word(struct word* w);
+
+// Function to work out the key of an a[i] operand as text. An associative
+// array's key is the text in the brackets with parameters expanded, as in
+// m[apple] or m[$name]; an indexed array's is the subscript's value.
+void arith_subscript_key(struct arith_node* n, bool* error, char* buf, size_t size) {
+    int i = find_variable(n->name);
+
+    if (i >= 0 && shell_vars[i].array && shell_vars[i].array->assoc) {
+        struct word w;
+        compile_word(n->c->name, &w);
+        char* key = expand_word_string(&w);
+        snprintf(buf, size, "%s", key);
+        free(key);
+        free_word(&w);
+    } else {
+        snprintf(buf, size, "%lld", arith_eval(n->c, error));
+    }
+}
+
+// Function to read element key of an array as an integer; 0 if it is not set
+long long arith_get_element(struct arith_node* n, const char* key) {
+    int i = find_variable(n->name);
+    struct array* a = i >= 0 ? shell_vars[i].array : NULL;
+    const char* text = NULL;
+
+    if (a) {
+        text = a->assoc ? assoc_get(a, key) : array_get(a, strtoll(key, NULL, 10));
+    } else if (i >= 0 && strcmp(key, "0") == 0) {
+        text = variable_string(&shell_vars[i]);
+    }
+    return text ? strtoll(text, NULL, 0) : 0;
+}
+
+// Function to assign an integer to element key of an array, making the
+// variable an indexed array if it is not one. Returns 0, or -1 if the index
+// is out of range.
+int arith_set_element(struct arith_node* n, const char* key, long long value) {
+    int i = store_variable(n->name);
+    struct array* a = shell_vars[i].array ? shell_vars[i].array : make_array(&shell_vars[i], false);
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%lld", value);
+
+    if (a->assoc) {
+        assoc_set(a, key, buf, len);
+        return 0;
+    }
+    return array_set(a, strtoll(key, NULL, 10), buf, len);
+}
+
+// Function to apply a binary operator. Overflow wraps around instead of
+// being undefined; division by zero sets *error.
+long long arith_apply(enum arith_op op, long long a, long long b, bool* error) {
+    unsigned long long ua = (unsigned long long)a, ub = (unsigned long long)b;
+
+    switch (op) {
+    case ARITH_MUL: return (long long)(ua * ub);
+    case ARITH_ADD: return (long long)(ua + ub);
+    case ARITH_SUB: return (long long)(ua - ub);
+    case ARITH_DIV:
+    case ARITH_MOD:
+        if (b == 0) {
+            fprintf(stderr, "arithmetic: division by zero\n");
+            *error = true;
+            return 0;
+        }
+        if (b == -1) {  // LLONG_MIN / -1 would trap
+            return op == ARITH_DIV ? (long long)(0 - ua) : 0;
+        }
+        return op == ARITH_DIV ? a / b : a % b;
+    case ARITH_POW: {
+        if (b < 0) {
+            fprintf(stderr, "arithmetic: exponent less than 0\n");
+            *error = true;
+            return 0;
+        }
+        // Square and multiply: O(log b) steps, wrapping like repeated *
+        unsigned long long r = 1, base = ua;
+        for (unsigned long long e = b; e > 0; e >>= 1) {
+            if (e & 1) {
+                r *= base;
+            }
+            base *= base;
+        }
+        return (long long)r;
+    }
+    case ARITH_SHL: return (long long)(ua << (b & 63));
+    case ARITH_SHR: return a >> (b & 63);
+    case ARITH_LT: return a < b;
+    case ARITH_LE: return a <= b;
+    case ARITH_GT: return a > b;
+    case ARITH_GE: return a >= b;
+    case ARITH_EQ: return a == b;
+    case ARITH_NE: return a != b;
+    case ARITH_BITAND: return a & b;
+    case ARITH_BITXOR: return a ^ b;
+    case ARITH_BITOR: return a | b;
+    default: return 0;
+    }
+}
+
+// Function to evaluate a compiled arithmetic expression over 64-bit integers
+long long arith_eval(struct arith_node* n, bool* error) {
+    long long a, b;
+
+    if (*error) {
+        return 0;
+    }
+    switch (n->op) {
+    case ARITH_NUM:
+        return n->value;
+    case ARITH_VAR:
+        if (n->c) {
+            char key[256];
+            arith_subscript_key(n, error, key, sizeof(key));
+            return arith_get_element(n, key);
+        }
+        return arith_get_var(n);
+    case ARITH_NEG:
+        return (long long)(0 - (unsigned long long)arith_eval(n->a, error));
+    case ARITH_NOT:
+        return !arith_eval(n->a, error);
+    case ARITH_BITNOT:
+        return ~arith_eval(n->a, error);
+    case ARITH_PREINC:
+    case ARITH_PREDEC:
+    case ARITH_POSTINC:
+    case ARITH_POSTDEC: {
+        char key[256];
+        if (n->c) {
+            arith_subscript_key(n, error, key, sizeof(key));
+        }
+        a = n->c ? arith_get_element(n, key) : arith_get_var(n);
+        b = (n->op == ARITH_PREINC || n->op == ARITH_POSTINC) ? arith_apply(ARITH_ADD, a, 1, error)
+                                                             : arith_apply(ARITH_SUB, a, 1, error);
+        if (!*error && (n->c ? arith_set_element(n, key, b) : set_variable_int(n->name, b)) != 0) {
+            *error = true;
+        }
+        return (n->op == ARITH_PREINC || n->op == ARITH_PREDEC) ? b : a;
+    }
+    case ARITH_AND:
+        return arith_eval(n->a, error) && arith_eval(n->b, error);
+    case ARITH_OR:
+        return arith_eval(n->a, error) || arith_eval(n->b, error);
+    case ARITH_COND:
+        return arith_eval(n->a, error) ? arith_eval(n->b, error) : arith_eval(n->c, error);
+    case ARITH_COMMA:
+        arith_eval(n->a, error);
+        return arith_eval(n->b, error);
+    case ARITH_SUBSCRIPT:
+        if (!n->a) {
+            fprintf(stderr, "%s: bad array subscript\n", n->name);
+            *error = true;
+            return 0;
+        }
+        return arith_eval(n->a, error);
+    case ARITH_ASSIGN: {
+        char key[256];
+        b = arith_eval(n->a, error);
+        if (n->c) {
+            arith_subscript_key(n, error, key, sizeof(key));
+        }
+        if (n->assign_op != ARITH_NUM) {
+            a = n->c ? arith_get_element(n, key) : arith_get_var(n);
+            b = arith_apply(n->assign_op, a, b, error);
+        }
+        if (!*error && (n->c ? arith_set_element(n, key, b) : set_variable_int(n->name, b)) != 0) {
+            *error = true;
+        }
+        return b;
+    }
+    default:
+        a = arith_eval(n->a, error);
+        b = arith_eval(n->b, error);
+        return arith_apply(n->op, a, b, error);
+    }
+}
+
+#define READ_BUFFER_SIZE 65536  // Largest read-ahead of the read built-in
+#define READ_CHUNK_MIN 128      // Read-ahead once other processes share the file
+#define MAX_READERS 8           // Descriptors with read-ahead state at a time
+
+// How the bytes buffered for a descriptor relate to what the kernel still holds
+enum reader_kind {
+    READER_FILE,   // Regular file: its offset runs ahead of pos, seek back to sync
+    READER_PIPE,   // Pipe: buf is a tee(2) copy, bytes before pos are not drained yet
+    READER_BYTES   // Terminals, sockets, devices: one byte per read(2)
+};
+
+// Read-ahead state of one descriptor read by the read built-in. Bytes are only
+// held back while the shell is the sole reader; sync_fd_reader() puts the
+// descriptor back in step before a child or a redirection can see it.
+struct fd_reader {
+    int fd;
+    enum reader_kind kind;
+    char *buf;
+    size_t pos;    // Next byte not yet returned by read
+    size_t len;    // Bytes in buf
+    size_t chunk;  // Current read-ahead for regular files
+} fd_readers[MAX_READERS];
+int reader_count = 0;
+int peek_pipe[2] = { -1, -1 };  // Private pipe that tee(2) copies pipe data into
+
+bool is_valid_name(const char* name, size_t len);
+
+// Function to take the bytes read has already returned out of a pipe whose
+// contents were only copied with tee(2)
+void drain_pipe_reader(struct fd_reader* r) {
+    size_t done = 0;
+    while (done < r->pos) {
+        // Same bytes as already in buf, so reading over them changes nothing
+        ssize_t n = read(r->fd, r->buf, r->pos - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    r->pos = r->len = 0;
+}
+
+// Function to give the kernel back everything read has not returned for fd:
+// seek a regular file back, or drain a pipe up to what was consumed. With
+// release the state is dropped too, as the descriptor is about to change.
+void sync_fd_reader(int fd, bool release) {
+    for (int i = 0; i < reader_count; i++) {
+        struct fd_reader* r = &fd_readers[i];
+        if (r->fd != fd) {
+            continue;
+        }
+        if (r->kind == READER_FILE && r->pos < r->len) {
+            lseek(fd, -(off_t)(r->len - r->pos), SEEK_CUR);
+            r->chunk = READ_CHUNK_MIN;  // Others read here too: read less ahead
+        } else if (r->kind == READER_PIPE) {
+            drain_pipe_reader(r);
+        }
+        r->pos = r->len = 0;
+        if (release) {
+            free(r->buf);
+            fd_readers[i] = fd_readers[--reader_count];
+        }
+        return;
+    }
+}
+
+// Function to sync every descriptor before another process can read from them
+void sync_fd_readers() {
+    for (int i = 0; i < reader_count; i++) {
+        sync_fd_reader(fd_readers[i].fd, false);
+    }
+}
+
+// Function to find or set up the read-ahead state for fd
+struct fd_reader* get_fd_reader(int fd) {
+    struct fd_reader* r;
+    struct stat st;
+
+    for (int i = 0; i < reader_count; i++) {
+        if (fd_readers[i].fd == fd) {
+            return &fd_readers[i];
+        }
+    }
+    if (reader_count == MAX_READERS) {
+        sync_fd_reader(fd_readers[0].fd, true);
+    }
+    r = &fd_readers[reader_count++];
+    r->fd = fd;
+    r->kind = READER_BYTES;
+    r->pos = r->len = 0;
+    r->chunk = READ_BUFFER_SIZE;
+    r->buf = malloc(READ_BUFFER_SIZE);
+    if (!r->buf) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(fd, &st) == 0) {
+        if (S_ISREG(st.st_mode)) {
+            r->kind = READER_FILE;
+        } else if (S_ISFIFO(st.st_mode)
+                   && (peek_pipe[0] >= 0 || pipe2(peek_pipe, O_CLOEXEC) == 0)) {
+            r->kind = READER_PIPE;
+        }
+    }
+    return r;
+}
+
+// Function to refill an exhausted buffer. Returns the number of bytes read,
+// 0 at end of file or -1 on error.
+ssize_t fill_fd_reader(struct fd_reader* r) {
+    ssize_t n;
+
+    if (r->kind == READER_PIPE) {
+        drain_pipe_reader(r);
+        do {
+            n = tee(r->fd, peek_pipe[1], READ_BUFFER_SIZE, 0);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && errno == EINVAL) {
+            r->kind = READER_BYTES;  // Not a pipe tee(2) accepts, e.g. a socket
+            return fill_fd_reader(r);
+        }
+        // Copy the peeked bytes out; the pipe itself still holds them
+        for (size_t done = 0; n > 0 && done < (size_t)n; ) {
+            ssize_t got = read(peek_pipe[0], r->buf + done, n - done);
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += got;
+        }
+    } else {
+        size_t want = r->kind == READER_FILE ? r->chunk : 1;
+        do {
+            n = read(r->fd, r->buf, want);
+        } while (n < 0 && errno == EINTR);
+        if (r->kind == READER_FILE && r->chunk < READ_BUFFER_SIZE) {
+            r->chunk *= 2;  // Nobody needed the offset since the last fill
+        }
+    }
+    if (n > 0) {
+        r->pos = 0;
+        r->len = n;
+    }
+    return n;
+}
+
+// Function to read one record up to delim (not included) from fd. Returns 1
+// if the delimiter was seen, 0 at end of input; *out holds what was read.
+int read_record(int fd, int delim, char** out, size_t* out_len) {
+    size_t len = 0, cap = 128;
+    char* line = malloc(cap);
+    int found = 0;
+
+    if (!line) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fd == STDIN_FILENO && stdin_redirects == 0) {
+        // The shell's own input: go through stdio so read_input() stays in step
+        int c;
+        while ((c = getc(stdin)) != EOF) {
+            if (c == delim) {
+                found = 1;
+                break;
+            }
+            if (len + 2 > cap) {
+                cap *= 2;
+                line = realloc(line, cap);
+            }
+            line[len++] = c;
+        }
+        clearerr(stdin);  // Ctrl+D ends the read, not the shell
+    } else {
+        struct fd_reader* r = get_fd_reader(fd);
+        while (r->pos < r->len || fill_fd_reader(r) > 0) {
+            char* start = r->buf + r->pos;
+            size_t avail = r->len - r->pos;
+            char* end = memchr(start, delim, avail);
+            size_t take = end ? (size_t)(end - start) : avail;
+
+            while (len + take + 1 > cap) {
+                cap *= 2;
+                line = realloc(line, cap);
+            }
+            memcpy(line + len, start, take);
+            len += take;
+            r->pos += take;
+            if (end) {
+                r->pos++;
+                found = 1;
+                break;
+            }
+        }
+    }
+    if (!line) {
+        fprintf(stderr, "Reallocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    line[len] = '\0';
+    *out = line;
+    *out_len = len;
+    return found;
+}
+
+// Function to split a record over the variables in names following IFS: one
+// field each, with the last variable taking the rest of the record. With an
+// array (read -a) every field is an element instead. Characters marked in
+// literal were backslash-escaped and never separate fields.
+void assign_read_fields(char** names, int count, struct array* array, const char* text, const bool* literal,
+                        size_t len) {
+    const char* ifs = get_variable_value("IFS");
+    size_t i = 0;
+
+    if (!ifs) {
+        ifs = " \t\n";
+    }
+#define READ_IFS(k) (!literal[k] && text[k] != '\0' && strchr(ifs, text[k]))
+#define READ_IFS_SPACE(k) (READ_IFS(k) && strchr(" \t\n", text[k]))
+    while (i < len && READ_IFS_SPACE(i)) {
+        i++;
+    }
+    for (int v = 0; array ? i < len : v < count; v++) {
+        size_t start = i;
+        if (!array && v == count - 1) {
+            size_t end = len;
+            while (end > i && READ_IFS_SPACE(end - 1)) {
+                end--;
+            }
+            set_variable_n(names[v], text + start, end - start);
+            break;
+        }
+        while (i < len && !READ_IFS(i)) {
+            i++;
+        }
+        if (array) {
+            array_set(array, v, text + start, i - start);
+        } else {
+            set_variable_n(names[v], text + start, i - start);
+        }
+        // One separator: IFS white space around at most one other IFS character
+        while (i < len && READ_IFS_SPACE(i)) {
+            i++;
+        }
+        if (i < len && READ_IFS(i)) {
+            i++;
+            while (i < len && READ_IFS_SPACE(i)) {
+                i++;
+            }
+        }
+    }
+#undef READ_IFS
+#undef READ_IFS_SPACE
+}
+
+// Function to implement read [-r] [-a array] [-d delim] [-p prompt] [-u fd] [name...]:
+// read one record and assign its fields, REPLY when no name is given.
+// Returns 0, or 1 at end of input, or 2 on a usage error.
+int read_builtin(char** args) {
+    bool raw = false;
+    int delim = '\n';
+    int fd = STDIN_FILENO;
+    const char* prompt = NULL;
+    const char* array_name = NULL;
+    char* reply[] = { "REPLY", NULL };
+    char** names;
+    char* line;
+    bool* literal;
+    size_t len, out = 0;
+    int found, count = 0, i = 1;
+
+    for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char* opt = args[i] + 1; *opt; opt++) {
+            if (*opt == 'r') {
+                raw = true;
+                continue;
+            }
+            if (strchr("adpu", *opt) == NULL) {
+                fprintf(stderr, "read: -%c: invalid option\n", *opt);
+                return 2;
+            }
+            // -a, -d, -p and -u take the rest of this word or the next argument
+            char* value = opt[1] ? opt + 1 : args[++i];
+            if (value == NULL) {
+                fprintf(stderr, "read: -%c: option requires an argument\n", *opt);
+                return 2;
+            }
+            if (*opt == 'a') {
+                array_name = value;
+            } else if (*opt == 'd') {
+                delim = (unsigned char)value[0];  // -d '' reads up to a NUL byte
+            } else if (*opt == 'p') {
+                prompt = value;
+            } else {
+                fd = atoi(value);
+            }
+            break;
+        }
+    }
+    names = args[i] ? args + i : reply;
+    if (array_name && !is_valid_name(array_name, strlen(array_name))) {
+        fprintf(stderr, "read: '%s': not a valid identifier\n", array_name);
+        return 2;
+    }
+    for (; !array_name && names[count]; count++) {
+        if (!is_valid_name(names[count], strlen(names[count]))) {
+            fprintf(stderr, "read: '%s': not a valid identifier\n", names[count]);
+            return 2;
+        }
+    }
+    if (prompt) {
+        fputs(prompt, stderr);
+    }
+    fflush(stdout);
+
+    fd = shell_fd(fd);
+    found = read_record(fd, delim, &line, &len);
+    // Without -r a trailing backslash continues the record on the next line
+    while (!raw && found) {
+        size_t slashes = 0;
+        while (slashes < len && line[len - 1 - slashes] == '\\') {
+            slashes++;
+        }
+        if (slashes % 2 == 0) {
+            break;
+        }
+        char* more;
+        size_t more_len;
+        found = read_record(fd, delim, &more, &more_len);
+        line = realloc(line, len + more_len);
+        if (!line) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(line + len - 1, more, more_len + 1);  // Over the backslash
+        len += more_len - 1;
+        free(more);
+    }
+
+    literal = calloc(len + 1, sizeof(bool));
+    if (!literal) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (raw) {
+        out = len;
+    } else {
+        for (size_t k = 0; k < len; k++) {  // Remove backslashes in place
+            if (line[k] == '\\') {
+                if (++k == len) {
+                    break;
+                }
+                literal[out] = true;
+            }
+            line[out++] = line[k];
+        }
+    }
+    struct array* array = NULL;
+    if (array_name) {
+        unset_variable(array_name);
+        int slot = store_variable(array_name);
+        array = make_array(&shell_vars[slot], false);
+    }
+    assign_read_fields(names, count, array, line, literal, out);
+    free(literal);
+    free(line);
+    return found ? 0 : 1;
+}
+
+// Function to end a forked copy of the shell: flush what built-ins printed,
+// but skip exit()'s stdio cleanup, which would rewind the shared stdin offset
+void exit_subshell(int status) {
+    if (tracing) {
+        trace_flush();
+    }
+    sync_fd_readers();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+int execute_builtin(char** args);
+
+// Function to append words, separated by spaces, to the job text in buf
+void append_words(char* buf, size_t size, char** words) {
+    size_t len = strlen(buf);
+    for (int i = 0; words[i] && len < size; i++) {
+        len += snprintf(buf + len, size - len, "%s%s", len > 0 ? " " : "", words[i]);
+    }
+}
+
+// Function for `timeout [-k grace] duration command [args...]`: run command
+// in a process group of its own, send the group SIGTERM once duration has
+// passed and SIGKILL after the grace period. Status 124 if it timed out.
+void timeout_builtin(char** args) {
+    long long limit, grace = TIMEOUT_GRACE;
+    struct deadline d = { 0, 0, -1, false };
+    int i = 1, status;
+
+    if (args[i] && strcmp(args[i], "-k") == 0) {
+        grace = args[i + 1] ? parse_duration(args[i + 1]) : -1;
+        i += 2;
+    }
+    limit = args[i] && grace >= 0 ? parse_duration(args[i]) : -1;
+    if (limit < 0 || args[i + 1] == NULL) {
+        fprintf(stderr, "Usage: timeout [-k grace] <duration> <command> [args...]\n");
+        last_status = 125;
+        return;
+    }
+    char** argv = args + i + 1;
+    char text[1024] = "";
+    append_words(text, sizeof(text), args);
+    struct placement place = inherited_placement();
+    char** placed = parse_placement(argv, &place);  // "timeout 5 nice make" places make itself
+    if (placed == NULL) {
+        last_status = 125;
+        return;
+    }
+    if (placed[0] != NULL) {
+        argv = placed;
+    }
+    char* leaf = cgroup_create(&place);
+
+    fflush(stdout);
+    sync_fd_readers();
+    pid_t pid = fork();
+    if (pid == 0) {
+        join_job_group(0, true);
+        cgroup_enter(leaf);
+        leave_event_loop();
+        apply_placement(&place);
+        in_subshell = true;
+        if (execute_builtin(argv)) {
+            exit_subshell(last_status);
+        }
+        execvp(argv[0], argv);
+        perror("Error executing command");
+        _exit(errno == ENOENT ? 127 : 126);
+    } else if (pid < 0) {
+        perror("Error forking");
+        cgroup_remove(leaf);
+        last_status = 125;
+        return;
+    }
+    struct job* j = new_job(text, false);
+    j->cgroup = leaf;
+    add_job_process(j, pid, true);
+    if (limit > 0) {  // "timeout 0" runs without a deadline
+        start_deadline(&d, pid, limit, grace);
+    }
+    status = wait_for_job(j);
+    stop_deadline(&d);  // Also when stopped: fg resumes it without the deadline
+    last_status = d.expired ? 124 : status;
+}
+
+#define COMMAND_TABLE_MIN 128 // Initial slots of the command table, a power of two
+
+// Built-ins: entered in the command table for dispatch, and offered by
+// command completion alongside the PATH index
+static const char* builtin_names[] = {
+    ":", "[", "affinity", "alias", "bg", "break", "cd", "cgroup", "continue", "declare", "disown", "echo",
+    "exit", "false", "fg", "help", "history", "jobs", "kill", "let", "local", "memo", "nice", "printenv",
+    "profile", "read", "return", "sched", "set", "shift", "snapshot", "tail", "test", "timeout", "true",
+    "typeset", "ulimit", "unalias", "unset", "watch-run", NULL
+};
+
+// What a command name stands for. Built-ins, functions and aliases share one
+// table, so a single lookup tells execute_builtin() and the parser about any
+// of them; names are never removed, only their meanings.
+struct command_entry {
+    char* name;             // NULL in an empty slot
+    bool builtin;
+    struct node* function;  // Body of `name() { ...; }`, or NULL
+    struct token* alias;    // Tokens the alias stands for, or NULL
+    int alias_count;
+    char* alias_text;       // The alias as defined, for listing it
+};
+
+// Open-addressing hash table of command names, one per session
+struct command_table {
+    struct command_entry* slots;
+    int cap;    // A power of two, at least twice count
+    int count;
+};
+
+struct command_table commands = { NULL, 0, 0 };
+
+// Function to hash a command name (FNV-1a)
+uint32_t command_hash(const char* name) {
+    return hash_bytes(name, strlen(name));
+}
+
+// Function to find the slot for name: its entry, or the empty slot where it belongs
+struct command_entry* command_slot(struct command_table* t, const char* name) {
+    uint32_t i = command_hash(name) & (t->cap - 1);
+    while (t->slots[i].name && strcmp(t->slots[i].name, name) != 0) {
+        i = (i + 1) & (t->cap - 1);
+    }
+    return &t->slots[i];
+}
+
+struct command_entry* command_insert(const char* name);
+
+// Function to give the table twice as many slots; the built-ins are entered
+// when it is first set up
+void command_table_grow(struct command_table* t) {
+    struct command_table old = *t;
+
+    t->cap = old.cap ? old.cap * 2 : COMMAND_TABLE_MIN;
+    t->slots = calloc(t->cap, sizeof(struct command_entry));
+    if (!t->slots) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < old.cap; i++) {
+        if (old.slots[i].name) {
+            *command_slot(t, old.slots[i].name) = old.slots[i];
+        }
+    }
+    free(old.slots);
+    if (old.cap == 0) {
+        for (int i = 0; builtin_names[i]; i++) {
+            command_insert(builtin_names[i])->builtin = true;
+        }
+    }
+}
+
+// Function to look up a command name; NULL if it is none of a built-in, a
+// function or an alias
+struct command_entry* command_lookup(const char* name) {
+    if (commands.cap == 0) {
+        command_table_grow(&commands);
+    }
+    struct command_entry* e = command_slot(&commands, name);
+    return e->name ? e : NULL;
+}
+
+// Function to find or add the entry for name
+struct command_entry* command_insert(const char* name) {
+    struct command_entry* e = command_lookup(name);
+    if (e) {
+        return e;
+    }
+    if (2 * (commands.count + 1) > commands.cap) {
+        command_table_grow(&commands);
+    }
+    e = command_slot(&commands, name);
+    e->name = strdup(name);
+    commands.count++;
+    return e;
+}
+
+void snapshot_builtin(char** args);
+void memo_builtin(char** args);
+void watch_run_builtin(char** args);
+int call_function(struct node* body, char** args);
+void alias_builtin(char** args);
+void unalias_builtin(char** args);
+void declare_builtin(char** args);
+void unset_element(const char* arg);
+void print_variable(struct var* v);
+void free_node(struct node* n);
+
+// Function to handle built-in commands, including shell variables (Version 06)
+// and record the command's exit status in last_status
+int execute_builtin(char** args) {
+    struct command_entry* e = command_lookup(args[0]);
+    int previous_status = last_status;  // For a bare `return`
+
+    last_status = 0;
+    if (e && e->function) {  // Functions come before built-ins of the same name
+        last_status = call_function(e->function, args);
+        return 1;
+    } else if (!e || !e->builtin) {
+        // Check if the command is a variable name
+        char* value = get_variable_value(args[0]);
+        if (value) {
+            printf("%s\n", value);
+            return 1;
+        }
+        return 0;  // Not a built-in command
+    } else if (strcmp(args[0], "cd") == 0) {
+        if (args[1] == NULL) {
+            fprintf(stderr, "Expected argument for \"cd\"\n");
+            last_status = 1;
+        } else if (chdir(args[1]) != 0) {
+            perror("cd failed");
+            last_status = 1;
+        }
+        return 1;
+    } else if (strcmp(args[0], "exit") == 0) {
+        int code = args[1] ? atoi(args[1]) : last_status;
+        if (in_subshell) {
+            exit_subshell(code);
+        }
+        if (embedded) {
+            last_status = code;
+            interrupted = true;  // Unwinds the rest of the line like Ctrl+C
+            return 1;
+        }
+        sync_fd_readers();  // Leave shared descriptors where a reader expects them
+        exit(code);
+    } else if (strcmp(args[0], "jobs") == 0) {
+        jobs_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "tail") == 0 && tail_builtin(args)) {
+        return 1;
+    } else if (strcmp(args[0], "fg") == 0 || strcmp(args[0], "bg") == 0 ||
+               strcmp(args[0], "disown") == 0) {
+        job_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "kill") == 0) {
+        kill_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "help") == 0) {
+        printf("Built-in Commands:\n");
+        printf("cd <directory> - Change directory\n");
+        printf("exit [n] - Exit the shell with status n (default: $?)\n");
+        printf("jobs [-l] - List jobs, -l with their process groups\n");
+        printf("jobs -o [%%n] - Print (and empty) a job's spooled output\n");
+        printf("tail [-n lines] %%n - Last lines of a job's spooled output\n");
+        printf("fg [%%n], bg [%%n] - Continue a job in the foreground or background\n");
+        printf("disown [%%n] - Drop a job from the job table\n");
+        printf("kill [-signal] <pid>|%%n - Signal a process or a whole job (default: KILL)\n");
+        printf("history - Display command history\n");
+        printf("profile [start [hz] | stop | report [file]] - Sample the shell's own stacks, report them folded\n");
+        printf("snapshot [save [file]] - Show the startup snapshot, or save variables, functions, aliases and history ($PSH_SNAPSHOT)\n");
+        printf("timeout [-k grace] <duration> <command> - Run command with a deadline (status 124 when hit)\n");
+        printf("memo [-i file] [-m file] [-e name] <command> - Replay command's stored output while its inputs are unchanged\n");
+        printf("memo [-c] - Show the memo store and its hits and misses, or empty it\n");
+        printf("watch-run [-d seconds] <path>... -- <command> - Run command again whenever the paths change\n");
+        printf("affinity <cpus> [command] - Run command on CPUs such as 0-3,8 (alone: session default, 'all' resets)\n");
+        printf("nice [-n adjust] [command] - Run command at a lower priority (alone: session default)\n");
+        printf("sched <policy>[,io=<class>] [command] - other|batch|idle|fifo:N|rr:N, io=none|rt:N|be:N|idle\n");
+        printf("ulimit [-S|-H] [-a|-cdflnstuv [value]] [command] - Resource limits for command (alone: session default)\n");
+        printf("cgroup memory=<size>,cpu=<n%%> [command] - Limits for the job's cgroup (needs set -o cgroup)\n");
+        printf("set <name>=<value> - Set a shell variable\n");
+        printf("set -o|+o noclobber - Refuse/allow '>' overwriting existing files\n");
+        printf("set -o|+o suggest - Show/hide inline suggestions from history\n");
+        printf("set -o timeout=<duration>, set +o timeout - Deadline for every foreground command\n");
+        printf("set -o cgroup=<dir>, set +o cgroup - Put each job in a cgroup v2 leaf under dir\n");
+        printf("set -o spool[=<size>], set +o spool - Capture '&' jobs' output (default 64K per job)\n");
+        printf("set -o|+o spill - Move old spooled output to memory files instead of dropping it\n");
+        printf("set -o trace=<file>, set +o trace - Record each command's phases as Chrome trace JSON\n");
+        printf("set -o memo=<size>, set +o memo - Size of the memo store (default 64M); off runs memo's commands every time\n");
+        printf("unset <name> - Remove a shell variable\n");
+        printf("unset <name>[<index>|<key>] - Remove an array element\n");
+        printf("unset -f <name> - Remove a function\n");
+        printf("printenv - List shell variables\n");
+        printf("name=(<word>...), name[<index>]=<value>, name+=<value> - Set an array or append to a variable\n");
+        printf("declare [-a|-A] [<name>[=<value>]]... - Make indexed (-a) or associative (-A) arrays, or list variables\n");
+        printf("name() { <list>; } - Define a function; it sees its arguments as $1, $2, ..., $# and $@\n");
+        printf("local [-a|-A] <name>[=<value>]... - Variables of the current function call\n");
+        printf("return [n] - Leave the current function with status n (default: $?)\n");
+        printf("shift [n] - Drop the first n positional parameters\n");
+        printf("alias [<name>[=<value>]]... - Define or show aliases\n");
+        printf("unalias [-a] <name>... - Remove aliases\n");
+        printf("echo [-n] <args> - Print arguments\n");
+        printf("test <expr>, [ <expr> ] - Evaluate a condition\n");
+        printf("let <expr>... - Evaluate arithmetic; also $(( <expr> ))\n");
+        printf("read [-r] [-a array] [-d delim] [-p prompt] [-u fd] [name...] - Read a line into variables\n");
+        printf("true, false, : - Succeed or fail without doing anything\n");
+        printf("break [n], continue [n] - Leave or restart enclosing loops\n");
+        printf("help - List built-in commands\n");
+        return 1;
+    } else if (strcmp(args[0], "profile") == 0) {
+        profile_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "snapshot") == 0) {
+        snapshot_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "history") == 0) {
+        display_history();
+        return 1;
+    } else if (strcmp(args[0], "timeout") == 0) {
+        timeout_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "memo") == 0) {
+        memo_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "watch-run") == 0) {
+        watch_run_builtin(args);
+        return 1;
+    } else if (is_placement_prefix(args[0])) {
+        struct placement p = session_placement;
+        char** command = parse_placement(args, &p);
+        if (command == NULL) {
+            last_status = 1;
+            return 1;
+        }
+        if (command[0] != NULL) {
+            return 0;  // A prefix: execute_command() forks and places the command
+        }
+        placement_builtin(args, &p);
+        return 1;
+    } else if (strcmp(args[0], "true") == 0 || strcmp(args[0], ":") == 0) {
+        return 1;
+    } else if (strcmp(args[0], "false") == 0) {
+        last_status = 1;
+        return 1;
+    } else if (strcmp(args[0], "echo") == 0) {  // Common in loops, so never forks
+        int i = 1;
+        bool newline = true;
+        if (args[1] && strcmp(args[1], "-n") == 0) {
+            newline = false;
+            i++;
+        }
+        for (; args[i] != NULL; i++) {
+            fputs(args[i], stdout);
+            if (args[i + 1] != NULL) {
+                fputc(' ', stdout);
+            }
+        }
+        if (newline) {
+            fputc('\n', stdout);
+        }
+        return 1;
+    } else if (strcmp(args[0], "let") == 0) {  // let expr...: status 0 if the last value is non-zero
+        long long value = 0;
+        if (args[1] == NULL) {
+            fprintf(stderr, "Usage: let <expression>...\n");
+            last_status = 2;
+            return 1;
+        }
+        for (int i = 1; args[i] != NULL; i++) {
+            struct arith_node* expr = arith_compile(args[i]);
+            bool error = false;
+            if (!expr) {
+                fprintf(stderr, "let: %s: arithmetic syntax error\n", args[i]);
+                last_status = 2;
+                return 1;
+            }
+            value = arith_eval(expr, &error);
+            arith_free(expr);
+            if (error) {
+                last_status = 2;
+                return 1;
+            }
+        }
+        last_status = (value != 0) ? 0 : 1;
+        return 1;
+    } else if (strcmp(args[0], "read") == 0) {
+        last_status = read_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "test") == 0 || strcmp(args[0], "[") == 0) {
+        int argc = 0;
+        while (args[argc] != NULL) {
+            argc++;
+        }
+        if (args[0][0] == '[') {
+            if (strcmp(args[argc - 1], "]") != 0) {
+                fprintf(stderr, "[: missing ']'\n");
+                last_status = 2;
+                return 1;
+            }
+            argc--;
+        }
+        last_status = evaluate_test(args + 1, argc - 1);
+        return 1;
+    } else if (strcmp(args[0], "break") == 0 || strcmp(args[0], "continue") == 0) {
+        int levels = args[1] ? atoi(args[1]) : 1;
+        if (loop_depth == 0) {
+            fprintf(stderr, "%s: only meaningful in a loop\n", args[0]);
+            last_status = 1;
+            return 1;
+        }
+        if (levels < 1) {
+            levels = 1;
+        }
+        if (levels > loop_depth) {
+            levels = loop_depth;
+        }
+        if (args[0][0] == 'b') {
+            break_levels = levels;
+        } else {
+            continue_levels = levels;
+        }
+        return 1;
+    } else if (strcmp(args[0], "set") == 0) {  // Set a shell variable
+        char *var_str = args[1];
+        if (var_str && (strcmp(var_str, "-o") == 0 || strcmp(var_str, "+o") == 0)) {
+            bool enable = var_str[0] == '-';
+            if (args[2] == NULL) {
+                printf("noclobber\t%s\n", noclobber ? "on" : "off");
+                printf("suggest\t\t%s\n", suggest ? "on" : "off");
+                if (default_deadline > 0) {
+                    printf("timeout\t\t%gs\n", default_deadline / 1000.0);
+                } else {
+                    printf("timeout\t\toff\n");
+                }
+                printf("cgroup\t\t%s\n", cgroup_root ? cgroup_root : "off");
+                if (spool_size > 0) {
+                    printf("spool\t\t%zu\n", spool_size);
+                } else {
+                    printf("spool\t\toff\n");
+                }
+                printf("spill\t\t%s\n", spool_spill ? "on" : "off");
+                printf("trace\t\t%s\n", tracing ? trace_path : "off");
+                if (memo_limit > 0) {
+                    printf("memo\t\t%lld\n", memo_limit);
+                } else {
+                    printf("memo\t\toff\n");
+                }
+            } else if (strncmp(args[2], "timeout", 7) == 0 && (args[2][7] == '=' || !enable)) {
+                long long ms = enable ? parse_duration(args[2] + 8) : 0;
+                if (ms < 0 || (!enable && args[2][7] != '\0')) {
+                    fprintf(stderr, "set: invalid timeout '%s'\n", args[2]);
+                    last_status = 1;
+                } else {
+                    default_deadline = ms;
+                }
+            } else if (strncmp(args[2], "cgroup", 6) == 0 && (args[2][6] == '=' || !enable)) {
+                if (!enable || cgroup_setup(args[2] + 7)) {
+                    free(cgroup_root);
+                    cgroup_root = enable ? strdup(args[2] + 7) : NULL;
+                    size_t len = cgroup_root ? strlen(cgroup_root) : 0;
+                    while (len > 1 && cgroup_root[len - 1] == '/') {
+                        cgroup_root[--len] = '\0';
+                    }
+                } else {
+                    last_status = 1;
+                }
+            } else if (strncmp(args[2], "spool", 5) == 0 && (args[2][5] == '\0' || (args[2][5] == '=' && enable))) {
+                long long size = args[2][5] == '=' ? parse_size(args[2] + 6) : 65536;
+                if (size <= 0) {
+                    fprintf(stderr, "set: invalid spool size '%s'\n", args[2] + 6);
+                    last_status = 1;
+                } else {
+                    spool_size = enable ? (size_t)size : 0;
+                }
+            } else if (strncmp(args[2], "trace", 5) == 0 && (enable ? args[2][5] == '=' && args[2][6] : !args[2][5])) {
+                if (!trace_to(enable ? args[2] + 6 : NULL)) {
+                    last_status = 1;
+                }
+            } else if (strncmp(args[2], "memo", 4) == 0 && (enable ? args[2][4] == '=' : !args[2][4])) {
+                long long size = enable ? parse_size(args[2] + 5) : 0;
+                if (size <= 0 && enable) {
+                    fprintf(stderr, "set: invalid memo size '%s'\n", args[2] + 5);
+                    last_status = 1;
+                } else {
+                    memo_limit = size;
+                    memo_store_bytes = -1;  // Trimmed to the new limit at the next store
+                }
+            } else if (strcmp(args[2], "spill") == 0) {
+                spool_spill = enable;
+            } else if (strcmp(args[2], "noclobber") == 0) {
+                noclobber = enable;
+            } else if (strcmp(args[2], "suggest") == 0) {
+                suggest = enable;
+            } else {
+                fprintf(stderr, "set: unknown option '%s'\n", args[2]);
+                last_status = 1;
+            }
+            return 1;
+        }
+        if (!var_str) {
+            fprintf(stderr, "Usage: set <name>=<value>\n");
+            last_status = 1;
+            return 1;
+        }
+        char *eq_pos = strchr(var_str, '=');
+        if (!eq_pos) {
+            fprintf(stderr, "Usage: set <name>=<value>\n");
+            last_status = 1;
+            return 1;
+        }
+        char* name = strndup(var_str, eq_pos - var_str);  // args may be an array's own text
+        set_variable(name, eq_pos + 1);
+        free(name);
+        return 1;
+    } else if (strcmp(args[0], "unset") == 0) {  // Unset a shell variable
+        if (args[1] && strcmp(args[1], "-f") == 0 && args[2]) {
+            struct command_entry* f = command_lookup(args[2]);
+            if (f && f->function) {
+                free_node(f->function);
+                f->function = NULL;
+            } else {
+                fprintf(stderr, "Function '%s' not found.\n", args[2]);
+                last_status = 1;
+            }
+            return 1;
+        }
+        if (!args[1]) {
+            fprintf(stderr, "Usage: unset <name>\n");
+            last_status = 1;
+            return 1;
+        }
+        if (strchr(args[1], '[')) {
+            unset_element(args[1]);
+        } else if (unset_variable(args[1]) != 0) {
+            fprintf(stderr, "Variable '%s' not found.\n", args[1]);
+            last_status = 1;
+        }
+        return 1;
+    } else if (strcmp(args[0], "printenv") == 0) {  // Print all shell variables
+        for (int i = 0; i < var_count; i++) {
+            print_variable(&shell_vars[i]);
+        }
+        return 1;
+    } else if (strcmp(args[0], "return") == 0) {
+        if (function_depth == 0) {
+            fprintf(stderr, "return: only meaningful in a function\n");
+            last_status = 1;
+            return 1;
+        }
+        return_status = args[1] ? atoi(args[1]) & 255 : previous_status;
+        return_pending = true;
+        last_status = return_status;
+        return 1;
+    } else if (strcmp(args[0], "shift") == 0) {
+        int n = args[1] ? atoi(args[1]) : 1;
+        if (n < 0 || n > positional_count) {
+            last_status = 1;
+            return 1;
+        }
+        positional += n;
+        positional_count -= n;
+        return 1;
+    } else if (strcmp(args[0], "local") == 0 || strcmp(args[0], "declare") == 0 ||
+               strcmp(args[0], "typeset") == 0) {
+        declare_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "alias") == 0) {
+        alias_builtin(args);
+        return 1;
+    } else if (strcmp(args[0], "unalias") == 0) {
+        unalias_builtin(args);
+        return 1;
+    }
+    return 0;  // e.g. tail without a job: the command of that name runs
+}
+
+// Function to read user input from the shell prompt; NULL at end of input
+char* read_input() {
+    char *buffer = NULL;
+    size_t bufsize = 0;
+    if (getline(&buffer, &bufsize, stdin) == -1) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+// Function to recognise a redirection operator at the start of a token, e.g.
+// "<", "2>>", ">&1", "3<>" or "&>file". Fills in r->fd and r->type and returns
+// the length of the operator, or 0 if the token is an ordinary word.
+int parse_redirect_op(const char* token, struct redirect* r) {
+    const char* p = token;
+    int fd = -1;
+
+    if (p[0] == '&' && p[1] == '>') {
+        r->fd = STDOUT_FILENO;
+        r->type = (p[2] == '>') ? REDIR_APPEND_ERR : REDIR_OUT_ERR;
+        return (p[2] == '>') ? 3 : 2;
+    }
+    if (isdigit((unsigned char)*p)) {
+        fd = 0;
+        while (isdigit((unsigned char)*p)) {
+            fd = fd * 10 + (*p - '0');
+            p++;
+        }
+    }
+    if (*p == '<') {
+        r->fd = (fd >= 0) ? fd : STDIN_FILENO;
+        if (p[1] == '>') {
+            r->type = REDIR_RDWR;
+            p += 2;
+        } else if (p[1] == '&') {
+            r->type = REDIR_DUP;
+            p += 2;
+        } else {
+            r->type = REDIR_IN;
+            p += 1;
+        }
+    } else if (*p == '>') {
+        r->fd = (fd >= 0) ? fd : STDOUT_FILENO;
+        if (p[1] == '>') {
+            r->type = REDIR_APPEND;
+            p += 2;
+        } else if (p[1] == '|') {
+            r->type = REDIR_CLOBBER;
+            p += 2;
+        } else if (p[1] == '&') {
+            r->type = REDIR_DUP;
+            p += 2;
+        } else {
+            r->type = REDIR_OUT;
+            p += 1;
+        }
+    } else {
+        return 0;  // Digits not followed by '<' or '>' are a plain word
+    }
+    return (int)(p - token);
+}
+
+// Function to add a token to a growable token array
+void add_token(struct token** tokens, int* count, int* cap, struct token tok) {
+    if (*count >= *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *tokens = realloc(*tokens, *cap * sizeof(struct token));
+        if (!*tokens) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*tokens)[(*count)++] = tok;
+}
+
+// Function to find the ')' matching the '(' at p, or NULL if it is missing
+const char* find_closing_paren(const char* p) {
+    int depth = 0;
+    for (; *p; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Function to find the '}' that closes the '{' at p, skipping nested ${...}
+const char* find_closing_brace(const char* p) {
+    int depth = 0;
+    for (; *p; p++) {
+        if (*p == '{') {
+            depth++;
+        } else if (*p == '}' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Function to find the end of a word starting at p. Quotes, backslashes,
+// ${...} and $((...)) are skipped over as a unit. Sets *status to PARSE_INCOMPLETE if the
+// input ends before a quote or brace is closed.
+const char* scan_word(const char* p, int* status) {
+    while (*p && !strchr(" \t\r\a\n;&|<>()", *p)) {
+        if (*p == '\\') {
+            if (p[1] == '\0' || (p[1] == '\n' && p[2] == '\0')) {
+                *status = PARSE_INCOMPLETE;  // Line continuation
+                return p + strlen(p);
+            }
+            p += 2;
+        } else if (*p == '\'') {
+            const char* close = strchr(p + 1, '\'');
+            if (!close) {
+                *status = PARSE_INCOMPLETE;
+                return p + strlen(p);
+            }
+            p = close + 1;
+        } else if (*p == '"') {
+            p++;
+            while (*p && *p != '"') {
+                if (*p == '\\' && p[1]) {
+                    p++;
+                }
+                p++;
+            }
+            if (!*p) {
+                *status = PARSE_INCOMPLETE;
+                return p;
+            }
+            p++;
+        } else if (*p == '$' && p[1] == '{') {
+            const char* close = find_closing_brace(p + 1);
+            if (!close) {
+                *status = PARSE_INCOMPLETE;
+                return p + strlen(p);
+            }
+            p = close + 1;
+        } else if (*p == '$' && p[1] == '(') {
+            const char* close = find_closing_paren(p + 1);
+            if (!close) {
+                *status = PARSE_INCOMPLETE;
+                return p + strlen(p);
+            }
+            p = close + 1;
+        } else {
+            p++;
+        }
+    }
+    return p;
+}
+
+// Function to split input into tokens. Words keep their quotes, which are
+// resolved later by compile_word(). Returns PARSE_OK, or PARSE_INCOMPLETE if
+// a quote is still open at the end of the input.
+int tokenize_input(const char* input, struct token** tokens_out, int* count_out) {
+    struct token* tokens = NULL;
+    int count = 0, cap = 0;
+    int status = PARSE_OK;
+    const char* p = input;
+
+    for (;;) {
+        struct token tok = { 0 };
+        int len;
+
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\a' ||
+               (*p == '\\' && p[1] == '\n' && p[2] != '\0')) {
+            p += (*p == '\\') ? 2 : 1;
+        }
+        if (*p == '#') {  // Comment runs to the end of the line
+            while (*p && *p != '\n') {
+                p++;
+            }
+        }
+        if (*p == '\0') {
+            tok.type = TOK_EOF;
+            add_token(&tokens, &count, &cap, tok);
+            break;
+        }
+
+        if (*p == '\n') {
+            tok.type = TOK_NEWLINE;
+            len = 1;
+        } else if (p[0] == '&' && p[1] == '&') {
+            tok.type = TOK_AND_IF;
+            len = 2;
+        } else if (p[0] == '|' && p[1] == '|') {
+            tok.type = TOK_OR_IF;
+            len = 2;
+        } else if (p[0] == ';' && p[1] == ';') {
+            tok.type = TOK_DSEMI;
+            len = 2;
+        } else if (*p == ';') {
+            tok.type = TOK_SEMI;
+            len = 1;
+        } else if (*p == '(') {
+            tok.type = TOK_LPAREN;
+            len = 1;
+        } else if (*p == ')') {
+            tok.type = TOK_RPAREN;
+            len = 1;
+        } else if (*p == '|') {
+            tok.type = TOK_PIPE;
+            len = 1;
+        } else if ((len = parse_redirect_op(p, &tok.redir)) > 0) {
+            tok.type = TOK_REDIR;
+        } else if (*p == '&') {
+            tok.type = TOK_AMP;
+            len = 1;
+        } else {
+            tok.type = TOK_WORD;
+            len = (int)(scan_word(p, &status) - p);
+        }
+        tok.text = strndup(p, len);
+        add_token(&tokens, &count, &cap, tok);
+        p += len;
+    }
+    *tokens_out = tokens;
+    *count_out = count;
+    return status;
+}
+
+// Function to release a token array
+void free_tokens(struct token* tokens, int count) {
+    for (int i = 0; i < count; i++) {
+        free(tokens[i].text);
+    }
+    free(tokens);
+}
+
+// Function to append a piece of text to a word being compiled, merging it
+// with the previous part when both are literals with the same quoting
+void add_word_part(struct word* w, enum part_type type, const char* text, size_t len, bool quoted) {
+    if (type == PART_LITERAL && w->part_count > 0) {
+        struct word_part* last = &w->parts[w->part_count - 1];
+        if (last->type == PART_LITERAL && last->quoted == quoted) {
+            size_t old = strlen(last->text);
+            last->text = realloc(last->text, old + len + 1);
+            memcpy(last->text + old, text, len);
+            last->text[old + len] = '\0';
+            return;
+        }
+    }
+    w->parts = realloc(w->parts, (w->part_count + 1) * sizeof(struct word_part));
+    if (!w->parts) {
+        fprintf(stderr, "Reallocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    w->parts[w->part_count].type = type;
+    w->parts[w->part_count].text = strndup(text, len);
+    w->parts[w->part_count].quoted = quoted;
+    w->parts[w->part_count].arith = NULL;
+    w->parts[w->part_count].prefix = 0;
+    w->parts[w->part_count].all = 0;
+    w->parts[w->part_count].subscript = NULL;
+    w->part_count++;
+}
+
+void compile_word(const char* raw, struct word* w);
+
+// Function to split the text of a ${...} part into its pieces: ${#name} is a
+// length, ${a[i]} one element of an array, ${a[@]} all of them and ${!a[@]}
+// their keys. Special parameters such as ${#} and ${!} are left alone.
+void compile_param(struct word_part* part) {
+    char* text = part->text;
+    char prefix = 0;
+
+    if ((text[0] == '#' || text[0] == '!') && text[1]) {
+        prefix = *text++;
+    }
+    char* open = strchr(text, '[');
+    size_t len = strlen(text);
+    bool all = open && (strcmp(open, "[@]") == 0 || strcmp(open, "[*]") == 0);
+
+    if (prefix == '!' && !all) {
+        return;  // Indirection is not supported
+    }
+    if (open && text[len - 1] == ']' && is_valid_name(text, open - text)) {
+        if (all) {
+            part->all = open[1];
+        } else {
+            char* sub = strndup(open + 1, text + len - 1 - (open + 1));
+            part->subscript = malloc(sizeof(struct word));
+            if (!part->subscript) {
+                fprintf(stderr, "Allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            compile_word(sub, part->subscript);
+            part->arith = arith_compile(sub);  // NULL for a key that is not an expression
+            free(sub);
+        }
+        len = open - text;
+    } else if (open) {
+        return;
+    }
+    part->prefix = prefix;
+    char* name = strndup(text, len);
+    free(part->text);
+    part->text = name;
+}
+
+// Function to compile the raw text of a word into literal and parameter parts.
+// Quotes and backslashes are resolved here, once, so running the command again
+// (as loops will) only has to substitute parameters.
+void compile_word(const char* raw, struct word* w) {
+    const char* p = raw;
+    bool dquote = false;
+
+    w->parts = NULL;
+    w->part_count = 0;
+    w->literal = NULL;
+    w->may_glob = false;
+    w->glob = NULL;
+
+    if (p[0] == '~' && (p[1] == '/' || p[1] == '\0')) {  // Tilde expansion
+        add_word_part(w, PART_PARAM, "HOME", 4, true);
+        p++;
+    }
+    while (*p) {
+        if (!dquote && *p == '\'') {
+            const char* close = strchr(p + 1, '\'');
+            add_word_part(w, PART_LITERAL, p + 1, close - p - 1, true);
+            p = close + 1;
+        } else if (*p == '"') {
+            if (!dquote && p[1] == '"') {
+                add_word_part(w, PART_LITERAL, "", 0, true);  // "" is still a word
+            }
+            dquote = !dquote;
+            p++;
+        } else if (*p == '\\' && p[1] != '\0') {
+            if (p[1] == '\n') {
+                p += 2;  // Line continuation
+            } else if (!dquote || strchr("$`\"\\", p[1])) {
+                add_word_part(w, PART_LITERAL, p + 1, 1, true);
+                p += 2;
+            } else {
+                add_word_part(w, PART_LITERAL, p, 1, true);
+                p++;
+            }
+        } else if (*p == '$' && p[1] == '(' && p[2] == '(' && find_closing_paren(p + 1) &&
+                   find_closing_paren(p + 1)[-1] == ')') {
+            // $(( expr )): compiled here so every evaluation skips parsing
+            const char* close = find_closing_paren(p + 1);
+            add_word_part(w, PART_ARITH, p + 3, close - 1 - (p + 3), dquote);
+            w->parts[w->part_count - 1].arith = arith_compile(w->parts[w->part_count - 1].text);
+            p = close + 1;
+        } else if (*p == '$' && p[1] == '{') {
+            const char* close = find_closing_brace(p + 1);
+            add_word_part(w, PART_PARAM, p + 2, close - p - 2, dquote);
+            compile_param(&w->parts[w->part_count - 1]);
+            p = close + 1;
+        } else if (*p == '$' && (isalpha((unsigned char)p[1]) || p[1] == '_')) {
+            const char* start = ++p;
+            while (isalnum((unsigned char)*p) || *p == '_') {
+                p++;
+            }
+            add_word_part(w, PART_PARAM, start, p - start, dquote);
+        } else if (*p == '$' && p[1] && strchr("?$!#@*-0123456789", p[1])) {
+            add_word_part(w, PART_PARAM, p + 1, 1, dquote);
+            p += 2;
+        } else {
+            add_word_part(w, PART_LITERAL, p, 1, dquote);
+            p++;
+        }
+    }
+
+    for (int i = 0; i < w->part_count; i++) {
+        if (!w->parts[i].quoted &&
+            (w->parts[i].type == PART_PARAM || strpbrk(w->parts[i].text, "*?[") != NULL)) {
+            w->may_glob = true;
+        }
+    }
+
+    // Words made only of literals skip expansion entirely
+    size_t len = 0;
+    for (int i = 0; i < w->part_count; i++) {
+        if (w->parts[i].type != PART_LITERAL) {
+            return;
+        }
+        len += strlen(w->parts[i].text);
+    }
+    w->literal = malloc(len + 1);
+    w->literal[0] = '\0';
+    for (int i = 0; i < w->part_count; i++) {
+        strcat(w->literal, w->parts[i].text);
+    }
+}
+
+void glob_free(struct glob_pattern* gp);
+
+// Function to release a compiled word
+void free_word(struct word* w) {
+    for (int i = 0; i < w->part_count; i++) {
+        free(w->parts[i].text);
+        arith_free(w->parts[i].arith);
+        if (w->parts[i].subscript) {
+            free_word(w->parts[i].subscript);
+            free(w->parts[i].subscript);
+        }
+    }
+    free(w->parts);
+    free(w->literal);
+    glob_free(w->glob);
+}
+
+// Function to release what an assignment word was compiled into
+void free_assignment(struct assignment* as) {
+    free(as->name);
+    free_word(&as->value);
+    if (as->subscript) {
+        free_word(as->subscript);
+        free(as->subscript);
+    }
+    arith_free(as->index);
+    for (int i = 0; i < as->item_count; i++) {
+        if (as->items[i].keyed) {
+            free_word(&as->items[i].key);
+        }
+        free_word(&as->items[i].value);
+    }
+    free(as->items);
+}
+
+// Function to release a command's words, redirections and expansion
+void free_command(struct command* cmd) {
+    for (int i = 0; i < cmd->assign_count; i++) {
+        free_assignment(&cmd->assigns[i]);
+    }
+    free(cmd->assigns);
+    cmd->assigns = NULL;
+    cmd->assign_count = 0;
+    for (int i = 0; i < cmd->list_count; i++) {
+        free_assignment(&cmd->lists[i]);
+    }
+    free(cmd->lists);
+    cmd->lists = NULL;
+    cmd->list_count = 0;
+    for (int i = 0; i < cmd->word_count; i++) {
+        free_word(&cmd->words[i]);
+    }
+    free(cmd->words);
+    for (int i = 0; i < cmd->redir_count; i++) {
+        free_word(&cmd->redirs[i].target_word);
+    }
+    free(cmd->redirs);
+    cmd->words = NULL;
+    cmd->word_count = 0;
+    cmd->redirs = NULL;
+    cmd->redir_count = 0;
+}
+
+// Function to allocate an empty syntax tree node
+struct node* new_node(enum node_type type) {
+    struct node* n = calloc(1, sizeof(struct node));
+    if (!n) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    n->type = type;
+    return n;
+}
+
+// Function to append a child to a pipeline or sequence node
+void add_child(struct node* parent, struct node* child) {
+    parent->children = realloc(parent->children, (parent->child_count + 1) * sizeof(struct node*));
+    if (!parent->children) {
+        fprintf(stderr, "Reallocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    parent->children[parent->child_count++] = child;
+}
+
+// Function to release a syntax tree, or drop one reference to it while
+// another owner such as the function table still holds it
+void free_node(struct node* n) {
+    if (!n) {
+        return;
+    }
+    if (n->refs > 0) {
+        n->refs--;
+        return;
+    }
+    free_command(&n->cmd);
+    for (int i = 0; i < n->child_count; i++) {
+        free_node(n->children[i]);
+    }
+    free(n->children);
+    free_node(n->left);
+    free_node(n->right);
+    free_node(n->alt);
+    free(n->var);
+    free(n->text);
+    for (int i = 0; i < n->item_count; i++) {
+        for (int j = 0; j < n->items[i].pattern_count; j++) {
+            free_word(&n->items[i].patterns[j]);
+        }
+        free(n->items[i].patterns);
+        free_node(n->items[i].body);
+    }
+    free(n->items);
+    free(n);
+}
+
+// Function to report a syntax error at the parser's current token. Running
+// out of input is not an error: more lines may still complete the command.
+void syntax_error(struct parser* ps) {
+    struct token* tok = &ps->tokens[ps->pos];
+    if (ps->status != PARSE_OK) {
+        return;
+    }
+    if (tok->type == TOK_EOF) {
+        ps->status = PARSE_INCOMPLETE;
+        return;
+    }
+    fprintf(stderr, "Syntax error near unexpected token '%s'\n",
+            tok->type == TOK_NEWLINE ? "newline" : tok->text);
+    ps->status = PARSE_ERROR;
+}
+
+// Function to skip newline tokens, e.g. after && or |
+void skip_newlines(struct parser* ps) {
+    while (ps->tokens[ps->pos].type == TOK_NEWLINE) {
+        ps->pos++;
+    }
+}
+
+// Function to check whether the current token is the given reserved word.
+// Reserved words are only recognised unquoted, where a command could start.
+bool at_keyword(struct parser* ps, const char* keyword) {
+    struct token* tok = &ps->tokens[ps->pos];
+    return tok->type == TOK_WORD && strcmp(tok->text, keyword) == 0;
+}
+
+// Function to consume a required reserved word, reporting a syntax error if absent
+bool expect_keyword(struct parser* ps, const char* keyword) {
+    if (!at_keyword(ps, keyword)) {
+        syntax_error(ps);
+        return false;
+    }
+    ps->pos++;
+    return true;
+}
+
+// Function to check for a valid variable name of length len
+bool is_valid_name(const char* name, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+        return false;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function to parse one redirection (operator plus target word) into cmd
+bool parse_redirect(struct parser* ps, struct command* cmd) {
+    struct token* tok = &ps->tokens[ps->pos];
+    struct redirect r = tok->redir;
+    struct token* target = &ps->tokens[ps->pos + 1];
+
+    if (target->type != TOK_WORD) {
+        ps->pos++;
+        if (target->type == TOK_EOF) {
+            fprintf(stderr, "Syntax error: missing target for '%s'\n", tok->text);
+            ps->status = PARSE_ERROR;
+        } else {
+            syntax_error(ps);
+        }
+        return false;
+    }
+    compile_word(target->text, &r.target_word);
+    // ">&file" is shorthand for "&>file"
+    if (r.type == REDIR_DUP && tok->text[0] == '>' && r.target_word.literal &&
+        !isdigit((unsigned char)r.target_word.literal[0]) &&
+        strcmp(r.target_word.literal, "-") != 0) {
+        r.type = REDIR_OUT_ERR;
+    }
+    cmd->redirs = realloc(cmd->redirs, (cmd->redir_count + 1) * sizeof(struct redirect));
+    if (!cmd->redirs) {
+        fprintf(stderr, "Reallocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    cmd->redirs[cmd->redir_count++] = r;
+    ps->pos += 2;
+    return true;
+}
+
+// Function to recognise an assignment word: name=value, name+=value,
+// name[i]=value or name[i]+=value. Returns a pointer to its '=', or NULL.
+const char* assignment_eq(const char* text) {
+    size_t len = strcspn(text, "[+=");
+    const char* p = text + len;
+
+    if (!is_valid_name(text, len)) {
+        return NULL;
+    }
+    if (*p == '[') {
+        int depth = 0;
+        for (; *p && (*p != ']' || --depth > 0); p++) {
+            depth += *p == '[';
+        }
+        if (!*p) {
+            return NULL;
+        }
+        p++;
+    }
+    if (*p == '+') {
+        p++;
+    }
+    return *p == '=' ? p : NULL;
+}
+
+// Function to parse the ( word [key]=word ... ) of an array assignment
+bool parse_array_items(struct parser* ps, struct assignment* as) {
+    as->list = true;
+    ps->pos++;  // (
+    for (;;) {
+        struct token* tok = &ps->tokens[ps->pos];
+        if (tok->type == TOK_NEWLINE) {
+            ps->pos++;
+            continue;
+        }
+        if (tok->type == TOK_RPAREN) {
+            ps->pos++;
+            return true;
+        }
+        if (tok->type != TOK_WORD) {
+            syntax_error(ps);
+            return false;
+        }
+        as->items = realloc(as->items, (as->item_count + 1) * sizeof(struct array_item));
+        if (!as->items) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        struct array_item* item = &as->items[as->item_count++];
+        const char* close = tok->text[0] == '[' ? strstr(tok->text, "]=") : NULL;
+        item->keyed = close != NULL;
+        if (close) {
+            char* key = strndup(tok->text + 1, close - tok->text - 1);
+            compile_word(key, &item->key);
+            compile_word(close + 2, &item->value);
+            free(key);
+        } else {
+            compile_word(tok->text, &item->value);
+        }
+        ps->pos++;
+    }
+}
+
+// Function to parse the assignment word at the cursor, whose '=' is at eq,
+// and the ( ... ) after it for an array, onto a list of assignments
+bool parse_assignment(struct parser* ps, struct assignment** list, int* count, const char* eq) {
+    const char* text = ps->tokens[ps->pos].text;
+    size_t len = strcspn(text, "[+=");
+
+    *list = realloc(*list, (*count + 1) * sizeof(struct assignment));
+    if (!*list) {
+        fprintf(stderr, "Reallocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    struct assignment* as = &(*list)[(*count)++];
+    memset(as, 0, sizeof(*as));
+    as->name = strndup(text, len);
+    as->append = eq[-1] == '+';
+    if (text[len] == '[') {
+        const char* close = eq - as->append - 1;
+        char* sub = strndup(text + len + 1, close - (text + len + 1));
+        as->subscript = malloc(sizeof(struct word));
+        if (!as->subscript) {
+            fprintf(stderr, "Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        compile_word(sub, as->subscript);
+        as->index = arith_compile(sub);
+        free(sub);
+    }
+    compile_word(eq + 1, &as->value);
+    ps->pos++;
+    if (eq[1] == '\0' && !as->subscript && ps->tokens[ps->pos].type == TOK_LPAREN) {
+        return parse_array_items(ps, as);
+    }
+    return true;
+}
+
+// Function to add len bytes of a raw word to a command's words
+void add_command_word(struct command* cmd, const char* text, size_t len) {
+    char* raw = strndup(text, len);
+
+    cmd->words = realloc(cmd->words, (cmd->word_count + 1) * sizeof(struct word));
+    if (!cmd->words) {
+        fprintf(stderr, "Reallocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    compile_word(raw, &cmd->words[cmd->word_count++]);
+    free(raw);
+}
+
+// Function to parse a simple command: assignments, words and redirections
+struct node* parse_simple_command(struct parser* ps) {
+    struct node* n = new_node(NODE_COMMAND);
+    struct command* cmd = &n->cmd;
+
+    for (;;) {
+        struct token* tok = &ps->tokens[ps->pos];
+        if (tok->type == TOK_WORD) {
+            const char* eq = assignment_eq(tok->text);
+            bool declaration = eq && eq[1] == '\0' && ps->tokens[ps->pos + 1].type == TOK_LPAREN &&
+                               cmd->word_count > 0 && cmd->words[0].literal &&
+                               (strcmp(cmd->words[0].literal, "declare") == 0 ||
+                                strcmp(cmd->words[0].literal, "typeset") == 0 ||
+                                strcmp(cmd->words[0].literal, "local") == 0);
+            if (eq && (cmd->word_count == 0 || declaration)) {
+                // Leading name=value words are assignments, not arguments. In
+                // "local -a name=(...)" the built-in gets the name alone.
+                if (declaration) {
+                    add_command_word(cmd, tok->text, strcspn(tok->text, "[+="));
+                }
+                if (!parse_assignment(ps, declaration ? &cmd->lists : &cmd->assigns,
+                                      declaration ? &cmd->list_count : &cmd->assign_count, eq)) {
+                    free_node(n);
+                    return NULL;
+                }
+                continue;
+            }
+            add_command_word(cmd, tok->text, strlen(tok->text));
+            ps->pos++;
+        } else if (tok->type == TOK_REDIR) {
+            if (!parse_redirect(ps, cmd)) {
+                free_node(n);
+                return NULL;
+            }
+        } else {
+            break;
+        }
+    }
+    if (cmd->word_count == 0 && cmd->redir_count == 0 && cmd->assign_count == 0) {
+        syntax_error(ps);
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+struct node* parse_list(struct parser* ps);
+
+// Function to parse the body of a compound command up to the closing keyword
+struct node* parse_body(struct parser* ps, const char* closing) {
+    struct node* body = parse_list(ps);
+    if (body && !expect_keyword(ps, closing)) {
+        free_node(body);
+        return NULL;
+    }
+    return body;
+}
+
+// Function to parse "if list; then list; [elif list; then list;]... [else list;] fi"
+struct node* parse_if(struct parser* ps) {
+    struct node* n = new_node(NODE_IF);
+
+    ps->pos++;  // "if" or "elif"
+    if (!(n->left = parse_body(ps, "then")) || !(n->right = parse_list(ps))) {
+        free_node(n);
+        return NULL;
+    }
+    if (at_keyword(ps, "elif")) {
+        n->alt = parse_if(ps);  // Consumes the shared "fi"
+        if (!n->alt) {
+            free_node(n);
+            return NULL;
+        }
+        return n;
+    }
+    if (at_keyword(ps, "else")) {
+        ps->pos++;
+        if (!(n->alt = parse_list(ps))) {
+            free_node(n);
+            return NULL;
+        }
+    }
+    if (!expect_keyword(ps, "fi")) {
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+// Function to parse "while|until list; do list; done"
+struct node* parse_while(struct parser* ps) {
+    struct node* n = new_node(at_keyword(ps, "while") ? NODE_WHILE : NODE_UNTIL);
+
+    ps->pos++;
+    if (!(n->left = parse_body(ps, "do")) || !(n->right = parse_body(ps, "done"))) {
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+// Function to parse "for name [in word...]; do list; done"
+struct node* parse_for(struct parser* ps) {
+    struct node* n = new_node(NODE_FOR);
+    struct token* tok;
+
+    ps->pos++;
+    tok = &ps->tokens[ps->pos];
+    if (tok->type != TOK_WORD || !is_valid_name(tok->text, strlen(tok->text))) {
+        syntax_error(ps);
+        free_node(n);
+        return NULL;
+    }
+    n->var = strdup(tok->text);
+    ps->pos++;
+    skip_newlines(ps);
+    if (at_keyword(ps, "in")) {
+        ps->pos++;
+        while (ps->tokens[ps->pos].type == TOK_WORD) {
+            struct command* cmd = &n->cmd;
+            cmd->words = realloc(cmd->words, (cmd->word_count + 1) * sizeof(struct word));
+            if (!cmd->words) {
+                fprintf(stderr, "Reallocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            compile_word(ps->tokens[ps->pos].text, &cmd->words[cmd->word_count++]);
+            ps->pos++;
+        }
+    } else {
+        struct word all;  // No "in": loop over the positional parameters
+        compile_word("\"$@\"", &all);
+        n->cmd.words = malloc(sizeof(struct word));
+        n->cmd.words[0] = all;
+        n->cmd.word_count = 1;
+    }
+    if (ps->tokens[ps->pos].type == TOK_SEMI) {
+        ps->pos++;
+    }
+    skip_newlines(ps);
+    if (!expect_keyword(ps, "do") || !(n->right = parse_body(ps, "done"))) {
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+// Function to parse "case word in [(]pattern[|pattern]...) list ;; ... esac"
+struct node* parse_case(struct parser* ps) {
+    struct node* n = new_node(NODE_CASE);
+    struct token* tok;
+
+    ps->pos++;
+    tok = &ps->tokens[ps->pos];
+    if (tok->type != TOK_WORD) {
+        syntax_error(ps);
+        free_node(n);
+        return NULL;
+    }
+    n->cmd.words = malloc(sizeof(struct word));
+    compile_word(tok->text, &n->cmd.words[0]);
+    n->cmd.word_count = 1;
+    ps->pos++;
+    skip_newlines(ps);
+    if (!expect_keyword(ps, "in")) {
+        free_node(n);
+        return NULL;
+    }
+    skip_newlines(ps);
+
+    while (!at_keyword(ps, "esac")) {
+        struct case_item item = { 0 };
+
+        if (ps->tokens[ps->pos].type == TOK_LPAREN) {
+            ps->pos++;
+        }
+        for (;;) {
+            tok = &ps->tokens[ps->pos];
+            if (tok->type != TOK_WORD) {
+                syntax_error(ps);
+                break;
+            }
+            item.patterns = realloc(item.patterns, (item.pattern_count + 1) * sizeof(struct word));
+            compile_word(tok->text, &item.patterns[item.pattern_count++]);
+            ps->pos++;
+            if (ps->tokens[ps->pos].type != TOK_PIPE) {
+                break;
+            }
+            ps->pos++;
+        }
+        if (ps->status == PARSE_OK && ps->tokens[ps->pos].type != TOK_RPAREN) {
+            syntax_error(ps);
+        }
+        if (ps->status == PARSE_OK) {
+            ps->pos++;
+            item.body = parse_list(ps);
+        }
+        n->items = realloc(n->items, (n->item_count + 1) * sizeof(struct case_item));
+        n->items[n->item_count++] = item;
+        if (!item.body) {
+            free_node(n);
+            return NULL;
+        }
+        if (ps->tokens[ps->pos].type == TOK_DSEMI) {
+            ps->pos++;
+            skip_newlines(ps);
+        } else if (!at_keyword(ps, "esac")) {
+            syntax_error(ps);
+            free_node(n);
+            return NULL;
+        }
+    }
+    ps->pos++;  // "esac"
+    return n;
+}
+
+// Function to replace an alias at the current token, where a command starts,
+// by the tokens it stands for; repeated while the first of those is an alias
+// too. An alias is not expanded again inside its own expansion.
+void expand_alias(struct parser* ps) {
+    static const char* reserved[] = { "if", "while", "until", "for", "case", "{", "!", NULL };
+
+    for (;;) {
+        struct token* tok = &ps->tokens[ps->pos];
+        struct command_entry* e;
+
+        if (tok->type != TOK_WORD) {
+            return;
+        }
+        for (int i = 0; reserved[i]; i++) {
+            if (strcmp(tok->text, reserved[i]) == 0) {
+                return;
+            }
+        }
+        e = command_lookup(tok->text);
+        if (!e || !e->alias) {
+            return;
+        }
+        for (int x = tok->expansion; x > 0; x = ps->expansions[x - 1].parent) {
+            if (ps->expansions[x - 1].alias == e) {
+                return;
+            }
+        }
+        ps->expansions = realloc(ps->expansions, (ps->expansion_count + 1) * sizeof(struct alias_expansion));
+        struct token* grown = realloc(ps->tokens, (ps->count + e->alias_count) * sizeof(struct token));
+        if (!ps->expansions || !grown) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        ps->expansions[ps->expansion_count].alias = e;
+        ps->expansions[ps->expansion_count].parent = grown[ps->pos].expansion;
+        ps->expansion_count++;
+        ps->tokens = grown;
+        free(ps->tokens[ps->pos].text);
+        memmove(&ps->tokens[ps->pos + e->alias_count], &ps->tokens[ps->pos + 1],
+                (ps->count - ps->pos - 1) * sizeof(struct token));
+        for (int i = 0; i < e->alias_count; i++) {
+            struct token* t = &ps->tokens[ps->pos + i];
+            *t = e->alias[i];
+            t->text = strdup(e->alias[i].text);
+            t->expansion = ps->expansion_count;
+        }
+        ps->count += e->alias_count - 1;
+        if (e->alias_count == 0) {  // An empty alias: the command is what follows it
+            return;
+        }
+    }
+}
+
+struct node* parse_command(struct parser* ps);
+
+// Function to check for "name ( )", the start of a function definition
+bool at_function_definition(struct parser* ps) {
+    struct token* tok = &ps->tokens[ps->pos];
+    return tok->type == TOK_WORD && !strpbrk(tok->text, "\"'\\$`=*?[") &&
+           tok[1].type == TOK_LPAREN && tok[2].type == TOK_RPAREN;
+}
+
+// Function to join tokens from..to-1 into text that parses back into them
+char* join_tokens(struct token* tokens, int from, int to) {
+    size_t len = 1;
+    for (int i = from; i < to; i++) {
+        len += strlen(tokens[i].text) + 1;
+    }
+    char* text = malloc(len);
+    if (!text) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    char* p = text;
+    for (int i = from; i < to; i++) {
+        if (i > from && tokens[i].type != TOK_NEWLINE && tokens[i - 1].type != TOK_NEWLINE) {
+            *p++ = ' ';
+        }
+        p = stpcpy(p, tokens[i].text);
+    }
+    *p = '\0';
+    return text;
+}
+
+// Function to parse "name() compound-command", the body being kept for
+// execute_node() to enter into the function table. The body also keeps the
+// definition as text, comments dropped and aliases already expanded, which
+// is how a snapshot saves it.
+struct node* parse_function(struct parser* ps) {
+    struct node* n = new_node(NODE_FUNCTION);
+    int start = ps->pos;
+
+    n->var = strdup(ps->tokens[ps->pos].text);
+    ps->pos += 3;
+    skip_newlines(ps);
+    if (ps->tokens[ps->pos].type != TOK_LPAREN && !at_keyword(ps, "{") && !at_keyword(ps, "if") &&
+        !at_keyword(ps, "while") && !at_keyword(ps, "until") && !at_keyword(ps, "for") &&
+        !at_keyword(ps, "case")) {
+        syntax_error(ps);  // The body must be a compound command
+        free_node(n);
+        return NULL;
+    }
+    n->left = parse_command(ps);
+    if (!n->left) {
+        free_node(n);
+        return NULL;
+    }
+    n->left->text = join_tokens(ps->tokens, start, ps->pos);
+    return n;
+}
+
+// Function to parse a command: a compound command followed by optional
+// redirections, or a simple command
+struct node* parse_command(struct parser* ps) {
+    struct node* n;
+
+    expand_alias(ps);
+    if (at_function_definition(ps)) {
+        return parse_function(ps);
+    } else if (at_keyword(ps, "if")) {
+        n = parse_if(ps);
+    } else if (at_keyword(ps, "while") || at_keyword(ps, "until")) {
+        n = parse_while(ps);
+    } else if (at_keyword(ps, "for")) {
+        n = parse_for(ps);
+    } else if (at_keyword(ps, "case")) {
+        n = parse_case(ps);
+    } else if (at_keyword(ps, "{")) {
+        n = new_node(NODE_GROUP);
+        ps->pos++;
+        if (!(n->left = parse_body(ps, "}"))) {
+            free_node(n);
+            return NULL;
+        }
+    } else if (ps->tokens[ps->pos].type == TOK_LPAREN) {
+        n = new_node(NODE_SUBSHELL);
+        ps->pos++;
+        n->left = parse_list(ps);
+        if (n->left && ps->tokens[ps->pos].type != TOK_RPAREN) {
+            syntax_error(ps);
+            free_node(n);
+            return NULL;
+        }
+        ps->pos++;
+    } else {
+        return parse_simple_command(ps);
+    }
+    while (n && ps->tokens[ps->pos].type == TOK_REDIR) {
+        if (!parse_redirect(ps, &n->cmd)) {
+            free_node(n);
+            return NULL;
+        }
+    }
+    return n;
+}
+
+// Function to parse a pipeline: [!] command [| command]...
+struct node* parse_pipeline(struct parser* ps) {
+    struct node* n;
+
+    if (at_keyword(ps, "!")) {
+        ps->pos++;
+        n = parse_pipeline(ps);
+        if (!n) {
+            return NULL;
+        }
+        struct node* not = new_node(NODE_NOT);
+        not->left = n;
+        return not;
+    }
+
+    n = parse_command(ps);
+    if (!n || ps->tokens[ps->pos].type != TOK_PIPE) {
+        return n;
+    }
+    struct node* pipeline = new_node(NODE_PIPELINE);
+    add_child(pipeline, n);
+    while (ps->tokens[ps->pos].type == TOK_PIPE) {
+        ps->pos++;
+        skip_newlines(ps);
+        n = parse_command(ps);
+        if (!n) {
+            free_node(pipeline);
+            return NULL;
+        }
+        add_child(pipeline, n);
+    }
+    return pipeline;
+}
+
+// Function to parse an AND-OR list: pipeline [&& | || pipeline]...
+struct node* parse_and_or(struct parser* ps) {
+    struct node* left = parse_pipeline(ps);
+
+    while (left && (ps->tokens[ps->pos].type == TOK_AND_IF || ps->tokens[ps->pos].type == TOK_OR_IF)) {
+        struct node* n = new_node(ps->tokens[ps->pos].type == TOK_AND_IF ? NODE_AND : NODE_OR);
+        ps->pos++;
+        skip_newlines(ps);
+        n->left = left;
+        n->right = parse_pipeline(ps);
+        if (!n->right) {
+            free_node(n);
+            return NULL;
+        }
+        left = n;
+    }
+    return left;
+}
+
+// Function to check for a token that ends a list: end of input, ')' or ';;',
+// or a reserved word closing a compound command
+bool at_list_end(struct parser* ps) {
+    static const char* closers[] = { "then", "elif", "else", "fi", "do", "done", "esac", "}", NULL };
+    enum token_type type = ps->tokens[ps->pos].type;
+
+    if (type == TOK_EOF || type == TOK_RPAREN || type == TOK_DSEMI) {
+        return true;
+    }
+    for (int i = 0; closers[i] != NULL; i++) {
+        if (at_keyword(ps, closers[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to parse a list of AND-OR lists separated by ';', '&' or newlines
+struct node* parse_list(struct parser* ps) {
+    struct node* seq = new_node(NODE_SEQUENCE);
+
+    skip_newlines(ps);
+    while (!at_list_end(ps)) {
+        struct node* n = parse_and_or(ps);
+        if (!n) {
+            free_node(seq);
+            return NULL;
+        }
+        enum token_type sep = ps->tokens[ps->pos].type;
+        if (sep == TOK_AMP) {
+            struct node* bg = new_node(NODE_BACKGROUND);
+            bg->left = n;
+            n = bg;
+        }
+        add_child(seq, n);
+        if (sep == TOK_SEMI || sep == TOK_AMP || sep == TOK_NEWLINE) {
+            ps->pos++;
+            skip_newlines(ps);
+        } else if (!at_list_end(ps)) {
+            syntax_error(ps);
+            free_node(seq);
+            return NULL;
+        }
+    }
+    return seq;
+}
+
+// Function to add an expanded field to a list
+void add_field(struct field_list* fields, char* field) {
+    if (fields->count + 1 >= fields->cap) {
+        fields->cap = fields->cap ? fields->cap * 2 : 16;
+        fields->items = realloc(fields->items, fields->cap * sizeof(char*));
+        if (!fields->items) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fields->items[fields->count++] = field;
+    fields->items[fields->count] = NULL;
+}
+
+#define GLOB_DENTS_SIZE (1 << 20)   // getdents64() buffer: about 30k entries per call
+#define DIR_CACHE_SIZE 8            // Directory listings kept between globs
+#define DIR_CACHE_TTL 30            // Seconds an unused listing is kept
+#define DIR_CACHE_RACY_NS 20000000  // Directories changed this recently are not cached
+
+// Element of a compiled glob component
+enum glob_op {
+    GLOB_CHAR,   // One literal character
+    GLOB_ANY,    // ?
+    GLOB_STAR,   // *
+    GLOB_CLASS   // [...]
+};
+
+struct glob_elem {
+    enum glob_op op;
+    unsigned char c;        // GLOB_CHAR
+    unsigned char set[32];  // GLOB_CLASS: bit n is set when character n matches
+};
+
+// One '/'-separated component of a pattern
+struct glob_component {
+    char *name;               // Component without wildcards, escapes removed; else NULL
+    struct glob_elem *elems;  // Compiled wildcard component
+    int elem_count;
+    bool globstar;            // "**": any number of directories
+};
+
+// A pathname pattern compiled once and matched against many names
+struct glob_pattern {
+    bool absolute;   // Starts at /
+    bool dir_only;   // Ends with /: only directories match
+    struct glob_component *comps;
+    int comp_count;
+};
+
+// Name and d_type of one directory entry
+struct dir_entry {
+    char *name;
+    unsigned char type;
+};
+
+// Listing of a directory, reused while its inode and mtime are unchanged
+struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct dir_entry *entries;
+    int count;
+    char *names;       // Storage for every entry name
+    time_t last_used;
+    int users;         // Walks currently iterating over the listing
+    bool cached;       // Owned by dir_cache[]; otherwise freed when released
+};
+struct dir_listing* dir_cache[DIR_CACHE_SIZE];
+
+// Function to compile the bracket expression that starts at s[i] == '['.
+// Returns the index just past the closing ']', or 0 if it is not closed.
+size_t glob_compile_class(const char* s, size_t n, size_t i, struct glob_elem* e) {
+    static const struct { const char *name; int (*test)(int); } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank }, { "cntrl", iscntrl },
+        { "digit", isdigit }, { "graph", isgraph }, { "lower", islower }, { "print", isprint },
+        { "punct", ispunct }, { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+        { NULL, NULL }
+    };
+    size_t j = i + 1, first;
+    bool negate = false;
+
+    memset(e->set, 0, sizeof(e->set));
+    e->op = GLOB_CLASS;
+    if (j < n && (s[j] == '!' || s[j] == '^')) {
+        negate = true;
+        j++;
+    }
+    first = j;
+    while (j < n && (s[j] != ']' || j == first)) {
+        unsigned char lo, hi;
+        if (s[j] == '[' && j + 1 < n && s[j + 1] == ':') {
+            const char* end = strstr(s + j + 2, ":]");
+            int k = 0;
+            if (end && (size_t)(end - s) < n) {
+                for (; classes[k].name; k++) {
+                    if (strlen(classes[k].name) == (size_t)(end - s - j - 2) &&
+                        strncmp(classes[k].name, s + j + 2, end - s - j - 2) == 0) {
+                        break;
+                    }
+                }
+            }
+            if (end && classes[k].name) {
+                for (int c = 0; c < 256; c++) {
+                    if (classes[k].test(c)) {
+                        e->set[c / 8] |= 1 << (c % 8);
+                    }
+                }
+                j = end - s + 2;
+                continue;
+            }
+        }
+        if (s[j] == '\\' && j + 1 < n) {
+            j++;
+        }
+        lo = hi = s[j++];
+        if (j + 1 < n && s[j] == '-' && s[j + 1] != ']') {
+            j++;
+            if (s[j] == '\\' && j + 1 < n) {
+                j++;
+            }
+            hi = s[j++];
+        }
+        for (int c = lo; c <= hi; c++) {
+            e->set[c / 8] |= 1 << (c % 8);
+        }
+    }
+    if (j >= n) {
+        return 0;
+    }
+    if (negate) {
+        for (size_t k = 0; k < sizeof(e->set); k++) {
+            e->set[k] = ~e->set[k];
+        }
+    }
+    return j + 1;
+}
+
+// Function to compile one component of n bytes. Returns true if it contains
+// wildcards; otherwise c->name holds the plain name.
+bool glob_compile_component(const char* s, size_t n, struct glob_component* c) {
+    size_t i = 0;
+    bool wild = false;
+
+    c->name = NULL;
+    c->elems = malloc((n + 1) * sizeof(struct glob_elem));
+    c->elem_count = 0;
+    c->globstar = n == 2 && s[0] == '*' && s[1] == '*';
+    if (!c->elems) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    while (i < n) {
+        struct glob_elem* e = &c->elems[c->elem_count];
+        size_t next;
+        if (s[i] == '*') {
+            wild = true;
+            if (c->elem_count == 0 || e[-1].op != GLOB_STAR) {
+                e->op = GLOB_STAR;
+                c->elem_count++;
+            }
+            i++;
+            continue;
+        }
+        if (s[i] == '?') {
+            wild = true;
+            e->op = GLOB_ANY;
+            i++;
+        } else if (s[i] == '[' && (next = glob_compile_class(s, n, i, e)) != 0) {
+            wild = true;
+            i = next;
+        } else {
+            if (s[i] == '\\' && i + 1 < n) {
+                i++;
+            }
+            e->op = GLOB_CHAR;
+            e->c = s[i++];
+        }
+        c->elem_count++;
+    }
+    if (!wild) {
+        c->name = malloc(c->elem_count + 1);
+        if (!c->name) {
+            fprintf(stderr, "Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < c->elem_count; k++) {
+            c->name[k] = c->elems[k].c;
+        }
+        c->name[c->elem_count] = '\0';
+    }
+    return wild;
+}
+
+// Function to release a compiled pattern
+void glob_free(struct glob_pattern* gp) {
+    if (!gp) {
+        return;
+    }
+    for (int i = 0; i < gp->comp_count; i++) {
+        free(gp->comps[i].name);
+        free(gp->comps[i].elems);
+    }
+    free(gp->comps);
+    free(gp);
+}
+
+// Function to compile a pathname pattern in which quoted characters are
+// backslash-escaped. Returns NULL if nothing in it is a wildcard.
+struct glob_pattern* glob_compile(const char* pat) {
+    struct glob_pattern* gp = calloc(1, sizeof(struct glob_pattern));
+    const char* p = pat;
+    bool wild = false;
+
+    if (!gp) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    gp->absolute = *p == '/';
+    while (*p) {
+        const char* end = p;
+        while (*end && *end != '/') {
+            end += (*end == '\\' && end[1]) ? 2 : 1;
+        }
+        if (end > p) {
+            gp->comps = realloc(gp->comps, (gp->comp_count + 1) * sizeof(struct glob_component));
+            if (!gp->comps) {
+                fprintf(stderr, "Reallocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            if (glob_compile_component(p, end - p, &gp->comps[gp->comp_count++])) {
+                wild = true;
+            }
+        }
+        gp->dir_only = *end == '/';
+        p = *end ? end + 1 : end;
+    }
+    if (!wild) {
+        glob_free(gp);
+        return NULL;
+    }
+    return gp;
+}
+
+// Function to match a file name against a compiled wildcard component
+bool glob_match(const struct glob_component* c, const char* name) {
+    const struct glob_elem* e = c->elems;
+    const struct glob_elem* end = c->elems + c->elem_count;
+    const struct glob_elem* star = NULL;  // Element after the last '*' seen
+    const char* star_name = NULL;         // Where that '*' started matching
+
+    // A leading '.' must be matched explicitly
+    if (name[0] == '.' && !(c->elem_count > 0 && e->op == GLOB_CHAR && e->c == '.')) {
+        return false;
+    }
+    while (*name) {
+        unsigned char ch = *name;
+        if (e < end && e->op == GLOB_STAR) {
+            star = ++e;
+            star_name = name;
+            continue;
+        }
+        if (e < end && (e->op == GLOB_ANY || (e->op == GLOB_CHAR && e->c == ch) ||
+                        (e->op == GLOB_CLASS && (e->set[ch / 8] & (1 << (ch % 8)))))) {
+            e++;
+            name++;
+            continue;
+        }
+        if (!star) {
+            return false;
+        }
+        e = star;  // Let the last '*' absorb one more character
+        name = ++star_name;
+    }
+    while (e < end && e->op == GLOB_STAR) {
+        e++;
+    }
+    return e == end;
+}
+
+// Function to free a directory listing
+void free_dir_listing(struct dir_listing* l) {
+    free(l->entries);
+    free(l->names);
+    free(l);
+}
+
+// Function to read a whole directory with large getdents64() calls
+struct dir_listing* scan_directory(int fd) {
+    struct dir_listing* l = calloc(1, sizeof(struct dir_listing));
+    char* buf = malloc(GLOB_DENTS_SIZE);
+    size_t* offsets = NULL;
+    unsigned char* types = NULL;
+    size_t used = 0, cap = 0, names_cap = 0;
+    ssize_t n;
+
+    if (!l || !buf) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    while ((n = getdents64(fd, buf, GLOB_DENTS_SIZE)) > 0) {
+        for (ssize_t pos = 0; pos < n; ) {
+            struct dirent64* d = (struct dirent64*)(buf + pos);
+            size_t len = strlen(d->d_name);
+            pos += d->d_reclen;
+            if (d->d_name[0] == '.' && (len == 1 || (len == 2 && d->d_name[1] == '.'))) {
+                continue;
+            }
+            if ((size_t)l->count == cap) {
+                cap = cap ? cap * 2 : 256;
+                offsets = realloc(offsets, cap * sizeof(size_t));
+                types = realloc(types, cap);
+            }
+            while (used + len + 1 > names_cap) {
+                names_cap = names_cap ? names_cap * 2 : 4096;
+                l->names = realloc(l->names, names_cap);
+            }
+            if (!offsets || !types || !l->names) {
+                fprintf(stderr, "Reallocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(l->names + used, d->d_name, len + 1);
+            offsets[l->count] = used;
+            types[l->count++] = d->d_type;
+            used += len + 1;
+        }
+    }
+    free(buf);
+    // Names have stopped moving, so entries can point into them now
+    l->entries = malloc((l->count + 1) * sizeof(struct dir_entry));
+    if (!l->entries) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < l->count; i++) {
+        l->entries[i].name = l->names + offsets[i];
+        l->entries[i].type = types[i];
+    }
+    free(offsets);
+    free(types);
+    return l;
+}
+
+// Function to get the listing of directory path, from the cache when the
+// directory's inode and mtime still match. Release it with release_dir_listing().
+struct dir_listing* get_dir_listing(const char* path) {
+    struct dir_listing* l;
+    struct timespec now;
+    struct stat st;
+    int fd, slot = -1;
+
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        l = dir_cache[i];
+        if (l && l->dev == st.st_dev && l->ino == st.st_ino &&
+            l->mtime.tv_sec == st.st_mtim.tv_sec && l->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            l->last_used = now.tv_sec;
+            l->users++;
+            return l;
+        }
+        // Drop listings that went stale or unused, unless a walk still holds them
+        if (l && l->users == 0 && ((l->dev == st.st_dev && l->ino == st.st_ino) ||
+                                   now.tv_sec - l->last_used > DIR_CACHE_TTL)) {
+            free_dir_listing(l);
+            dir_cache[i] = NULL;
+        }
+    }
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    fstat(fd, &st);
+    l = scan_directory(fd);
+    close(fd);
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+    l->mtime = st.st_mtim;
+    l->last_used = now.tv_sec;
+    l->users = 1;
+
+    // A directory changed within the last clock tick may change again without
+    // its mtime moving, so only older listings are kept
+    long long age = (now.tv_sec - st.st_mtim.tv_sec) * 1000000000LL + (now.tv_nsec - st.st_mtim.tv_nsec);
+    if (age < DIR_CACHE_RACY_NS) {
+        return l;
+    }
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (!dir_cache[i]) {
+            slot = i;
+            break;
+        }
+        if (dir_cache[i]->users == 0 &&
+            (slot < 0 || dir_cache[i]->last_used < dir_cache[slot]->last_used)) {
+            slot = i;  // Least recently used
+        }
+    }
+    if (slot >= 0) {
+        if (dir_cache[slot]) {
+            free_dir_listing(dir_cache[slot]);
+        }
+        dir_cache[slot] = l;
+        l->cached = true;
+    }
+    return l;
+}
+
+// Function to hand back a listing from get_dir_listing()
+void release_dir_listing(struct dir_listing* l) {
+    l->users--;
+    if (!l->cached) {
+        free_dir_listing(l);
+    }
+}
+
+// Function to check whether the entry just appended to path is a directory,
+// using d_type and only falling back to stat() when it cannot tell
+bool glob_is_dir(const char* path, const struct dir_entry* e, bool follow) {
+    struct stat st;
+    if (e->type == DT_DIR) {
+        return true;
+    }
+    if (e->type != DT_UNKNOWN && !(follow && e->type == DT_LNK)) {
+        return false;
+    }
+    return (follow ? stat(path, &st) : lstat(path, &st)) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Function to add path as a match, with the pattern's trailing '/' if any
+void glob_add_match(struct glob_pattern* gp, const char* path, struct field_list* out) {
+    size_t len = strlen(path);
+    char* match = malloc(len + 2);
+    if (!match) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(match, path, len);
+    if (gp->dir_only) {
+        match[len++] = '/';
+    }
+    match[len] = '\0';
+    add_field(out, match);
+}
+
+// Function to match the components of gp from ci on below path, a directory
+// prefix of len bytes ending in '/' ("" for the current directory)
+void glob_walk(struct glob_pattern* gp, int ci, char* path, size_t len, struct field_list* out) {
+    struct glob_component* c = &gp->comps[ci];
+    bool last = ci == gp->comp_count - 1;
+    struct dir_listing* l;
+    struct stat st;
+
+    if (c->name) {  // Plain name: no need to list the directory
+        size_t n = strlen(c->name);
+        if (len + n + 2 > PATH_MAX) {
+            return;
+        }
+        memcpy(path + len, c->name, n + 1);
+        if (!last) {
+            path[len + n] = '/';
+            path[len + n + 1] = '\0';
+            glob_walk(gp, ci + 1, path, len + n + 1, out);
+        } else if (gp->dir_only ? stat(path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(path, &st) == 0) {
+            glob_add_match(gp, path, out);
+        }
+        path[len] = '\0';
+        return;
+    }
+
+    if (c->globstar && !last) {
+        glob_walk(gp, ci + 1, path, len, out);  // "**" matching no directory at all
+    }
+    l = get_dir_listing(len ? path : ".");
+    if (!l) {
+        return;
+    }
+    for (int i = 0; i < l->count; i++) {
+        struct dir_entry* e = &l->entries[i];
+        size_t n = strlen(e->name);
+
+        if (c->globstar ? e->name[0] == '.' : !glob_match(c, e->name)) {
+            continue;
+        }
+        if (len + n + 2 > PATH_MAX) {
+            continue;
+        }
+        memcpy(path + len, e->name, n + 1);
+        if (c->globstar) {
+            // Descend into real directories only, so symlink loops end
+            bool dir = glob_is_dir(path, e, false);
+            if (last && (!gp->dir_only || dir)) {
+                glob_add_match(gp, path, out);
+            }
+            if (dir) {
+                path[len + n] = '/';
+                path[len + n + 1] = '\0';
+                glob_walk(gp, ci, path, len + n + 1, out);
+            }
+        } else if (last) {
+            if (!gp->dir_only || glob_is_dir(path, e, true)) {
+                glob_add_match(gp, path, out);
+            }
+        } else if (glob_is_dir(path, e, true)) {
+            path[len + n] = '/';
+            path[len + n + 1] = '\0';
+            glob_walk(gp, ci + 1, path, len + n + 1, out);
+        }
+    }
+    path[len] = '\0';
+    release_dir_listing(l);
+}
+
+// Function to order matches by name
+int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Function to add the pathnames matching gp to fields in sorted order, or
+// text itself when nothing matches
+void glob_field(struct glob_pattern* gp, const char* text, struct field_list* fields) {
+    char path[PATH_MAX];
+    int start = fields->count;
+
+    strcpy(path, gp->absolute ? "/" : "");
+    glob_walk(gp, 0, path, strlen(path), fields);
+    if (fields->count == start) {
+        add_field(fields, strdup(text));
+    } else {
+        // Only the matches are sorted, not the (possibly much larger) listing
+        qsort(fields->items + start, fields->count - start, sizeof(char*), compare_strings);
+    }
+}
+
+#define MAX_PATH_DIRS 64  // PATH directories the command index can watch
+
+// Node of the prefix trie of executables in PATH. Children form a sibling
+// list sorted by character, so a walk visits names in order.
+struct trie_node {
+    char c;
+    struct trie_node *child, *next;
+    unsigned long long dirs;  // Bit i: path_dirs[i] holds an executable of this name
+};
+
+struct trie_node command_trie;     // Root of the command index
+char* indexed_path = NULL;         // PATH the index was built from; NULL until first use
+char* path_dirs[MAX_PATH_DIRS];    // Absolute PATH directories in search order
+int path_watches[MAX_PATH_DIRS];   // inotify watch descriptor of each directory
+int path_dir_count = 0;
+int path_inotify_fd = -1;
+bool path_index_exact = false;     // Every PATH entry is indexed, so lookups may skip execvp()'s search
+
+// Function to find the child of n for character c, adding it if create is set
+struct trie_node* trie_child(struct trie_node* n, char c, bool create) {
+    struct trie_node** link = &n->child;
+    while (*link && (unsigned char)(*link)->c < (unsigned char)c) {
+        link = &(*link)->next;
+    }
+    if (*link && (*link)->c == c) {
+        return *link;
+    }
+    if (!create) {
+        return NULL;
+    }
+    struct trie_node* child = calloc(1, sizeof(struct trie_node));
+    if (!child) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    child->c = c;
+    child->next = *link;
+    *link = child;
+    return child;
+}
+
+// Function to find the trie node for name (or a prefix of names)
+struct trie_node* trie_find(const char* name, bool create) {
+    struct trie_node* n = &command_trie;
+    for (; *name && n; name++) {
+        n = trie_child(n, *name, create);
+    }
+    return n;
+}
+
+// Function to free the children of a trie node
+void trie_free(struct trie_node* n) {
+    struct trie_node* child = n->child;
+    while (child) {
+        struct trie_node* next = child->next;
+        trie_free(child);
+        free(child);
+        child = next;
+    }
+    n->child = NULL;
+}
+
+// Function to forget every executable of one PATH directory
+void trie_clear_dir(struct trie_node* n, unsigned long long bit) {
+    for (struct trie_node* child = n->child; child; child = child->next) {
+        child->dirs &= ~bit;
+        trie_clear_dir(child, bit);
+    }
+}
+
+// Function to add every name below n to out; buf holds the depth-byte prefix
+void trie_collect(struct trie_node* n, char* buf, size_t depth, struct field_list* out) {
+    for (struct trie_node* child = n->child; child; child = child->next) {
+        if (depth + 2 > PATH_MAX) {
+            continue;
+        }
+        buf[depth] = child->c;
+        buf[depth + 1] = '\0';
+        if (child->dirs) {
+            add_field(out, strdup(buf));
+        }
+        trie_collect(child, buf, depth + 1, out);
+    }
+}
+
+// Function to check whether name in PATH directory i is an executable file
+bool path_entry_executable(int i, const char* name) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (snprintf(path, sizeof(path), "%s/%s", path_dirs[i], name) >= (int)sizeof(path)) {
+        return false;
+    }
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111);
+}
+
+bool snapshot_index_dir(int i);
+
+// Function to (re)build the command index from path, watching each directory
+// before it is scanned so no change can slip in between
+void build_command_index(const char* path) {
+    char* copy = strdup(path);
+    char* rest = copy;
+    char* dir;
+
+    trie_free(&command_trie);
+    for (int i = 0; i < path_dir_count; i++) {
+        free(path_dirs[i]);
+    }
+    path_dir_count = 0;
+    if (path_inotify_fd >= 0) {
+        close(path_inotify_fd);  // Drops every watch
+    }
+    free(indexed_path);
+    indexed_path = strdup(path);
+    path_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    path_index_exact = path_inotify_fd >= 0;
+
+    while ((dir = strsep(&rest, ":")) != NULL) {
+        bool seen = false;
+        if (dir[0] != '/') {  // "" or relative entries depend on the current directory
+            path_index_exact = false;
+            continue;
+        }
+        for (int i = 0; i < path_dir_count; i++) {
+            seen = seen || strcmp(path_dirs[i], dir) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+        if (path_dir_count == MAX_PATH_DIRS) {
+            path_index_exact = false;
+            break;
+        }
+        int i = path_dir_count++;
+        path_dirs[i] = strdup(dir);
+        path_watches[i] = path_inotify_fd < 0 ? -1 :
+            inotify_add_watch(path_inotify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                              IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (snapshot_index_dir(i)) {
+            continue;  // Unchanged since the snapshot was saved: its names are used as they are
+        }
+
+        int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        struct dir_listing* l = scan_directory(fd);
+        close(fd);
+        for (int k = 0; k < l->count; k++) {
+            if (l->entries[k].type != DT_DIR && path_entry_executable(i, l->entries[k].name)) {
+                trie_find(l->entries[k].name, true)->dirs |= 1ULL << i;
+            }
+        }
+        free_dir_listing(l);
+    }
+    free(copy);
+}
+
+// Function to bring the command index up to date: rebuilt when PATH changed,
+// otherwise patched with the inotify events queued since the last call
+void refresh_command_index() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char* path = getenv("PATH");
+    bool overflow = false;
+    ssize_t n;
+
+    if (!path) {
+        path = "/bin:/usr/bin";  // execvp()'s default
+    }
+    if (!indexed_path || strcmp(path, indexed_path) != 0) {
+        build_command_index(path);
+        return;
+    }
+    while (path_inotify_fd >= 0 && (n = read(path_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            int i = 0;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                continue;
+            }
+            while (i < path_dir_count && path_watches[i] != ev->wd) {
+                i++;
+            }
+            if (i == path_dir_count) {
+                continue;
+            }
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // A directory made again later would go unseen: stop trusting lookups
+                trie_clear_dir(&command_trie, 1ULL << i);
+                path_index_exact = false;
+            } else if (ev->len > 0 && !(ev->mask & IN_ISDIR)) {
+                bool exists = !(ev->mask & (IN_DELETE | IN_MOVED_FROM)) &&
+                              path_entry_executable(i, ev->name);
+                if (exists) {
+                    trie_find(ev->name, true)->dirs |= 1ULL << i;
+                } else {
+                    struct trie_node* node = trie_find(ev->name, false);
+                    if (node) {
+                        node->dirs &= ~(1ULL << i);
+                    }
+                }
+            }
+        }
+    }
+    if (overflow) {
+        build_command_index(path);
+    }
+}
+
+// Function to look a command up in the index, which is what completion uses
+// too. Returns the full path to exec (to be freed), or NULL to leave the
+// search to execvp().
+char* resolve_command(const char* name) {
+    struct trie_node* node;
+    char* path;
+    int i = 0;
+
+    if (!interactive || strchr(name, '/')) {
+        return NULL;
+    }
+    refresh_command_index();
+    node = trie_find(name, false);
+    if (!path_index_exact || !node || !node->dirs) {
+        return NULL;
+    }
+    while (!(node->dirs & (1ULL << i))) {
+        i++;  // The first PATH directory wins
+    }
+    path = malloc(strlen(path_dirs[i]) + strlen(name) + 2);
+    if (!path) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(path, "%s/%s", path_dirs[i], name);
+    return path;
+}
+
+#define SNAPSHOT_MAGIC "PSHSNAP"      // 8 bytes with its NUL
+#define SNAPSHOT_VERSION 1            // Raised whenever the layout of a section changes
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_VAR_GLOBAL 1         // struct snapshot_var flags
+#define SNAPSHOT_VAR_INT 2            // ival holds the value's integer
+
+// Sections of a snapshot file. A reader skips types it does not know, so a
+// new kind of state gets a section of its own without a version change.
+enum snapshot_section_type {
+    SNAPSHOT_STRINGS = 1,  // NUL-terminated strings the other sections point into
+    SNAPSHOT_VARS,         // struct snapshot_var
+    SNAPSHOT_HISTORY,      // String offsets, oldest entry first
+    SNAPSHOT_INDEX_DIRS,   // struct snapshot_dir
+    SNAPSHOT_INDEX_NAMES,  // String offsets: the executables of each directory
+    SNAPSHOT_FUNCTIONS,    // String offsets: each definition, "name() body"
+    SNAPSHOT_ALIASES,      // struct snapshot_alias
+    SNAPSHOT_SECTION_TYPES
+};
+
+// Start of a snapshot file, followed by the section table
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;           // SNAPSHOT_BYTE_ORDER as the writer stored it
+    uint64_t size;                 // Whole file, so a truncated one is refused
+    int64_t saved_sec, saved_nsec; // CLOCK_REALTIME_COARSE when it was written
+    uint32_t sections;             // Entries in the section table
+    uint32_t unused;
+};
+
+struct snapshot_section {
+    uint32_t type;
+    uint32_t count;   // Records (bytes for SNAPSHOT_STRINGS)
+    uint64_t offset;  // From the start of the file, 8-byte aligned
+    uint64_t length;
+};
+
+struct snapshot_var {
+    uint32_t name, value;  // String offsets
+    uint32_t flags;
+    uint32_t unused;
+    int64_t ival;
+};
+
+// A PATH directory of the command index and the range of its names
+struct snapshot_dir {
+    uint32_t path;  // String offset
+    uint32_t first, count;
+    uint32_t unused;
+    int64_t mtime_sec, mtime_nsec;
+};
+
+struct snapshot_alias {
+    uint32_t name, text;  // String offsets
+};
+
+// Size of one record of each section type
+static const size_t snapshot_record_size[SNAPSHOT_SECTION_TYPES] = {
+    0, 1, sizeof(struct snapshot_var), sizeof(uint32_t), sizeof(struct snapshot_dir), sizeof(uint32_t),
+    sizeof(uint32_t), sizeof(struct snapshot_alias)
+};
+
+// A section being written
+struct snapshot_buffer {
+    char* data;
+    size_t len, cap;
+};
+
+char* snapshot_path = NULL;                   // $PSH_SNAPSHOT: loaded at startup, saved on exit
+pid_t snapshot_pid = 0;                       // The shell that saves it (not its children)
+const struct snapshot_header* snapshot_head = NULL;
+const char* snapshot_strings = NULL;
+const struct snapshot_dir* snapshot_dirs = NULL;
+uint32_t snapshot_dir_count = 0;
+const uint32_t* snapshot_names = NULL;
+int snapshot_vars = 0, snapshot_history = 0;  // Taken from the snapshot at startup
+int snapshot_functions = 0, snapshot_aliases = 0;
+int snapshot_dirs_reused = 0, snapshot_dirs_scanned = 0;
+
+int parse_text(const char* input, struct node** tree);
+void define_function(const char* name, struct node* body);
+
+// Function to define a function from its text in a snapshot. Only a single
+// definition is taken, so the file cannot run commands.
+bool snapshot_function(const char* text) {
+    struct node* tree;
+    if (parse_text(text, &tree) != PARSE_OK) {
+        return false;
+    }
+    bool ok = tree->child_count == 1 && tree->children[0]->type == NODE_FUNCTION;
+    if (ok) {
+        define_function(tree->children[0]->var, tree->children[0]->left);
+    }
+    free_node(tree);
+    return ok;
+}
+
+// Function to map a snapshot and take its variables and history, which keep
+// pointing into the read-only mapping until they change. Functions are
+// parsed again from their text, before the aliases come back so that the
+// bodies (saved with their aliases expanded) are not expanded twice. The
+// command index is only looked at when it is built (see snapshot_index_dir()).
+bool snapshot_load(const char* path) {
+    const void* data[SNAPSHOT_SECTION_TYPES] = {NULL};
+    uint32_t count[SNAPSHOT_SECTION_TYPES] = {0};
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {  // A first run finds no snapshot yet
+            fprintf(stderr, "snapshot: %s: %s\n", path, strerror(errno));
+        }
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        fprintf(stderr, "snapshot: %s: not a snapshot, ignored\n", path);
+        return false;
+    }
+    const char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "snapshot: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    const struct snapshot_header* h = (const struct snapshot_header*)map;
+    const struct snapshot_section* table = (const struct snapshot_section*)(h + 1);
+    bool valid = memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) == 0 &&
+                 h->version == SNAPSHOT_VERSION && h->byte_order == SNAPSHOT_BYTE_ORDER &&
+                 h->size == (uint64_t)st.st_size &&
+                 h->sections <= (h->size - sizeof(*h)) / sizeof(struct snapshot_section);
+    for (uint32_t i = 0; valid && i < h->sections; i++) {
+        const struct snapshot_section* sec = &table[i];
+        valid = sec->offset % 8 == 0 && sec->offset <= h->size && sec->length <= h->size - sec->offset;
+        if (valid && sec->type > 0 && sec->type < SNAPSHOT_SECTION_TYPES) {
+            valid = (uint64_t)sec->count * snapshot_record_size[sec->type] <= sec->length;
+            data[sec->type] = map + sec->offset;
+            count[sec->type] = sec->count;
+        }
+    }
+    // Every string must lie in the string section, which ends with a NUL
+    const char* strings = data[SNAPSHOT_STRINGS];
+    uint32_t strings_len = count[SNAPSHOT_STRINGS];
+    const struct snapshot_var* vars = data[SNAPSHOT_VARS];
+    const uint32_t* hist = data[SNAPSHOT_HISTORY];
+    const struct snapshot_dir* dirs = data[SNAPSHOT_INDEX_DIRS];
+    const uint32_t* names = data[SNAPSHOT_INDEX_NAMES];
+    const uint32_t* functions = data[SNAPSHOT_FUNCTIONS];
+    const struct snapshot_alias* aliases = data[SNAPSHOT_ALIASES];
+    valid = valid && strings_len > 0 && strings[strings_len - 1] == '\0';
+    for (uint32_t i = 0; valid && i < count[SNAPSHOT_VARS]; i++) {
+        valid = vars[i].name < strings_len && vars[i].value < strings_len;
+    }
+    for (uint32_t i = 0; valid && i < count[SNAPSHOT_HISTORY]; i++) {
+        valid = hist[i] < strings_len;
+    }
+    for (uint32_t i = 0; valid && i < count[SNAPSHOT_INDEX_DIRS]; i++) {
+        valid = dirs[i].path < strings_len && dirs[i].first <= count[SNAPSHOT_INDEX_NAMES] &&
+                dirs[i].count <= count[SNAPSHOT_INDEX_NAMES] - dirs[i].first;
+    }
+    for (uint32_t i = 0; valid && i < count[SNAPSHOT_INDEX_NAMES]; i++) {
+        valid = names[i] < strings_len;
+    }
+    for (uint32_t i = 0; valid && i < count[SNAPSHOT_FUNCTIONS]; i++) {
+        valid = functions[i] < strings_len;
+    }
+    for (uint32_t i = 0; valid && i < count[SNAPSHOT_ALIASES]; i++) {
+        valid = aliases[i].name < strings_len && aliases[i].text < strings_len;
+    }
+    if (!valid) {
+        fprintf(stderr, "snapshot: %s: not a version %d snapshot, ignored\n", path, SNAPSHOT_VERSION);
+        munmap((void*)map, st.st_size);
+        return false;
+    }
+
+    snapshot_map = map;
+    snapshot_size = st.st_size;
+    snapshot_head = h;
+    snapshot_strings = strings;
+    for (uint32_t i = 0; i < count[SNAPSHOT_VARS]; i++) {
+        struct var* v = new_variable();
+        var_count++;
+        v->name = (char*)strings + vars[i].name;
+        v->value = (char*)strings + vars[i].value;
+        v->global = vars[i].flags & SNAPSHOT_VAR_GLOBAL;
+        v->ival = vars[i].ival;
+        v->ival_valid = vars[i].flags & SNAPSHOT_VAR_INT;
+        v->str_stale = false;
+        snapshot_vars++;
+    }
+    for (uint32_t i = 0; i < count[SNAPSHOT_HISTORY] && history_count < HISTORY_SIZE; i++) {
+        history[history_count++] = (char*)strings + hist[i];
+        snapshot_history++;
+    }
+    for (uint32_t i = 0; i < count[SNAPSHOT_FUNCTIONS]; i++) {
+        if (snapshot_function(strings + functions[i])) {
+            snapshot_functions++;
+        } else {
+            fprintf(stderr, "snapshot: %s: bad function definition, skipped\n", path);
+        }
+    }
+    for (uint32_t i = 0; i < count[SNAPSHOT_ALIASES]; i++) {
+        const char* name = strings + aliases[i].name;
+        const char* text = strings + aliases[i].text;
+        char* arg = malloc(strlen(name) + strlen(text) + 2);
+        if (!arg) {
+            fprintf(stderr, "Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(arg, "%s=%s", name, text);
+        char* args[] = {"alias", arg, NULL};
+        alias_builtin(args);  // Checks the name and tokenizes the text as typed
+        struct command_entry* e = command_lookup(name);
+        snapshot_aliases += e && e->alias;
+        free(arg);
+    }
+    snapshot_dirs = dirs;
+    snapshot_dir_count = count[SNAPSHOT_INDEX_DIRS];
+    snapshot_names = names;
+    return true;
+}
+
+// Function for build_command_index(): index PATH directory i from the
+// snapshot instead of scanning it, if it has not changed since. Its watch
+// is already in place. A directory modified at or after the moment the
+// snapshot was written could have changed after it was recorded, so it is
+// scanned, as is one the snapshot does not have. Returns false to scan.
+bool snapshot_index_dir(int i) {
+    struct stat st;
+
+    for (uint32_t k = 0; k < snapshot_dir_count; k++) {
+        const struct snapshot_dir* d = &snapshot_dirs[k];
+        if (strcmp(snapshot_strings + d->path, path_dirs[i]) != 0) {
+            continue;
+        }
+        if (stat(path_dirs[i], &st) < 0 || st.st_mtim.tv_sec != d->mtime_sec ||
+            st.st_mtim.tv_nsec != d->mtime_nsec || st.st_mtim.tv_sec > snapshot_head->saved_sec ||
+            (st.st_mtim.tv_sec == snapshot_head->saved_sec && st.st_mtim.tv_nsec >= snapshot_head->saved_nsec)) {
+            snapshot_dirs_scanned++;
+            return false;
+        }
+        for (uint32_t n = d->first; n < d->first + d->count; n++) {
+            trie_find(snapshot_strings + snapshot_names[n], true)->dirs |= 1ULL << i;
+        }
+        snapshot_dirs_reused++;
+        return true;
+    }
+    snapshot_dirs_scanned += snapshot_map != NULL;
+    return false;
+}
+
+// Function to append len bytes to a section being written
+void snapshot_put(struct snapshot_buffer* b, const void* data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+        if (!b->data) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+// Function to add a string to the string section and return its offset
+uint32_t snapshot_string(struct snapshot_buffer* sections, const char* s) {
+    uint32_t offset = sections[SNAPSHOT_STRINGS].len;
+    snapshot_put(&sections[SNAPSHOT_STRINGS], s, strlen(s) + 1);
+    return offset;
+}
+
+// Function to add the names below n indexed in the directory of bit;
+// buf holds the depth-byte prefix
+void snapshot_add_names(struct trie_node* n, char* buf, size_t depth, unsigned long long bit,
+                        struct snapshot_buffer* sections) {
+    for (struct trie_node* child = n->child; child; child = child->next) {
+        if (depth + 2 > PATH_MAX) {
+            continue;
+        }
+        buf[depth] = child->c;
+        buf[depth + 1] = '\0';
+        if (child->dirs & bit) {
+            uint32_t offset = snapshot_string(sections, buf);
+            snapshot_put(&sections[SNAPSHOT_INDEX_NAMES], &offset, sizeof(offset));
+        }
+        snapshot_add_names(child, buf, depth + 1, bit, sections);
+    }
+}
+
+// Function to write the shell's state to path. The file is written under a
+// temporary name and renamed over path, so a shell that has the old one
+// mapped keeps a consistent copy and readers never see half a file.
+bool snapshot_save(const char* path) {
+    struct snapshot_buffer sections[SNAPSHOT_SECTION_TYPES];
+    struct snapshot_header h;
+    struct timespec now;
+    char buf[PATH_MAX];
+
+    memset(sections, 0, sizeof(sections));
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);  // The clock file timestamps come from
+    snapshot_put(&sections[SNAPSHOT_STRINGS], "", 1);
+    for (int i = 0; i < var_count; i++) {
+        struct snapshot_var v = {0};
+        if (shell_vars[i].array) {
+            continue;  // Arrays are not kept across sessions
+        }
+        v.name = snapshot_string(sections, shell_vars[i].name);
+        v.value = snapshot_string(sections, variable_string(&shell_vars[i]));
+        v.flags = (shell_vars[i].global ? SNAPSHOT_VAR_GLOBAL : 0) |
+                  (shell_vars[i].ival_valid ? SNAPSHOT_VAR_INT : 0);
+        v.ival = shell_vars[i].ival;
+        snapshot_put(&sections[SNAPSHOT_VARS], &v, sizeof(v));
+    }
+    for (int i = 0; i < history_count; i++) {
+        uint32_t offset = snapshot_string(sections, history[i]);
+        snapshot_put(&sections[SNAPSHOT_HISTORY], &offset, sizeof(offset));
+    }
+    for (int i = 0; i < commands.cap; i++) {
+        struct command_entry* e = &commands.slots[i];
+        if (e->name && e->function && e->function->text) {
+            uint32_t offset = snapshot_string(sections, e->function->text);
+            snapshot_put(&sections[SNAPSHOT_FUNCTIONS], &offset, sizeof(offset));
+        }
+        if (e->name && e->alias) {
+            struct snapshot_alias a = {snapshot_string(sections, e->name), snapshot_string(sections, e->alias_text)};
+            snapshot_put(&sections[SNAPSHOT_ALIASES], &a, sizeof(a));
+        }
+    }
+    refresh_command_index();  // Built now if it never was; takes the changes queued since
+    for (int i = 0; path_index_exact && i < path_dir_count; i++) {
+        struct snapshot_dir d = {0};
+        struct stat st;
+        if (stat(path_dirs[i], &st) < 0) {
+            continue;
+        }
+        d.path = snapshot_string(sections, path_dirs[i]);
+        d.first = sections[SNAPSHOT_INDEX_NAMES].len / sizeof(uint32_t);
+        d.mtime_sec = st.st_mtim.tv_sec;
+        d.mtime_nsec = st.st_mtim.tv_nsec;
+        snapshot_add_names(&command_trie, buf, 0, 1ULL << i, sections);
+        d.count = sections[SNAPSHOT_INDEX_NAMES].len / sizeof(uint32_t) - d.first;
+        snapshot_put(&sections[SNAPSHOT_INDEX_DIRS], &d, sizeof(d));
+    }
+
+    // Header, section table, then each section at an 8-byte boundary
+    struct snapshot_buffer file = {0};
+    struct snapshot_section table[SNAPSHOT_SECTION_TYPES - 1];
+    uint64_t offset = sizeof(h) + sizeof(table);
+    for (int t = 1; t < SNAPSHOT_SECTION_TYPES; t++) {
+        offset = (offset + 7) & ~7ULL;
+        table[t - 1].type = t;
+        table[t - 1].count = sections[t].len / snapshot_record_size[t];
+        table[t - 1].offset = offset;
+        table[t - 1].length = sections[t].len;
+        offset += sections[t].len;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.byte_order = SNAPSHOT_BYTE_ORDER;
+    h.size = offset;
+    h.saved_sec = now.tv_sec;
+    h.saved_nsec = now.tv_nsec;
+    h.sections = SNAPSHOT_SECTION_TYPES - 1;
+    snapshot_put(&file, &h, sizeof(h));
+    snapshot_put(&file, table, sizeof(table));
+    for (int t = 1; t < SNAPSHOT_SECTION_TYPES; t++) {
+        static const char zeros[8];
+        snapshot_put(&file, zeros, table[t - 1].offset - file.len);
+        snapshot_put(&file, sections[t].data, sections[t].len);
+        free(sections[t].data);
+    }
+
+    bool ok = snprintf(buf, sizeof(buf), "%s.%d.tmp", path, (int)getpid()) < (int)sizeof(buf);
+    int fd = ok ? open(buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    ok = fd >= 0;
+    for (size_t done = 0; ok && done < file.len; ) {
+        ssize_t n = write(fd, file.data + done, file.len - done);
+        ok = n > 0 || (n < 0 && errno == EINTR);
+        done += n > 0 ? n : 0;
+    }
+    if (fd >= 0 && close(fd) < 0) {
+        ok = false;
+    }
+    ok = ok && rename(buf, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "snapshot: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            unlink(buf);
+        }
+    }
+    free(file.data);
+    return ok;
+}
+
+// Function to save the snapshot when an interactive shell exits
+void snapshot_at_exit() {
+    if (getpid() == snapshot_pid) {
+        snapshot_save(snapshot_path);
+    }
+}
+
+// Function to handle the snapshot built-in: status, or `snapshot save [file]`
+void snapshot_builtin(char** args) {
+    if (args[1] == NULL) {
+        if (!snapshot_map) {
+            printf("snapshot: none loaded%s%s\n", snapshot_path ? ", saves to " : "",
+                   snapshot_path ? snapshot_path : "");
+            return;
+        }
+        int copied = 0;
+        for (int i = 0; i < var_count; i++) {
+            copied += in_snapshot(shell_vars[i].name) && !in_snapshot(shell_vars[i].value);
+        }
+        printf("snapshot: %s, version %d, %zu bytes mapped\n", snapshot_path, SNAPSHOT_VERSION, snapshot_size);
+        printf("variables: %d loaded, %d copied since\n", snapshot_vars, copied);
+        printf("history: %d entries loaded\n", snapshot_history);
+        printf("functions: %d loaded, aliases: %d loaded\n", snapshot_functions, snapshot_aliases);
+        printf("index: %d directories reused, %d scanned\n", snapshot_dirs_reused, snapshot_dirs_scanned);
+    } else if (strcmp(args[1], "save") == 0 && (args[2] == NULL || args[3] == NULL)) {
+        const char* path = args[2] ? args[2] : snapshot_path;
+        if (path == NULL) {
+            fprintf(stderr, "snapshot: no file (give one, or set PSH_SNAPSHOT)\n");
+            last_status = 1;
+        } else if (!snapshot_save(path)) {
+            last_status = 1;
+        }
+    } else {
+        fprintf(stderr, "Usage: snapshot [save [file]]\n");
+        last_status = 2;
+    }
+}
+
+#define MEMO_MAGIC "PSHMEMO1"      // First 8 bytes of a stored result; the digit is the format version
+#define MEMO_KEEP 90               // Percent of the limit the store is trimmed to once over it
+
+// Stored result: this header, the key it was stored under, then what the
+// command wrote to stdout and to stderr
+struct memo_header {
+    char magic[8];
+    uint32_t key_len;
+    int32_t status;
+    uint64_t out_len, err_len;
+    uint64_t run_ns;             // What running the command took: saved by each hit
+};
+
+// 128-bit hash of a byte stream, the same however the stream is split up
+struct memo_hash {
+    uint64_t a, b;
+    uint64_t tail;               // Bytes not yet making up a whole word
+    uint64_t length;
+};
+
+// Output of a command run by memo: passed on as it comes, and kept to be stored
+struct memo_capture {
+    int fd[2];                   // Read ends of its stdout and stderr pipes, -1 at EOF
+    struct snapshot_buffer out[2];
+    bool overflow;               // More than the store can hold: not kept
+    bool abandoned;              // Will not be stored (the job was stopped): freed at EOF
+};
+
+// Entry of the store, as listed when it is trimmed
+struct memo_entry {
+    struct timespec used;        // Modification time, moved forward by each hit
+    long long size;
+    char name[33];
+};
+
+// Counters of a store, in its "stats" file. Every shell using the store maps
+// it shared and adds to them atomically, forked children included.
+struct memo_counters {
+    uint64_t hits, misses, stored, evicted;
+    uint64_t saved_ns;           // Run time of the commands hits replaced
+    uint64_t hit_ns;             // Time the hits took
+};
+
+struct memo_counters memo_unshared;              // Counted here when the file cannot be mapped
+struct memo_counters* memo_count = &memo_unshared;
+char memo_count_dir[PATH_MAX];                   // Store whose counters memo_count maps
+
+#define MEMO_COUNT(field, n) __atomic_add_fetch(&memo_count->field, (n), __ATOMIC_RELAXED)
+
+// Function to mix one 64-bit word into the hash
+void memo_hash_word(struct memo_hash* h, uint64_t w) {
+    h->a = (h->a ^ w) * 0x9e3779b97f4a7c15ULL;
+    h->a ^= h->a >> 29;
+    h->b = (h->b + w) * 0xc2b2ae3d27d4eb4fULL;
+    h->b = (h->b << 31) | (h->b >> 33);
+}
+
+// Function to add len bytes to the hash, a word at a time where aligned
+void memo_hash_update(struct memo_hash* h, const void* data, size_t len) {
+    const unsigned char* p = data;
+
+    while (len > 0) {
+        if (h->length % 8 == 0 && len >= 8) {
+            uint64_t w;
+            memcpy(&w, p, sizeof(w));
+            memo_hash_word(h, le64toh(w));
+            p += 8;
+            len -= 8;
+            h->length += 8;
+            continue;
+        }
+        h->tail |= (uint64_t)*p++ << (8 * (h->length++ % 8));
+        len--;
+        if (h->length % 8 == 0) {
+            memo_hash_word(h, h->tail);
+            h->tail = 0;
+        }
+    }
+}
+
+// Function to finalise 64 bits of hash state (MurmurHash3's fmix64)
+uint64_t memo_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Function to finish the hash into 16 bytes
+void memo_hash_final(struct memo_hash* h, unsigned char digest[16]) {
+    memo_hash_word(h, h->tail);
+    uint64_t a = memo_mix(h->a ^ h->length);
+    uint64_t b = memo_mix(h->b + a);
+    a += b;
+    memcpy(digest, &a, 8);
+    memcpy(digest + 8, &b, 8);
+}
+
+// Function to start a hash
+struct memo_hash memo_hash_start() {
+    struct memo_hash h = { 0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL, 0, 0 };
+    return h;
+}
+
+// Function to add one field, tagged and with its length, to a key
+void memo_key_field(struct snapshot_buffer* key, char tag, const void* data, size_t len) {
+    uint32_t n = len;
+    snapshot_put(key, &tag, 1);
+    snapshot_put(key, &n, sizeof(n));
+    snapshot_put(key, data, len);
+}
+
+// Function to add a declared input file to a key: the hash of its contents,
+// or with by_stat only its device, inode, size and modification time. A file
+// that cannot be read is keyed by the error.
+void memo_key_input(struct snapshot_buffer* key, const char* path, bool by_stat) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    memo_key_field(key, by_stat ? 'm' : 'i', path, strlen(path));
+    if (fd >= 0 && by_stat && fstat(fd, &st) == 0) {
+        int64_t id[5] = { (int64_t)st.st_dev, (int64_t)st.st_ino, (int64_t)st.st_size,
+                          (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec };
+        memo_key_field(key, 's', id, sizeof(id));
+        close(fd);
+        return;
+    }
+    if (fd >= 0 && !by_stat) {
+        struct memo_hash h = memo_hash_start();
+        unsigned char digest[16];
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+            memo_hash_update(&h, buf, n > 0 ? n : 0);
+        }
+        if (n == 0) {
+            memo_hash_final(&h, digest);
+            memo_key_field(key, 'h', digest, sizeof(digest));
+            close(fd);
+            return;
+        }
+    }
+    int error = errno;
+    memo_key_field(key, 'x', &error, sizeof(error));
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Function to find the store: $PSH_MEMO, else pucitshell/memo under
+// $XDG_CACHE_HOME or ~/.cache. With create, missing directories are made.
+const char* memo_directory(bool create) {
+    static char dir[PATH_MAX];
+    const char* base;
+    int n;
+
+    if ((base = getenv("PSH_MEMO")) && *base) {
+        n = snprintf(dir, sizeof(dir), "%s", base);
+    } else if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+        n = snprintf(dir, sizeof(dir), "%s/pucitshell/memo", base);
+    } else if ((base = getenv("HOME")) && *base) {
+        n = snprintf(dir, sizeof(dir), "%s/.cache/pucitshell/memo", base);
+    } else {
+        return NULL;
+    }
+    if (n >= (int)sizeof(dir) - 34) {  // Room for "/" and an entry's name
+        return NULL;
+    }
+    for (char* p = dir + 1; create; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+                fprintf(stderr, "memo: %s: %s\n", dir, strerror(errno));
+                return NULL;
+            }
+            *p = c;
+            if (c == '\0') {
+                break;
+            }
+        }
+    }
+    return dir;
+}
+
+// Function to map the counters of the store in dir, once per process and
+// store. Falls back to counters of this shell's own.
+struct memo_counters* memo_counters(const char* dir) {
+    if (strcmp(dir, memo_count_dir) == 0) {
+        return memo_count;
+    }
+    if (memo_count != &memo_unshared) {
+        munmap(memo_count, sizeof(struct memo_counters));
+    }
+    memo_count = &memo_unshared;
+    snprintf(memo_count_dir, sizeof(memo_count_dir), "%s", dir);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stats", dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 &&
+        (st.st_size >= (off_t)sizeof(struct memo_counters) || ftruncate(fd, sizeof(struct memo_counters)) == 0)) {
+        void* map = mmap(NULL, sizeof(struct memo_counters), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            memo_count = map;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return memo_count;
+}
+
+// Function to write all of data to fd; false on an error
+bool memo_write(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno != EINTR) {
+            return false;
+        }
+        p += n > 0 ? n : 0;
+        len -= n > 0 ? n : 0;
+    }
+    return true;
+}
+
+// Function to replay the result stored at path if it was stored under key:
+// its output to stdout and stderr, then its status into *status. The entry
+// becomes the most recently used. False if there is none.
+bool memo_replay(const char* path, struct snapshot_buffer* key, int* status) {
+    struct memo_header h;
+    struct stat st;
+    bool hit = false;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(h) + key->len) {
+        char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            memcpy(&h, map, sizeof(h));
+            hit = memcmp(h.magic, MEMO_MAGIC, sizeof(h.magic)) == 0 && h.key_len == key->len &&
+                  h.out_len <= (uint64_t)st.st_size && h.err_len <= (uint64_t)st.st_size &&
+                  sizeof(h) + h.key_len + h.out_len + h.err_len == (uint64_t)st.st_size &&
+                  memcmp(map + sizeof(h), key->data, key->len) == 0;
+            if (hit) {
+                const char* out = map + sizeof(h) + h.key_len;
+                fflush(stdout);
+                fflush(stderr);
+                memo_write(shell_fd(STDOUT_FILENO), out, h.out_len);
+                memo_write(shell_fd(STDERR_FILENO), out + h.out_len, h.err_len);
+                *status = h.status;
+                MEMO_COUNT(saved_ns, h.run_ns);
+                futimens(fd, NULL);
+            }
+            munmap(map, st.st_size);
+        }
+    }
+    close(fd);
+    return hit;
+}
+
+// Function to order entries from least to most recently used
+int memo_entry_compare(const void* a, const void* b) {
+    const struct memo_entry* x = a;
+    const struct memo_entry* y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+// Function to list the entries of the store in dir, least recently used
+// first. Sets *bytes to their total size; the caller frees *list.
+int memo_scan(const char* dir, struct memo_entry** list, long long* bytes) {
+    DIR* d = opendir(dir);
+    struct dirent* e;
+    int count = 0, cap = 0;
+
+    *list = NULL;
+    *bytes = 0;
+    while (d && (e = readdir(d)) != NULL) {
+        struct stat st;
+        if (strlen(e->d_name) != 32 || strspn(e->d_name, "0123456789abcdef") != 32 ||
+            fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;  // Not an entry, or one that just went
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            *list = realloc(*list, cap * sizeof(struct memo_entry));
+            if (!*list) {
+                fprintf(stderr, "Reallocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*list)[count].used = st.st_mtim;
+        (*list)[count].size = st.st_size;
+        strcpy((*list)[count].name, e->d_name);
+        *bytes += st.st_size;
+        count++;
+    }
+    if (d) {
+        closedir(d);
+    }
+    if (count > 0) {
+        qsort(*list, count, sizeof(struct memo_entry), memo_entry_compare);
+    }
+    return count;
+}
+
+// Function to bring the store down to MEMO_KEEP percent of its limit once it
+// is over, removing the least recently used entries first. Other shells may
+// share the store, so it is counted afresh each time.
+void memo_trim(const char* dir) {
+    struct memo_entry* list;
+    long long bytes;
+    int count = memo_scan(dir, &list, &bytes);
+    bool trim = bytes > memo_limit;
+
+    for (int i = 0; i < count && bytes > memo_limit / 100 * MEMO_KEEP && trim; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, list[i].name);
+        if (unlink(path) == 0) {
+            bytes -= list[i].size;
+            MEMO_COUNT(evicted, 1);
+        }
+    }
+    memo_store_bytes = bytes;
+    free(list);
+}
+
+// Function to store a finished command's result under key, as file name in
+// dir. It is written under a temporary name and renamed into place, so other
+// shells never replay half an entry.
+void memo_store(const char* dir, const char* name, struct snapshot_buffer* key, struct memo_capture* c,
+                int status, long long run_ns) {
+    struct memo_header h;
+    char path[PATH_MAX], tmp[PATH_MAX];
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MEMO_MAGIC, sizeof(h.magic));
+    h.key_len = key->len;
+    h.status = status;
+    h.out_len = c->out[0].len;
+    h.err_len = c->out[1].len;
+    h.run_ns = run_ns;
+    long long size = sizeof(h) + h.key_len + h.out_len + h.err_len;
+    if (size > memo_limit / 100 * MEMO_KEEP) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%d", dir, name, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd >= 0 && memo_write(fd, &h, sizeof(h)) && memo_write(fd, key->data, key->len) &&
+              memo_write(fd, c->out[0].data, h.out_len) && memo_write(fd, c->out[1].data, h.err_len);
+    if (fd >= 0 && close(fd) < 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp, path) < 0) {
+        fprintf(stderr, "memo: %s: %s\n", dir, strerror(errno));
+        if (fd >= 0) {
+            unlink(tmp);
+        }
+        return;
+    }
+    MEMO_COUNT(stored, 1);
+    if (memo_store_bytes >= 0) {
+        memo_store_bytes += size;
+    }
+    if (memo_store_bytes < 0 || memo_store_bytes > memo_limit) {
+        memo_trim(dir);
+    }
+}
+
+// Function to free a capture once nothing reads its pipes any more
+void memo_capture_free(struct memo_capture* c) {
+    free(c->out[0].data);
+    free(c->out[1].data);
+    free(c);
+}
+
+// Function to drain one of a memo'd command's pipes, from the event loop or
+// once it has exited: pass the output on and keep a copy
+void memo_ready(int fd, void* data) {
+    struct memo_capture* c = data;
+    int k = fd == c->fd[0] ? 0 : 1;
+    char buf[65536];
+
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0) {
+            fflush(k == 0 ? stdout : stderr);
+            memo_write(shell_fd(STDOUT_FILENO + k), buf, n);
+            if (c->abandoned || c->overflow) {
+                continue;
+            }
+            if ((long long)(c->out[0].len + c->out[1].len + n) > memo_limit) {
+                c->overflow = true;
+                continue;
+            }
+            snapshot_put(&c->out[k], buf, n);
+        } else if (n == 0) {  // Every process holding the write end is gone
+            event_remove(fd);
+            close(fd);
+            c->fd[k] = -1;
+            if (c->abandoned && c->fd[1 - k] < 0) {
+                memo_capture_free(c);
+            }
+            return;
+        } else if (errno != EINTR) {
+            return;
+        }
+    }
+}
+
+// Function to run argv as a foreground job for a built-in that takes a
+// command (memo, watch-run) and return its status. Its stdout and stderr
+// are out_w and err_w unless they are -1. *started is its process group
+// while it runs, for event handlers that need to signal it.
+int run_foreground(char** argv, const char* text, int out_w, int err_w, pid_t* started) {
+    struct placement place = inherited_placement();
+    struct deadline d = { 0, 0, -1, false };
+    long long limit = in_subshell ? 0 : default_deadline;
+    char** placed = parse_placement(argv, &place);  // "memo nice gen" places gen itself
+
+    if (placed == NULL) {
+        if (out_w >= 0) {
+            close(out_w);
+            close(err_w);
+        }
+        return 1;
+    }
+    if (placed[0] != NULL) {
+        argv = placed;
+    }
+    char* leaf = cgroup_create(&place);
+
+    fflush(stdout);
+    fflush(stderr);
+    sync_fd_readers();
+    pid_t pid = fork();
+    if (pid == 0) {
+        join_job_group(0, true);
+        cgroup_enter(leaf);
+        leave_event_loop();
+        apply_placement(&place);
+        in_subshell = true;
+        if (out_w >= 0) {
+            dup2(out_w, STDOUT_FILENO);
+        }
+        if (err_w >= 0) {
+            dup2(err_w, STDERR_FILENO);
+        }
+        if (execute_builtin(argv)) {
+            exit_subshell(last_status);
+        }
+        execvp(argv[0], argv);
+        perror("Error executing command");
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+    if (out_w >= 0) {
+        close(out_w);
+    }
+    if (err_w >= 0) {
+        close(err_w);
+    }
+    if (pid < 0) {
+        perror("Error forking");
+        cgroup_remove(leaf);
+        return 126;
+    }
+    struct job* j = new_job(text, false);
+    j->cgroup = leaf;
+    add_job_process(j, pid, true);
+    if (limit > 0) {
+        start_deadline(&d, pid, limit, TIMEOUT_GRACE);
+    }
+    *started = pid;
+    int status = wait_for_job(j);
+    *started = 0;
+    stop_deadline(&d);
+    return d.expired ? 124 : status;
+}
+
+// Function to show the store and how memo has done in this shell
+void memo_stats() {
+    const char* dir = memo_directory(false);
+    struct memo_entry* list;
+    long long bytes;
+
+    if (dir == NULL) {
+        printf("memo: no store (set PSH_MEMO or HOME)\n");
+        return;
+    }
+    int count = memo_scan(dir, &list, &bytes);
+    free(list);
+    printf("memo: %s, %d entries, %lld bytes", dir, count, bytes);
+    if (memo_limit > 0) {
+        printf(" of %lld\n", memo_limit);
+    } else {
+        printf(", off\n");
+    }
+    struct memo_counters* n = memo_counters(dir);
+    printf("hits: %llu", (unsigned long long)n->hits);
+    if (n->hits > 0) {
+        printf(", %llu us each, %.3f s of run time saved", (unsigned long long)(n->hit_ns / n->hits / 1000),
+               n->saved_ns / 1e9);
+    }
+    printf("\nmisses: %llu, %llu stored, %llu evicted\n", (unsigned long long)n->misses,
+           (unsigned long long)n->stored, (unsigned long long)n->evicted);
+}
+
+// Function for `memo [-i file]... [-m file]... [-e name]... command [args...]`:
+// replay the command's stored output and status when its arguments, working
+// directory, the named variables and the input files are what they were when
+// it last ran; otherwise run it and store the result. `memo` alone shows the
+// store, `memo -c` empties it and resets its counters.
+void memo_builtin(char** args) {
+    long long t_start = monotonic_ns();
+    struct snapshot_buffer key = { 0 };
+    char buf[PATH_MAX];
+    int i = 1;
+
+    if (args[1] == NULL) {
+        memo_stats();
+        return;
+    }
+    if (strcmp(args[1], "-c") == 0 && args[2] == NULL) {
+        const char* dir = memo_directory(false);
+        struct memo_entry* list;
+        long long bytes;
+        int count = dir ? memo_scan(dir, &list, &bytes) : 0;
+        for (int k = 0; k < count; k++) {
+            snprintf(buf, sizeof(buf), "%s/%s", dir, list[k].name);
+            unlink(buf);
+        }
+        if (dir) {
+            free(list);
+            memset(memo_counters(dir), 0, sizeof(struct memo_counters));
+        }
+        memo_store_bytes = 0;
+        return;
+    }
+    for (; args[i] && args[i][0] == '-'; i += 2) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (args[i + 1] == NULL || args[i][1] == '\0' || args[i][2] != '\0' || !strchr("ime", args[i][1])) {
+            i = -1;
+            break;
+        }
+        if (args[i][1] == 'e') {
+            const char* value = get_variable_value(args[i + 1]);
+            value = value ? value : getenv(args[i + 1]);
+            snprintf(buf, sizeof(buf), "%s%s%s", args[i + 1], value ? "=" : "", value ? value : "");
+            memo_key_field(&key, 'e', buf, strlen(buf));
+        } else {
+            memo_key_input(&key, args[i + 1], args[i][1] == 'm');
+        }
+    }
+    if (i < 0 || args[i] == NULL) {
+        fprintf(stderr, "Usage: memo [-i file]... [-m file]... [-e name]... <command> [args...]\n");
+        free(key.data);
+        last_status = 2;
+        return;
+    }
+    if (getcwd(buf, sizeof(buf)) != NULL) {
+        memo_key_field(&key, 'd', buf, strlen(buf));
+    }
+    for (int k = i; args[k]; k++) {
+        memo_key_field(&key, 'a', args[k], strlen(args[k]));
+    }
+
+    // The entry's name is the key's hash; the key itself is checked on a hit
+    struct memo_hash h = memo_hash_start();
+    unsigned char digest[16];
+    char name[33];
+    memo_hash_update(&h, key.data, key.len);
+    memo_hash_final(&h, digest);
+    for (int k = 0; k < 16; k++) {
+        snprintf(name + 2 * k, 3, "%02x", digest[k]);
+    }
+    const char* dir = memo_limit > 0 ? memo_directory(true) : NULL;
+    if (dir) {
+        int status;
+        memo_counters(dir);
+        snprintf(buf, sizeof(buf), "%s/%s", dir, name);
+        if (memo_replay(buf, &key, &status)) {
+            MEMO_COUNT(hits, 1);
+            MEMO_COUNT(hit_ns, monotonic_ns() - t_start);
+            last_status = status;
+            free(key.data);
+            return;
+        }
+        MEMO_COUNT(misses, 1);
+    }
+
+    // A miss: run it, with its output through pipes the event loop reads
+    struct memo_capture* c = NULL;
+    int out[2], err[2];
+    char text[1024] = "";
+    append_words(text, sizeof(text), args);
+    if (dir && ensure_event_loop() && signal_fd >= 0 && pipe2(out, O_CLOEXEC) == 0) {
+        if (pipe2(err, O_CLOEXEC) == 0) {
+            c = calloc(1, sizeof(struct memo_capture));
+            if (!c) {
+                fprintf(stderr, "Allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+            c->fd[0] = out[0];
+            c->fd[1] = err[0];
+            fcntl(out[0], F_SETFL, O_NONBLOCK);
+            fcntl(err[0], F_SETFL, O_NONBLOCK);
+        } else {
+            close(out[0]);
+            close(out[1]);
+        }
+    }
+    long long t_run = monotonic_ns();
+    pid_t pid;
+    if (c) {
+        event_add(c->fd[0], memo_ready, c);
+        event_add(c->fd[1], memo_ready, c);
+    }
+    int status = run_foreground(args + i, text, c ? out[1] : -1, c ? err[1] : -1, &pid);
+    long long run_ns = monotonic_ns() - t_run;
+    last_status = status;
+    if (c) {
+        for (int k = 0; k < 2; k++) {
+            if (c->fd[k] >= 0) {
+                memo_ready(c->fd[k], c);  // What it wrote last, still in the pipe
+            }
+        }
+        if (c->fd[0] >= 0 || c->fd[1] >= 0) {
+            c->abandoned = true;  // Stopped, or something it started still holds the pipe
+            free(c->out[0].data);
+            free(c->out[1].data);
+            memset(c->out, 0, sizeof(c->out));
+        } else {
+            // Only results of commands that ran to their end: not ones that
+            // could not start (126, 127), were killed or were interrupted
+            if (!c->overflow && status < 126 && !interrupted) {
+                memo_store(dir, name, &key, c, status, run_ns);
+            }
+            memo_capture_free(c);
+        }
+    }
+    free(key.data);
+}
+
+#define WATCH_DEBOUNCE 50  // Default milliseconds watch-run waits for a burst of changes to end
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB)
+
+// Directory watched by watch-run, whole or for one of its entries
+struct watch_path {
+    int wd;                      // inotify watch descriptor
+    char* dir;
+    char* name;                  // The entry watched, or NULL for the directory and those below it
+};
+
+// State of a running watch-run
+struct watch {
+    int fd;                      // inotify descriptor
+    struct watch_path* paths;
+    int count, cap;
+    long long debounce;          // Milliseconds without changes before the command runs
+    int timer;                   // Debounce timer, -1 when none is pending
+    bool due;                    // Changes have settled (or none yet): time to run
+    pid_t running;               // Process group of the run in progress, 0 if none
+    struct deadline cancel;      // Ends the run in progress once changes arrive
+};
+
+// Function to watch directory dir for entry name, or the whole directory
+// (and, with recursive, every directory below it except hidden ones)
+bool watch_add(struct watch* w, const char* dir, const char* name, bool recursive) {
+    int wd = inotify_add_watch(w->fd, dir, WATCH_EVENTS | IN_ONLYDIR);
+
+    if (wd < 0) {
+        fprintf(stderr, "watch-run: %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+    if (w->count == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 16;
+        w->paths = realloc(w->paths, w->cap * sizeof(struct watch_path));
+        if (!w->paths) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    w->paths[w->count].wd = wd;
+    w->paths[w->count].dir = strdup(dir);
+    w->paths[w->count].name = name ? strdup(name) : NULL;
+    w->count++;
+
+    DIR* d = recursive ? opendir(dir) : NULL;
+    struct dirent* e;
+    bool ok = true;
+    while (d && ok && (e = readdir(d)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (e->d_name[0] == '.' || (e->d_type != DT_DIR && e->d_type != DT_UNKNOWN) ||
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name) >= (int)sizeof(path) ||
+            lstat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            continue;
+        }
+        ok = watch_add(w, path, NULL, true);
+    }
+    if (d) {
+        closedir(d);
+    }
+    return ok;
+}
+
+// Function to watch a path given to watch-run: a directory with everything
+// below it, or a file through its directory, so that editors replacing the
+// file by renaming a new one over it are seen too
+bool watch_add_path(struct watch* w, const char* path) {
+    struct stat st;
+    char dir[PATH_MAX];
+
+    if (stat(path, &st) < 0) {
+        fprintf(stderr, "watch-run: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        return watch_add(w, path, NULL, true);
+    }
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        return watch_add(w, ".", path, false);
+    }
+    snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    return watch_add(w, dir, slash + 1, false);
+}
+
+// Function called when the debounce timer fires: the changes have settled
+void watch_settled(void* data) {
+    struct watch* w = data;
+    w->timer = -1;
+    w->due = true;
+}
+
+// Function to take watch-run's inotify events. A change ends the run in
+// progress, if any, and (re)starts the debounce timer; new directories
+// below a watched one are watched as well.
+void watch_changed(int fd, void* data) {
+    struct watch* w = data;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                changed = true;  // Events were lost: assume the worst
+                continue;
+            }
+            for (int i = 0; i < w->count && !(ev->mask & IN_IGNORED); i++) {
+                if (w->paths[i].wd != ev->wd) {
+                    continue;
+                }
+                if (w->paths[i].name && (ev->len == 0 || strcmp(w->paths[i].name, ev->name) != 0)) {
+                    continue;  // Another entry of a file's directory
+                }
+                if (!w->paths[i].name && ev->len > 0 && ev->name[0] == '.') {
+                    break;  // Hidden: editor swap files, .git
+                }
+                changed = true;
+                if (!w->paths[i].name && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    char path[PATH_MAX];
+                    snprintf(path, sizeof(path), "%s/%s", w->paths[i].dir, ev->name);
+                    watch_add(w, path, NULL, true);
+                }
+                break;
+            }
+        }
+    }
+    if (!changed) {
+        return;
+    }
+    if (w->running > 0 && w->cancel.timer < 0 && !w->cancel.expired) {
+        start_deadline(&w->cancel, w->running, 0, TIMEOUT_GRACE);  // SIGTERM now, SIGKILL after the grace
+    }
+    timer_cancel(w->timer);
+    w->timer = timer_start(w->debounce, watch_settled, w);
+}
+
+// Function for `watch-run [-d seconds] <path>... -- <command> [args...]`: run
+// command, then again each time something under the paths changes, once no
+// more changes have come for the debounce time. Changes during a run end it
+// first. Runs until Ctrl+C, or until the command is stopped with Ctrl+Z.
+void watch_run_builtin(char** args) {
+    struct watch w = { -1, NULL, 0, 0, WATCH_DEBOUNCE, -1, true, 0, { 0, 0, -1, false } };
+    int i = 1, paths = 0, status = 0;
+    bool ok = true;
+
+    if (args[1] && strcmp(args[1], "-d") == 0) {
+        w.debounce = args[2] ? parse_duration(args[2]) : -1;
+        i = 3;
+    }
+    while (args[i + paths] && strcmp(args[i + paths], "--") != 0) {
+        paths++;
+    }
+    if (w.debounce < 0 || paths == 0 || args[i + paths] == NULL || args[i + paths + 1] == NULL) {
+        fprintf(stderr, "Usage: watch-run [-d seconds] <path>... -- <command> [args...]\n");
+        last_status = 2;
+        return;
+    }
+    if (!ensure_event_loop() || signal_fd < 0 || (w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "watch-run: %s\n", strerror(errno));
+        last_status = 1;
+        return;
+    }
+    for (int k = i; k < i + paths && ok; k++) {
+        ok = watch_add_path(&w, args[k]);
+    }
+    char** argv = args + i + paths + 1;
+    char text[1024] = "";
+    append_words(text, sizeof(text), argv);
+    event_add(w.fd, watch_changed, &w);
+
+    while (ok) {
+        while (!w.due && !interrupted) {
+            event_dispatch(-1);  // Idle: blocked in epoll_wait() until something changes
+        }
+        if (interrupted) {
+            break;
+        }
+        w.due = false;
+        status = run_foreground(argv, text, -1, -1, &w.running);
+        stop_deadline(&w.cancel);
+        if (status == 128 + SIGTSTP || interrupted) {
+            break;  // Ctrl+Z leaves the run stopped in the job table; Ctrl+C ends both
+        }
+        if (w.cancel.expired) {
+            fprintf(stderr, "watch-run: changes, restarting\n");
+            w.cancel.expired = false;
+        }
+    }
+    timer_cancel(w.timer);
+    event_remove(w.fd);
+    close(w.fd);
+    for (int k = 0; k < w.count; k++) {
+        free(w.paths[k].dir);
+        free(w.paths[k].name);
+    }
+    free(w.paths);
+    last_status = !ok ? 1 : interrupted ? 130 : status;
+}
+
+// Function to collect the completions of word (wlen bytes): built-ins,
+// functions, aliases and PATH commands in command position, otherwise file
+// names. Sorted, no duplicates.
+void collect_completions(const char* word, size_t wlen, bool command, struct field_list* out) {
+    char buf[PATH_MAX];
+    int kept = 0;
+
+    if (wlen + 1 >= sizeof(buf)) {
+        return;
+    }
+    memcpy(buf, word, wlen);
+    buf[wlen] = '\0';
+    if (command && !strchr(buf, '/')) {
+        struct trie_node* node;
+        if (commands.cap == 0) {
+            command_table_grow(&commands);
+        }
+        for (int i = 0; i < commands.cap; i++) {
+            struct command_entry* e = &commands.slots[i];
+            if (e->name && (e->builtin || e->function || e->alias) && strncmp(e->name, buf, wlen) == 0) {
+                add_field(out, strdup(e->name));
+            }
+        }
+        refresh_command_index();
+        node = trie_find(buf, false);
+        if (node) {
+            if (wlen > 0 && node->dirs) {
+                add_field(out, strdup(buf));
+            }
+            trie_collect(node, buf, wlen, out);
+        }
+    } else {
+        // Directory part up to the last '/', listed through the glob cache
+        const char* slash = strrchr(buf, '/');
+        size_t dir_len = slash ? (size_t)(slash - buf) + 1 : 0;
+        const char* base = buf + dir_len;
+        size_t base_len = wlen - dir_len;
+        char dir[PATH_MAX];
+        struct dir_listing* l;
+
+        memcpy(dir, buf, dir_len);
+        dir[dir_len] = '\0';
+        l = get_dir_listing(dir_len ? dir : ".");
+        if (!l) {
+            return;
+        }
+        for (int i = 0; i < l->count; i++) {
+            struct dir_entry* e = &l->entries[i];
+            size_t n = strlen(e->name);
+            if (strncmp(e->name, base, base_len) != 0 || (e->name[0] == '.' && base[0] != '.') ||
+                dir_len + n + 2 > sizeof(dir)) {
+                continue;
+            }
+            memcpy(dir + dir_len, e->name, n + 1);
+            if (glob_is_dir(dir, e, true)) {
+                strcat(dir, "/");
+            }
+            add_field(out, strdup(dir));
+        }
+        release_dir_listing(l);
+    }
+    if (out->count > 1) {
+        qsort(out->items, out->count, sizeof(char*), compare_strings);
+    }
+    for (int i = 0; i < out->count; i++) {  // Built-ins that are also in PATH
+        if (kept > 0 && strcmp(out->items[kept - 1], out->items[i]) == 0) {
+            free(out->items[i]);
+        } else {
+            out->items[kept++] = out->items[i];
+        }
+    }
+    out->count = kept;
+    if (out->items) {
+        out->items[kept] = NULL;
+    }
+}
+
+// Function to print completion candidates in columns below the input line
+void list_completions(struct field_list* candidates) {
+    struct winsize ws;
+    int width = 80, col_width = 0, cols;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        width = ws.ws_col;
+    }
+    for (int i = 0; i < candidates->count; i++) {
+        int n = strlen(candidates->items[i]);
+        if (n > col_width) {
+            col_width = n;
+        }
+    }
+    col_width += 2;
+    cols = width / col_width > 0 ? width / col_width : 1;
+    int rows = (candidates->count + cols - 1) / cols;
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            int i = c * rows + r;  // Sorted down the columns, like ls
+            if (i < candidates->count) {
+                printf("%-*s", (c == cols - 1 || i + rows >= candidates->count) ? 0 : col_width,
+                       candidates->items[i]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+// Function to handle Tab with the cursor after the len bytes of line: return
+// the completion to insert, or the part all candidates share (to be freed).
+// On a second Tab the candidates are listed instead and *listed is set.
+char* complete_line(const char* line, size_t len, bool second_tab, bool* listed) {
+    struct field_list candidates = { 0 };
+    size_t start = len, before, common;
+    char* insert = NULL;
+
+    while (start > 0 && !strchr(" \t;|&<>()", line[start - 1])) {
+        start--;
+    }
+    before = start;
+    while (before > 0 && (line[before - 1] == ' ' || line[before - 1] == '\t')) {
+        before--;
+    }
+    bool command = before == 0 || strchr(";|&(", line[before - 1]) != NULL;
+    collect_completions(line + start, len - start, command, &candidates);
+
+    if (candidates.count == 0) {
+        return NULL;
+    }
+    common = strlen(candidates.items[0]);
+    for (int i = 1; i < candidates.count; i++) {
+        size_t k = 0;
+        while (k < common && candidates.items[i][k] == candidates.items[0][k]) {
+            k++;
+        }
+        common = k;
+    }
+    if (candidates.count == 1) {
+        const char* word = candidates.items[0];
+        bool dir = word[common - 1] == '/';
+        insert = malloc(common - (len - start) + 2);
+        sprintf(insert, "%s%s", word + (len - start), dir ? "" : " ");
+    } else if (common > len - start) {
+        insert = strndup(candidates.items[0] + (len - start), common - (len - start));
+    } else if (second_tab) {
+        printf("\n");
+        list_completions(&candidates);
+        fflush(stdout);
+        *listed = true;
+    }
+    for (int i = 0; i < candidates.count; i++) {
+        free(candidates.items[i]);
+    }
+    free(candidates.items);
+    return insert;
+}
+
+#define PROMPT_CACHE_SIZE 8  // Directories whose slow prompt segments are remembered
+#define PROMPT_HELPER_TIMEOUT 5000  // Milliseconds before a stuck helper is killed
+
+// Slow prompt segments of one directory, as the helper last computed them
+struct prompt_segments {
+    char *dir;
+    char *git;     // Branch, with '*' if tracked files changed; "" outside a repository
+    time_t used;
+} prompt_cache[PROMPT_CACHE_SIZE];
+char load_average[16] = "";        // 1-minute load average from the last helper run
+pid_t prompt_helper = -1;          // Helper computing the slow segments, if running
+int prompt_helper_fd = -1;         // Its result pipe, watched by the event loop
+int prompt_helper_generation = 0;  // Prompt the running helper was started for
+int prompt_helper_timer = -1;      // Timer that kills it if git hangs
+
+// Function to find the cached segments of dir, taking over the least
+// recently used entry for it if create is set
+struct prompt_segments* find_prompt_segments(const char* dir, bool create) {
+    struct prompt_segments* victim = &prompt_cache[0];
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        struct prompt_segments* s = &prompt_cache[i];
+        if (s->dir && strcmp(s->dir, dir) == 0) {
+            s->used = time(NULL);
+            return s;
+        }
+        if (!s->dir || (victim->dir && s->used < victim->used)) {
+            victim = s;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    free(victim->dir);
+    free(victim->git);
+    victim->dir = strdup(dir);
+    victim->git = NULL;
+    victim->used = time(NULL);
+    return victim;
+}
+
+// Function to expand the PS1 template into prompt_text. \g (git branch) and
+// \l (load average) are slow, so they are taken from the cache, or shown as
+// "…" until known; *async is set when the template uses them.
+void render_prompt(bool* async) {
+    const char* ps1 = get_variable_value("PS1");
+    char cwd[PATH_MAX];
+    size_t len = 0;
+
+    *async = false;
+    prompt_text[0] = '\0';
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd() error");
+        return;
+    }
+    if (!ps1) {
+        snprintf(prompt_text, sizeof(prompt_text), "PUCITshell@%s:- ", cwd);
+        return;
+    }
+    for (const char* p = ps1; *p; p++) {
+        char buf[PATH_MAX];
+        const char* add = buf;
+        const char* home = getenv("HOME");
+        struct prompt_segments* seg;
+        time_t now;
+
+        buf[0] = '\0';
+        if (*p != '\\' || p[1] == '\0') {
+            buf[0] = *p;
+            buf[1] = '\0';
+        } else {
+            switch (*++p) {
+            case 'u': {
+                struct passwd* pw = getenv("USER") ? NULL : getpwuid(geteuid());
+                add = getenv("USER") ? getenv("USER") : pw ? pw->pw_name : "";
+                break;
+            }
+            case 'h':
+                gethostname(buf, sizeof(buf));
+                buf[sizeof(buf) - 1] = '\0';
+                buf[strcspn(buf, ".")] = '\0';
+                break;
+            case 'w': {
+                size_t n = home ? strlen(home) : 0;
+                if (n > 1 && strncmp(cwd, home, n) == 0 && (cwd[n] == '/' || cwd[n] == '\0')) {
+                    snprintf(buf, sizeof(buf), "~%s", cwd + n);
+                } else {
+                    add = cwd;
+                }
+                break;
+            }
+            case 'W':
+                add = strcmp(cwd, "/") == 0 ? cwd : strrchr(cwd, '/') + 1;
+                break;
+            case '?':
+                snprintf(buf, sizeof(buf), "%d", last_status);
+                break;
+            case '$':
+                add = geteuid() == 0 ? "#" : "$";
+                break;
+            case 'j':
+                snprintf(buf, sizeof(buf), "%d", count_jobs());
+                break;
+            case 't':
+                now = time(NULL);
+                strftime(buf, sizeof(buf), "%H:%M:%S", localtime(&now));
+                break;
+            case 'n':
+                add = "\n";
+                break;
+            case 'e':
+                add = "\x1b";
+                break;
+            case '[':
+            case ']':
+                add = "";  // Escape sequences are never counted as width anyway
+                break;
+            case 'g':
+                *async = true;
+                seg = find_prompt_segments(cwd, false);
+                add = seg && seg->git ? seg->git : "…";
+                break;
+            case 'l':
+                *async = true;
+                add = load_average[0] ? load_average : "…";
+                break;
+            default:
+                snprintf(buf, sizeof(buf), "\\%c", *p);
+                break;
+            }
+        }
+        len += snprintf(prompt_text + len, sizeof(prompt_text) - len, "%s", add);
+        if (len >= sizeof(prompt_text)) {
+            len = sizeof(prompt_text) - 1;
+            break;
+        }
+    }
+}
+
+// Function run by the helper: compute the slow segments for dir and write
+// "dir\0git\0load\0" to out
+void write_prompt_segments(int out, const char* dir) {
+    char branch[256] = "", load[16] = "", line[1024];
+    char result[PATH_MAX + 512];
+    bool repo = false, dirty = false;
+    int fds[2], status, len;
+
+    if (pipe(fds) == 0) {
+        pid_t git = fork();
+        if (git == 0) {
+            int null = open("/dev/null", O_RDWR);
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDERR_FILENO);
+            dup2(fds[1], STDOUT_FILENO);
+            setenv("GIT_OPTIONAL_LOCKS", "0", 1);  // A prompt must never hold the index lock
+            execlp("git", "git", "status", "--porcelain=v2", "--branch", "--untracked-files=no", (char*)NULL);
+            _exit(127);
+        }
+        close(fds[1]);
+        FILE* f = fdopen(fds[0], "r");
+        while (f && fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "# branch.head ", 14) == 0) {
+                snprintf(branch, sizeof(branch), "%.*s", (int)strcspn(line + 14, "\n"), line + 14);
+            } else if (line[0] != '#') {
+                dirty = true;
+            }
+        }
+        if (f) {
+            fclose(f);
+        }
+        repo = git > 0 && waitpid(git, &status, 0) == git && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    int fd = open("/proc/loadavg", O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = read(fd, load, sizeof(load) - 1);
+        load[n > 0 ? n : 0] = '\0';
+        load[strcspn(load, " ")] = '\0';
+        close(fd);
+    }
+    len = snprintf(result, sizeof(result), "%s%c%s%s%c%s", dir, '\0', repo ? branch : "",
+                   repo && dirty ? "*" : "", '\0', load);
+    if (len >= 0 && (size_t)len < sizeof(result)) {
+        write(out, result, len + 1);
+    }
+}
+
+// Function called by the timer when the helper takes too long: kill it and
+// its git, in the process group of their own it runs in
+void stop_prompt_helper(void* data) {
+    (void)data;
+    prompt_helper_timer = -1;
+    kill(-prompt_helper, SIGKILL);
+}
+
+void prompt_helper_ready(int fd, void* data);
+
+// Function to start a helper computing the slow segments for dir. The event
+// loop picks its result up from prompt_helper_fd, so nothing waits for it.
+void start_prompt_helper(const char* dir) {
+    int fds[2];
+
+    if (prompt_helper > 0 || pipe2(fds, O_CLOEXEC) < 0) {
+        return;  // One helper at a time
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        leave_event_loop();
+        setpgid(0, 0);  // Out of the terminal's way, and killed as a group
+        close(fds[0]);
+        write_prompt_segments(fds[1], dir);
+        _exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+    if (pid < 0 || !event_add(fds[0], prompt_helper_ready, NULL)) {
+        close(fds[0]);
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        return;
+    }
+    setpgid(pid, pid);
+    prompt_helper = pid;
+    prompt_helper_fd = fds[0];
+    prompt_helper_generation = prompt_generation;
+    prompt_helper_timer = timer_start(PROMPT_HELPER_TIMEOUT, stop_prompt_helper, NULL);
+}
+
+// Function to read the helper's result once its pipe is readable and cache
+// it. Returns true if the prompt shows something different now.
+bool collect_prompt_helper() {
+    char buf[PATH_MAX + 512];
+    size_t len = 0;
+    ssize_t n;
+    bool changed = false;
+
+    while ((n = read(prompt_helper_fd, buf + len, sizeof(buf) - 1 - len)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        len += n;
+    }
+    event_remove(prompt_helper_fd);
+    close(prompt_helper_fd);
+    waitpid(prompt_helper, NULL, 0);
+    timer_cancel(prompt_helper_timer);
+    prompt_helper_fd = -1;
+    prompt_helper = -1;
+    prompt_helper_timer = -1;
+
+    buf[len] = '\0';
+    char* dir = buf;
+    char* git = memchr(buf, '\0', len);
+    char* load = git ? memchr(git + 1, '\0', len - (git + 1 - buf)) : NULL;
+    if (load) {
+        git++;
+        load++;
+        struct prompt_segments* s = find_prompt_segments(dir, true);
+        changed = !s->git || strcmp(s->git, git) != 0 || strcmp(load_average, load) != 0;
+        free(s->git);
+        s->git = strdup(git);
+        snprintf(load_average, sizeof(load_average), "%s", load);
+    }
+    if (prompt_helper_generation != prompt_generation && getcwd(buf, sizeof(buf))) {
+        start_prompt_helper(buf);  // Started for an earlier prompt: refresh for this one
+    }
+    return changed;
+}
+
+// State of the line editor while a line is being typed
+struct editor {
+    char *line;            // Text typed so far
+    size_t len, cap;
+    size_t cursor;         // Byte offset of the cursor in line
+    char *shown;           // Text after the prompt as last drawn, suggestion included
+    size_t shown_len;
+    size_t shown_ghost;    // Where the drawn suggestion starts in shown
+    size_t term_col;       // Column of the terminal cursor, counted from the prompt's start
+    size_t prompt_width;   // Columns of the prompt's last row
+    int prompt_rows;       // Rows of the prompt above that one
+    size_t width;          // Terminal width
+    int hist_index;        // Entry of history[] shown, history_count for the line being typed
+    bool done;             // Enter was pressed: draw the line without a suggestion
+    char *draft;           // The line being typed while history is browsed
+    char *out;             // Terminal output of one keystroke, sent with a single write()
+    size_t out_len, out_cap;
+    bool last_tab;         // The previous key was Tab: a second one lists the candidates
+    bool eof, cancel;      // Ctrl+D on an empty line, Ctrl+C
+    int escape;            // Escape sequence being read: 1 after ESC, 2 after ESC [ or ESC O
+    int escape_num;        // Its numeric parameter so far
+    void (*on_line)(char* line); // Called with the finished line
+} line_editor;
+struct termios cooked_termios;  // Terminal settings to restore when the line is done
+
+// Function to queue terminal output for the next editor_flush()
+void editor_out(struct editor* e, const char* text, size_t n) {
+    while (e->out_len + n > e->out_cap) {
+        e->out_cap = e->out_cap ? e->out_cap * 2 : 256;
+        e->out = realloc(e->out, e->out_cap);
+        if (!e->out) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(e->out + e->out_len, text, n);
+    e->out_len += n;
+}
+
+// Function to send everything queued for the terminal in one write()
+void editor_flush(struct editor* e) {
+    size_t done = 0;
+    while (done < e->out_len) {
+        ssize_t n = write(STDOUT_FILENO, e->out + done, e->out_len - done);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        done += n > 0 ? n : 0;
+    }
+    e->out_len = 0;
+}
+
+// Function to count the terminal columns of text: one per UTF-8 character,
+// none for escape sequences such as colours in the prompt
+size_t text_width(const char* text, size_t n) {
+    size_t width = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (text[i] == '\x1b' && i + 1 < n && text[i + 1] == '[') {
+            for (i += 2; i < n && !(text[i] >= 0x40 && text[i] <= 0x7E); i++) {
+            }
+            continue;
+        }
+        if (((unsigned char)text[i] & 0xC0) != 0x80) {
+            width++;
+        }
+    }
+    return width;
+}
+
+// Function to move the terminal cursor between two columns counted from the
+// start of the prompt, across wrapped rows if needed
+void editor_move(struct editor* e, size_t to) {
+    char seq[32];
+    size_t from_row = e->term_col / e->width, to_row = to / e->width;
+    size_t from_col = e->term_col % e->width, to_col = to % e->width;
+
+    if (to_row < from_row) {
+        editor_out(e, seq, sprintf(seq, "\x1b[%zuA", from_row - to_row));
+    } else if (to_row > from_row) {
+        editor_out(e, seq, sprintf(seq, "\x1b[%zuB", to_row - from_row));
+    }
+    if (to_col < from_col) {
+        editor_out(e, seq, sprintf(seq, "\x1b[%zuD", from_col - to_col));
+    } else if (to_col > from_col) {
+        editor_out(e, seq, sprintf(seq, "\x1b[%zuC", to_col - from_col));
+    }
+    e->term_col = to;
+}
+
+// Function to find the suggestion for the line: the rest of the newest
+// history entry that starts with it
+const char* find_suggestion(struct editor* e, size_t* n) {
+    if (!suggest || e->done || e->len == 0 || e->cursor != e->len) {
+        return NULL;
+    }
+    for (int i = history_count - 1; i >= 0; i--) {
+        size_t hlen = strcspn(history[i], "\n");  // First line only
+        if (hlen > e->len && strncmp(history[i], e->line, e->len) == 0) {
+            *n = hlen - e->len;
+            return history[i] + e->len;
+        }
+    }
+    return NULL;
+}
+
+// Function to bring the screen up to date with the minimal change: keep what
+// old and new text share, rewrite only the rest and clear what is left over
+void editor_refresh(struct editor* e) {
+    size_t ghost_len = 0, same = 0, new_len, end_col, old_end_col;
+    const char* ghost = find_suggestion(e, &ghost_len);
+    char* text;
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        e->width = ws.ws_col;
+    }
+    // Control characters (from history entries) are drawn as ^X
+    new_len = 0;
+    text = malloc(2 * e->len + ghost_len + 1);
+    if (!text) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t cursor_at = 0;
+    for (size_t i = 0; i < e->len; i++) {
+        if (i == e->cursor) {
+            cursor_at = new_len;
+        }
+        if ((unsigned char)e->line[i] < 32) {
+            text[new_len++] = '^';
+            text[new_len++] = e->line[i] + 64;
+        } else {
+            text[new_len++] = e->line[i];
+        }
+    }
+    if (e->cursor == e->len) {
+        cursor_at = new_len;
+    }
+    size_t ghost_at = new_len;
+    memcpy(text + new_len, ghost ? ghost : "", ghost_len);
+    new_len += ghost_len;
+
+    while (same < new_len && same < e->shown_len && text[same] == e->shown[same] &&
+           (same < ghost_at) == (same < e->shown_ghost)) {
+        same++;
+    }
+    while (same > 0 && ((unsigned char)text[same] & 0xC0) == 0x80) {
+        same--;  // Never split a UTF-8 character
+    }
+    old_end_col = e->prompt_width + text_width(e->shown, e->shown_len);
+    end_col = e->prompt_width + text_width(text, new_len);
+
+    if (same < new_len || end_col < old_end_col) {
+        editor_move(e, e->prompt_width + text_width(text, same));
+        if (same < ghost_at) {
+            editor_out(e, text + same, ghost_at - same);
+        }
+        if (ghost_len > 0) {
+            size_t from = same > ghost_at ? same : ghost_at;
+            editor_out(e, "\x1b[2m", 4);  // Suggestions are drawn dim
+            editor_out(e, text + from, new_len - from);
+            editor_out(e, "\x1b[0m", 4);
+        }
+        e->term_col = end_col;
+        if (end_col % e->width == 0 && new_len > same) {
+            editor_out(e, "\r\n", 2);  // Leave the pending-wrap state at the right margin
+        }
+        if (end_col < old_end_col) {
+            editor_out(e, "\x1b[J", 3);
+        }
+    }
+    editor_move(e, e->prompt_width + text_width(text, cursor_at));
+    free(e->shown);
+    e->shown = text;
+    e->shown_len = new_len;
+    e->shown_ghost = ghost_at;
+}
+
+// Function to replace the line with text, cursor at the end
+void editor_set_line(struct editor* e, const char* text, size_t n) {
+    while (n + 2 > e->cap) {
+        e->cap *= 2;
+        e->line = realloc(e->line, e->cap);
+        if (!e->line) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(e->line, text, n);
+    e->len = e->cursor = n;
+}
+
+// Function to insert n bytes at the cursor
+void editor_insert(struct editor* e, const char* text, size_t n) {
+    while (e->len + n + 2 > e->cap) {
+        e->cap *= 2;
+        e->line = realloc(e->line, e->cap);
+        if (!e->line) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memmove(e->line + e->cursor + n, e->line + e->cursor, e->len - e->cursor);
+    memcpy(e->line + e->cursor, text, n);
+    e->len += n;
+    e->cursor += n;
+}
+
+// Function to delete the bytes between from and to
+void editor_delete(struct editor* e, size_t from, size_t to) {
+    memmove(e->line + from, e->line + to, e->len - to);
+    e->len -= to - from;
+    e->cursor = from;
+}
+
+// Function to step from pos over one UTF-8 character backwards or forwards
+size_t editor_step(struct editor* e, size_t pos, bool forward) {
+    if (forward) {
+        if (pos < e->len) {
+            pos++;
+        }
+        while (pos < e->len && ((unsigned char)e->line[pos] & 0xC0) == 0x80) {
+            pos++;
+        }
+    } else {
+        if (pos > 0) {
+            pos--;
+        }
+        while (pos > 0 && ((unsigned char)e->line[pos] & 0xC0) == 0x80) {
+            pos--;
+        }
+    }
+    return pos;
+}
+
+// Function to show history entry index, or the draft when index is history_count
+void editor_browse(struct editor* e, int index) {
+    if (index < 0 || index > history_count || index == e->hist_index) {
+        editor_out(e, "\a", 1);
+        return;
+    }
+    if (e->hist_index == history_count) {
+        free(e->draft);
+        e->draft = strndup(e->line, e->len);
+    }
+    e->hist_index = index;
+    if (index == history_count) {
+        editor_set_line(e, e->draft, strlen(e->draft));
+    } else {
+        size_t n = strlen(history[index]);
+        if (n > 0 && history[index][n - 1] == '\n') {
+            n--;
+        }
+        editor_set_line(e, history[index], n);
+    }
+}
+
+// Function to measure prompt_text: rows above its last row, and that row's width
+void editor_measure_prompt(struct editor* e) {
+    const char* last = strrchr(prompt_text, '\n');
+    e->prompt_rows = 0;
+    for (const char* p = prompt_text; (p = strchr(p, '\n')) != NULL; p++) {
+        e->prompt_rows++;
+    }
+    last = last ? last + 1 : prompt_text;
+    e->prompt_width = text_width(last, strlen(last));
+}
+
+// Function to draw a freshly rendered prompt over the old one and the line after it
+void editor_repaint_prompt(struct editor* e) {
+    char seq[32];
+    bool async;
+
+    render_prompt(&async);
+    editor_move(e, 0);
+    if (e->prompt_rows > 0) {
+        editor_out(e, seq, sprintf(seq, "\x1b[%dA", e->prompt_rows));
+    }
+    editor_out(e, "\r\x1b[J", 4);
+    editor_out(e, prompt_text, strlen(prompt_text));
+    editor_measure_prompt(e);
+    e->term_col = e->prompt_width;
+    e->shown_len = e->shown_ghost = 0;
+    editor_refresh(e);
+    editor_flush(e);
+}
+
+// Function called when the prompt helper's pipe is readable: take its result
+// in and repaint the prompt if a line is being edited under it
+void prompt_helper_ready(int fd, void* data) {
+    (void)fd;
+    (void)data;
+    if (collect_prompt_helper() && prompt_live && editing) {
+        editor_repaint_prompt(&line_editor);
+    }
+}
+
+// Function to print the queued job notices above the line being edited and
+// draw the prompt and the line again below them
+void editor_show_notices() {
+    struct editor* e = &line_editor;
+    char seq[32];
+
+    editor_move(e, 0);
+    if (e->prompt_rows > 0) {
+        editor_out(e, seq, sprintf(seq, "\x1b[%dA", e->prompt_rows));
+    }
+    editor_out(e, "\r\x1b[J", 4);
+    editor_flush(e);
+    for (int i = 0; i < notice_count; i++) {
+        printf("%s\r\n", job_notices[i]);  // Raw mode: no newline translation
+        free(job_notices[i]);
+    }
+    notice_count = 0;
+    fflush(stdout);
+    editor_out(e, prompt_text, strlen(prompt_text));
+    e->term_col = e->prompt_width;
+    e->shown_len = e->shown_ghost = 0;
+    editor_refresh(e);
+    editor_flush(e);
+}
+
+// Function to act on the final byte of an escape sequence: 'A'..'D' for the
+// arrows, 'H'/'F' for Home/End, '3' for Delete
+void editor_escape_key(struct editor* e, int c) {
+    size_t ghost_len;
+    const char* ghost;
+
+    if (c == 'A') {
+        editor_browse(e, e->hist_index - 1);
+    } else if (c == 'B') {
+        editor_browse(e, e->hist_index + 1);
+    } else if (c == 'C') {
+        ghost = find_suggestion(e, &ghost_len);
+        if (ghost) {
+            editor_insert(e, ghost, ghost_len);  // Accept the suggestion
+        } else {
+            e->cursor = editor_step(e, e->cursor, true);
+        }
+    } else if (c == 'D') {
+        e->cursor = editor_step(e, e->cursor, false);
+    } else if (c == 'H') {
+        e->cursor = 0;
+    } else if (c == 'F') {
+        ghost = find_suggestion(e, &ghost_len);
+        if (ghost) {
+            editor_insert(e, ghost, ghost_len);
+        }
+        e->cursor = e->len;
+    } else if (c == '3' && e->cursor < e->len) {
+        editor_delete(e, e->cursor, editor_step(e, e->cursor, true));
+    }
+}
+
+// Function to handle one input byte (-1 at end of input). Escape sequences
+// arrive a byte at a time and are collected in e->escape.
+void editor_key(struct editor* e, int c) {
+    bool tab = false;
+
+    if (e->escape == 1) {  // After ESC: only CSI and SS3 sequences are understood
+        e->escape = c == '[' || c == 'O' ? 2 : 0;
+        e->escape_num = 0;
+        return;
+    }
+    if (e->escape == 2) {
+        if (c >= '0' && c <= '9') {
+            e->escape_num = e->escape_num * 10 + (c - '0');
+            return;
+        }
+        e->escape = 0;
+        if (c == '~') {  // ESC [ n ~
+            int num = e->escape_num;
+            c = num == 1 || num == 7 ? 'H' : num == 4 || num == 8 ? 'F' : num == 3 ? '3' : 0;
+        }
+        editor_escape_key(e, c);
+        e->last_tab = false;
+        return;
+    }
+
+    if (c == 27) {
+        e->escape = 1;
+        return;
+    } else if (c < 0 || (c == 4 && e->len == 0)) {  // Ctrl+D on an empty line
+        e->eof = true;
+        e->done = true;
+    } else if (c == '\r' || c == '\n') {
+        e->cursor = e->len;
+        e->done = true;
+    } else if (c == 3) {  // Ctrl+C discards the line, leaving it on screen
+        e->cursor = e->len;
+        e->done = true;
+        editor_refresh(e);
+        editor_out(e, "^C", 2);
+        e->len = 0;
+        e->cancel = true;
+    } else if (c == 4) {  // Ctrl+D inside a line deletes forward
+        if (e->cursor < e->len) {
+            editor_delete(e, e->cursor, editor_step(e, e->cursor, true));
+        }
+    } else if (c == 127 || c == 8) {
+        if (e->cursor > 0) {
+            editor_delete(e, editor_step(e, e->cursor, false), e->cursor);
+        }
+    } else if (c == 1) {  // Ctrl+A
+        e->cursor = 0;
+    } else if (c == 5) {  // Ctrl+E
+        e->cursor = e->len;
+    } else if (c == 11) {  // Ctrl+K: delete to the end of the line
+        e->len = e->cursor;
+    } else if (c == 21) {  // Ctrl+U: delete to the start of the line
+        editor_delete(e, 0, e->cursor);
+    } else if (c == 23) {  // Ctrl+W: delete the word before the cursor
+        size_t from = e->cursor;
+        while (from > 0 && e->line[from - 1] == ' ') {
+            from--;
+        }
+        while (from > 0 && e->line[from - 1] != ' ') {
+            from--;
+        }
+        editor_delete(e, from, e->cursor);
+    } else if (c == 12) {  // Ctrl+L: clear the screen and draw the line again
+        editor_out(e, "\x1b[H\x1b[2J", 7);
+        editor_out(e, prompt_text, strlen(prompt_text));
+        e->term_col = e->prompt_width;
+        e->shown_len = e->shown_ghost = 0;
+    } else if (c == '\t') {
+        bool listed = false;
+        editor_refresh(e);  // Bytes before the Tab may not be drawn yet
+        editor_flush(e);
+        char* insert = complete_line(e->line, e->cursor, e->last_tab, &listed);
+        tab = true;
+        if (insert) {
+            editor_insert(e, insert, strlen(insert));
+            free(insert);
+        } else if (listed) {  // The candidates pushed the line down: draw it afresh
+            editor_out(e, prompt_text, strlen(prompt_text));
+            e->term_col = e->prompt_width;
+            e->shown_len = e->shown_ghost = 0;
+        } else {
+            editor_out(e, "\a", 1);
+        }
+    } else if (c >= 32) {
+        char ch = c;
+        editor_insert(e, &ch, 1);
+    }
+    e->last_tab = tab;
+}
+
+// Function to restore the terminal, stop watching it and hand the finished
+// line (with its newline, like getline(), or NULL at end of input) on
+void editor_finish(struct editor* e) {
+    void (*on_line)(char* line) = e->on_line;
+    char* line = e->line;
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked_termios);
+    event_remove(STDIN_FILENO);
+    editing = false;
+    free(e->shown);
+    free(e->draft);
+    free(e->out);
+    if (e->eof) {
+        free(line);
+        line = NULL;
+    } else {
+        line[e->len++] = '\n';
+        line[e->len] = '\0';
+    }
+    memset(e, 0, sizeof(*e));
+    on_line(line);
+}
+
+// Function called by the event loop when the terminal has input: feed the
+// bytes already there to the editor one by one and send the screen update in
+// one write(). Bytes are read singly so that typed-ahead input after Enter
+// stays in the terminal for the command the line starts.
+void editor_input(int fd, void* data) {
+    struct editor* e = &line_editor;
+    int pending = 1;
+
+    (void)data;
+    if (ioctl(fd, FIONREAD, &pending) < 0 || pending < 1) {
+        pending = 1;  // Readable with nothing queued: end of input
+    }
+    while (pending-- > 0 && !e->done) {
+        unsigned char c;
+        ssize_t n = read(fd, &c, 1);
+        if (n < 0 && errno == EINTR) {
+            pending++;
+            continue;
+        }
+        editor_key(e, n == 1 ? c : -1);
+        if (n != 1) {
+            break;
+        }
+    }
+    if (!e->eof && !e->cancel) {
+        editor_refresh(e);
+    }
+    if (e->done) {
+        editor_out(e, "\r\n", 2);
+    }
+    editor_flush(e);
+    if (e->done) {
+        editor_finish(e);
+    }
+}
+
+// Function to start editing a line under the prompt already printed: arrow
+// keys, Home/End, Backspace/Delete, Ctrl+A/E/K/U/W/L, Up/Down through the
+// history, Tab completion and (with set -o suggest) inline suggestions. Keys
+// are taken by the event loop; on_line gets the line once Enter is pressed.
+void editor_start(void (*on_line)(char* line)) {
+    struct editor* e = &line_editor;
+    struct termios raw;
+
+    memset(e, 0, sizeof(*e));
+    e->cap = 128;
+    e->line = malloc(e->cap);
+    if (!e->line) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    e->width = 80;
+    editor_measure_prompt(e);
+    e->term_col = e->prompt_width;
+    e->hist_index = history_count;
+    e->on_line = on_line;
+
+    tcgetattr(STDIN_FILENO, &cooked_termios);
+    raw = cooked_termios;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    fflush(stdout);
+    if (!indexed_path) {
+        // Build the command index while the first prompt waits; keys typed
+        // meanwhile stay queued in the terminal
+        refresh_command_index();
+    }
+    editing = event_add(STDIN_FILENO, editor_input, NULL);
+    if (!editing) {
+        e->eof = true;
+        editor_finish(e);
+    }
+}
+
+// Function to join words with the first character of IFS, as $*, unquoted $@
+// and ${a[*]} expand. The result lasts until the next call.
+const char* join_params(char** items, int count) {
+    static char* joined = NULL;
+    static size_t cap = 0;
+    const char* ifs = get_variable_value("IFS");
+    size_t len = 0;
+
+    for (int i = 0; i < count; i++) {
+        size_t n = strlen(items[i]);
+        if (len + n + 2 > cap) {
+            cap = (len + n + 2) * 2;
+            joined = realloc(joined, cap);
+            if (!joined) {
+                fprintf(stderr, "Reallocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (i > 0 && (!ifs || ifs[0])) {
+            joined[len++] = ifs ? ifs[0] : ' ';
+        }
+        memcpy(joined + len, items[i], n);
+        len += n;
+    }
+    if (len == 0) {
+        return "";
+    }
+    joined[len] = '\0';
+    return joined;
+}
+
+// Function to find the value of a parameter: special parameters first, then
+// shell variables, then the environment. numbuf holds numeric results.
+const char* lookup_param(const char* name, char* numbuf, size_t numbuf_size) {
+    if (strcmp(name, "?") == 0) {
+        snprintf(numbuf, numbuf_size, "%d", last_status);
+        return numbuf;
+    } else if (strcmp(name, "$") == 0) {
+        snprintf(numbuf, numbuf_size, "%d", (int)getpid());
+        return numbuf;
+    } else if (strcmp(name, "!") == 0) {
+        if (last_bg_pid == 0) {
+            return "";
+        }
+        snprintf(numbuf, numbuf_size, "%d", (int)last_bg_pid);
+        return numbuf;
+    } else if (strcmp(name, "#") == 0) {
+        snprintf(numbuf, numbuf_size, "%d", positional_count);
+        return numbuf;
+    } else if (strcmp(name, "0") == 0) {
+        return "PUCITshell";
+    } else if (isdigit((unsigned char)name[0])) {  // $1 ... ${10}
+        int n = atoi(name);
+        return n <= positional_count ? positional[n - 1] : "";
+    } else if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0) {
+        return join_params(positional, positional_count);
+    }
+    const char* value = get_variable_value((char*)name);
+    if (!value) {
+        value = getenv(name);
+    }
+    return value ? value : "";
+}
+
+// Function to evaluate a compiled $(( )) part. Reports an error and sets
+// expansion_failed when the expression is invalid.
+long long evaluate_arith_part(struct word_part* part) {
+    bool error = false;
+    long long value;
+
+    if (!part->arith) {
+        fprintf(stderr, "%s: arithmetic syntax error\n", part->text);
+        expansion_failed = true;
+        return 0;
+    }
+    value = arith_eval(part->arith, &error);
+    if (error) {
+        expansion_failed = true;
+    }
+    return value;
+}
+
+char* expand_word_string(struct word* w);
+
+// Words "$@", "${a[@]}" or "${!a[@]}" expand to, a field each. They are the
+// positional parameters or point into the array's arena, except the indexes
+// of an indexed array, which are formatted into strings of their own.
+struct param_words {
+    char **items;
+    int count;
+    bool own_list;              // items was allocated here
+    bool own_items;             // ... and so were the strings in it
+    struct array_arena *arena;  // Where the strings are, for borrowing them
+};
+
+// Function to list the words of "$@", or of an array's elements or keys
+void param_words(struct word_part* part, struct param_words* pw) {
+    int slot = part->all ? find_variable(part->text) : -1;
+    struct array* a = slot >= 0 ? shell_vars[slot].array : NULL;
+
+    memset(pw, 0, sizeof(*pw));
+    if (!part->all) {
+        pw->items = positional;
+        pw->count = positional_count;
+        return;
+    }
+    pw->items = malloc((a ? a->set + 1 : 1) * sizeof(char*));
+    if (!pw->items) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    pw->own_list = true;
+    if (!a) {  // A string is an array of one element
+        if (slot >= 0) {
+            pw->items[pw->count++] = part->prefix == '!' ? "0" : variable_string(&shell_vars[slot]);
+        }
+        return;
+    }
+    pw->arena = a->arena;
+    for (int i = 0; !a->assoc && i < a->count; i++) {
+        if (a->items[i].length == SLICE_UNSET) {
+            continue;
+        }
+        if (part->prefix == '!') {
+            char index[16];
+            snprintf(index, sizeof(index), "%d", i);
+            pw->items[pw->count++] = strdup(index);
+            pw->own_items = true;
+            pw->arena = NULL;
+        } else {
+            pw->items[pw->count++] = array_text(a, a->items[i]);
+        }
+    }
+    for (int i = 0; a->assoc && i < a->cap; i++) {
+        if (a->slots[i].state == SLOT_FULL) {
+            pw->items[pw->count++] = array_text(a, part->prefix == '!' ? a->slots[i].key : a->slots[i].value);
+        }
+    }
+}
+
+// Function to release a list made by param_words()
+void free_param_words(struct param_words* pw) {
+    for (int i = 0; pw->own_items && i < pw->count; i++) {
+        free(pw->items[i]);
+    }
+    if (pw->own_list) {
+        free(pw->items);
+    }
+}
+
+// Function to evaluate the subscript of an indexed array's element. Reports
+// an error and sets expansion_failed when it is not a valid expression.
+bool subscript_index(struct word* subscript, struct arith_node* arith, long long* index) {
+    bool error = false;
+
+    if (arith) {
+        *index = arith_eval(arith, &error);
+    } else {  // Compiled again after expansion, e.g. a["$i"]
+        char* text = expand_word_string(subscript);
+        struct arith_node* n = arith_compile(text);
+        if (!n) {
+            fprintf(stderr, "%s: bad array subscript\n", text);
+            error = true;
+        } else {
+            *index = arith_eval(n, &error);
+            arith_free(n);
+        }
+        free(text);
+    }
+    if (error) {
+        expansion_failed = true;
+    }
+    return !error;
+}
+
+// Function to get the element ${a[i]} expands to, "" if it is not set. A
+// string variable is its own element 0.
+const char* element_value(struct word_part* part) {
+    int slot = find_variable(part->text);
+    struct array* a = slot >= 0 ? shell_vars[slot].array : NULL;
+    const char* value = NULL;
+    long long i;
+
+    if (a && a->assoc) {
+        char* key = expand_word_string(part->subscript);
+        value = assoc_get(a, key);
+        free(key);
+    } else if (subscript_index(part->subscript, part->arith, &i)) {
+        if (a) {
+            value = array_get(a, i);
+        } else if (slot >= 0 && i == 0) {
+            value = variable_string(&shell_vars[slot]);
+        }
+    }
+    return value ? value : "";
+}
+
+// Function to get the text of ${#name}, ${a[i]}, or of ${a[@]} and ${!a[@]}
+// joined as $* is joined
+const char* array_param(struct word_part* part, char* numbuf, size_t numbuf_size) {
+    if (part->all || (part->prefix == '#' && (strcmp(part->text, "@") == 0 || strcmp(part->text, "*") == 0))) {
+        struct param_words pw;
+        const char* text;
+        param_words(part, &pw);
+        if (part->prefix == '#') {
+            snprintf(numbuf, numbuf_size, "%d", pw.count);
+            text = numbuf;
+        } else {
+            text = join_params(pw.items, pw.count);
+        }
+        free_param_words(&pw);
+        return text;
+    }
+    const char* value = part->subscript ? element_value(part) : lookup_param(part->text, numbuf, numbuf_size);
+    if (part->prefix == '#') {
+        snprintf(numbuf, numbuf_size, "%zu", strlen(value));
+        return numbuf;
+    }
+    return value;
+}
+
+// Function to get the text a word part expands to; numeric results are
+// formatted into numbuf
+const char* part_value(struct word_part* part, char* numbuf, size_t numbuf_size) {
+    if (part->type == PART_PARAM && (part->prefix || part->all || part->subscript)) {
+        return array_param(part, numbuf, numbuf_size);
+    } else if (part->type == PART_PARAM) {
+        return lookup_param(part->text, numbuf, numbuf_size);
+    } else if (part->type == PART_ARITH) {
+        snprintf(numbuf, numbuf_size, "%lld", evaluate_arith_part(part));
+        return numbuf;
+    }
+    return part->text;
+}
+
+// Function to keep an arena alive while fields point into it
+void pin_arena(struct field_list* fields, struct array_arena* arena) {
+    for (int i = 0; i < fields->pin_count; i++) {
+        if (fields->pins[i] == arena) {
+            return;
+        }
+    }
+    fields->pins = realloc(fields->pins, (fields->pin_count + 1) * sizeof(struct array_arena*));
+    if (!fields->pins) {
+        fprintf(stderr, "Reallocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    fields->pins[fields->pin_count++] = arena;
+    arena->refs++;
+}
+
+// Function to check whether an argument points into one of the pinned
+// arenas, a NULL-terminated list, rather than being a string of its own
+bool borrowed(struct array_arena** pins, const char* arg) {
+    for (int i = 0; pins[i] != NULL; i++) {
+        if (arg >= pins[i]->data && arg < pins[i]->data + pins[i]->used) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to expand a field made by substitution as a pathname pattern
+void expand_glob_field(const char* pat, const char* text, struct field_list* fields) {
+    struct glob_pattern* gp = glob_compile(pat);
+    if (gp) {
+        glob_field(gp, text, fields);
+        glob_free(gp);
+    } else {
+        add_field(fields, strdup(text));
+    }
+}
+
+char* expand_pattern(struct word* w);
+
+// Function to add a field built by expand_word() (len bytes of cur) to the
+// list, replaced by the pathnames it matches if it has unquoted wildcards
+void end_field(char* cur, size_t len, char* pat, size_t pat_len, bool field_glob, struct field_list* fields) {
+    cur[len] = '\0';
+    if (field_glob) {
+        pat[pat_len] = '\0';
+        expand_glob_field(pat, cur, fields);
+    } else {
+        add_field(fields, strndup(cur, len));
+    }
+}
+
+// Function to expand a compiled word into zero or more fields. Unquoted
+// parameter values are split on IFS; quoted parts are never split. Fields
+// with unquoted wildcards are replaced by the pathnames they match.
+void expand_word(struct word* w, struct field_list* fields) {
+    char numbuf[32];
+    const char* ifs = get_variable_value("IFS");
+    char* cur;
+    char* pat = NULL;  // The field as a pattern, with quoted wildcards escaped
+    size_t len = 0, cap = 64, pat_len = 0;
+    bool have_field = false;
+    bool field_glob = false;  // The field has an unquoted wildcard
+
+    if (w->literal) {  // Fast path: nothing to substitute
+        if (w->may_glob && !w->glob) {
+            char* text = expand_pattern(w);
+            w->glob = glob_compile(text);
+            w->may_glob = w->glob != NULL;  // e.g. a lone '[' is not compiled again
+            free(text);
+        }
+        if (w->glob) {
+            glob_field(w->glob, w->literal, fields);
+        } else {
+            add_field(fields, strdup(w->literal));
+        }
+        return;
+    }
+    if (!ifs) {
+        ifs = " \t\n";
+    }
+    cur = malloc(cap);
+    if (w->may_glob) {
+        pat = malloc(2 * cap);
+    }
+    for (int i = 0; i < w->part_count; i++) {
+        struct word_part* part = &w->parts[i];
+        const char* text = part->text;
+        bool split = false;
+        // "$@" is a field for each positional parameter, the first joined to
+        // the text before it and the last to the text after it; "${a[@]}"
+        // one for each element and "${!a[@]}" one for each key
+        bool each = part->quoted && part->type == PART_PARAM && part->prefix != '#' &&
+                    (part->all == '@' || (!part->all && strcmp(part->text, "@") == 0));
+        struct param_words words;
+
+        if (each) {
+            param_words(part, &words);
+            if (fields->borrow && w->part_count == 1 && words.arena) {
+                // The word is just "${a[@]}": the fields are the elements
+                // themselves, not copies
+                for (int k = 0; k < words.count; k++) {
+                    add_field(fields, words.items[k]);
+                }
+                if (words.count > 0) {
+                    pin_arena(fields, words.arena);
+                }
+                free_param_words(&words);
+                continue;
+            }
+        }
+        if (part->type != PART_LITERAL && !each) {
+            text = part_value(part, numbuf, sizeof(numbuf));
+            split = !part->quoted;
+        }
+        // A quoted part makes a field even when empty, except "$@" with no parameters
+        if (part->quoted && !each) {
+            have_field = true;
+        }
+        for (int k = 0; k < (each ? words.count : 1); k++) {
+            if (each) {
+                if (k > 0) {
+                    end_field(cur, len, pat, pat_len, field_glob, fields);
+                    len = pat_len = 0;
+                    field_glob = false;
+                }
+                text = words.items[k];
+                have_field = true;
+            }
+            for (const char* c = text; *c; c++) {
+                if (split && strchr(ifs, *c)) {
+                    if (len > 0 || have_field) {  // Field boundary
+                        end_field(cur, len, pat, pat_len, field_glob, fields);
+                        len = pat_len = 0;
+                        have_field = field_glob = false;
+                    }
+                    continue;
+                }
+                if (len + 2 > cap) {
+                    cap *= 2;
+                    cur = realloc(cur, cap);
+                    if (pat) {
+                        pat = realloc(pat, 2 * cap);
+                    }
+                }
+                cur[len++] = *c;
+                if (pat) {
+                    if (part->quoted && strchr("*?[]\\", *c)) {
+                        pat[pat_len++] = '\\';
+                    } else if (!part->quoted && strchr("*?[", *c)) {
+                        field_glob = true;
+                    }
+                    pat[pat_len++] = *c;
+                }
+                have_field = true;
+            }
+        }
+        if (each) {
+            free_param_words(&words);
+        }
+    }
+    if (have_field) {
+        end_field(cur, len, pat, pat_len, field_glob, fields);
+    }
+    free(cur);
+    free(pat);
+}
+
+// Function to expand a word into a single string without field splitting,
+// as needed for assignment values and case subjects
+char* expand_word_string(struct word* w) {
+    char numbuf[32];
+    size_t len = 0, cap = 64;
+    char* result;
+
+    if (w->literal) {
+        return strdup(w->literal);
+    }
+    result = malloc(cap);
+    for (int i = 0; i < w->part_count; i++) {
+        // Each part is expanded exactly once: $(( )) may have side effects
+        const char* text = part_value(&w->parts[i], numbuf, sizeof(numbuf));
+        size_t n = strlen(text);
+        while (len + n + 1 > cap) {
+            cap *= 2;
+            result = realloc(result, cap);
+        }
+        memcpy(result + len, text, n);
+        len += n;
+    }
+    result[len] = '\0';
+    return result;
+}
+
+// Function to expand a word used as a case pattern. Quoted characters are
+// backslash-escaped so that only unquoted *, ? and [ act as wildcards.
+char* expand_pattern(struct word* w) {
+    char numbuf[32];
+    size_t len = 0, cap = 64;
+    char* result = malloc(cap);
+
+    for (int i = 0; i < w->part_count; i++) {
+        struct word_part* part = &w->parts[i];
+        const char* text = part_value(part, numbuf, sizeof(numbuf));
+        for (const char* c = text; *c; c++) {
+            if (len + 3 > cap) {
+                cap *= 2;
+                result = realloc(result, cap);
+            }
+            if (part->quoted && strchr("*?[]\\", *c)) {
+                result[len++] = '\\';
+            }
+            result[len++] = *c;
+        }
+    }
+    result[len] = '\0';
+    return result;
+}
+
+// Function to expand a command's redirection targets into file names.
+// Returns 0, or -1 if a target does not expand to exactly one word.
+int expand_redirects(struct command* cmd) {
+    for (int i = 0; i < cmd->redir_count; i++) {
+        struct field_list target = { 0 };
+        struct redirect* r = &cmd->redirs[i];
+        expand_word(&r->target_word, &target);
+        if (target.count != 1) {
+            fprintf(stderr, "%s: ambiguous redirect\n", r->target_word.literal ? r->target_word.literal : "$...");
+            for (int j = 0; j < target.count; j++) {
+                free(target.items[j]);
+            }
+            free(target.items);
+            for (int j = 0; j < i; j++) {
+                free(cmd->redirs[j].target);
+                cmd->redirs[j].target = NULL;
+            }
+            return -1;
+        }
+        r->target = target.items[0];
+        free(target.items);
+    }
+    return 0;
+}
+
+// Function to expand a command's words into its argument vector and its
+// redirection targets into file names. Returns 0, or -1 on a bad target.
+// Arguments from "${a[@]}" point into the array's arena; the arenas they
+// borrow from are listed after the NULL that ends the arguments.
+int expand_command(struct command* cmd) {
+    struct field_list fields = { 0 };
+
+    expansion_failed = false;
+    fields.borrow = true;
+    for (int i = 0; i < cmd->word_count; i++) {
+        expand_word(&cmd->words[i], &fields);
+    }
+    add_field(&fields, NULL);  // Guarantees a NULL-terminated array
+    for (int i = 0; i < fields.pin_count; i++) {
+        add_field(&fields, (char*)fields.pins[i]);
+    }
+    free(fields.pins);
+    cmd->args = fields.items;
+    if (expansion_failed) {
+        return -1;
+    }
+    return expand_redirects(cmd);
+}
+
+// Function to free the arguments and targets produced by expand_command()
+void release_expansion(struct command* cmd) {
+    if (cmd->args) {
+        int argc = 0;
+        while (cmd->args[argc] != NULL) {
+            argc++;
+        }
+        struct array_arena** pins = (struct array_arena**)cmd->args + argc + 1;
+        for (int i = 0; i < argc; i++) {
+            if (!borrowed(pins, cmd->args[i])) {
+                free(cmd->args[i]);
+            }
+        }
+        for (int i = 0; pins[i] != NULL; i++) {
+            arena_release(pins[i]);
+        }
+        free(cmd->args);
+        cmd->args = NULL;
+    }
+    for (int i = 0; i < cmd->redir_count; i++) {
+        free(cmd->redirs[i].target);
+        cmd->redirs[i].target = NULL;
+        cmd->redirs[i].fanout = false;
+    }
+}
+
+// Function to open the file behind a redirection. The descriptor is opened
+// close-on-exec, so it can never leak into the command or back into the shell
+// even if a later redirection in the same list fails.
+int open_redirect_target(struct redirect* r) {
+    int flags;
+
+    switch (r->type) {
+    case REDIR_IN:
+        flags = O_RDONLY;
+        break;
+    case REDIR_RDWR:
+        flags = O_RDWR | O_CREAT;
+        break;
+    case REDIR_APPEND:
+    case REDIR_APPEND_ERR:
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+        break;
+    case REDIR_OUT:
+    case REDIR_OUT_ERR:
+        if (noclobber) {
+            int fd = open(r->target, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+            struct stat st;
+            if (fd >= 0 || errno != EEXIST) {
+                return fd;
+            }
+            // Existing non-regular files such as /dev/null may still be written
+            if (stat(r->target, &st) == 0 && !S_ISREG(st.st_mode)) {
+                return open(r->target, O_WRONLY | O_CLOEXEC);
+            }
+            errno = EEXIST;
+            return -1;
+        }
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        break;
+    default:
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        break;
+    }
+    return open(r->target, flags | O_CLOEXEC, 0666);
+}
+
+// Function to make descriptor to a copy of from. The engine's private
+// descriptors in shell_fds stay close-on-exec, so no command inherits them.
+int dup_to(int from, int to) {
+    bool private = to > STDERR_FILENO && (to == shell_fds[0] || to == shell_fds[1] || to == shell_fds[2]);
+    return dup3(from, to, private ? O_CLOEXEC : 0);
+}
+
+// Function to remember the current state of a descriptor before it is replaced
+void save_fd(int fd, struct saved_fd* saved, int* saved_count) {
+    for (int i = 0; i < *saved_count; i++) {
+        if (saved[i].fd == fd) {
+            return;  // Already saved by an earlier redirection
+        }
+    }
+    sync_fd_reader(fd, true);
+    if (fd == shell_fds[STDIN_FILENO]) {
+        stdin_redirects++;
+    }
+    saved[*saved_count].fd = fd;
+    saved[*saved_count].copy = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    (*saved_count)++;
+}
+
+int fanout_fd = -1;  // In a command's child: the fan-out pipe, until its first target is reached
+
+// Function to report a redirection whose file could not be opened
+void redirect_error(struct redirect* r) {
+    if (errno == EEXIST && noclobber) {
+        fprintf(stderr, "%s: cannot overwrite existing file\n", r->target);
+    } else {
+        fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+    }
+}
+
+// Function to apply a command's redirection list in order. When saved is not
+// NULL the previous descriptors are kept so restore_redirects() can undo the
+// changes (used for built-ins, which run inside the shell process).
+// Descriptors 0-2 are the engine's own (see shell_fds).
+// Returns 0 on success, -1 after reporting the failing redirection.
+int apply_redirects(struct command* cmd, struct saved_fd* saved, int* saved_count) {
+    for (int i = 0; i < cmd->redir_count; i++) {
+        struct redirect* r = &cmd->redirs[i];
+        int target = shell_fd(r->fd);
+
+        if (r->fanout) {  // Stdout goes to the helper from here on, in order with 2>&1 and the like
+            if (fanout_fd >= 0) {
+                dup_to(fanout_fd, target);
+                close(fanout_fd);
+                fanout_fd = -1;
+            }
+            continue;
+        }
+        if (saved) {
+            save_fd(target, saved, saved_count);
+            if (r->type == REDIR_OUT_ERR || r->type == REDIR_APPEND_ERR) {
+                save_fd(shell_fd(STDERR_FILENO), saved, saved_count);
+            }
+        } else {
+            sync_fd_reader(target, true);
+            if (target == shell_fds[STDIN_FILENO]) {
+                stdin_redirects++;  // Forked copy: never restored
+            }
+        }
+
+        if (r->type == REDIR_DUP) {
+            if (strcmp(r->target, "-") == 0) {
+                close(target);
+                continue;
+            }
+            char* end;
+            long src = strtol(r->target, &end, 10);
+            if (*end != '\0' || src < 0 || src > INT_MAX) {
+                fprintf(stderr, "%s: ambiguous redirect\n", r->target);
+                return -1;
+            }
+            if (shell_fd((int)src) != target && dup_to(shell_fd((int)src), target) < 0) {
+                fprintf(stderr, "%ld: %s\n", src, strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+
+        int fd = open_redirect_target(r);
+        if (fd < 0) {
+            redirect_error(r);
+            return -1;
+        }
+        // dup_to() clears close-on-exec on the target descriptor only
+        if (fd != target) {
+            dup_to(fd, target);
+            close(fd);
+        } else {
+            fcntl(fd, F_SETFD, 0);
+        }
+        if (r->type == REDIR_OUT_ERR || r->type == REDIR_APPEND_ERR) {
+            dup_to(target, shell_fd(STDERR_FILENO));
+        }
+    }
+    return 0;
+}
+
+// Function to put back descriptors saved by apply_redirects()
+void restore_redirects(struct saved_fd* saved, int saved_count) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = saved_count - 1; i >= 0; i--) {
+        sync_fd_reader(saved[i].fd, true);
+        if (saved[i].fd == shell_fds[STDIN_FILENO]) {
+            stdin_redirects--;
+        }
+        if (saved[i].copy >= 0) {
+            dup_to(saved[i].copy, saved[i].fd);
+            close(saved[i].copy);
+        } else {
+            close(saved[i].fd);
+        }
+    }
+}
+
+// Function to tell whether execute_builtin() runs args in the shell itself,
+// so their redirections belong in the shell, or leaves them to
+// execute_command(), which opens the files in the child. Returns -1 after
+// reporting bad placement prefixes.
+int runs_in_shell(char** args) {
+    struct command_entry* e = command_lookup(args[0]);
+
+    if (e && e->function) {
+        return 1;
+    } else if (!e || !e->builtin) {
+        return get_variable_value(args[0]) != NULL;
+    } else if (strcmp(args[0], "tail") == 0) {
+        return is_job_tail(args);
+    } else if (is_placement_prefix(args[0])) {
+        struct placement p = session_placement;
+        char** command = parse_placement(args, &p);
+        return command == NULL ? -1 : command[0] == NULL;
+    }
+    return 1;
+}
+
+// Function to run a built-in with its redirections applied in the shell itself.
+// Returns 0 if the command is not a built-in, 1 otherwise.
+int run_builtin(struct command* cmd) {
+    struct saved_fd* saved;
+    int saved_count = 0;
+    int handled = 1;
+
+    if (cmd->args[0] != NULL && cmd->redir_count == 0) {
+        return execute_builtin(cmd->args);
+    }
+    if (cmd->args[0] != NULL) {
+        int in_shell = runs_in_shell(cmd->args);
+        if (in_shell < 0) {
+            last_status = 1;
+            return 1;
+        } else if (in_shell == 0) {
+            return 0;  // execute_command() redirects in the child
+        }
+    }
+    fflush(stdout);  // Pending prompt text belongs to the terminal, not the target
+    saved = malloc((2 * cmd->redir_count + 1) * sizeof(struct saved_fd));
+    if (!saved) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cmd->args[0] == NULL) {  // Only redirections, e.g. "> file" creates the file
+        if (apply_redirects(cmd, saved, &saved_count) != 0) {
+            last_status = 1;
+        } else if (cmd->assign_count == 0) {
+            last_status = 0;  // Otherwise the assignments' status stands
+        }
+    } else if (apply_redirects(cmd, saved, &saved_count) == 0) {
+        struct command_entry* e = command_lookup(cmd->args[0]);
+        for (int i = 0; e && e->function && i < cmd->redir_count; i++) {
+            free(cmd->redirs[i].target);  // Opened; the function may expand this command again
+            cmd->redirs[i].target = NULL;
+        }
+        handled = execute_builtin(cmd->args);
+    } else {
+        // Do not fall through to execute_command() after a failed redirection
+        last_status = 1;
+    }
+    restore_redirects(saved, saved_count);
+    free(saved);
+    return handled;
+}
+
+// Function to count the sinks standing behind a command's stdout: every file
+// redirected with >, >> or >|, plus the pipe to the next stage if there is one
+int count_stdout_sinks(struct command* cmd, bool piped) {
+    int sinks = piped ? 1 : 0;
+    for (int i = 0; i < cmd->redir_count; i++) {
+        struct redirect* r = &cmd->redirs[i];
+        if (r->fd == STDOUT_FILENO &&
+            (r->type == REDIR_OUT || r->type == REDIR_APPEND || r->type == REDIR_CLOBBER)) {
+            sinks++;
+        }
+    }
+    return sinks;
+}
+
+// Function to move exactly len bytes from the pipe src into dst. splice(2)
+// keeps the data in the kernel; targets that refuse it (EINVAL) fall back to
+// a read/write copy for the rest of the stream.
+int move_from_pipe(int src, int dst, size_t len, bool* use_splice) {
+    char buf[65536];
+
+    while (len > 0) {
+        ssize_t n;
+        if (*use_splice) {
+            n = splice(src, NULL, dst, NULL, len, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINVAL) {
+                *use_splice = false;
+                continue;
+            }
+        } else {
+            n = read(src, buf, len < sizeof(buf) ? len : sizeof(buf));
+            for (ssize_t off = 0; n > 0 && off < n; ) {
+                ssize_t w = write(dst, buf + off, n - off);
+                if (w < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return -1;
+                }
+                off += w;
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to run the fan-out helper: everything arriving on in_fd is copied to
+// every sink without passing through user space. tee(2) duplicates the pipe
+// contents into a private pipe per extra sink, splice(2) drains those into the
+// files, and finally the original data is spliced into the last sink.
+void run_fanout(int in_fd, int* sinks, int sink_count) {
+    int (*pipes)[2] = calloc(sink_count, sizeof(int[2]));
+    bool* use_splice = malloc(sink_count * sizeof(bool));
+    int status = 0;
+
+    if (!pipes || !use_splice) {
+        fprintf(stderr, "Allocation error\n");
+        _exit(EXIT_FAILURE);
+    }
+    fcntl(in_fd, F_SETPIPE_SZ, 1 << 20);  // Larger batches per syscall; best effort
+    for (int k = 0; k < sink_count; k++) {
+        use_splice[k] = true;
+        if (k < sink_count - 1) {
+            if (pipe(pipes[k]) < 0) {
+                perror("Error creating pipe");
+                _exit(EXIT_FAILURE);
+            }
+            fcntl(pipes[k][0], F_SETPIPE_SZ, 1 << 20);
+        }
+    }
+
+    for (;;) {
+        ssize_t n = tee(in_fd, pipes[0][1], 1 << 20, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("tee failed");
+            status = 1;
+            break;
+        }
+        if (n == 0) {
+            break;  // Writer closed its end
+        }
+        // The first tee() decided the batch size; the others copy the same bytes
+        for (int k = 0; k < sink_count - 1 && status == 0; k++) {
+            if (k > 0) {
+                ssize_t done = 0;
+                while (done < n) {
+                    ssize_t t = tee(in_fd, pipes[k][1], n - done, 0);
+                    if (t <= 0) {
+                        if (t < 0 && errno == EINTR) {
+                            continue;
+                        }
+                        status = 1;
+                        break;
+                    }
+                    // tee() never consumes, so a short copy only happens when
+                    // the private pipe filled up; drain it and continue
+                    if (move_from_pipe(pipes[k][0], sinks[k], t, &use_splice[k]) < 0) {
+                        status = 1;
+                        break;
+                    }
+                    done += t;
+                }
+            } else if (move_from_pipe(pipes[0][0], sinks[0], n, &use_splice[0]) < 0) {
+                status = 1;
+            }
+        }
+        if (status != 0 || move_from_pipe(in_fd, sinks[sink_count - 1], n, &use_splice[sink_count - 1]) < 0) {
+            perror("Error writing output");
+            status = 1;
+            break;
+        }
+    }
+    _exit(status);
+}
+
+// Function to fork the fan-out helper for a stage whose stdout goes to several
+// sinks. The files are opened here, in order, so a failure is reported like
+// any redirection and the command is not started; the helper inherits them
+// and the shell closes its copies. Returns the write end of the pipe that
+// becomes the command's stdout at its first file target, or -1 on failure.
+// The helper is one of the job's processes, so it stops and resumes with the
+// stage.
+int start_fanout(struct command* cmd, int next_pipe, struct job* job, bool own_group) {
+    int fan[2];
+    int sink_count = count_stdout_sinks(cmd, next_pipe >= 0);
+    int* sinks = malloc(sink_count * sizeof(int));
+    int n = 0;
+
+    if (!sinks) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < cmd->redir_count; i++) {
+        struct redirect* r = &cmd->redirs[i];
+        if (r->fd == STDOUT_FILENO &&
+            (r->type == REDIR_OUT || r->type == REDIR_APPEND || r->type == REDIR_CLOBBER)) {
+            sinks[n] = open_redirect_target(r);
+            if (sinks[n] < 0) {
+                redirect_error(r);
+                break;
+            }
+            n++;
+        }
+    }
+    bool opened = n == sink_count - (next_pipe >= 0);
+    if (opened && pipe2(fan, O_CLOEXEC) < 0) {
+        perror("Error creating pipe");
+        opened = false;
+    }
+    pid_t pid = opened ? fork() : -1;
+    if (pid == 0) {
+        if (own_group) {
+            join_job_group(job->pgid, !job->background);
+        }
+        cgroup_enter(job->cgroup);
+        leave_event_loop();
+        close(fan[1]);
+        if (next_pipe >= 0) {
+            sinks[n++] = next_pipe;  // Pipe goes last: pipe-to-pipe splice is cheapest
+        }
+        run_fanout(fan[0], sinks, n);
+    } else if (pid < 0 && opened) {
+        perror("Error forking");
+        close(fan[0]);
+        close(fan[1]);
+    }
+    for (int i = 0; i < n; i++) {
+        close(sinks[i]);  // The helper has its own copies
+    }
+    free(sinks);
+    if (pid < 0) {
+        return -1;
+    }
+    close(fan[0]);
+    for (int i = 0; i < cmd->redir_count; i++) {
+        struct redirect* r = &cmd->redirs[i];
+        if (r->fd == STDOUT_FILENO &&
+            (r->type == REDIR_OUT || r->type == REDIR_APPEND || r->type == REDIR_CLOBBER)) {
+            r->fanout = true;
+        }
+    }
+    add_job_process(job, pid, own_group);
+    return fan[1];
+}
+
+int execute_node(struct node* n);
+char* append_to_old(const char* old, char* value);
+
+// Function to expand the value of a VAR=value prefix of a command
+char* prefix_value(struct assignment* as) {
+    char* value = expand_word_string(&as->value);
+    if (as->append) {
+        const char* old = get_variable_value(as->name);
+        value = append_to_old(old ? old : getenv(as->name), value);
+    }
+    return value;
+}
+
+// Function to execute commands with optional I/O redirection and background process handling.
+// stages holds the stages of a pipeline; each stage runs in its own child.
+// Returns the exit status of the last stage (0 when started in the background).
+int execute_command(struct node** stages, int count, bool background) {
+    int prev_read = -1;
+    int status = 0;
+    // A job gets a process group of its own under job control, or to be
+    // signalled when its deadline passes
+    long long limit = background || in_subshell ? 0 : default_deadline;
+    bool own_group = job_control() || limit > 0;
+    struct deadline d = { 0, 0, -1, false };
+    struct job* job = new_job("", background);
+    struct placement session = inherited_placement();
+    char text[1024] = "";
+    int spool_fd = -1;
+    long long t_command = tracing ? monotonic_ns() : 0;
+
+    job->cgroup = cgroup_create(&session);
+    if (background) {
+        spool_attach(job, spool_open(&spool_fd));
+    }
+
+    // Flush buffered output so the children do not inherit and repeat it
+    fflush(stdout);
+    sync_fd_readers();  // Children may read from the same descriptors
+
+    for (int i = 0; i < count; i++) {
+        struct command* cmd = &stages[i]->cmd;
+        bool simple = stages[i]->type == NODE_COMMAND;
+        int pipefd[2] = { -1, -1 };
+        int out_fd = -1;
+
+        if (simple && cmd->args == NULL && expand_command(cmd) != 0) {
+            status = 1;
+            break;
+        }
+        // Placement prefixes are taken off here, so errors stop the pipeline
+        struct placement place = session;
+        char** argv = simple ? parse_placement(cmd->args, &place) : NULL;
+        if (simple && argv == NULL) {
+            status = 1;
+            break;
+        }
+        if (simple && argv[0] == NULL) {
+            argv = cmd->args;  // "affinity 0 | ..." shows or sets it in the child
+        }
+        if (place.has_memory || place.has_cpu) {
+            cgroup_limit(job->cgroup ? job->cgroup : own_cgroup, &place);  // The whole job's
+        }
+        if (i < count - 1 && pipe2(pipefd, O_CLOEXEC) < 0) {
+            perror("Error creating pipe");
+            status = 1;
+            break;
+        }
+        out_fd = pipefd[1];
+        int fan_fd = -1;
+        if (simple && count_stdout_sinks(cmd, i < count - 1) > 1) {
+            fan_fd = start_fanout(cmd, pipefd[1], job, own_group);
+            if (fan_fd < 0) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                status = 1;
+                break;
+            }
+        }
+        // Looked up here, where the command index is kept current, not in the child
+        char* exec_path = NULL;
+        if (simple && argv[0] != NULL) {
+            bool sets_path = false;
+            for (int j = 0; j < cmd->assign_count; j++) {
+                sets_path = sets_path || strcmp(cmd->assigns[j].name, "PATH") == 0;
+            }
+            if (!sets_path) {
+                long long t_resolve = tracing ? monotonic_ns() : 0;
+                exec_path = resolve_command(argv[0]);
+                if (tracing) {
+                    trace_span("resolve", t_resolve, exec_path ? exec_path : argv[0], 0, -1);
+                }
+            }
+        }
+        if (i > 0) {
+            strncat(text, " |", sizeof(text) - strlen(text) - 1);
+        }
+        if (simple) {
+            append_words(text, sizeof(text), cmd->args);
+        } else {
+            strncat(text, i > 0 ? " (...)" : "(...)", sizeof(text) - strlen(text) - 1);
+        }
+
+        long long t_fork = tracing ? monotonic_ns() : 0;
+        pid_t pid = fork();
+        if (pid == 0) {  // Child process
+            long long t_child = tracing ? monotonic_ns() : 0;
+            if (own_group) {
+                join_job_group(job->pgid, !background);
+            }
+            cgroup_enter(job->cgroup);
+            leave_event_loop();
+            apply_placement(&place);
+            if (spool_fd >= 0) {  // Stages' stderr and the last one's stdout
+                dup2(spool_fd, STDOUT_FILENO);
+                dup2(spool_fd, STDERR_FILENO);
+            }
+            if (prev_read >= 0) {
+                dup2(prev_read, STDIN_FILENO);
+                stdin_redirects++;
+            }
+            if (out_fd >= 0) {
+                dup2(out_fd, STDOUT_FILENO);
+            }
+            fanout_fd = fan_fd;  // Taken by apply_redirects() at the first file target
+            in_subshell = true;
+            if (!simple) {  // Compound stage runs in this forked copy of the shell
+                exit_subshell(execute_node(stages[i]));
+            }
+            // Files are opened here, after fork(), so nothing is left open in the shell
+            if (apply_redirects(cmd, NULL, NULL) != 0) {
+                _exit(EXIT_FAILURE);
+            }
+            if (cmd->args[0] == NULL) {
+                _exit(EXIT_SUCCESS);
+            }
+            for (int j = 0; j < cmd->assign_count; j++) {  // VAR=value cmd
+                struct assignment* as = &cmd->assigns[j];
+                if (as->list || as->subscript) {
+                    continue;  // Arrays are not exported
+                }
+                char* value = prefix_value(as);
+                setenv(as->name, value, 1);
+                free(value);
+            }
+            if (execute_builtin(argv)) {  // Built-ins can be pipeline stages too
+                exit_subshell(last_status);
+            }
+
+            // Execute the command
+            if (tracing) {  // From fork() to exec(), recorded by the child itself
+                char words[1024] = "";
+                append_words(words, sizeof(words), argv);
+                trace_span("exec", t_child, words, 0, -1);
+                trace_flush();
+            }
+            if (exec_path) {
+                execv(exec_path, argv);  // On failure, search PATH as usual
+            }
+            if (execvp(argv[0], argv) == -1) {
+                perror("Error executing command");
+            }
+            _exit(errno == ENOENT ? 127 : 126);
+
+        } else if (pid < 0) {  // Fork error
+            perror("Error forking");
+            status = 1;
+        } else {
+            add_job_process(job, pid, own_group);
+            if (tracing) {
+                trace_span("fork", t_fork, NULL, pid, -1);
+            }
+        }
+
+        // Parent keeps only the read end for the next stage
+        free(exec_path);
+        release_expansion(cmd);
+        if (prev_read >= 0) {
+            close(prev_read);
+        }
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        if (fan_fd >= 0) {
+            close(fan_fd);
+        }
+        prev_read = pipefd[0];
+        if (pid < 0) {
+            break;
+        }
+    }
+    if (prev_read >= 0) {
+        close(prev_read);
+    }
+    if (spool_fd >= 0) {
+        close(spool_fd);  // Only the children write to it
+    }
+    for (int i = 0; i < count; i++) {
+        release_expansion(&stages[i]->cmd);  // Stages skipped after an error
+    }
+
+    free(job->text);
+    job->text = strdup(text);
+    if (job->proc_count == 0) {
+        free_job(job);
+    } else if (background) {
+        current_job = job->id;
+        last_bg_pid = job->procs[job->proc_count - 1].pid;
+        printf("[Background] Job %d started with PID %d\n", job->id, last_bg_pid);
+    } else if (status != 0) {
+        wait_for_job(job);  // A stage failed to start: the status stays a failure
+    } else {
+        long long t_wait = tracing ? monotonic_ns() : 0;
+        pid_t last_pid = job->procs[job->proc_count - 1].pid;
+        if (limit > 0) {
+            start_deadline(&d, job->pgid, limit, TIMEOUT_GRACE);
+        }
+        status = wait_for_job(job);
+        stop_deadline(&d);
+        if (d.expired) {
+            status = 124;
+        }
+        if (tracing) {
+            trace_span("wait", t_wait, NULL, last_pid, status);
+        }
+    }
+    if (tracing) {
+        trace_span("command", t_command, text, 0, background ? -1 : status);
+    }
+
+    return status;
+}
+
+// Function to run a subtree in a forked copy of the shell, used for
+// backgrounded lists such as "a && b &"
+int execute_in_background(struct node* n) {
+    bool own_group = job_control();
+    struct placement place = inherited_placement();
+    char* leaf = cgroup_create(&place);
+    int spool_fd = -1;
+    struct spool* spool = spool_open(&spool_fd);
+
+    fflush(stdout);
+    sync_fd_readers();
+    long long t_fork = tracing ? monotonic_ns() : 0;
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (own_group) {
+            join_job_group(0, false);
+        }
+        cgroup_enter(leaf);
+        leave_event_loop();
+        apply_placement(&place);
+        if (spool_fd >= 0) {
+            dup2(spool_fd, STDOUT_FILENO);
+            dup2(spool_fd, STDERR_FILENO);
+            close(spool_fd);
+        }
+        in_subshell = true;
+        exit_subshell(execute_node(n));
+    } else if (pid < 0) {
+        perror("Error forking");
+        cgroup_remove(leaf);
+        spool_free(spool);
+        if (spool_fd >= 0) {
+            close(spool_fd);
+        }
+        return 1;
+    }
+    if (spool_fd >= 0) {
+        close(spool_fd);
+    }
+    struct job* j = new_job(current_line, true);
+    j->cgroup = leaf;
+    spool_attach(j, spool);
+    add_job_process(j, pid, own_group);
+    if (tracing) {
+        trace_span("fork", t_fork, current_line, pid, -1);
+    }
+    current_job = j->id;
+    printf("[Background] Job %d started with PID %d\n", j->id, pid);
+    last_bg_pid = pid;
+    return 0;
+}
+
+// Function to check whether a break, a continue, a return or Ctrl+C is
+// unwinding enclosing lists
+bool loop_control_pending() {
+    return break_levels > 0 || continue_levels > 0 || return_pending || interrupted;
+}
+
+// Function to account for one loop iteration ending. Returns true if the
+// loop must stop (break, a continue aimed at an outer loop, or Ctrl+C).
+bool loop_should_stop() {
+    check_interrupt();
+    if (interrupted || return_pending) {
+        return true;
+    }
+    if (break_levels > 0) {
+        break_levels--;
+        return true;
+    }
+    if (continue_levels > 0) {
+        continue_levels--;
+        return continue_levels > 0;  // "continue 2" also leaves this loop
+    }
+    return false;
+}
+
+// Function to append the value already in a variable (or the environment)
+// to the front of value, for name+=value. Returns a new string.
+char* append_to_old(const char* old, char* value) {
+    size_t old_len = old ? strlen(old) : 0, len = strlen(value);
+    char* joined = malloc(old_len + len + 1);
+    if (!joined) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(joined, old, old_len);
+    memcpy(joined + old_len, value, len + 1);
+    free(value);
+    return joined;
+}
+
+// Function to assign name[i]=value or name[key]=value, making name an
+// indexed array if it is not an array yet. Returns 0, or 1 on a bad subscript.
+int assign_element(struct assignment* as) {
+    int slot = find_variable(as->name);
+    bool assoc = slot >= 0 && shell_vars[slot].array && shell_vars[slot].array->assoc;
+    char* key = NULL;
+    long long index = 0;
+    int status = 0;
+
+    if (assoc) {
+        key = expand_word_string(as->subscript);
+    } else if (!subscript_index(as->subscript, as->index, &index)) {
+        return 1;
+    }
+    char* value = expand_word_string(&as->value);
+    slot = store_variable(as->name);
+    struct array* a = shell_vars[slot].array ? shell_vars[slot].array : make_array(&shell_vars[slot], false);
+    if (as->append) {
+        value = append_to_old(assoc ? assoc_get(a, key) : array_get(a, index), value);
+    }
+    if (assoc) {
+        assoc_set(a, key, value, strlen(value));
+    } else {
+        status = array_set(a, index, value, strlen(value)) != 0;
+    }
+    free(key);
+    free(value);
+    return status || expansion_failed;
+}
+
+// Function to assign name=(words...), or add the words with name+=(...).
+// Plain words are split and globbed as arguments are and go to the next
+// index; [key]=word items are not split. A failed assignment leaves the old
+// array as it was.
+int assign_list(struct assignment* as) {
+    int slot = find_variable(as->name);
+    bool assoc = slot >= 0 && shell_vars[slot].array && shell_vars[slot].array->assoc;
+    struct array* a;
+    int status = 0;
+
+    if (as->append) {
+        slot = store_variable(as->name);
+        a = shell_vars[slot].array ? shell_vars[slot].array : make_array(&shell_vars[slot], false);
+    } else {
+        a = array_new(assoc);
+    }
+    long long next = a->count;
+    for (int i = 0; i < as->item_count && status == 0; i++) {
+        struct array_item* item = &as->items[i];
+        if (item->keyed) {
+            char* value = expand_word_string(&item->value);
+            if (assoc) {
+                char* key = expand_word_string(&item->key);
+                assoc_set(a, key, value, strlen(value));
+                free(key);
+            } else if (subscript_index(&item->key, NULL, &next)) {
+                status = array_set(a, next, value, strlen(value)) != 0;
+                next = next < 0 ? a->count : next + 1;
+            } else {
+                status = 1;
+            }
+            free(value);
+            continue;
+        }
+        struct field_list fields = { 0 };
+        expand_word(&item->value, &fields);
+        for (int k = 0; k < fields.count; k++) {
+            if (assoc && status == 0) {
+                fprintf(stderr, "%s: %s: must use [key]=value for an associative array\n", as->name, fields.items[k]);
+                status = 1;
+            } else if (status == 0) {
+                status = array_set(a, next++, fields.items[k], strlen(fields.items[k])) != 0;
+            }
+            free(fields.items[k]);
+        }
+        free(fields.items);
+    }
+    status = status || expansion_failed;
+    if (!as->append && status != 0) {
+        array_free(a);
+    } else if (!as->append) {
+        slot = store_variable(as->name);
+        struct var* v = &shell_vars[slot];
+        release_string(v->value);
+        v->value = NULL;
+        array_free(v->array);
+        v->array = a;
+        v->ival_valid = v->str_stale = false;
+    }
+    return status;
+}
+
+// Function to perform one assignment word of a simple command. Returns 0,
+// or 1 if an expansion or a subscript failed.
+int assign(struct assignment* as) {
+    struct word* value_word = &as->value;
+
+    if (as->list) {
+        return assign_list(as);
+    } else if (as->subscript) {
+        return assign_element(as);
+    }
+    if (!as->append && value_word->part_count == 1 && value_word->parts[0].type == PART_ARITH) {
+        // i=$((i+1)): store the integer directly, no decimal string
+        long long value = evaluate_arith_part(&value_word->parts[0]);
+        if (expansion_failed) {
+            return 1;
+        }
+        set_variable_int(as->name, value);
+        return 0;
+    }
+    char* value = expand_word_string(value_word);
+    if (as->append) {
+        const char* old = get_variable_value(as->name);
+        value = append_to_old(old ? old : getenv(as->name), value);
+    }
+    set_variable(as->name, value);
+    free(value);
+    return expansion_failed;
+}
+
+// A variable that a VAR=value prefix replaces while a built-in or function runs
+struct saved_prefix {
+    char* name;        // NULL for an array assignment, which is left alone
+    struct var outer;  // outer.name is NULL if the variable was not set
+    char* env;         // Its value in the environment, or NULL
+};
+
+// Function to apply the VAR=value prefixes of a command run in the shell.
+// Each variable is moved aside, strings and all, and set in the shell and
+// the environment (for the commands a function starts) until
+// restore_prefixes() puts the old one back. The values are expanded in
+// order, each seeing the ones before it.
+struct saved_prefix* apply_prefixes(struct command* cmd) {
+    struct saved_prefix* saved = calloc(cmd->assign_count, sizeof(struct saved_prefix));
+    if (!saved) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < cmd->assign_count; i++) {
+        struct assignment* as = &cmd->assigns[i];
+        if (as->list || as->subscript) {
+            continue;  // As in a child: arrays are not exported
+        }
+        char* value = prefix_value(as);
+        const char* env = getenv(as->name);
+        int slot = find_variable(as->name);
+        saved[i].name = strdup(as->name);
+        saved[i].env = env ? strdup(env) : NULL;
+        if (slot >= 0) {
+            saved[i].outer = shell_vars[slot];
+            shell_vars[slot] = shell_vars[--var_count];
+        }
+        set_variable(as->name, value);
+        setenv(as->name, value, 1);
+        free(value);
+    }
+    return saved;
+}
+
+// Function to put back the variables apply_prefixes() replaced, last first
+// so that "A=1 A=2 cmd" ends with the original A
+void restore_prefixes(struct command* cmd, struct saved_prefix* saved) {
+    for (int i = cmd->assign_count - 1; i >= 0; i--) {
+        struct saved_prefix* p = &saved[i];
+        if (!p->name) {
+            continue;
+        }
+        unset_variable(p->name);
+        if (p->outer.name) {
+            *new_variable() = p->outer;
+            var_count++;
+        }
+        if (p->env) {
+            setenv(p->name, p->env, 1);
+        } else {
+            unsetenv(p->name);
+        }
+        free(p->name);
+        free(p->env);
+    }
+    free(saved);
+}
+
+// Function to run a simple command in the shell: assignments, built-ins, or
+// a fork for external commands. Built-ins and functions never fork, so loops
+// made only of them and expansions stay inside the shell process. Their
+// VAR=value prefixes hold only while they run.
+int execute_simple(struct node* n) {
+    struct command* cmd = &n->cmd;
+    int status;
+
+    if (cmd->word_count == 0 && cmd->assign_count > 0) {  // Plain "name=value"
+        status = 0;
+        expansion_failed = false;
+        for (int i = 0; i < cmd->assign_count && status == 0; i++) {
+            status = assign(&cmd->assigns[i]);
+        }
+        if (cmd->redir_count == 0) {
+            return status;
+        }
+        last_status = status;
+    }
+    if (expand_command(cmd) != 0) {
+        release_expansion(cmd);
+        return 1;
+    }
+    long long t_builtin = tracing ? monotonic_ns() : 0;
+    char** args = cmd->args;  // A recursive function call expands cmd again
+    struct saved_prefix* prefixes = NULL;
+    bool in_shell = count_stdout_sinks(cmd, false) <= 1;
+    if (in_shell && cmd->assign_count > 0) {
+        in_shell = cmd->word_count == 0 || (args[0] && runs_in_shell(args) != 0);
+        prefixes = in_shell && args[0] ? apply_prefixes(cmd) : NULL;
+    }
+    if (in_shell && run_builtin(cmd)) {
+        status = last_status;  // Built-in handled in the shell itself
+        cmd->args = args;
+        if (prefixes) {
+            restore_prefixes(cmd, prefixes);
+        }
+        expansion_failed = false;
+        for (int i = 0; i < cmd->list_count && status == 0; i++) {  // local -a name=(...)
+            status = last_status = assign(&cmd->lists[i]);
+        }
+        if (tracing) {
+            char words[1024] = "";
+            append_words(words, sizeof(words), cmd->args);
+            trace_span("builtin", t_builtin, words, 0, status);
+        }
+        release_expansion(cmd);
+        return status;
+    }
+    if (prefixes) {  // Not run in the shell after all: the child sets them
+        restore_prefixes(cmd, prefixes);
+    }
+    if (tracing) {  // Time spent finding out it is not a built-in
+        trace_span("lookup", t_builtin, cmd->args[0], 0, -1);
+    }
+    return execute_command(&n, 1, false);  // External command
+}
+
+// Function to run a for loop over its expanded word list
+int execute_for(struct node* n) {
+    struct field_list fields = { 0 };
+    int status = 0;
+
+    for (int i = 0; i < n->cmd.word_count; i++) {
+        expand_word(&n->cmd.words[i], &fields);
+    }
+    loop_depth++;
+    for (int i = 0; i < fields.count; i++) {
+        set_variable(n->var, fields.items[i]);
+        status = execute_node(n->right);
+        if (loop_should_stop()) {
+            break;
+        }
+    }
+    loop_depth--;
+    for (int i = 0; i < fields.count; i++) {
+        free(fields.items[i]);
+    }
+    free(fields.items);
+    return status;
+}
+
+// Function to run a case command: the first arm with a matching pattern wins
+int execute_case(struct node* n) {
+    char* subject = expand_word_string(&n->cmd.words[0]);
+    int status = 0;
+
+    for (int i = 0; i < n->item_count; i++) {
+        struct case_item* item = &n->items[i];
+        bool matched = false;
+        for (int j = 0; j < item->pattern_count && !matched; j++) {
+            char* pattern = expand_pattern(&item->patterns[j]);
+            matched = fnmatch(pattern, subject, 0) == 0;
+            free(pattern);
+        }
+        if (matched) {
+            status = execute_node(item->body);
+            break;
+        }
+    }
+    free(subject);
+    return status;
+}
+
+// Function to run a ( list ) subshell in a forked copy of the shell
+int execute_subshell(struct node* n) {
+    bool own_group = job_control();
+    struct placement place = inherited_placement();
+    char* leaf = cgroup_create(&place);
+
+    fflush(stdout);
+    sync_fd_readers();
+    long long t_fork = tracing ? monotonic_ns() : 0;
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (own_group) {
+            join_job_group(0, true);
+        }
+        cgroup_enter(leaf);
+        leave_event_loop();
+        apply_placement(&place);
+        in_subshell = true;
+        if (expand_redirects(&n->cmd) != 0 || apply_redirects(&n->cmd, NULL, NULL) != 0) {
+            _exit(EXIT_FAILURE);
+        }
+        loop_depth = 0;  // break/continue cannot leave the subshell
+        exit_subshell(execute_node(n->left));
+    } else if (pid < 0) {
+        perror("Error forking");
+        cgroup_remove(leaf);
+        return 1;
+    }
+    struct job* j = new_job(current_line, false);
+    j->cgroup = leaf;
+    add_job_process(j, pid, own_group);
+    if (tracing) {
+        trace_span("fork", t_fork, current_line, pid, -1);
+    }
+    return wait_for_job(j);
+}
+
+#define FUNCTION_DEPTH_MAX 1000  // Nested function calls before one is refused
+
+// A variable hidden by `local`, put back when the declaring call returns
+struct saved_local {
+    char* name;
+    struct var outer;  // outer.name is NULL if the variable was not set
+    int depth;         // function_depth of the declaring call
+};
+
+struct saved_local* saved_locals = NULL;
+int saved_local_count = 0;
+int saved_local_cap = 0;
+
+// Function to enter a function definition into the command table. The body
+// stays in the tree it was parsed into, which keeps its own reference.
+void define_function(const char* name, struct node* body) {
+    struct command_entry* e = command_insert(name);
+    free_node(e->function);
+    body->refs++;
+    e->function = body;
+}
+
+// Function for `declare` (or `typeset`) and `local`: [-a|-A] name[=value]...
+// -a makes each name an indexed array and -A an associative one. In a
+// function the names are local to the call: the outer variables are moved
+// aside, strings and all, until it returns. Without names, declare lists the
+// variables.
+void declare_builtin(char** args) {
+    bool local = strcmp(args[0], "local") == 0;
+    char kind = 0;  // 'a' or 'A'
+    int i = 1;
+
+    if (local && function_depth == 0) {
+        fprintf(stderr, "local: only meaningful in a function\n");
+        last_status = 1;
+        return;
+    }
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if ((args[i][1] != 'a' && args[i][1] != 'A') || args[i][2]) {
+            fprintf(stderr, "%s: %s: invalid option\nUsage: %s [-a|-A] name[=value]...\n", args[0], args[i], args[0]);
+            last_status = 2;
+            return;
+        }
+        kind = args[i][1];
+    }
+    if (!args[i] && !local) {
+        for (int j = 0; j < var_count; j++) {
+            print_variable(&shell_vars[j]);
+        }
+        return;
+    }
+    local = function_depth > 0;
+    for (; args[i]; i++) {
+        char* eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        bool declared = !local;
+
+        if (!is_valid_name(args[i], len)) {
+            fprintf(stderr, "%s: '%s': not a valid name\n", args[0], args[i]);
+            last_status = 1;
+            continue;
+        }
+        char* name = strndup(args[i], len);
+        for (int j = saved_local_count - 1; !declared && j >= 0 && saved_locals[j].depth == function_depth; j--) {
+            declared = strcmp(saved_locals[j].name, name) == 0;
+        }
+        if (!declared) {
+            if (saved_local_count == saved_local_cap) {
+                saved_local_cap = saved_local_cap ? saved_local_cap * 2 : 16;
+                saved_locals = realloc(saved_locals, saved_local_cap * sizeof(struct saved_local));
+                if (!saved_locals) {
+                    fprintf(stderr, "Reallocation error\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            struct saved_local* l = &saved_locals[saved_local_count++];
+            int slot = find_variable(name);
+            memset(l, 0, sizeof(*l));
+            l->name = strdup(name);
+            l->depth = function_depth;
+            if (slot >= 0) {  // Moved aside, strings and all
+                l->outer = shell_vars[slot];
+                shell_vars[slot] = shell_vars[--var_count];
+            }
+        }
+        int slot = kind ? store_variable(name) : -1;
+        if (kind && !make_array(&shell_vars[slot], kind == 'A')) {
+            last_status = 1;
+        } else if (eq) {
+            set_variable(name, eq + 1);
+        } else if (find_variable(name) < 0) {
+            set_variable(name, "");
+        }
+        free(name);
+    }
+}
+
+// Function for `unset name[i]` and `unset name[key]`: remove one element
+void unset_element(const char* arg) {
+    const char* open = strchr(arg, '[');
+    size_t len = strlen(arg);
+    char* name = strndup(arg, open - arg);
+    char* key = len > 0 && arg[len - 1] == ']' ? strndup(open + 1, arg + len - 1 - open - 1) : NULL;
+    int slot = find_variable(name);
+
+    if (!key || !is_valid_name(name, strlen(name))) {
+        fprintf(stderr, "unset: '%s': not a valid name\n", arg);
+        last_status = 1;
+    } else if (slot >= 0 && shell_vars[slot].array && shell_vars[slot].array->assoc) {
+        assoc_unset(shell_vars[slot].array, key);
+    } else if (slot >= 0) {
+        struct arith_node* index = arith_compile(key);
+        bool error = !index;
+        long long i = index ? arith_eval(index, &error) : 0;
+        arith_free(index);
+        if (error) {
+            fprintf(stderr, "unset: '%s': bad array subscript\n", arg);
+            last_status = 1;
+        } else if (shell_vars[slot].array) {
+            array_unset(shell_vars[slot].array, i);
+        } else if (i == 0) {
+            unset_variable(name);
+        }
+    }
+    free(name);
+    free(key);
+}
+
+// Function to print a variable as printenv and declare list it: name=value,
+// or name=([index]=value ...) for an array
+void print_variable(struct var* v) {
+    struct array* a = v->array;
+
+    if (!a) {
+        printf("%s=%s\n", v->name, variable_string(v));
+        return;
+    }
+    printf("%s=(", v->name);
+    const char* sep = "";
+    for (int i = 0; !a->assoc && i < a->count; i++) {
+        if (a->items[i].length != SLICE_UNSET) {
+            printf("%s[%d]=%s", sep, i, array_text(a, a->items[i]));
+            sep = " ";
+        }
+    }
+    for (int i = 0; a->assoc && i < a->cap; i++) {
+        if (a->slots[i].state == SLOT_FULL) {
+            printf("%s[%s]=%s", sep, array_text(a, a->slots[i].key), array_text(a, a->slots[i].value));
+            sep = " ";
+        }
+    }
+    printf(")\n");
+}
+
+// Function to put back the variables the returning call declared local
+void restore_locals() {
+    while (saved_local_count > 0 && saved_locals[saved_local_count - 1].depth == function_depth) {
+        struct saved_local* l = &saved_locals[--saved_local_count];
+        unset_variable(l->name);
+        if (l->outer.name) {
+            *new_variable() = l->outer;
+            var_count++;
+        }
+        free(l->name);
+    }
+}
+
+// Function to run a function's body in the shell with args[1]... as its
+// positional parameters. Returns the body's status, or the one `return` gave.
+int call_function(struct node* body, char** args) {
+    char** saved_positional = positional;
+    int saved_count = positional_count;
+    int saved_loop_depth = loop_depth;
+    int argc = 0, status;
+
+    if (function_depth >= FUNCTION_DEPTH_MAX) {
+        fprintf(stderr, "%s: maximum function nesting exceeded\n", args[0]);
+        return 1;
+    }
+    while (args[argc + 1]) {
+        argc++;
+    }
+    positional = args + 1;  // The caller keeps args until the call returns
+    positional_count = argc;
+    loop_depth = 0;         // break and continue stay inside the function
+    function_depth++;
+    body->refs++;           // Kept even if the body redefines its function
+    status = execute_node(body);
+    free_node(body);
+    if (return_pending) {
+        status = return_status;
+        return_pending = false;
+    }
+    restore_locals();
+    function_depth--;
+    break_levels = continue_levels = 0;
+    loop_depth = saved_loop_depth;
+    positional = saved_positional;
+    positional_count = saved_count;
+    return status;
+}
+
+// Function to forget an entry's alias
+void drop_alias(struct command_entry* e) {
+    free_tokens(e->alias, e->alias_count + 1);  // With its TOK_EOF
+    e->alias = NULL;
+    e->alias_count = 0;
+    free(e->alias_text);
+    e->alias_text = NULL;
+}
+
+// Function to print an alias as the command that defines it
+void print_alias(struct command_entry* e) {
+    printf("alias %s='", e->name);
+    for (const char* c = e->alias_text; *c; c++) {
+        if (*c == '\'') {
+            printf("'\\''");
+        } else {
+            fputc(*c, stdout);
+        }
+    }
+    printf("'\n");
+}
+
+// Function for `alias [name[=value]]...`: define aliases, or show the named
+// ones, or all of them in order of name. The value is tokenized here, once,
+// and the parser splices the tokens in where the name starts a command.
+void alias_builtin(char** args) {
+    if (args[1] == NULL) {
+        struct field_list names = { 0 };
+        for (int i = 0; i < commands.cap; i++) {
+            if (commands.slots[i].alias) {
+                add_field(&names, commands.slots[i].name);
+            }
+        }
+        if (names.count > 0) {
+            qsort(names.items, names.count, sizeof(char*), compare_strings);
+        }
+        for (int i = 0; i < names.count; i++) {
+            print_alias(command_lookup(names.items[i]));
+        }
+        free(names.items);
+        return;
+    }
+    for (int i = 1; args[i]; i++) {
+        char* eq = strchr(args[i], '=');
+        if (!eq) {
+            struct command_entry* e = command_lookup(args[i]);
+            if (e && e->alias) {
+                print_alias(e);
+            } else {
+                fprintf(stderr, "alias: %s: not found\n", args[i]);
+                last_status = 1;
+            }
+            continue;
+        }
+        char* name = strndup(args[i], eq - args[i]);
+        struct token* tokens;
+        int count;
+        if (!name[0] || strpbrk(name, " \t\n\"'\\$`/|&;<>()")) {
+            fprintf(stderr, "alias: '%s': not a valid name\n", name);
+            last_status = 1;
+        } else if (tokenize_input(eq + 1, &tokens, &count) != PARSE_OK) {
+            fprintf(stderr, "alias: %s: unterminated quote\n", name);
+            free_tokens(tokens, count);
+            last_status = 1;
+        } else {
+            struct command_entry* e = command_insert(name);
+            if (e->alias) {
+                drop_alias(e);
+            }
+            e->alias = tokens;
+            e->alias_count = count - 1;
+            e->alias_text = strdup(eq + 1);
+        }
+        free(name);
+    }
+}
+
+// Function for `unalias [-a] name...`
+void unalias_builtin(char** args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "Usage: unalias [-a] <name>...\n");
+        last_status = 1;
+        return;
+    }
+    if (strcmp(args[1], "-a") == 0) {
+        for (int i = 0; i < commands.cap; i++) {
+            if (commands.slots[i].alias) {
+                drop_alias(&commands.slots[i]);
+            }
+        }
+        return;
+    }
+    for (int i = 1; args[i]; i++) {
+        struct command_entry* e = command_lookup(args[i]);
+        if (e && e->alias) {
+            drop_alias(e);
+        } else {
+            fprintf(stderr, "unalias: %s: not found\n", args[i]);
+            last_status = 1;
+        }
+    }
+}
+
+// Function to execute a syntax tree node and return its exit status, which
+// is also recorded in last_status for $?
+int execute_node(struct node* n) {
+    struct saved_fd* saved = NULL;
+    int saved_count = 0;
+    int status = 0;
+
+    // Redirections on compound commands apply to the whole body, e.g. "done < file"
+    if (n->type != NODE_COMMAND && n->type != NODE_SUBSHELL && n->cmd.redir_count > 0) {
+        fflush(stdout);
+        saved = malloc(2 * n->cmd.redir_count * sizeof(struct saved_fd));
+        if (!saved) {
+            fprintf(stderr, "Allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        if (expand_redirects(&n->cmd) != 0 || apply_redirects(&n->cmd, saved, &saved_count) != 0) {
+            restore_redirects(saved, saved_count);
+            free(saved);
+            release_expansion(&n->cmd);
+            last_status = 1;
+            return 1;
+        }
+    }
+
+    switch (n->type) {
+    case NODE_COMMAND:
+        status = execute_simple(n);
+        break;
+    case NODE_PIPELINE:
+        status = execute_command(n->children, n->child_count, false);
+        break;
+    case NODE_AND:
+        status = execute_node(n->left);
+        if (status == 0 && !loop_control_pending()) {
+            status = execute_node(n->right);
+        }
+        break;
+    case NODE_OR:
+        status = execute_node(n->left);
+        if (status != 0 && !loop_control_pending()) {
+            status = execute_node(n->right);
+        }
+        break;
+    case NODE_NOT:
+        status = execute_node(n->left) == 0 ? 1 : 0;
+        break;
+    case NODE_SEQUENCE:
+        for (int i = 0; i < n->child_count && !loop_control_pending(); i++) {
+            status = execute_node(n->children[i]);
+        }
+        break;
+    case NODE_BACKGROUND:
+        if (n->left->type == NODE_COMMAND) {
+            status = execute_command(&n->left, 1, true);
+        } else if (n->left->type == NODE_PIPELINE) {
+            status = execute_command(n->left->children, n->left->child_count, true);
+        } else {
+            status = execute_in_background(n->left);
+        }
+        break;
+    case NODE_IF:
+        if (execute_node(n->left) == 0) {
+            status = execute_node(n->right);
+        } else if (n->alt && !loop_control_pending()) {
+            status = execute_node(n->alt);
+        }
+        break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        loop_depth++;
+        for (;;) {
+            int cond = execute_node(n->left);
+            if (loop_control_pending()) {
+                if (loop_should_stop()) {
+                    break;
+                }
+                continue;
+            }
+            if ((cond == 0) != (n->type == NODE_WHILE)) {
+                break;
+            }
+            status = execute_node(n->right);
+            if (loop_should_stop()) {
+                break;
+            }
+        }
+        loop_depth--;
+        break;
+    case NODE_FOR:
+        status = execute_for(n);
+        break;
+    case NODE_CASE:
+        status = execute_case(n);
+        break;
+    case NODE_GROUP:
+        status = execute_node(n->left);
+        break;
+    case NODE_SUBSHELL:
+        status = execute_subshell(n);
+        break;
+    case NODE_FUNCTION:
+        define_function(n->var, n->left);
+        break;
+    }
+
+    if (saved) {
+        restore_redirects(saved, saved_count);
+        free(saved);
+        release_expansion(&n->cmd);
+    }
+    last_status = status;
+    return status;
+}
+
+// Function to parse a complete input into *tree. Returns PARSE_OK,
+// PARSE_INCOMPLETE if a quote, a pipeline or an && / || list is left open,
+// or PARSE_ERROR after reporting a syntax error.
+int parse_text(const char* input, struct node** tree) {
+    struct parser ps = { 0 };
+    int status = tokenize_input(input, &ps.tokens, &ps.count);
+
+    *tree = NULL;
+    if (status == PARSE_OK) {
+        *tree = parse_list(&ps);
+        if (*tree && ps.tokens[ps.pos].type != TOK_EOF) {
+            syntax_error(&ps);  // Stray "fi", ")" and the like
+            free_node(*tree);
+            *tree = NULL;
+        }
+        status = ps.status;
+    }
+    free_tokens(ps.tokens, ps.count);
+    free(ps.expansions);
+    if (status != PARSE_OK && *tree) {
+        free_node(*tree);
+        *tree = NULL;
+    }
+    return status;
+}
+
+// Function to show the continuation prompt
+void display_continuation_prompt() {
+    strcpy(prompt_text, "> ");
+    printf("%s", prompt_text);
+    prompt_live = false;
+}
+
+// Function to parse a whole input into a syntax tree. While a quote, a
+// pipeline or an && / || list is left open, continuation lines are read and
+// appended to *input, so the complete list is parsed once and run in one go.
+struct node* parse_input(char** input) {
+    for (;;) {
+        struct node* tree;
+        int status = parse_text(*input, &tree);
+
+        if (status == PARSE_OK) {
+            return tree;
+        } else if (status == PARSE_ERROR) {
+            last_status = 2;
+            return NULL;
+        }
+
+        // Incomplete: read a continuation line
+        display_continuation_prompt();
+        char* more = read_input();
+        if (more == NULL) {
+            fprintf(stderr, "Syntax error: unexpected end of file\n");
+            last_status = 2;
+            return NULL;
+        }
+        size_t len = strlen(*input);
+        *input = realloc(*input, len + strlen(more) + 1);
+        strcpy(*input + len, more);
+        free(more);
+    }
+}
+
+char* pending_input = NULL;        // Interactive command still being continued
+bool pending_from_history = false; // It came from !number, so it is not added to history
+
+// Function called by the line editor with each line typed at the terminal
+// (NULL at end of input): parse it, run it, and start the next line
+void run_line(char* line) {
+    struct node* tree;
+    int status;
+
+    if (line == NULL) {
+        if (pending_input == NULL) {
+            printf("\n");
+            return;  // Nothing is watching the terminal now: main() returns
+        }
+        fprintf(stderr, "Syntax error: unexpected end of file\n");
+        free(pending_input);
+        pending_input = NULL;
+        last_status = 2;
+        display_prompt();
+        editor_start(run_line);
+        return;
+    }
+    if (pending_input) {
+        size_t len = strlen(pending_input);
+        pending_input = realloc(pending_input, len + strlen(line) + 1);
+        strcpy(pending_input + len, line);
+        free(line);
+    } else if (line[0] == '!' && isdigit((unsigned char)line[1])) {  // !number for history
+        int index = atoi(line + 1);
+        free(line);
+        pending_input = get_command_from_history(index);
+        if (pending_input == NULL) {
+            display_prompt();
+            editor_start(run_line);
+            return;
+        }
+        printf("%s", pending_input);  // Print the command being executed
+        pending_from_history = true;
+    } else {
+        pending_input = line;
+        pending_from_history = false;
+    }
+
+    long long t_parse = tracing ? monotonic_ns() : 0;
+    status = parse_text(pending_input, &tree);
+    if (tracing) {
+        trace_span("parse", t_parse, NULL, 0, -1);
+    }
+    if (status == PARSE_INCOMPLETE) {
+        display_continuation_prompt();
+        editor_start(run_line);
+        return;
+    }
+    line = pending_input;
+    pending_input = NULL;
+    if (status == PARSE_ERROR) {
+        last_status = 2;
+    }
+    if (!pending_from_history) {
+        add_to_history(line);
+    }
+    if (tree) {
+        signals_received(signal_fd, NULL);  // A Ctrl+C already seen belongs to the last command
+        interrupted = false;
+        current_line = line;
+        long long t_line = tracing ? monotonic_ns() : 0;
+        execute_node(tree);
+        if (interrupted) {
+            last_status = 130;  // Ctrl+C stopped the line, as if it had killed a foreground job
+        }
+        if (tracing) {
+            trace_span("line", t_line, line, 0, last_status);
+        }
+        free_node(tree);
+        current_line = "";
+    }
+    free(line);
+    display_prompt();
+    editor_start(run_line);
+}
+
+#define SERVER_MAX_RUNNING 64        // Requests of one connection running at once; later ones wait
+#define SERVER_MAX_BACKLOG (4 << 20) // Response bytes a connection may hold before its requests' output waits
+#define SERVER_READ_SIZE 65536
+
+struct server_conn;
+
+// A request being run by the server: a forked copy of the shell in a
+// process group of its own
+struct server_request {
+    uint32_t id;
+    struct server_conn* conn;    // NULL once the client has gone
+    pid_t pid;
+    int out_fd, err_fd, pid_fd;  // -1 once closed
+    int status;
+    struct server_request* next;
+};
+
+// A client connection
+struct server_conn {
+    int fd;
+    char *in, *out;              // Frames received and not yet handled; frames to send
+    size_t in_len, in_cap, out_len, out_cap;
+    int running;
+    bool paused;                 // Its requests' output waits for the client to read
+    bool eof;                    // The client has sent all it will; closed once all is answered
+    struct server_conn* next;
+};
+
+int server_fd = -1;                           // Listening socket of `--server`
+struct server_conn* server_conns = NULL;
+struct server_request* server_requests = NULL;
+
+// Function to append bytes to a connection buffer
+void server_put(char** buf, size_t* len, size_t* cap, const void* data, size_t n) {
+    if (*len + n > *cap) {
+        *cap = (*len + n) * 2;
+        *buf = realloc(*buf, *cap);
+        if (!*buf) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+// Function to queue a response frame for a connection
+void server_send(struct server_conn* c, uint32_t id, uint8_t type, const void* data, size_t n) {
+    struct psh_frame f = { 0 };
+    f.length = n;
+    f.id = id;
+    f.type = type;
+    server_put(&c->out, &c->out_len, &c->out_cap, &f, sizeof(f));
+    server_put(&c->out, &c->out_len, &c->out_cap, data, n);
+}
+
+void server_handle_frames(struct server_conn* c);
+void server_close(struct server_conn* c);
+
+// Function to bring a connection up to date after a change: start requests
+// that were waiting for others to finish, close it once all is answered,
+// and watch its socket for reading while it may start more requests and for
+// writing while it has frames to send. Its requests' pipes are read only
+// while the backlog of frames is small.
+void server_update(struct server_conn* c) {
+    server_handle_frames(c);
+    if (c->eof && c->running == 0 && c->out_len == 0) {
+        server_close(c);
+        return;
+    }
+    bool full = c->out_len > SERVER_MAX_BACKLOG;
+    event_watch(c->fd, !c->eof && c->running < SERVER_MAX_RUNNING, c->out_len > 0);
+    if (full != c->paused) {
+        c->paused = full;
+        for (struct server_request* r = server_requests; r; r = r->next) {
+            if (r->conn == c) {
+                if (r->out_fd >= 0) {
+                    event_watch(r->out_fd, !full, false);
+                }
+                if (r->err_fd >= 0) {
+                    event_watch(r->err_fd, !full, false);
+                }
+            }
+        }
+    }
+}
 
-// Function to display the shell prompt with the current working directory
-void display_prompt() {
-    char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        printf("PUCITshell@%s:- ", cwd);
-    } else {
-        perror("getcwd() error");
+// Function to send a finished request's status once its output is closed
+// and it has exited, and forget it
+void server_finish(struct server_request* r) {
+    if (r->out_fd >= 0 || r->err_fd >= 0 || r->pid_fd >= 0) {
+        return;
+    }
+    for (struct server_request** p = &server_requests; *p; p = &(*p)->next) {
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+    }
+    if (r->conn) {
+        int32_t status = r->status;
+        server_send(r->conn, r->id, PSH_FRAME_EXIT, &status, sizeof(status));
+        r->conn->running--;
     }
+    free(r);
 }
 
-// Function to add a command to history
-void add_to_history(char* input) {
-    if (history_count < HISTORY_SIZE) {
-        history[history_count++] = strdup(input);
-    } else {
-        free(history[0]);
-        for (int i = 1; i < HISTORY_SIZE; i++) {
-            history[i - 1] = history[i];
+// Function to pass a request's output on to its client as it arrives
+void server_output(int fd, void* data) {
+    char buf[SERVER_READ_SIZE];
+    struct server_request* r = data;
+
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    struct server_conn* c = r->conn;
+    if (n > 0) {
+        if (c) {
+            server_send(c, r->id, fd == r->out_fd ? PSH_FRAME_STDOUT : PSH_FRAME_STDERR, buf, n);
+            server_update(c);
         }
-        history[HISTORY_SIZE - 1] = strdup(input);
+        return;
+    }
+    event_remove(fd);
+    close(fd);
+    *(fd == r->out_fd ? &r->out_fd : &r->err_fd) = -1;
+    server_finish(r);
+    if (c) {
+        server_update(c);
     }
 }
 
-// Function to display command history
-void display_history() {
-    for (int i = 0; i < history_count; i++) {
-        printf("%d: %s", i + 1, history[i]);
+// Function to reap a request when its pidfd says it has exited
+void server_exited(int fd, void* data) {
+    struct server_request* r = data;
+    int status = 0;
+
+    waitpid(r->pid, &status, 0);
+    r->status = decode_status(status);
+    event_remove(fd);
+    close(fd);
+    r->pid_fd = -1;
+    struct server_conn* c = r->conn;
+    server_finish(r);
+    if (c) {
+        server_update(c);
     }
 }
 
-// Function to retrieve command from history
-char* get_command_from_history(int index) {
-    if (index < 1 || index > history_count) {
-        printf("No such command in history.\n");
-        return NULL;
+// Function for a request's child: run the command line in this copy of the
+// shell and exit with its status
+void server_child(const char* cwd, const char* line, const char* env, const char* end, int out, int err) {
+    struct node* tree;
+
+    leave_event_loop();
+    setpgid(0, 0);  // Signalled as a group when the client goes away
+    int null = open("/dev/null", O_RDONLY);
+    if (null >= 0) {
+        dup2(null, STDIN_FILENO);
+        close(null);
     }
-    return strdup(history[index - 1]);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    close(out);
+    close(err);
+    close(server_fd);
+    for (struct server_conn* c = server_conns; c; c = c->next) {
+        close(c->fd);
+    }
+    in_subshell = true;
+    for (; env < end; env += strlen(env) + 1) {
+        char* eq = strchr(env, '=');
+        if (eq) {
+            char* name = strndup(env, eq - env);
+            setenv(name, eq + 1, 1);
+            free(name);
+        }
+    }
+    if (cwd[0] != '\0' && chdir(cwd) != 0) {
+        fprintf(stderr, "cd: %s: %s\n", cwd, strerror(errno));
+        exit_subshell(1);
+    }
+    char* text = strdup(line);
+    int status = parse_text(text, &tree);
+    if (status == PARSE_INCOMPLETE) {
+        fprintf(stderr, "Syntax error: unexpected end of input\n");
+    }
+    if (status != PARSE_OK) {
+        exit_subshell(2);
+    }
+    current_line = text;
+    exit_subshell(execute_node(tree));
 }
 
-/// Find the value of a shell variable by name
-char* get_variable_value(char* name) {
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(shell_vars[i].name, name) == 0) {
-            return shell_vars[i].value;
+// Function to start the request in a run frame's payload
+void server_start(struct server_conn* c, uint32_t id, const char* payload, size_t len) {
+    int out[2], err[2];
+    const char* end = payload + len;
+    const char* cwd = payload;
+    const char* line = memchr(cwd, '\0', len) ? cwd + strlen(cwd) + 1 : end;
+
+    if (line >= end || !memchr(line, '\0', end - line) || end[-1] != '\0') {
+        static const char msg[] = "server: malformed request\n";
+        int32_t status = 2;
+        server_send(c, id, PSH_FRAME_STDERR, msg, sizeof(msg) - 1);
+        server_send(c, id, PSH_FRAME_EXIT, &status, sizeof(status));
+        return;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        out[0] = out[1] = -1;
+    } else if (pipe2(err, O_CLOEXEC) < 0) {
+        close(out[0]);
+        close(out[1]);
+        out[0] = out[1] = -1;
+    }
+    pid_t pid = out[0] < 0 ? -1 : fork();
+    if (pid == 0) {
+        close(out[0]);
+        close(err[0]);
+        server_child(cwd, line, line + strlen(line) + 1, end, out[1], err[1]);
+    }
+    int pid_fd = pid > 0 ? pidfd_open(pid, 0) : -1;
+    if (pid < 0 || pid_fd < 0) {
+        char msg[128];
+        int32_t status = 126;
+        int n = snprintf(msg, sizeof(msg), "server: cannot start request: %s\n", strerror(errno));
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        if (out[0] >= 0) {
+            close(out[0]);
+            close(out[1]);
+            close(err[0]);
+            close(err[1]);
         }
+        server_send(c, id, PSH_FRAME_STDERR, msg, n);
+        server_send(c, id, PSH_FRAME_EXIT, &status, sizeof(status));
+        return;
+    }
+    setpgid(pid, pid);
+    close(out[1]);
+    close(err[1]);
+    struct server_request* r = malloc(sizeof(struct server_request));
+    if (!r) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    r->id = id;
+    r->conn = c;
+    r->pid = pid;
+    r->out_fd = out[0];
+    r->err_fd = err[0];
+    r->pid_fd = pid_fd;
+    r->status = 0;
+    r->next = server_requests;
+    server_requests = r;
+    c->running++;
+    fcntl(r->out_fd, F_SETFL, O_NONBLOCK);
+    fcntl(r->err_fd, F_SETFL, O_NONBLOCK);
+    event_add(r->out_fd, server_output, r);
+    event_add(r->err_fd, server_output, r);
+    event_add(r->pid_fd, server_exited, r);
+    if (c->paused) {
+        event_watch(r->out_fd, false, false);
+        event_watch(r->err_fd, false, false);
     }
-    return NULL;  // Variable not found
 }
 
-// Function to handle built-in commands, including shell variables (Version 06)
-int execute_builtin(char** args) {
-    if (strcmp(args[0], "cd") == 0) {
-        if (args[1] == NULL) {
-            fprintf(stderr, "Expected argument for \"cd\"\n");
-        } else if (chdir(args[1]) != 0) {
-            perror("cd failed");
+// Function to start the requests received on a connection, as many as may run
+void server_handle_frames(struct server_conn* c) {
+    size_t used = 0;
+
+    while (c->running < SERVER_MAX_RUNNING && c->in_len - used >= sizeof(struct psh_frame)) {
+        struct psh_frame f;
+        memcpy(&f, c->in + used, sizeof(f));
+        if (c->in_len - used - sizeof(f) < f.length) {
+            break;  // The rest of the payload is still on its way
         }
-        return 1;
-    } else if (strcmp(args[0], "exit") == 0) {
-        exit(0);
-    } else if (strcmp(args[0], "jobs") == 0) {
-        printf("Background Jobs:\n");
-        for (int i = 0; i < bg_count; i++) {
-            int status;
-            pid_t result = waitpid(bg_processes[i], &status, WNOHANG);
-            if (result == 0) {
-                printf("[%d] PID: %d\n", i + 1, bg_processes[i]);
-            } else {
-                for (int j = i; j < bg_count - 1; j++) {
-                    bg_processes[j] = bg_processes[j + 1];
-                }
-                bg_count--;
-                i--;
-            }
+        if (f.type == PSH_FRAME_RUN) {
+            server_start(c, f.id, c->in + used + sizeof(f), f.length);
         }
-        return 1;
-    } else if (strcmp(args[0], "kill") == 0) {
-        if (args[1] == NULL) {
-            fprintf(stderr, "Expected PID for \"kill\"\n");
-        } else {
-            int pid = atoi(args[1]);
-            if (kill(pid, SIGKILL) == 0) {
-                printf("Process %d terminated.\n", pid);
-            } else {
-                perror("kill failed");
+        used += sizeof(f) + f.length;
+    }
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+}
+
+// Function to drop a connection. Its running requests get SIGTERM and are
+// reaped without a client to report to.
+void server_close(struct server_conn* c) {
+    for (struct server_request* r = server_requests; r; r = r->next) {
+        if (r->conn == c) {
+            kill(-r->pid, SIGTERM);
+            r->conn = NULL;
+            if (c->paused) {  // Nobody waits for the output now
+                if (r->out_fd >= 0) {
+                    event_watch(r->out_fd, true, false);
+                }
+                if (r->err_fd >= 0) {
+                    event_watch(r->err_fd, true, false);
+                }
             }
         }
-        return 1;
-    } else if (strcmp(args[0], "help") == 0) {
-        printf("Built-in Commands:\n");
-        printf("cd <directory> - Change directory\n");
-        printf("exit - Exit the shell\n");
-        printf("jobs - List background jobs\n");
-        printf("kill <pid> - Terminate background process with PID\n");
-        printf("history - Display command history\n");
-        printf("set <name>=<value> - Set a shell variable\n");
-        printf("unset <name> - Remove a shell variable\n");
-        printf("printenv - List shell variables\n");
-        printf("help - List built-in commands\n");
-        return 1;
-    } else if (strcmp(args[0], "history") == 0) {
-        display_history();
-        return 1;
-    } else if (strcmp(args[0], "set") == 0) {  // Set a shell variable
-        char *var_str = args[1];
-        if (!var_str) {
-            fprintf(stderr, "Usage: set <name>=<value>\n");
-            return 1;
-        }
-        char *eq_pos = strchr(var_str, '=');
-        if (!eq_pos) {
-            fprintf(stderr, "Usage: set <name>=<value>\n");
-            return 1;
+    }
+    for (struct server_conn** p = &server_conns; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
         }
-        *eq_pos = '\0';  // Split name and value at '='
-        char *name = var_str;
-        char *value = eq_pos + 1;
-        for (int i = 0; i < var_count; i++) {  // Update if variable already exists
-            if (strcmp(shell_vars[i].name, name) == 0) {
-                free(shell_vars[i].value);
-                shell_vars[i].value = strdup(value);
-                return 1;
+    }
+    event_remove(c->fd);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+// Function to serve a connection: send what is queued, then take new frames
+void server_conn_ready(int fd, void* data) {
+    struct server_conn* c = data;
+    bool reading = !c->eof && c->running < SERVER_MAX_RUNNING;
+
+    if (!reading && c->out_len == 0) {
+        server_close(c);  // Called while watched for nothing: the client hung up
+        return;
+    }
+    while (c->out_len > 0) {
+        ssize_t n = send(fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
             }
+            server_close(c);
+            return;
         }
-        if (var_count < MAX_VARS) {  // Add new variable
-            shell_vars[var_count].name = strdup(name);
-            shell_vars[var_count].value = strdup(value);
-            shell_vars[var_count].global = false;
-            var_count++;
-        } else {
-            fprintf(stderr, "Max number of variables reached.\n");
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+    if (reading) {
+        char buf[SERVER_READ_SIZE];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            server_close(c);
+            return;
         }
-        return 1;
-    } else if (strcmp(args[0], "unset") == 0) {  // Unset a shell variable
-        if (!args[1]) {
-            fprintf(stderr, "Usage: unset <name>\n");
-            return 1;
+        c->eof = n == 0;
+        if (n > 0) {
+            server_put(&c->in, &c->in_len, &c->in_cap, buf, n);
         }
-        for (int i = 0; i < var_count; i++) {
-            if (strcmp(shell_vars[i].name, args[1]) == 0) {
-                free(shell_vars[i].name);
-                free(shell_vars[i].value);
-                shell_vars[i] = shell_vars[var_count - 1];
-                var_count--;
-                return 1;
-            }
+        if (c->in_len >= sizeof(struct psh_frame) &&
+            ((struct psh_frame*)c->in)->length > PSH_FRAME_MAX) {
+            server_close(c);  // Not a client of ours
+            return;
         }
-        fprintf(stderr, "Variable '%s' not found.\n", args[1]);
-        return 1;
-    } else if (strcmp(args[0], "printenv") == 0) {  // Print all shell variables
-        for (int i = 0; i < var_count; i++) {
-            printf("%s=%s\n", shell_vars[i].name, shell_vars[i].value);
+    }
+    server_update(c);
+}
+
+// Function to accept the connections waiting on the listening socket
+void server_accept(int fd, void* data) {
+    int conn_fd;
+
+    (void)data;
+    while ((conn_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct server_conn* c = calloc(1, sizeof(struct server_conn));
+        if (!c) {
+            fprintf(stderr, "Allocation error\n");
+            exit(EXIT_FAILURE);
         }
-        return 1;
-    } else {
-        // Check if the command is a variable name
-        char* value = get_variable_value(args[0]);
-        if (value) {
-            printf("%s\n", value);
-            return 1;
+        c->fd = conn_fd;
+        if (!event_add(conn_fd, server_conn_ready, c)) {
+            close(conn_fd);
+            free(c);
+            continue;
         }
+        c->next = server_conns;
+        server_conns = c;
     }
-    return 0;  // Not a built-in command
 }
 
-// Function to read user input from the shell prompt
-char* read_input() {
-    char *buffer = NULL;
-    size_t bufsize = 0;
-    getline(&buffer, &bufsize, stdin);
-    return buffer;
+// Function for `--server PATH`: take requests on a Unix socket and run each
+// in a forked copy of the shell, streaming its output back, until SIGINT or
+// SIGTERM. The shell is started (and its state set up) once, not per request.
+int run_server(const char* path) {
+    struct sockaddr_un addr = { 0 };
+    sigset_t mask;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "server: %s: path too long\n", path);
+        return 1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0 || !ensure_event_loop()) {
+        perror("server");
+        return 1;
+    }
+    // A socket left by a server that is gone is replaced; a live one is not
+    if (connect(server_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "server: %s: another server is listening\n", path);
+        close(server_fd);
+        return 1;
+    }
+    if (errno == ECONNREFUSED) {
+        unlink(path);
+    }
+    close(server_fd);
+    server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0 || bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(server_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "server: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    event_add(server_fd, server_accept, NULL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signalfd(signal_fd, &mask, 0);
+
+    interrupted = false;
+    while (!interrupted) {
+        event_dispatch(-1);
+    }
+
+    while (server_conns) {
+        server_close(server_conns);
+    }
+    for (struct server_request* r = server_requests; r; r = r->next) {
+        kill(-r->pid, SIGTERM);
+    }
+    event_remove(server_fd);
+    close(server_fd);
+    unlink(path);
+    return 0;
 }
 
-// Function to parse input and split by spaces
-char** parse_input(char* input) {
-    int bufsize = BUFFER_SIZE, position = 0;
-    char** tokens = malloc(bufsize * sizeof(char*));
-    char* token;
+// A background job that finished, waiting for psh_poll() to report it
+struct finished_job {
+    int id, status;
+    char* text;
+};
 
-    if (!tokens) {
-        fprintf(stderr, "Allocation error\n");
-        exit(EXIT_FAILURE);
+// State of an embedding API session. The engine works on globals; each
+// session's share of them is kept here while another session is loaded.
+struct psh_session {
+    struct var* vars;
+    int var_count, var_cap;
+    char* history[HISTORY_SIZE];
+    int history_count;
+    int last_status;
+    pid_t last_bg_pid;
+    struct job** job_table;
+    int job_count, job_cap, current_job;
+    bool noclobber, suggest, spool_spill;
+    long long default_deadline;
+    size_t spool_size;
+    long long memo_limit;
+    struct command_table commands;  // Its functions and aliases
+    struct placement placement;
+    int cwd_fd;                  // O_PATH descriptor of its working directory, or -1
+    psh_job_callback on_job_done;
+    void* on_job_done_data;
+    struct finished_job* finished;
+    int finished_count, finished_cap;
+};
+
+pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;  // One session runs at a time
+struct psh_session* loaded_session = NULL;  // Whose state is in the globals now
+
+// Function to move the state of session s into the globals, saving that of
+// the session loaded before. Nothing is copied while s stays loaded.
+void session_switch(struct psh_session* s) {
+    struct psh_session* old = loaded_session;
+
+    if (old == s) {
+        return;
     }
+    if (old) {
+        old->vars = shell_vars;
+        old->var_count = var_count;
+        old->var_cap = var_cap;
+        memcpy(old->history, history, sizeof(history));
+        old->history_count = history_count;
+        old->last_status = last_status;
+        old->last_bg_pid = last_bg_pid;
+        old->job_table = job_table;
+        old->job_count = job_count;
+        old->job_cap = job_cap;
+        old->current_job = current_job;
+        old->noclobber = noclobber;
+        old->suggest = suggest;
+        old->spool_spill = spool_spill;
+        old->default_deadline = default_deadline;
+        old->spool_size = spool_size;
+        old->memo_limit = memo_limit;
+        old->commands = commands;
+        old->placement = session_placement;
+    }
+    shell_vars = s->vars;
+    var_count = s->var_count;
+    var_cap = s->var_cap;
+    memcpy(history, s->history, sizeof(history));
+    history_count = s->history_count;
+    last_status = s->last_status;
+    last_bg_pid = s->last_bg_pid;
+    job_table = s->job_table;
+    job_count = s->job_count;
+    job_cap = s->job_cap;
+    current_job = s->current_job;
+    noclobber = s->noclobber;
+    suggest = s->suggest;
+    spool_spill = s->spool_spill;
+    default_deadline = s->default_deadline;
+    spool_size = s->spool_size;
+    memo_limit = s->memo_limit;
+    commands = s->commands;
+    session_placement = s->placement;
+    loaded_session = s;
+}
 
-    token = strtok(input, " \t\r\n\a");
-    while (token != NULL) {
-        tokens[position] = token;
-        position++;
+// Function to move the process into session s's working directory for a
+// call that runs commands. Returns a descriptor of the host's directory,
+// for session_leave_cwd().
+int session_enter_cwd(struct psh_session* s) {
+    int host = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
 
-        if (position >= bufsize) {
-            bufsize += BUFFER_SIZE;
-            tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
-                fprintf(stderr, "Reallocation error\n");
-                exit(EXIT_FAILURE);
-            }
-        }
+    if (s->cwd_fd >= 0 && fchdir(s->cwd_fd) < 0) {
+        perror("cd failed");
+    }
+    return host;
+}
 
-        token = strtok(NULL, " \t\r\n\a");
+// Function to remember the directory the call left session s in, and put
+// the host back in its own
+void session_leave_cwd(struct psh_session* s, int host) {
+    if (s->cwd_fd >= 0) {
+        close(s->cwd_fd);
+    }
+    s->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (host >= 0) {
+        if (fchdir(host) < 0) {
+            perror("cd failed");
+        }
+        close(host);
     }
-    tokens[position] = NULL;
-    return tokens;
 }
 
-// Function to execute commands with optional I/O redirection and background process handling
-int execute_command(char** args) {
-    int in_redirect = -1, out_redirect = -1;
-    int background = 0;
-    int i = 0;
+// Function for update_jobs(): keep a finished background job of the loaded
+// session for psh_poll() to report
+void session_job_done(struct job* j) {
+    struct psh_session* s = loaded_session;
 
-    // Check for background process symbol '&' at the end
-    while (args[i] != NULL) {
-        if (strcmp(args[i], "&") == 0) {
-            background = 1;
-            args[i] = NULL;  // Remove '&' from the arguments list
-            break;
+    if (!s || !s->on_job_done) {
+        return;
+    }
+    if (s->finished_count == s->finished_cap) {
+        s->finished_cap = s->finished_cap ? s->finished_cap * 2 : 8;
+        s->finished = realloc(s->finished, s->finished_cap * sizeof(struct finished_job));
+        if (!s->finished) {
+            fprintf(stderr, "Reallocation error\n");
+            exit(EXIT_FAILURE);
         }
-        i++;
     }
+    struct finished_job* f = &s->finished[s->finished_count++];
+    f->id = j->id;
+    f->status = decode_status(j->procs[j->proc_count - 1].status);
+    f->text = strdup(j->text);
+}
+
+psh_session* psh_session_new(void) {
+    struct psh_session* s = calloc(1, sizeof(struct psh_session));
+    if (s) {
+        s->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        s->memo_limit = MEMO_SIZE;
+    }
+    return s;
+}
 
-    i = 0;
-    // Identify any redirection operators and open the files
-    while (args[i] != NULL) {
-        if (strcmp(args[i], "<") == 0) {
-            in_redirect = open(args[i + 1], O_RDONLY);
-            if (in_redirect < 0) {
-                perror("Error opening input file");
-                return 1;
-            }
-            args[i] = NULL;  // Remove redirection from args
-        } else if (strcmp(args[i], ">") == 0) {
-            out_redirect = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (out_redirect < 0) {
-                perror("Error opening output file");
-                return 1;
-            }
-            args[i] = NULL;  // Remove redirection from args
+void psh_session_free(psh_session* s) {
+    if (!s) {
+        return;
+    }
+    pthread_mutex_lock(&engine_lock);
+    session_switch(s);
+    while (job_count > 0) {
+        free_job(job_table[0]);  // Its processes keep running
+    }
+    free(job_table);
+    job_table = NULL;
+    job_cap = current_job = 0;
+    for (int i = 0; i < var_count; i++) {
+        free_variable(&shell_vars[i]);
+    }
+    free(shell_vars);
+    shell_vars = NULL;
+    for (int i = 0; i < history_count; i++) {
+        release_string(history[i]);
+    }
+    var_count = var_cap = history_count = last_status = 0;
+    last_bg_pid = 0;
+    noclobber = suggest = spool_spill = false;
+    default_deadline = 0;
+    spool_size = 0;
+    memo_limit = MEMO_SIZE;
+    for (int i = 0; i < commands.cap; i++) {
+        struct command_entry* e = &commands.slots[i];
+        if (e->alias) {
+            drop_alias(e);
         }
-        i++;
+        free_node(e->function);
+        free(e->name);
+    }
+    free(commands.slots);
+    memset(&commands, 0, sizeof(commands));
+    memset(&session_placement, 0, sizeof(session_placement));
+    loaded_session = NULL;
+    pthread_mutex_unlock(&engine_lock);
+    for (int i = 0; i < s->finished_count; i++) {
+        free(s->finished[i].text);
+    }
+    free(s->finished);
+    if (s->cwd_fd >= 0) {
+        close(s->cwd_fd);
     }
+    free(s);
+}
 
-    pid_t pid = fork();
-    if (pid == 0) {  // Child process
-        // Handle input redirection
-        if (in_redirect != -1) {
-            dup2(in_redirect, STDIN_FILENO);
-            close(in_redirect);
+// Function to give a command line its own descriptor for fd: a new memfd
+// when b captures the stream, or else a private copy of the host's fd.
+// Either way it is close-on-exec and above the descriptors commands name.
+int session_fd(int fd, psh_buffer* b) {
+    int mfd = b && b->data ? memfd_create("psh-output", MFD_CLOEXEC) : -1;
+    int copy = fcntl(mfd >= 0 ? mfd : fd, F_DUPFD_CLOEXEC, 10);
+
+    if (mfd >= 0) {
+        close(mfd);
+    }
+    if (copy < 0) {  // The host has fd closed: commands get /dev/null
+        int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+        copy = null >= 0 ? fcntl(null, F_DUPFD_CLOEXEC, 10) : -1;
+        if (null >= 0) {
+            close(null);
         }
-        // Handle output redirection
-        if (out_redirect != -1) {
-            dup2(out_redirect, STDOUT_FILENO);
-            close(out_redirect);
+    }
+    return copy;
+}
+
+// Function to copy what a capture memfd holds into b
+void capture_end(int mfd, psh_buffer* b) {
+    struct stat st;
+
+    b->length = fstat(mfd, &st) == 0 ? (size_t)st.st_size : 0;
+    size_t n = b->length < b->size ? b->length : b->size;
+    ssize_t got = n > 0 ? pread(mfd, b->data, n, 0) : 0;
+    if (got >= 0 && (size_t)got < b->size) {
+        b->data[got] = '\0';  // For callers that want a C string, when it fits
+    }
+}
+
+int psh_run(psh_session* s, const char* line, psh_buffer* out, psh_buffer* err) {
+    bool shared = err && err->data && err == out && out->data;  // Both streams in the order written
+    struct node* tree;
+
+    pthread_mutex_lock(&engine_lock);
+    session_switch(s);
+    shell_fds[STDIN_FILENO] = session_fd(STDIN_FILENO, NULL);
+    shell_fds[STDOUT_FILENO] = session_fd(STDOUT_FILENO, out);
+    shell_fds[STDERR_FILENO] = shared ? fcntl(shell_fds[STDOUT_FILENO], F_DUPFD_CLOEXEC, 10)
+                                      : session_fd(STDERR_FILENO, err);
+    shell_stdout = shell_fds[STDOUT_FILENO] >= 0 ? fdopen(shell_fds[STDOUT_FILENO], "w") : NULL;
+    shell_stderr = shell_fds[STDERR_FILENO] >= 0 ? fdopen(shell_fds[STDERR_FILENO], "w") : NULL;
+    if (!shell_stdout || !shell_stderr) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(shell_stderr, NULL, _IONBF, 0);
+    int host_cwd = session_enter_cwd(s);  // After the descriptors, which may take 0-2
+
+    char* text = strdup(line);
+    int status = parse_text(text, &tree);
+    if (status == PARSE_INCOMPLETE) {
+        fprintf(stderr, "Syntax error: unexpected end of input\n");
+    }
+    if (status != PARSE_OK) {
+        last_status = 2;
+    }
+    if (tree) {
+        interrupted = false;
+        embedded = true;
+        current_line = text;
+        execute_node(tree);
+        free_node(tree);
+        current_line = "";
+        embedded = interrupted = false;
+        break_levels = continue_levels = 0;
+    }
+    free(text);
+
+    fflush(stdout);
+    if (out && out->data) {
+        capture_end(shell_fds[STDOUT_FILENO], out);
+    }
+    if (err && err->data && !shared) {
+        capture_end(shell_fds[STDERR_FILENO], err);
+    }
+    sync_fd_reader(shell_fds[STDIN_FILENO], true);  // Leave the host's stdin where read stopped
+    fclose(shell_stdout);
+    fclose(shell_stderr);
+    close(shell_fds[STDIN_FILENO]);
+    shell_stdout = shell_stderr = NULL;
+    shell_fds[STDIN_FILENO] = STDIN_FILENO;
+    shell_fds[STDOUT_FILENO] = STDOUT_FILENO;
+    shell_fds[STDERR_FILENO] = STDERR_FILENO;
+    session_leave_cwd(s, host_cwd);
+    status = last_status;
+    pthread_mutex_unlock(&engine_lock);
+    return status;
+}
+
+int psh_set_var(psh_session* s, const char* name, const char* value) {
+    pthread_mutex_lock(&engine_lock);
+    session_switch(s);
+    int r = set_variable(name, value);
+    pthread_mutex_unlock(&engine_lock);
+    return r;
+}
+
+int psh_get_var(psh_session* s, const char* name, char* buf, size_t size) {
+    int len = -1;
+
+    pthread_mutex_lock(&engine_lock);
+    session_switch(s);
+    char* value = get_variable_value((char*)name);
+    if (value) {
+        len = strlen(value);
+        if (size > 0) {
+            snprintf(buf, size, "%s", value);
         }
+    }
+    pthread_mutex_unlock(&engine_lock);
+    return len;
+}
 
-        // Execute the command
-        if (execvp(args[0], args) == -1) {
-            perror("Error executing command");
+void psh_on_job_done(psh_session* s, psh_job_callback callback, void* data) {
+    pthread_mutex_lock(&engine_lock);
+    s->on_job_done = callback;
+    s->on_job_done_data = data;
+    if (!callback) {  // Nobody to report the jobs already queued to
+        for (int i = 0; i < s->finished_count; i++) {
+            free(s->finished[i].text);
         }
-        exit(EXIT_FAILURE);
+        s->finished_count = 0;
+    }
+    pthread_mutex_unlock(&engine_lock);
+}
 
-    } else if (pid < 0) {  // Fork error
-        perror("Error forking");
+int psh_poll(psh_session* s) {
+    int running = 0;
 
-    } else {  // Parent process
-        if (background) {
-            printf("[Background] Started process with PID %d\n", pid);
-            bg_processes[bg_count++] = pid;  // Store background process ID
-        } else {
-            waitpid(pid, NULL, 0);  // Wait for foreground process
+    pthread_mutex_lock(&engine_lock);
+    session_switch(s);
+    update_jobs();
+    for (int i = 0; i < job_count; i++) {
+        running += job_procs_in(job_table[i], PROC_DONE) < job_table[i]->proc_count;
+    }
+    struct finished_job* finished = s->finished;
+    int count = s->finished_count;
+    psh_job_callback callback = s->on_job_done;
+    void* data = s->on_job_done_data;
+    s->finished = NULL;
+    s->finished_count = s->finished_cap = 0;
+    pthread_mutex_unlock(&engine_lock);
+
+    // Called without the lock, so the callback can run more commands
+    for (int i = 0; i < count; i++) {
+        if (callback) {
+            callback(s, finished[i].id, finished[i].status, finished[i].text, data);
         }
+        free(finished[i].text);
     }
+    free(finished);
+    return running;
+}
+
+int psh_serve(psh_session* s, const char* path) {
+    pthread_mutex_lock(&engine_lock);
+    session_switch(s);
+    int host_cwd = session_enter_cwd(s);
+    int status = run_server(path);
+    session_leave_cwd(s, host_cwd);
+    pthread_mutex_unlock(&engine_lock);
+    return status;
+}
+
+int run_shell();
 
-    return 1;  // Keep shell running
+int psh_main(psh_session* s) {
+    pthread_mutex_lock(&engine_lock);
+    session_switch(s);
+    if (s->cwd_fd >= 0 && fchdir(s->cwd_fd) < 0) {  // The shell is the program now: cd moves it
+        perror("cd failed");
+    }
+    int status = run_shell();
+    session_leave_cwd(s, -1);
+    pthread_mutex_unlock(&engine_lock);
+    return status;
 }
 
-// Main shell loop
-int main() {
+// Main shell loop, on the process's terminal or standard input
+int run_shell() {
     char* input;
-    char** args;
-    int status;
+    struct node* tree;
+
+    snapshot_path = getenv("PSH_SNAPSHOT");
+    if (snapshot_path && snapshot_path[0] == '\0') {
+        snapshot_path = NULL;
+    }
+    if (snapshot_path) {
+        snapshot_load(snapshot_path);
+    }
+    interactive = isatty(STDIN_FILENO) && start_event_loop();
+    if (interactive && snapshot_path) {  // Scripts only save with `snapshot save`
+        snapshot_pid = getpid();
+        atexit(snapshot_at_exit);
+    }
+
+    if (interactive) {
+        // Keys, child exits, signals, timers and the prompt helper all
+        // arrive through one event loop; each line runs from run_line()
+        display_prompt();
+        editor_start(run_line);
+        while (editing) {
+            event_dispatch(-1);
+        }
+        if (prompt_helper > 0) {
+            kill(-prompt_helper, SIGKILL);
+        }
+        return last_status;
+    }
 
-    do {
+    for (;;) {
         display_prompt();
+        long long t_read = tracing ? monotonic_ns() : 0;
         input = read_input();
+        if (tracing) {
+            trace_span("read", t_read, NULL, 0, -1);
+        }
 
         // Exit on Ctrl+D (EOF)
-        if (feof(stdin)) {
+        if (input == NULL) {
             printf("\n");
             break;
         }
 
         // Handle !number for history
-        if (input[0] == '!') {
+        bool from_history = input[0] == '!' && isdigit((unsigned char)input[1]);
+        if (from_history) {
             int index = atoi(input + 1);
             free(input);
             input = get_command_from_history(index);
@@ -325,20 +12218,45 @@ int main() {
                 continue;
             }
             printf("%s", input);  // Print the command being executed
-        } else {
+        }
+        long long t_parse = tracing ? monotonic_ns() : 0;
+        tree = parse_input(&input);
+        if (tracing) {
+            trace_span("parse", t_parse, NULL, 0, -1);
+        }
+        if (!from_history) {
             add_to_history(input);  // Add command to history if not a history command
         }
 
-        args = parse_input(input);
-        if (args[0] != NULL) {
-            if (execute_builtin(args) == 0) {  // Run built-in or external command
-                status = execute_command(args);
+        if (tree) {
+            current_line = input;
+            long long t_line = tracing ? monotonic_ns() : 0;
+            execute_node(tree);
+            if (tracing) {
+                trace_span("line", t_line, input, 0, last_status);
             }
+            free_node(tree);
+            current_line = "";
         }
-
         free(input);
-        free(args);
-    } while (status);
+    }
 
-    return 0;
+    return last_status;
+}
+
+#ifndef PSH_LIBRARY
+// The pucitshell program: one session on the terminal, or `--server PATH`
+int main(int argc, char** argv) {
+    bool server = argc == 3 && strcmp(argv[1], "--server") == 0;
+    if (argc > 1 && !server) {
+        fprintf(stderr, "Usage: %s [--server <socket>]\n", argv[0]);
+        return 2;
+    }
+    psh_session* s = psh_session_new();
+    if (!s) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    return server ? psh_serve(s, argv[2]) : psh_main(s);
 }
+#endif
@@ -0,0 +1,277 @@
+// psh-client - send command lines to a `pucitshell --server` over its socket
+//
+//   psh-client [-C dir] [-e NAME=VALUE]... <socket> <command...>
+//       Run one command line, stream its output, exit with its status.
+//   psh-client -n count [-j depth] <socket> <command...>
+//       Benchmark: run it count times, depth requests at a time on one
+//       connection, and print requests per second.
+//   psh-client -n count [-j depth] -s <command...>
+//       The same with a fresh `sh -c` for each run, for comparison.
+//
+// Build with: gcc -o psh-client psh-client.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <stdbool.h>
+
+#include "pucitshell.h"
+
+#define MAX_ENV 64
+
+// Function to write all of buf, or exit
+void write_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("psh-client");
+            exit(125);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+// Function to read exactly len bytes; false at end of stream
+bool read_all(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Function to connect to the server's socket
+int connect_server(const char* path) {
+    struct sockaddr_un addr = { 0 };
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    addr.sun_family = AF_UNIX;
+    if (fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "psh-client: %s: bad socket path\n", path);
+        exit(125);
+    }
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "psh-client: %s: %s\n", path, strerror(errno));
+        exit(125);
+    }
+    return fd;
+}
+
+// Function to build a run frame (header and payload) in buf; returns its size
+size_t build_request(char* buf, size_t size, uint32_t id, const char* cwd, const char* line,
+                     char** env, int env_count) {
+    struct psh_frame f = { 0 };
+    size_t len = sizeof(f);
+
+    const char* parts[MAX_ENV + 2];
+    int count = 0;
+    parts[count++] = cwd;
+    parts[count++] = line;
+    for (int i = 0; i < env_count; i++) {
+        parts[count++] = env[i];
+    }
+    for (int i = 0; i < count; i++) {
+        size_t n = strlen(parts[i]) + 1;
+        if (len + n > size) {
+            fprintf(stderr, "psh-client: request too long\n");
+            exit(125);
+        }
+        memcpy(buf + len, parts[i], n);
+        len += n;
+    }
+    f.length = len - sizeof(f);
+    f.id = id;
+    f.type = PSH_FRAME_RUN;
+    memcpy(buf, &f, sizeof(f));
+    return len;
+}
+
+// Function to join the command words with spaces into one command line
+char* join_words(char** words) {
+    size_t len = 1;
+    for (int i = 0; words[i]; i++) {
+        len += strlen(words[i]) + 1;
+    }
+    char* line = malloc(len);
+    if (!line) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    line[0] = '\0';
+    for (int i = 0; words[i]; i++) {
+        strcat(line, words[i]);
+        if (words[i + 1]) {
+            strcat(line, " ");
+        }
+    }
+    return line;
+}
+
+// Function to run one request and relay its output; returns its exit status
+int run_one(const char* path, const char* cwd, const char* line, char** env, int env_count) {
+    static char buf[PSH_FRAME_MAX + sizeof(struct psh_frame)];
+    int fd = connect_server(path);
+
+    write_all(fd, buf, build_request(buf, sizeof(buf), 1, cwd, line, env, env_count));
+    for (;;) {
+        struct psh_frame f;
+        if (!read_all(fd, &f, sizeof(f)) || f.length > PSH_FRAME_MAX || !read_all(fd, buf, f.length)) {
+            fprintf(stderr, "psh-client: connection closed\n");
+            return 125;
+        }
+        if (f.type == PSH_FRAME_STDOUT) {
+            write_all(STDOUT_FILENO, buf, f.length);
+        } else if (f.type == PSH_FRAME_STDERR) {
+            write_all(STDERR_FILENO, buf, f.length);
+        } else if (f.type == PSH_FRAME_EXIT && f.length == sizeof(int32_t)) {
+            int32_t status;
+            memcpy(&status, buf, sizeof(status));
+            close(fd);
+            return status;
+        }
+    }
+}
+
+// Function to time count requests through the server, depth at a time;
+// returns how many failed
+int bench_server(const char* path, const char* line, int count, int depth) {
+    static char buf[PSH_FRAME_MAX + sizeof(struct psh_frame)];
+    int fd = connect_server(path);
+    int sent = 0, done = 0, failed = 0;
+
+    while (done < count) {
+        while (sent < count && sent - done < depth) {
+            write_all(fd, buf, build_request(buf, sizeof(buf), sent, "", line, NULL, 0));
+            sent++;
+        }
+        struct psh_frame f;
+        if (!read_all(fd, &f, sizeof(f)) || f.length > PSH_FRAME_MAX || !read_all(fd, buf, f.length)) {
+            fprintf(stderr, "psh-client: connection closed\n");
+            exit(125);
+        }
+        if (f.type == PSH_FRAME_EXIT) {
+            int32_t status;
+            memcpy(&status, buf, sizeof(status));
+            failed += status != 0;
+            done++;
+        }
+    }
+    close(fd);
+    return failed;
+}
+
+// Function to time count runs of `sh -c line`, depth at a time, with their
+// output read through a pipe as the server's is; returns how many failed
+int bench_sh(const char* line, int count, int depth) {
+    char buf[65536];
+    int started = 0, done = 0, failed = 0;
+    struct pollfd fds[depth];
+    pid_t pids[depth];
+    int running = 0;
+
+    while (done < count) {
+        while (started < count && running < depth) {
+            int p[2];
+            if (pipe(p) < 0) {
+                perror("pipe");
+                exit(125);
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                dup2(p[1], STDOUT_FILENO);
+                dup2(p[1], STDERR_FILENO);
+                close(p[0]);
+                close(p[1]);
+                execl("/bin/sh", "sh", "-c", line, (char*)NULL);
+                _exit(127);
+            }
+            close(p[1]);
+            fds[running].fd = p[0];
+            fds[running].events = POLLIN;
+            pids[running++] = pid;
+            started++;
+        }
+        if (poll(fds, running, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(125);
+        }
+        for (int i = 0; i < running; i++) {
+            if (fds[i].revents && read(fds[i].fd, buf, sizeof(buf)) <= 0) {
+                int status;
+                close(fds[i].fd);
+                waitpid(pids[i], &status, 0);
+                failed += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+                done++;
+                fds[i] = fds[--running];
+                pids[i] = pids[running];
+                i--;
+            }
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char** argv) {
+    char* env[MAX_ENV];
+    int env_count = 0, count = 0, depth = 1;
+    const char* cwd = "";
+    bool sh = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+C:e:n:j:s")) != -1) {
+        if (opt == 'C') {
+            cwd = optarg;
+        } else if (opt == 'e' && env_count < MAX_ENV && strchr(optarg, '=')) {
+            env[env_count++] = optarg;
+        } else if (opt == 'n' && atoi(optarg) > 0) {
+            count = atoi(optarg);
+        } else if (opt == 'j' && atoi(optarg) > 0) {
+            depth = atoi(optarg);
+        } else if (opt == 's') {
+            sh = true;
+        } else {
+            optind = argc;  // Usage below
+            break;
+        }
+    }
+    if (argc - optind < (sh ? 1 : 2) || (sh && count == 0)) {
+        fprintf(stderr, "Usage: psh-client [-C dir] [-e NAME=VALUE]... <socket> <command...>\n"
+                        "       psh-client -n count [-j depth] <socket>|-s <command...>\n");
+        return 125;
+    }
+    const char* path = sh ? NULL : argv[optind++];
+    char* line = join_words(argv + optind);
+    if (count == 0) {
+        return run_one(path, cwd, line, env, env_count);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int failed = sh ? bench_sh(line, count, depth) : bench_server(path, line, count, depth);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%d requests in %.3f s: %.0f requests/s, %d failed (%s, depth %d)\n",
+           count, secs, count / secs, failed, sh ? "sh -c" : "server", depth);
+    free(line);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+// pucitshell.h - C API of the PUCITshell engine (libpucitshell)
+//
+// A program links the engine in and runs command lines in sessions instead
+// of starting /bin/sh for each one. Every session has its own variables,
+// history, jobs, options and working directory. External commands are still
+// forked and executed, but the shell that interprets the line is not.
+//
+// Calls may come from any thread, but they are serialised by one lock: a
+// command line runs alone in the process, and a `sleep 10` in one session
+// holds up calls on every other session for those 10 seconds.
+//
+// A command line writes to its own copies of descriptors 0-2 (or to memfds
+// when its output is captured), never to the process's, so what the host's
+// other threads write meanwhile stays theirs. The exception is a built-in
+// redirecting a descriptor above 2, which changes that descriptor of the
+// process until the built-in returns.
+//
+// Likewise the process's working directory is the session's only while a
+// call runs commands; psh_run() puts the host's back before it returns.
+//
+// The engine does not depend on the process's signal mask: any thread may
+// take SIGCHLD. It follows its children through pidfds (Linux 5.3 or later)
+// and waitpid() on their own pids. The host must not reap them for it, with
+// waitpid(-1) or with SIGCHLD set to SIG_IGN, or their statuses are lost.
+
+#ifndef PUCITSHELL_H
+#define PUCITSHELL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PSH_API __attribute__((visibility("default")))
+
+typedef struct psh_session psh_session;
+
+// Where psh_run() puts a stream's output. data may be NULL to let the
+// stream through to the process's own stdout or stderr instead.
+typedef struct {
+    char* data;     // Caller's buffer
+    size_t size;    // Its size in bytes; output beyond it is dropped
+    size_t length;  // Set by psh_run(): bytes written, which may exceed size
+} psh_buffer;
+
+// Called by psh_poll() for each background job that has finished, with the
+// job number, its exit status (128+N if killed by signal N) and its text
+typedef void (*psh_job_callback)(psh_session* s, int job, int status, const char* command, void* data);
+
+// Function to create a session, working in the current directory. NULL when
+// out of memory.
+PSH_API psh_session* psh_session_new(void);
+
+// Function to end a session. Background jobs it started keep running and
+// are no longer reported.
+PSH_API void psh_session_free(psh_session* s);
+
+// Function to run a command line (several lines and compound commands are
+// fine) and return its exit status: 2 for a syntax error, or the status
+// given to `exit`, which ends the line without ending the process. out and
+// err may be NULL, or the same buffer to get both streams interleaved.
+PSH_API int psh_run(psh_session* s, const char* line, psh_buffer* out, psh_buffer* err);
+
+// Function to set a shell variable (element 0 if it is an array). Returns 0.
+PSH_API int psh_set_var(psh_session* s, const char* name, const char* value);
+
+// Function to copy a variable's value into buf (NUL-terminated, truncated to
+// size). Returns the value's full length, or -1 if it is not set.
+PSH_API int psh_get_var(psh_session* s, const char* name, char* buf, size_t size);
+
+// Function to register the callback psh_poll() reports finished jobs to.
+// NULL stops the reports and drops those not yet delivered.
+PSH_API void psh_on_job_done(psh_session* s, psh_job_callback callback, void* data);
+
+// Function to reap the session's finished background jobs without
+// blocking, calling the job callback for each. Returns the number of jobs
+// still running. The callback may call back into the API.
+PSH_API int psh_poll(psh_session* s);
+
+// Function to run the shell on the process's terminal or standard input
+// until end of input or `exit`, as the pucitshell program does. Returns the
+// exit status.
+PSH_API int psh_main(psh_session* s);
+
+// Function to serve requests on a Unix socket at path until SIGINT or
+// SIGTERM, as `pucitshell --server path` does. Returns 0, or 1 if the socket
+// cannot be set up.
+PSH_API int psh_serve(psh_session* s, const char* path);
+
+// Server protocol. Both directions are a stream of frames: a header, then
+// length bytes of payload, in host byte order. A client may send any
+// number of requests without waiting; they run at the same time, and the
+// frames of their responses are interleaved, each tagged with its id.
+struct psh_frame {
+    uint32_t length;  // Payload bytes, at most PSH_FRAME_MAX
+    uint32_t id;      // Request the frame belongs to, chosen by the client
+    uint8_t type;     // PSH_FRAME_*
+    uint8_t unused[3];
+};
+
+#define PSH_FRAME_MAX (1 << 20)
+#define PSH_FRAME_RUN 'R'     // Client: cwd, command line, then NAME=VALUE for each
+                              // variable to set in the environment, each ending in a
+                              // NUL. An empty cwd keeps the server's directory.
+#define PSH_FRAME_STDOUT 'O'  // Server: output the request wrote
+#define PSH_FRAME_STDERR 'E'
+#define PSH_FRAME_EXIT 'X'    // Server: int32_t exit status; the request's last frame
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // PUCITSHELL_H
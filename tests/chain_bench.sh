@@ -0,0 +1,59 @@
+#!/bin/sh
+# chain_bench.sh - time long && chains of built-ins and of external commands
+#
+#   tests/chain_bench.sh [-n count] [-s] [shell]    (default: 10000 commands, ./myshell)
+#
+# Runs one line of `cd . && cd . && ...` with count commands, which the
+# shell parses into one tree and runs without forking, and the same chain
+# of /bin/true (count/10 commands, as each one forks and execs). With -s
+# the built-in chain also runs in bash and dash, for comparison. Each line
+# gives the best of 3 runs.
+
+count=10000
+others=false
+while getopts n:s opt; do
+    case $opt in
+    n) count=$OPTARG ;;
+    s) others=true ;;
+    *) echo "Usage: chain_bench.sh [-n count] [-s] [shell]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+# Function to write a chain of $2 commands $1 joined by && to file $3
+chain() {
+    awk -v cmd="$1" -v n="$2" 'BEGIN {
+        for (i = 1; i <= n; i++)
+            printf "%s%s", cmd, (i < n ? " && " : "\n") }' > "$3"
+}
+
+# Function to print the best of 3 runs of shell $1 on script $2, which runs
+# $3 commands, labelled $4
+best() {
+    min=
+    for run in 1 2 3; do
+        t0=$(date +%s%N)
+        "$1" < "$2" > /dev/null 2>&1
+        t=$(( $(date +%s%N) - t0 ))
+        if [ -z "$min" ] || [ "$t" -lt "$min" ]; then
+            min=$t
+        fi
+    done
+    awk -v n="$3" -v t="$min" -v what="$4" 'BEGIN {
+        printf "%d commands in %.3f s: %.0f ns/command (%s)\n", n, t / 1e9, t / n, what }'
+}
+
+chain "cd ." "$count" "$dir/builtin"
+chain /bin/true $((count / 10)) "$dir/external"
+best "$shell" "$dir/builtin" "$count" "cd ."
+best "$shell" "$dir/external" $((count / 10)) "/bin/true"
+if $others; then
+    for other in bash dash; do
+        if command -v $other > /dev/null; then
+            best $other "$dir/builtin" "$count" "cd ., $other"
+        fi
+    done
+fi
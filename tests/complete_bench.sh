@@ -0,0 +1,92 @@
+#!/bin/sh
+# complete_bench.sh - time Tab completion of commands on a terminal
+#
+#   tests/complete_bench.sh [-n executables] [shell]    (default: 20000, ./myshell)
+#
+# Fills a directory with executables cmd00000, cmd00001, ... and one named
+# bench_target, and runs the shell on a pseudo-terminal (with python3's pty
+# module) with only that directory and /bin in PATH. It times `bench_tar`
+# Tab from the shell's start, typed as soon as the prompt appears (so it
+# also waits for the command index to be built). Then, from the key press
+# to the shell's answer, it times 200 more of them (median and p99) and
+# one Tab on the prefix cmd01, shared by 1000 names.
+
+count=20000
+while getopts n: opt; do
+    case $opt in
+    n) count=$OPTARG ;;
+    *) echo "Usage: complete_bench.sh [-n executables] [shell]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+shell=$(cd "$(dirname "$shell")" && pwd)/$(basename "$shell")
+mkdir "$dir/bin"
+
+cd "$dir/bin" || exit 1
+awk -v n="$count" 'BEGIN { for (i = 0; i < n; i++) printf "cmd%05d\n", i }' |
+    while read -r f; do
+        printf '#!/bin/sh\n:\n' > "$f"
+    done
+printf '#!/bin/sh\n:\n' > bench_target
+chmod +x cmd* bench_target
+
+cd "$dir" || exit 1
+python3 - "$shell" "$dir/bin" "$count" <<'EOF_PY'
+import os, pty, select, sys, time
+
+shell, bindir, count = sys.argv[1], sys.argv[2], int(sys.argv[3])
+name = "bench_target"
+env = dict(os.environ, PATH=bindir + ":/bin", TERM="xterm")
+
+# Read what the shell prints until it has been quiet for t seconds
+def drain(t):
+    out = b""
+    while select.select([fd], [], [], t)[0]:
+        try:
+            out += os.read(fd, 65536)
+        except OSError:
+            break
+    return out
+
+# Type prefix, then return the milliseconds from Tab to the shell's answer
+def tab(prefix):
+    os.write(fd, prefix)
+    drain(0.05)
+    t = time.perf_counter()
+    os.write(fd, b"\t")
+    if not select.select([fd], [], [], 5)[0]:
+        sys.exit("complete_bench: no answer to Tab")
+    ms = (time.perf_counter() - t) * 1e3
+    drain(0.05)
+    os.write(fd, b"\x03")
+    drain(0.05)
+    return ms
+
+start = time.perf_counter()
+pid, fd = pty.fork()
+if pid == 0:
+    os.execve(shell, [shell], env)
+select.select([fd], [], [], 5)
+os.read(fd, 4096)
+# The index is built while the first prompt waits, so this Tab waits for it
+os.write(fd, name[:-1].encode() + b"\t")
+out = b""
+while not out.endswith(name.encode() + b" ") and select.select([fd], [], [], 5)[0]:
+    out += os.read(fd, 4096)
+first = (time.perf_counter() - start) * 1e3
+os.write(fd, b"\x03")
+drain(0.05)
+lat = sorted(tab(name[:-1].encode()) for i in range(200))
+shared = min(1000, max(0, count - 1000))
+many = tab(b"cmd01")
+os.write(fd, b"exit\r")
+drain(0.2)
+os.waitpid(pid, 0)
+
+print("%d executables: start to first completion %.2f ms" % (count, first))
+print("%d executables: Tab median %.3f ms, p99 %.3f ms" % (count, lat[100], lat[198]))
+print("%d executables: Tab on a prefix of %d names %.3f ms" % (count, shared, many))
+EOF_PY
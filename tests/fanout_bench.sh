@@ -0,0 +1,52 @@
+#!/bin/sh
+# fanout_bench.sh - time output fan-out against tee(1)
+#
+#   tests/fanout_bench.sh [-m megabytes] [shell]    (default: 500 MB, ./myshell)
+#
+# Writes a file of random data, then has the shell run
+# `cat big > o1 > o2 | wc -c` (the kernel-side fan-out) and
+# `cat big | tee o3 o4 | wc -c` (every byte copied through tee). Both
+# outputs are compared with the input once. Each line gives the best of 3
+# runs.
+
+mb=500
+while getopts m: opt; do
+    case $opt in
+    m) mb=$OPTARG ;;
+    *) echo "Usage: fanout_bench.sh [-m megabytes] [shell]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+shell=$(cd "$(dirname "$shell")" && pwd)/$(basename "$shell")
+cd "$dir" || exit 1
+
+head -c $((mb * 1048576)) /dev/urandom > big
+echo 'cat big > o1 > o2 | wc -c > /dev/null' > fanout
+echo 'cat big | tee o3 o4 | wc -c > /dev/null' > tee
+
+# Function to print the best of 3 runs of the shell on script $1, labelled $2
+best() {
+    min=
+    for run in 1 2 3; do
+        t0=$(date +%s%N)
+        "$shell" < "$1" > /dev/null 2>&1
+        t=$(( $(date +%s%N) - t0 ))
+        if [ -z "$min" ] || [ "$t" -lt "$min" ]; then
+            min=$t
+        fi
+    done
+    awk -v mb="$mb" -v t="$min" -v what="$2" 'BEGIN {
+        printf "%d MB in %.3f s: %.0f MB/s (%s)\n", mb, t / 1e9, mb / (t / 1e9), what }'
+}
+
+best fanout "cat big > o1 > o2 | wc -c"
+best tee "cat big | tee o3 o4 | wc -c"
+for f in o1 o2 o3 o4; do
+    if ! cmp -s big $f; then
+        echo "fanout_bench: $f differs from the input"
+        exit 1
+    fi
+done
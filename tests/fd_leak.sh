@@ -0,0 +1,50 @@
+#!/bin/sh
+# fd_leak.sh - check that redirections leave no descriptors open in the shell
+#
+#   tests/fd_leak.sh [shell] [rounds]    (default: ./myshell, 500 rounds)
+#
+# Each round applies ten redirections that succeed or fail, on built-ins,
+# external commands, compound commands and bare redirections. The shell's
+# /proc/PID/fd must list the same descriptors afterwards as before: 0-2
+# and the O_PATH descriptor of its working directory.
+
+shell=${1:-./myshell}
+rounds=${2:-500}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+shell=$(cd "$(dirname "$shell")" && pwd)/$(basename "$shell")
+cd "$dir" || exit 1
+
+cat > run.psh <<END
+sh -c 'ls /proc/\$PPID/fd' > before
+i=0
+while [ \$i -lt $rounds ]; do
+    echo \$i > out
+    echo \$i >> out 2>&1
+    cat < out > /dev/null
+    cat < /nonexistent/\$i
+    echo x > /nonexistent/\$i
+    > /nonexistent/\$i
+    echo x 3> three 4>&3 >&4
+    echo x >&9
+    while false; do :; done < out
+    set -o noclobber
+    echo x > out
+    set +o noclobber
+    i=\$((i + 1))
+done
+sh -c 'ls /proc/\$PPID/fd' > after
+END
+
+"$shell" < run.psh > log 2>&1
+if [ ! -s before ] || [ ! -s after ]; then
+    echo "fd_leak: the shell did not run to the end; see its output:"
+    tail -n 5 log
+    exit 1
+fi
+if ! cmp -s before after; then
+    echo "fd_leak: descriptors left open after $((rounds * 10)) redirections:"
+    diff before after
+    exit 1
+fi
+echo "fd_leak: ok, $((rounds * 10)) redirections, descriptors $(tr '\n' ' ' < after)"
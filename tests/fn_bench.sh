@@ -0,0 +1,61 @@
+#!/bin/sh
+# fn_bench.sh - time shell function calls against the alternatives
+#
+#   tests/fn_bench.sh [-n count] [-s] [shell]    (default: 1000000 calls, ./myshell)
+#
+# Runs `while [ $i -lt count ]; do f $i; i=$((i+1)); done` with f() { :; },
+# the same loop calling `FOO=1 f` (a prefix assignment, set and put back
+# around the call), the built-in `:` instead, and a #!/bin/sh script
+# called in its place (count/500 times, as each call forks and execs). With
+# -s the function loop also runs in sh, for comparison. Each line gives the
+# best of 3 runs.
+
+count=1000000
+sh=false
+while getopts n:s opt; do
+    case $opt in
+    n) count=$OPTARG ;;
+    s) sh=true ;;
+    *) echo "Usage: fn_bench.sh [-n count] [-s] [shell]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf '#!/bin/sh\n:\n' > "$dir/wrap.sh"
+chmod +x "$dir/wrap.sh"
+
+# Function to write a loop of $2 iterations calling $1 to file $3
+loop() {
+    printf 'f() { :; }\ni=0; while [ $i -lt %d ]; do %s $i; i=$((i+1)); done\n' "$2" "$1" > "$3"
+}
+
+# Function to print the best of 3 runs of shell $1 on script $2, which makes
+# $3 calls, labelled $4
+best() {
+    min=
+    for run in 1 2 3; do
+        t0=$(date +%s%N)
+        "$1" < "$2" > /dev/null 2>&1
+        t=$(( $(date +%s%N) - t0 ))
+        if [ -z "$min" ] || [ "$t" -lt "$min" ]; then
+            min=$t
+        fi
+    done
+    awk -v n="$3" -v t="$min" -v what="$4" 'BEGIN {
+        printf "%d calls in %.3f s: %.0f ns/call (%s)\n", n, t / 1e9, t / n, what }'
+}
+
+loop f "$count" "$dir/function"
+loop "FOO=1 f" "$count" "$dir/prefixed"
+loop : "$count" "$dir/builtin"
+loop "$dir/wrap.sh" $((count / 500)) "$dir/script"
+best "$shell" "$dir/function" "$count" "function"
+best "$shell" "$dir/prefixed" "$count" "FOO=1 function"
+best "$shell" "$dir/builtin" "$count" "built-in :"
+best "$shell" "$dir/script" $((count / 500)) "#!/bin/sh script"
+if $sh; then
+    best sh "$dir/function" "$count" "function, sh"
+fi
@@ -0,0 +1,61 @@
+#!/bin/sh
+# glob_bench.sh - time pathname expansion in a large directory
+#
+#   tests/glob_bench.sh [-n files] [-s] [shell]    (default: 1000000 files, ./myshell)
+#
+# Creates a directory of empty files, one in ten named *.log, and times
+# `for f in *.log; do :; done` once and five times in a row (the later
+# globs can reuse the cached listing). With -s both also run in bash and
+# dash, for comparison. Each line gives the best of 3 runs.
+
+count=1000000
+others=false
+while getopts n:s opt; do
+    case $opt in
+    n) count=$OPTARG ;;
+    s) others=true ;;
+    *) echo "Usage: glob_bench.sh [-n files] [-s] [shell]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+shell=$(cd "$(dirname "$shell")" && pwd)/$(basename "$shell")
+mkdir "$dir/files"
+cd "$dir/files" || exit 1
+
+awk -v n="$count" 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "f%d.%s\n", i, (i % 10 ? "dat" : "log") }' | xargs touch
+echo 'for f in *.log; do :; done' > ../one
+for i in 1 2 3 4 5; do cat ../one; done > ../five
+# Listings of directories changed just before the scan are not cached
+sleep 1
+
+# Function to print the best of 3 runs of shell $1 on script $2, which runs
+# $3 globs, labelled $4
+best() {
+    min=
+    for run in 1 2 3; do
+        t0=$(date +%s%N)
+        "$1" < "$2" > /dev/null 2>&1
+        t=$(( $(date +%s%N) - t0 ))
+        if [ -z "$min" ] || [ "$t" -lt "$min" ]; then
+            min=$t
+        fi
+    done
+    awk -v n="$count" -v g="$3" -v t="$min" -v what="$4" 'BEGIN {
+        printf "%d glob(s) over %d files in %.3f s (%s)\n", g, n, t / 1e9, what }'
+}
+
+best "$shell" ../one 1 "one glob"
+best "$shell" ../five 5 "five globs"
+if $others; then
+    for other in bash dash; do
+        if command -v $other > /dev/null; then
+            best $other ../one 1 "one glob, $other"
+            best $other ../five 5 "five globs, $other"
+        fi
+    done
+fi
@@ -0,0 +1,75 @@
+#!/bin/sh
+# job_stop.sh - check that job control stops and resumes a whole pipeline
+#
+#   tests/job_stop.sh [shell]    (default: ./myshell)
+#
+# Runs the shell on a pseudo-terminal with script(1) and starts a pipeline
+# of three CPU burners. Every burner must be stopped (T in ps) after Ctrl-Z
+# and after `kill -STOP %1`, running (R) after `bg`, and running in the
+# terminal's foreground group (R+) after `fg`. Ctrl-C must end all of them.
+
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+mark=psh_burn_$$
+burner="sh -c 'while :; do :; done' $mark"
+
+# Function to list the burners' states: R, S, T... with + when the process
+# is in the terminal's foreground group
+states() {
+    ps -eo stat=,args= | awk -v m="$mark" '$NF == m && !/awk/ {
+        printf "%s%s ", substr($1, 1, 1), index($1, "+") ? "+" : "" }'
+}
+
+# Function to wait until every burner is in state $2 (or, with "none", until
+# there are none), then report step $1 on descriptor 4
+expect() {
+    want=$2
+    [ "$want" = none ] && want="" || want="$want $want $want "
+    for i in $(seq 50); do
+        got=$(states)
+        [ "$got" = "$want" ] && break
+        sleep 0.1
+    done
+    if [ "$got" = "$want" ]; then
+        echo "job_stop: $1: ${got:-none} ok" >&4
+    else
+        echo "job_stop: $1: expected ${want:-none}, got ${got:-none}" >&4
+        touch "$dir/failed"
+    fi
+}
+
+# Function to type into the shell, step by step, checking the burners after each
+drive() {
+    sleep 0.5
+    printf '%s | %s | %s\r' "$burner" "$burner" "$burner"
+    expect "started" R+
+    printf '\032'
+    expect "Ctrl-Z" T
+    printf 'bg\r'
+    expect "bg" R
+    printf 'kill -STOP %%1\r'
+    expect "kill -STOP %1" T
+    printf 'fg\r'
+    expect "fg" R+
+    printf '\003'
+    expect "Ctrl-C" none
+    printf 'exit\r'
+    sleep 0.5
+}
+
+cleanup() {
+    ps -eo pid=,args= | awk -v m="$mark" '$NF == m && !/awk/ { print $1 }' | xargs -r kill -9
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+# script runs in the foreground of this pipeline: started with `&`, it and
+# the burners would inherit SIGINT ignored, and Ctrl-C could not end them
+exec 4>&1
+drive | script -qc "$shell" /dev/null > "$dir/log" 2>&1
+
+if [ -e "$dir/failed" ]; then
+    echo "job_stop: failed; the shell's output was:"
+    tr -d '\r' < "$dir/log" | tail -n 15
+    exit 1
+fi
@@ -0,0 +1,56 @@
+#!/bin/sh
+# loop_bench.sh - time nested for loops run from the syntax tree
+#
+#   tests/loop_bench.sh [-d depth] [-s] [shell]    (default: depth 6, ./myshell)
+#
+# Runs depth nested `for` loops over ten words each, with one assignment
+# in the innermost body: 10^depth iterations (1,000,000 by default)
+# without a fork. With -s the same loop also runs in bash and dash, for
+# comparison. Each line gives the best of 3 runs.
+
+depth=6
+others=false
+while getopts d:s opt; do
+    case $opt in
+    d) depth=$OPTARG ;;
+    s) others=true ;;
+    *) echo "Usage: loop_bench.sh [-d depth] [-s] [shell]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+awk -v d="$depth" 'BEGIN {
+    for (i = 1; i <= d; i++)
+        printf "for v%d in 0 1 2 3 4 5 6 7 8 9; do ", i
+    printf "x=$v%d; ", d
+    for (i = 1; i <= d; i++)
+        printf "done%s", (i < d ? "; " : "\n")
+    printf "echo $x\n" }' > "$dir/loop"
+count=$(awk -v d="$depth" 'BEGIN { printf "%d", 10 ^ d }')
+
+# Function to print the best of 3 runs of shell $1 on the loop, labelled $2
+best() {
+    min=
+    for run in 1 2 3; do
+        t0=$(date +%s%N)
+        "$1" < "$dir/loop" > /dev/null 2>&1
+        t=$(( $(date +%s%N) - t0 ))
+        if [ -z "$min" ] || [ "$t" -lt "$min" ]; then
+            min=$t
+        fi
+    done
+    awk -v n="$count" -v t="$min" -v what="$2" 'BEGIN {
+        printf "%d iterations in %.3f s: %.0f ns/iteration (%s)\n", n, t / 1e9, t / n, what }'
+}
+
+best "$shell" "$(basename "$shell")"
+if $others; then
+    for other in bash dash; do
+        if command -v $other > /dev/null; then
+            best $other $other
+        fi
+    done
+fi
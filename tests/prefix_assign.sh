@@ -0,0 +1,40 @@
+#!/bin/sh
+# prefix_assign.sh - check that VAR=value before a built-in or function
+# leaves the command's own effects in place
+#
+#   tests/prefix_assign.sh [shell]    (default: ./myshell)
+#
+# Built-ins and functions run in the shell, so what they set must outlast
+# them, while the VAR=value prefix holds only for the command itself: each
+# case prints one line, compared with the expected one.
+
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+shell=$(cd "$(dirname "$shell")" && pwd)/$(basename "$shell")
+cd "$dir" || exit 1
+printf 'one\n two \nthree\n' > lines
+echo 'a:b:c' > colons
+status=0
+
+# Function to run $1 in the shell and compare its last line of output with $2
+check() {
+    got=$(printf '%s\n' "$1" | "$shell" 2>&1 | sed 's/PUCITshell@[^ ]*:- //g' | grep -v '^$' | tail -n 1)
+    if [ "$got" = "$2" ]; then
+        echo "prefix_assign: ok: $1"
+    else
+        echo "prefix_assign: $1: expected [$2], got [$got]"
+        status=1
+    fi
+}
+
+check 'while IFS= read -r l; do s="$s[$l]"; done < lines; echo "$s"' '[one][ two ][three]'
+check 'IFS=: read x y < colons; echo "$x,$y,[$IFS]"' 'a,b:c,[]'
+check 'FOO=1 let y=5; echo "$y,[$FOO]"' '5,[]'
+check 'FOO=1 cd /; pwd' '/'
+check 'f() { g=$FOO; }; FOO=2 f; echo "$g,[$FOO]"' '2,[]'
+check 'FOO=old; FOO=new : ; echo $FOO' 'old'
+check 'f() { sh -c "echo \$FOO"; }; FOO=exported f' 'exported'
+check 'A=1; A=2 A=3 :; echo $A' '1'
+check 'f() { echo $$; }; X=1 f > pid; echo $$ > pid2; cmp -s pid pid2 && echo same' 'same'
+exit $status
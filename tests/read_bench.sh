@@ -0,0 +1,55 @@
+#!/bin/sh
+# read_bench.sh - time `while read` loops over a file and a pipe
+#
+#   tests/read_bench.sh [-n lines] [-s] [shell]    (default: 10000000 lines, ./myshell)
+#
+# Writes a file of numbered lines, then times `while read -r l; do :; done`
+# reading it directly, reading it from `cat` through a pipe, and with the
+# `IFS= read -r l` idiom (a prefix assignment around the built-in). With -s
+# the first loop also runs in bash and dash, for comparison (expect
+# minutes at the default size). Each line gives the best of 3 runs.
+
+count=10000000
+others=false
+while getopts n:s opt; do
+    case $opt in
+    n) count=$OPTARG ;;
+    s) others=true ;;
+    *) echo "Usage: read_bench.sh [-n lines] [-s] [shell]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+shell=${1:-./myshell}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+seq -f 'line %.0f of the input' "$count" > "$dir/lines"
+echo "while read -r l; do :; done < $dir/lines; echo \$l" > "$dir/file"
+echo "cat $dir/lines | while read -r l; do :; done" > "$dir/pipe"
+echo "while IFS= read -r l; do :; done < $dir/lines; echo \$l" > "$dir/ifs"
+
+# Function to print the best of 3 runs of shell $1 on script $2, labelled $3
+best() {
+    min=
+    for run in 1 2 3; do
+        t0=$(date +%s%N)
+        "$1" < "$2" > /dev/null 2>&1
+        t=$(( $(date +%s%N) - t0 ))
+        if [ -z "$min" ] || [ "$t" -lt "$min" ]; then
+            min=$t
+        fi
+    done
+    awk -v n="$count" -v t="$min" -v what="$3" 'BEGIN {
+        printf "%d lines in %.3f s: %.0f lines/s (%s)\n", n, t / 1e9, n / (t / 1e9), what }'
+}
+
+best "$shell" "$dir/file" "read -r, file"
+best "$shell" "$dir/pipe" "read -r, pipe"
+best "$shell" "$dir/ifs" "IFS= read -r, file"
+if $others; then
+    for other in bash dash; do
+        if command -v $other > /dev/null; then
+            best $other "$dir/file" "read -r, file, $other"
+        fi
+    done
+fi